@@ -0,0 +1,230 @@
+#include "adaptive.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "macros.h"
+
+// Updates smaller than this are dominated by latency rather than by the link
+#define MIN_SAMPLE_BYTES (64 * 1024)
+#define MIN_SAMPLE_NS 1000000ull
+#define FENCE_INTERVAL_NS 1000000000ull
+// An unanswered fence counts as a round trip of at least this long
+#define FENCE_TIMEOUT_NS 5000000000ull
+#define VOTES_TO_SWITCH 3
+#define MIN_SWITCH_INTERVAL_NS 3000000000ull
+// Weight of a new sample in the moving averages
+#define SMOOTHING 0.3
+// Below this the server is on the local network, above it packets queue up somewhere
+#define LAN_RTT_MS 1.0
+#define RAW_MAX_RTT_MS 5.0
+#define CONGESTED_RTT_MS 250.0
+
+static const u8 fence_tag[4] = { 'a', 'd', 'p', 't' };
+
+struct Level {
+	double min_mbps;
+	struct Vnc_adaptive_settings settings;
+};
+
+// Fastest link first
+static const struct Level levels[] = {
+	{ 400.0, { VNC_ADAPTIVE_PROFILE_RAW, 9, 0 } },
+	{ 50.0, { VNC_ADAPTIVE_PROFILE_ZRLE, 9, 1 } },
+	{ 20.0, { VNC_ADAPTIVE_PROFILE_TIGHT, 8, 2 } },
+	{ 8.0, { VNC_ADAPTIVE_PROFILE_TIGHT, 7, 4 } },
+	{ 3.0, { VNC_ADAPTIVE_PROFILE_TIGHT, 5, 6 } },
+	{ 1.0, { VNC_ADAPTIVE_PROFILE_TIGHT, 3, 8 } },
+	{ 0.0, { VNC_ADAPTIVE_PROFILE_TIGHT, 1, 9 } },
+};
+
+static u64 now_ns(void);
+static void add_sample(double *average, bool *have_average, double sample);
+static void vote(struct Vnc_adaptive *adaptive);
+static struct Vnc_adaptive_settings pick_settings(struct Vnc_adaptive *adaptive);
+static bool settings_eq(struct Vnc_adaptive_settings *a, struct Vnc_adaptive_settings *b);
+
+void vnc_adaptive_init(struct Vnc_adaptive *adaptive, bool enabled,
+		       struct Vnc_adaptive_settings *initial)
+{
+	*adaptive = (struct Vnc_adaptive){
+		.enabled = enabled,
+		.settings = *initial,
+		.candidate = *initial,
+	};
+}
+
+void vnc_adaptive_update_started(struct Vnc_adaptive *adaptive, u64 bytes_received)
+{
+	adaptive->update_start_ns = now_ns();
+	adaptive->update_start_bytes = bytes_received;
+}
+
+void vnc_adaptive_update_finished(struct Vnc_adaptive *adaptive, u64 bytes_received)
+{
+	u64 bytes = bytes_received - adaptive->update_start_bytes;
+	u64 elapsed_ns = now_ns() - adaptive->update_start_ns;
+	if (bytes < MIN_SAMPLE_BYTES || elapsed_ns < MIN_SAMPLE_NS) {
+		return;
+	}
+	add_sample(&adaptive->throughput_mbps, &adaptive->have_throughput,
+		   bytes * 8 * 1000.0 / elapsed_ns);
+	vote(adaptive);
+}
+
+bool vnc_adaptive_fence_due(struct Vnc_adaptive *adaptive, struct Vnc_rfb_fence *fence)
+{
+	if (!adaptive->enabled) {
+		return false;
+	}
+	u64 now = now_ns();
+	if (adaptive->fence_pending) {
+		u64 elapsed_ns = now - adaptive->fence_sent_ns;
+		if (elapsed_ns < FENCE_TIMEOUT_NS) {
+			return false;
+		}
+		add_sample(&adaptive->rtt_ms, &adaptive->have_rtt, elapsed_ns / 1e6);
+		vote(adaptive);
+	} else if (now - adaptive->fence_sent_ns < FENCE_INTERVAL_NS) {
+		return false;
+	}
+
+	adaptive->fence_pending = true;
+	adaptive->fence_sent_ns = now;
+	++adaptive->fence_seq;
+	*fence = (struct Vnc_rfb_fence){
+		.message_type = VNC_RFB_CLIENT_MESSAGE_TYPE_FENCE,
+		.flags = htonl(VNC_RFB_FENCE_FLAG_REQUEST),
+		.length = sizeof(fence_tag) + sizeof(adaptive->fence_seq),
+	};
+	memcpy(fence->payload, fence_tag, sizeof(fence_tag));
+	memcpy(fence->payload + sizeof(fence_tag), &adaptive->fence_seq,
+	       sizeof(adaptive->fence_seq));
+	return true;
+}
+
+bool vnc_adaptive_fence_returned(struct Vnc_adaptive *adaptive, struct Vnc_rfb_fence *fence)
+{
+	if ((fence->flags & VNC_RFB_FENCE_FLAG_REQUEST) != 0 ||
+	    fence->length != sizeof(fence_tag) + sizeof(adaptive->fence_seq) ||
+	    memcmp(fence->payload, fence_tag, sizeof(fence_tag)) != 0) {
+		return false;
+	}
+	u32 seq;
+	memcpy(&seq, fence->payload + sizeof(fence_tag), sizeof(seq));
+	// Late answers to fences that already timed out are not a measurement
+	if (adaptive->fence_pending && seq == adaptive->fence_seq) {
+		adaptive->fence_pending = false;
+		add_sample(&adaptive->rtt_ms, &adaptive->have_rtt,
+			   (now_ns() - adaptive->fence_sent_ns) / 1e6);
+		vote(adaptive);
+	}
+	return true;
+}
+
+bool vnc_adaptive_evaluate(struct Vnc_adaptive *adaptive, struct Vnc_adaptive_settings *settings)
+{
+	if (!adaptive->enabled || adaptive->candidate_votes < VOTES_TO_SWITCH) {
+		return false;
+	}
+	u64 now = now_ns();
+	if (adaptive->last_switch_ns != 0 &&
+	    now - adaptive->last_switch_ns < MIN_SWITCH_INTERVAL_NS) {
+		return false;
+	}
+
+	char rtt[32] = "unknown";
+	if (adaptive->have_rtt) {
+		snprintf(rtt, sizeof(rtt), "%.2f ms", adaptive->rtt_ms);
+	}
+	struct Vnc_adaptive_settings *from = &adaptive->settings;
+	struct Vnc_adaptive_settings *to = &adaptive->candidate;
+	vnc_log_info("Adaptive: %s quality %u compress %u -> %s quality %u compress %u "
+		     "(throughput %.2f Mbit/s, rtt %s)",
+		     vnc_adaptive_profile_to_str(from->profile), from->quality_level,
+		     from->compress_level, vnc_adaptive_profile_to_str(to->profile),
+		     to->quality_level, to->compress_level, adaptive->throughput_mbps, rtt);
+	adaptive->settings = adaptive->candidate;
+	adaptive->candidate_votes = 0;
+	adaptive->last_switch_ns = now;
+	*settings = adaptive->settings;
+	return true;
+}
+
+const char *vnc_adaptive_profile_to_str(enum Vnc_adaptive_profile profile)
+{
+	switch (profile) {
+	case VNC_ADAPTIVE_PROFILE_RAW:
+		return "raw";
+	case VNC_ADAPTIVE_PROFILE_ZRLE:
+		return "zrle";
+	case VNC_ADAPTIVE_PROFILE_TIGHT:
+		return "tight";
+	}
+	return "unknown";
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void add_sample(double *average, bool *have_average, double sample)
+{
+	*average = *have_average ? *average + SMOOTHING * (sample - *average) : sample;
+	*have_average = true;
+}
+
+// A switch needs several samples in a row that agree, so one odd update can't cause it
+static void vote(struct Vnc_adaptive *adaptive)
+{
+	if (!adaptive->have_throughput) {
+		return;
+	}
+	struct Vnc_adaptive_settings target = pick_settings(adaptive);
+	if (settings_eq(&target, &adaptive->settings)) {
+		adaptive->candidate = target;
+		adaptive->candidate_votes = 0;
+	} else if (settings_eq(&target, &adaptive->candidate)) {
+		adaptive->candidate_votes = MIN(adaptive->candidate_votes + 1, VOTES_TO_SWITCH);
+	} else {
+		adaptive->candidate = target;
+		adaptive->candidate_votes = 1;
+	}
+}
+
+static struct Vnc_adaptive_settings pick_settings(struct Vnc_adaptive *adaptive)
+{
+	size_t level = 0;
+	while (level + 1 < ARRAY_COUNT(levels) &&
+	       adaptive->throughput_mbps < levels[level].min_mbps) {
+		++level;
+	}
+	if (adaptive->have_rtt) {
+		// Raw updates are large, so they only pay off when the server is close by
+		if (levels[level].settings.profile == VNC_ADAPTIVE_PROFILE_RAW &&
+		    adaptive->rtt_ms > RAW_MAX_RTT_MS) {
+			++level;
+		}
+		// Updates back up somewhere along the way, send fewer bytes
+		if (adaptive->rtt_ms > CONGESTED_RTT_MS && level + 1 < ARRAY_COUNT(levels)) {
+			++level;
+		}
+		// Throughput on a LAN is bound by the server's encoder, lossless is affordable
+		if (adaptive->rtt_ms < LAN_RTT_MS && level > 1) {
+			level = 1;
+		}
+	}
+	return levels[level].settings;
+}
+
+static bool settings_eq(struct Vnc_adaptive_settings *a, struct Vnc_adaptive_settings *b)
+{
+	return a->profile == b->profile && a->quality_level == b->quality_level &&
+	       a->compress_level == b->compress_level;
+}
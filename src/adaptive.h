@@ -0,0 +1,51 @@
+#pragma once
+
+#include "rfb.h"
+#include "types.h"
+
+// Preferred encoding, from fast links where decoding dominates to slow links where bytes do
+enum Vnc_adaptive_profile {
+	VNC_ADAPTIVE_PROFILE_RAW,
+	VNC_ADAPTIVE_PROFILE_ZRLE,
+	VNC_ADAPTIVE_PROFILE_TIGHT,
+};
+
+struct Vnc_adaptive_settings {
+	enum Vnc_adaptive_profile profile;
+	u8 quality_level; // JPEG quality 0-9 requested from Tight servers
+	u8 compress_level; // zlib effort 0-9 requested from Tight and ZRLE servers
+};
+
+// Picks encoding settings from the throughput of large framebuffer updates and the round trip
+// time of client fences
+struct Vnc_adaptive {
+	bool enabled;
+	struct Vnc_adaptive_settings settings; // What the server was last asked for
+	struct Vnc_adaptive_settings candidate; // What the metrics point at, once stable
+	u8 candidate_votes;
+	u64 last_switch_ns;
+
+	u64 update_start_ns;
+	u64 update_start_bytes;
+	bool have_throughput;
+	double throughput_mbps;
+
+	bool fence_pending;
+	u32 fence_seq;
+	u64 fence_sent_ns;
+	bool have_rtt;
+	double rtt_ms;
+};
+
+void vnc_adaptive_init(struct Vnc_adaptive *adaptive, bool enabled,
+		       struct Vnc_adaptive_settings *initial);
+// Brackets a framebuffer update, with the byte count of the connection at either end
+void vnc_adaptive_update_started(struct Vnc_adaptive *adaptive, u64 bytes_received);
+void vnc_adaptive_update_finished(struct Vnc_adaptive *adaptive, u64 bytes_received);
+// Fills in a fence request when it is time to measure the round trip time again
+bool vnc_adaptive_fence_due(struct Vnc_adaptive *adaptive, struct Vnc_rfb_fence *fence);
+// Returns true when the fence answers one of ours
+bool vnc_adaptive_fence_returned(struct Vnc_adaptive *adaptive, struct Vnc_rfb_fence *fence);
+// Returns true with the settings to send when the metrics have settled on different ones
+bool vnc_adaptive_evaluate(struct Vnc_adaptive *adaptive, struct Vnc_adaptive_settings *settings);
+const char *vnc_adaptive_profile_to_str(enum Vnc_adaptive_profile profile);
@@ -0,0 +1,160 @@
+#include "cursor.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "macros.h"
+
+static bool ensure_image_capacity(struct Vnc_cursor *cursor, size_t pixel_count);
+static bool check_size(struct Vnc_rfb_rect *rect);
+
+void vnc_cursor_deinit(struct Vnc_cursor *cursor)
+{
+	free(cursor->image);
+	free(cursor->wire);
+	*cursor = (struct Vnc_cursor){ 0 };
+}
+
+enum Vnc_rfb_result vnc_cursor_measure(struct Vnc_rfb_stream *stream, struct Vnc_rfb_rect *rect,
+				       struct Vnc_pixel_converter *converter)
+{
+	if (!check_size(rect)) {
+		return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+	}
+	size_t pixels_size = (size_t)rect->width * rect->height * converter->bytes_per_pixel;
+	size_t mask_size = (size_t)(rect->width + 7) / 8 * rect->height;
+	return vnc_rfb_stream_ensure(stream, pixels_size + mask_size);
+}
+
+enum Vnc_rfb_result vnc_cursor_recv(struct Vnc_cursor *cursor, struct Vnc_rfb_stream *stream,
+				    struct Vnc_rfb_rect *rect,
+				    struct Vnc_pixel_converter *converter)
+{
+	if (!check_size(rect)) {
+		return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+	}
+	u8 pixel_size = converter->bytes_per_pixel;
+	size_t pixels_size = (size_t)rect->width * rect->height * pixel_size;
+	size_t mask_row_size = (rect->width + 7) / 8;
+	size_t mask_size = mask_row_size * rect->height;
+	if (pixels_size + mask_size > cursor->wire_capacity) {
+		u8 *wire = realloc(cursor->wire, pixels_size + mask_size);
+		if (wire == NULL) {
+			vnc_log_error("Cursor: unable to allocate a %ux%u cursor", rect->width,
+				      rect->height);
+			return VNC_RFB_RESULT_ERROR_OUT_OF_MEMORY;
+		}
+		cursor->wire = wire;
+		cursor->wire_capacity = pixels_size + mask_size;
+	}
+	if (!ensure_image_capacity(cursor, (size_t)rect->width * rect->height)) {
+		vnc_log_error("Cursor: unable to allocate a %ux%u cursor", rect->width,
+			      rect->height);
+		return VNC_RFB_RESULT_ERROR_OUT_OF_MEMORY;
+	}
+	RFB_TRY_READ(stream, cursor->wire, pixels_size + mask_size);
+
+	cursor->width = rect->width;
+	cursor->height = rect->height;
+	cursor->hot_x = MIN(rect->x, rect->width > 0 ? rect->width - 1 : 0);
+	cursor->hot_y = MIN(rect->y, rect->height > 0 ? rect->height - 1 : 0);
+	const u8 *pixels = cursor->wire;
+	const u8 *mask = cursor->wire + pixels_size;
+	for (u16 y = 0; y < rect->height; ++y) {
+		u32 *row = cursor->image + y * rect->width;
+		const u8 *mask_row = mask + y * mask_row_size;
+		for (u16 x = 0; x < rect->width; ++x) {
+			u32 color = vnc_pixel_read(converter, pixels) & 0x00ffffff;
+			bool opaque = (mask_row[x / 8] >> (7 - x % 8)) & 1;
+			row[x] = opaque ? color | 0xff000000 : 0;
+			pixels += pixel_size;
+		}
+	}
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+bool vnc_cursor_copy(struct Vnc_cursor *dest, struct Vnc_cursor *src)
+{
+	size_t pixel_count = (size_t)src->width * src->height;
+	if (!ensure_image_capacity(dest, pixel_count)) {
+		return false;
+	}
+	if (pixel_count > 0) {
+		memcpy(dest->image, src->image, pixel_count * sizeof(u32));
+	}
+	dest->width = src->width;
+	dest->height = src->height;
+	dest->hot_x = src->hot_x;
+	dest->hot_y = src->hot_y;
+	return true;
+}
+
+void vnc_cursor_draw(struct Vnc_cursor *cursor, i32 x, i32 y, struct Vnc_rfb_rect *clip,
+		     struct Vnc_framebuffer *framebuffer)
+{
+	struct Vnc_rfb_rect area;
+	if (!vnc_cursor_get_rect(cursor, x, y, framebuffer, &area)) {
+		return;
+	}
+	i32 left = MAX(area.x, clip->x);
+	i32 top = MAX(area.y, clip->y);
+	i32 right = MIN(area.x + area.width, clip->x + clip->width);
+	i32 bottom = MIN(area.y + area.height, clip->y + clip->height);
+	i32 origin_x = x - cursor->hot_x;
+	i32 origin_y = y - cursor->hot_y;
+	u32 stride = framebuffer->pitch / sizeof(u32);
+	for (i32 row = top; row < bottom; ++row) {
+		const u32 *src = cursor->image + (row - origin_y) * cursor->width - origin_x;
+		u32 *dest = (u32 *)framebuffer->buffer + row * stride;
+		for (i32 column = left; column < right; ++column) {
+			if (src[column] >> 24) {
+				dest[column] = src[column];
+			}
+		}
+	}
+}
+
+bool vnc_cursor_get_rect(struct Vnc_cursor *cursor, i32 x, i32 y,
+			 struct Vnc_framebuffer *framebuffer, struct Vnc_rfb_rect *rect)
+{
+	i32 left = MAX(x - cursor->hot_x, 0);
+	i32 top = MAX(y - cursor->hot_y, 0);
+	i32 right = MIN(x - cursor->hot_x + cursor->width, (i32)framebuffer->width);
+	i32 bottom = MIN(y - cursor->hot_y + cursor->height, (i32)framebuffer->height);
+	if (left >= right || top >= bottom) {
+		return false;
+	}
+	*rect = (struct Vnc_rfb_rect){
+		.x = left,
+		.y = top,
+		.width = right - left,
+		.height = bottom - top,
+	};
+	return true;
+}
+
+static bool ensure_image_capacity(struct Vnc_cursor *cursor, size_t pixel_count)
+{
+	if (pixel_count <= cursor->image_capacity) {
+		return true;
+	}
+	u32 *image = realloc(cursor->image, pixel_count * sizeof(u32));
+	if (image == NULL) {
+		return false;
+	}
+	cursor->image = image;
+	cursor->image_capacity = pixel_count;
+	return true;
+}
+
+static bool check_size(struct Vnc_rfb_rect *rect)
+{
+	if (rect->width > VNC_CURSOR_MAX_SIZE || rect->height > VNC_CURSOR_MAX_SIZE) {
+		vnc_log_error("Cursor: %ux%u is larger than %ux%u", rect->width, rect->height,
+			      VNC_CURSOR_MAX_SIZE, VNC_CURSOR_MAX_SIZE);
+		return false;
+	}
+	return true;
+}
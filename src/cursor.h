@@ -0,0 +1,37 @@
+#pragma once
+
+#include "fb.h"
+#include "pixel.h"
+#include "rfb.h"
+#include "types.h"
+
+// Larger cursors are rejected as corrupt
+#define VNC_CURSOR_MAX_SIZE 1024
+
+// Cursor image sent through the Cursor pseudo-encoding
+struct Vnc_cursor {
+	u32 *image; // ARGB8888, alpha is either 0 or 255 as taken from the bitmask
+	size_t image_capacity;
+	u8 *wire; // Pixels and bitmask as received
+	size_t wire_capacity;
+	u16 width;
+	u16 height;
+	u16 hot_x;
+	u16 hot_y;
+};
+
+void vnc_cursor_deinit(struct Vnc_cursor *cursor);
+// Returns VNC_RFB_RESULT_WOULD_BLOCK until the cursor image and mask are buffered
+enum Vnc_rfb_result vnc_cursor_measure(struct Vnc_rfb_stream *stream, struct Vnc_rfb_rect *rect,
+				       struct Vnc_pixel_converter *converter);
+// The rect position is the hotspot, its size the size of the cursor
+enum Vnc_rfb_result vnc_cursor_recv(struct Vnc_cursor *cursor, struct Vnc_rfb_stream *stream,
+				    struct Vnc_rfb_rect *rect,
+				    struct Vnc_pixel_converter *converter);
+bool vnc_cursor_copy(struct Vnc_cursor *dest, struct Vnc_cursor *src);
+// Draws the cursor with its hotspot at x, y, clipped to `clip`
+void vnc_cursor_draw(struct Vnc_cursor *cursor, i32 x, i32 y, struct Vnc_rfb_rect *clip,
+		     struct Vnc_framebuffer *framebuffer);
+// The area covered by the cursor with its hotspot at x, y, clipped to the framebuffer
+bool vnc_cursor_get_rect(struct Vnc_cursor *cursor, i32 x, i32 y,
+			 struct Vnc_framebuffer *framebuffer, struct Vnc_rfb_rect *rect);
@@ -0,0 +1,179 @@
+#include "damage.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "macros.h"
+
+#define TILE_SHIFT 4
+#define WORD_BITS 64
+
+static bool clip_to_tiles(struct Vnc_damage *damage, struct Vnc_rfb_rect *rect, u32 *column,
+			  u32 *end_column, u32 *row, u32 *end_row);
+static void set_span(u64 *words, u32 start, u32 end);
+static void clear_span(u64 *words, u32 start, u32 end);
+static bool span_is_set(u64 *words, u32 start, u32 end);
+static u64 span_mask(u32 word, u32 start, u32 end);
+
+bool vnc_damage_init(struct Vnc_damage *damage, u32 width, u32 height)
+{
+	*damage = (struct Vnc_damage){ 0 };
+	damage->width = width;
+	damage->height = height;
+	damage->columns = (width + (1 << TILE_SHIFT) - 1) >> TILE_SHIFT;
+	damage->rows = (height + (1 << TILE_SHIFT) - 1) >> TILE_SHIFT;
+	damage->words_per_row = (damage->columns + WORD_BITS - 1) / WORD_BITS;
+	damage->tiles = calloc((size_t)damage->rows * damage->words_per_row, sizeof(u64));
+	if (damage->tiles == NULL && damage->rows * damage->words_per_row > 0) {
+		vnc_log_error("Unable to allocate damage tiles");
+		return false;
+	}
+	return true;
+}
+
+void vnc_damage_deinit(struct Vnc_damage *damage)
+{
+	free(damage->tiles);
+	damage->tiles = NULL;
+}
+
+bool vnc_damage_is_empty(struct Vnc_damage *damage)
+{
+	return damage->top >= damage->bottom;
+}
+
+void vnc_damage_clear(struct Vnc_damage *damage)
+{
+	if (!vnc_damage_is_empty(damage)) {
+		memset(damage->tiles + damage->top * damage->words_per_row, 0,
+		       (damage->bottom - damage->top) * damage->words_per_row * sizeof(u64));
+	}
+	damage->top = 0;
+	damage->bottom = 0;
+}
+
+void vnc_damage_add_rect(struct Vnc_damage *damage, struct Vnc_rfb_rect *rect)
+{
+	u32 column, end_column, row, end_row;
+	if (!clip_to_tiles(damage, rect, &column, &end_column, &row, &end_row)) {
+		return;
+	}
+	for (u32 y = row; y < end_row; ++y) {
+		set_span(damage->tiles + y * damage->words_per_row, column, end_column);
+	}
+	if (vnc_damage_is_empty(damage)) {
+		damage->top = row;
+		damage->bottom = end_row;
+	} else {
+		damage->top = MIN(damage->top, row);
+		damage->bottom = MAX(damage->bottom, end_row);
+	}
+}
+
+void vnc_damage_add_all(struct Vnc_damage *damage)
+{
+	struct Vnc_rfb_rect screen = { .width = MIN(damage->width, USHRT_MAX),
+				       .height = MIN(damage->height, USHRT_MAX) };
+	vnc_damage_add_rect(damage, &screen);
+}
+
+bool vnc_damage_pop_rect(struct Vnc_damage *damage, struct Vnc_rfb_rect *rect)
+{
+	u32 words_per_row = damage->words_per_row;
+	for (; damage->top < damage->bottom; ++damage->top) {
+		u64 *words = damage->tiles + damage->top * words_per_row;
+		u32 word = 0;
+		while (word < words_per_row && words[word] == 0) {
+			++word;
+		}
+		if (word == words_per_row) {
+			continue;
+		}
+
+		u32 column = word * WORD_BITS + __builtin_ctzll(words[word]);
+		// The run ends at the first clean tile, bits past the last column are never set
+		u64 clean = ~words[word] & (~0ull << (column % WORD_BITS));
+		while (clean == 0 && ++word < words_per_row) {
+			clean = ~words[word];
+		}
+		u32 end_column = word < words_per_row ? word * WORD_BITS + __builtin_ctzll(clean) :
+							 words_per_row * WORD_BITS;
+		end_column = MIN(end_column, damage->columns);
+
+		u32 end_row = damage->top + 1;
+		while (end_row < damage->bottom &&
+		       span_is_set(damage->tiles + end_row * words_per_row, column, end_column)) {
+			++end_row;
+		}
+		for (u32 y = damage->top; y < end_row; ++y) {
+			clear_span(damage->tiles + y * words_per_row, column, end_column);
+		}
+
+		u32 x = column << TILE_SHIFT;
+		u32 y = damage->top << TILE_SHIFT;
+		rect->x = x;
+		rect->y = y;
+		rect->width = MIN(end_column << TILE_SHIFT, damage->width) - x;
+		rect->height = MIN(end_row << TILE_SHIFT, damage->height) - y;
+		return true;
+	}
+	damage->top = 0;
+	damage->bottom = 0;
+	return false;
+}
+
+// Tiles touched by `rect`, false if it is empty or off screen
+static bool clip_to_tiles(struct Vnc_damage *damage, struct Vnc_rfb_rect *rect, u32 *column,
+			  u32 *end_column, u32 *row, u32 *end_row)
+{
+	u32 right = MIN((u32)rect->x + rect->width, damage->width);
+	u32 bottom = MIN((u32)rect->y + rect->height, damage->height);
+	if (rect->x >= right || rect->y >= bottom) {
+		return false;
+	}
+	*column = rect->x >> TILE_SHIFT;
+	*end_column = ((right - 1) >> TILE_SHIFT) + 1;
+	*row = rect->y >> TILE_SHIFT;
+	*end_row = ((bottom - 1) >> TILE_SHIFT) + 1;
+	return true;
+}
+
+static void set_span(u64 *words, u32 start, u32 end)
+{
+	for (u32 word = start / WORD_BITS; word <= (end - 1) / WORD_BITS; ++word) {
+		words[word] |= span_mask(word, start, end);
+	}
+}
+
+static void clear_span(u64 *words, u32 start, u32 end)
+{
+	for (u32 word = start / WORD_BITS; word <= (end - 1) / WORD_BITS; ++word) {
+		words[word] &= ~span_mask(word, start, end);
+	}
+}
+
+static bool span_is_set(u64 *words, u32 start, u32 end)
+{
+	for (u32 word = start / WORD_BITS; word <= (end - 1) / WORD_BITS; ++word) {
+		u64 mask = span_mask(word, start, end);
+		if ((words[word] & mask) != mask) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// The bits of tiles [start, end) that fall into `word`
+static u64 span_mask(u32 word, u32 start, u32 end)
+{
+	u64 mask = ~0ull;
+	if (word == start / WORD_BITS) {
+		mask &= ~0ull << (start % WORD_BITS);
+	}
+	if (word == (end - 1) / WORD_BITS) {
+		mask &= ~0ull >> (WORD_BITS - 1 - (end - 1) % WORD_BITS);
+	}
+	return mask;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "rfb.h"
+#include "types.h"
+
+// Damage as one bit per 16x16 tile of the screen. The memory it takes only depends on the
+// screen size, overlapping rects cost nothing extra and no rect is ever dropped. Rows outside
+// [top, bottom) are known to be clean, so sparse damage is cheap to go through.
+struct Vnc_damage {
+	u32 width;
+	u32 height;
+	u32 columns;
+	u32 rows;
+	u32 words_per_row;
+	u64 *tiles;
+	u32 top;
+	u32 bottom;
+};
+
+bool vnc_damage_init(struct Vnc_damage *damage, u32 width, u32 height);
+void vnc_damage_deinit(struct Vnc_damage *damage);
+bool vnc_damage_is_empty(struct Vnc_damage *damage);
+void vnc_damage_clear(struct Vnc_damage *damage);
+void vnc_damage_add_rect(struct Vnc_damage *damage, struct Vnc_rfb_rect *rect);
+void vnc_damage_add_all(struct Vnc_damage *damage);
+// Takes the next rect of damage off, false once there is none left. Runs of dirty tiles in a
+// row are merged, and so are the rows below that are dirty over the same run.
+bool vnc_damage_pop_rect(struct Vnc_damage *damage, struct Vnc_rfb_rect *rect);
@@ -0,0 +1,25 @@
+#include "display.h"
+
+#include "macros.h"
+
+void vnc_display_place_outputs(struct Vnc_display *display)
+{
+	u32 x = 0;
+	for (u32 i = 0; i < display->output_count; ++i) {
+		struct Vnc_display_output *output = &display->outputs[i];
+		output->x = x;
+		output->y = 0;
+		x += output->fbs[0].width;
+	}
+}
+
+void vnc_display_get_size(struct Vnc_display *display, u32 *width, u32 *height)
+{
+	*width = 0;
+	*height = 0;
+	for (u32 i = 0; i < display->output_count; ++i) {
+		struct Vnc_display_output *output = &display->outputs[i];
+		*width = MAX(*width, output->x + output->fbs[0].width);
+		*height = MAX(*height, output->y + output->fbs[0].height);
+	}
+}
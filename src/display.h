@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "fb.h"
+#include "rfb.h"
+#include "types.h"
+
+// More damage than this goes to the display as one bounding rect
+#define VNC_DISPLAY_MAX_DAMAGE_CLIPS 64
+
+// Outputs beyond this are left dark
+#define VNC_DISPLAY_MAX_OUTPUTS 4
+
+// One monitor: where it is in the desktop and the two scanout buffers that are flipped between
+// on it, optionally with a cursor plane
+struct Vnc_display_output {
+	struct Vnc_framebuffer fbs[2];
+	u32 x; // Of the top left corner in the desktop, outputs are placed side by side
+	u32 y;
+	bool flip_pending; // Until then the old buffer is still scanned out
+	// Cursor plane, the cursor operations are only called when has_cursor is set
+	bool has_cursor;
+	struct Vnc_framebuffer cursor_fb;
+};
+
+// What the fb mngr presents on. Backends embed it, fill in the outputs and set the operations in
+// their init. Every output flips on its own vblank, independent of the others.
+struct Vnc_display {
+	struct Vnc_display_output outputs[VNC_DISPLAY_MAX_OUTPUTS];
+	u32 output_count;
+	int fd; // Readable once a flip completed on any of the outputs
+
+	// Queues `fb_index` to be shown on the next vblank of `output`. `damage` is what changed
+	// compared to the buffer on screen, drivers that upload the framebuffer (virtio-gpu, udl)
+	// only send that.
+	bool (*flip_buffer)(struct Vnc_display *display, u32 output, u32 fb_index,
+			    struct Vnc_rfb_rect *damage, u32 damage_count);
+	// Reads the flip completions off fd once it is readable, clearing flip_pending
+	bool (*handle_events)(struct Vnc_display *display);
+	// Flushes CPU writes to `rects` of the buffer on screen for drivers that need it
+	void (*mark_dirty)(struct Vnc_display *display, u32 output, u32 fb_index,
+			   struct Vnc_rfb_rect *rects, u32 rect_count);
+	// Shows cursor_fb on the cursor plane, its contents are ARGB8888
+	bool (*set_cursor)(struct Vnc_display *display, u32 output, u16 hot_x, u16 hot_y);
+	bool (*hide_cursor)(struct Vnc_display *display, u32 output);
+	// Positions the hotspot of the cursor, relative to the output
+	bool (*move_cursor)(struct Vnc_display *display, u32 output, i32 x, i32 y);
+};
+
+// Lays the outputs out left to right in the order they were found, aligned at the top
+void vnc_display_place_outputs(struct Vnc_display *display);
+// The size of the desktop the outputs are laid out in
+void vnc_display_get_size(struct Vnc_display *display, u32 *width, u32 *height);
@@ -0,0 +1,43 @@
+#include "draw.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+static void fill_row(u32 *dest, u32 count, u32 color);
+
+void vnc_draw_fill_rect(struct Vnc_framebuffer *framebuffer, u16 x, u16 y, u16 width, u16 height,
+			u32 color)
+{
+	u32 stride = framebuffer->pitch / sizeof(u32);
+	u32 *row = (u32 *)framebuffer->buffer + y * stride + x;
+	for (u16 i = 0; i < height; ++i) {
+		fill_row(row, width, color);
+		row += stride;
+	}
+}
+
+static void fill_row(u32 *dest, u32 count, u32 color)
+{
+	u32 i = 0;
+#if defined(__SSE2__)
+	__m128i value = _mm_set1_epi32(color);
+	for (; i + 8 <= count; i += 8) {
+		_mm_storeu_si128((__m128i *)&dest[i], value);
+		_mm_storeu_si128((__m128i *)&dest[i + 4], value);
+	}
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_si128((__m128i *)&dest[i], value);
+	}
+#elif defined(__ARM_NEON)
+	uint32x4_t value = vdupq_n_u32(color);
+	for (; i + 4 <= count; i += 4) {
+		vst1q_u32(&dest[i], value);
+	}
+#endif
+	for (; i < count; ++i) {
+		dest[i] = color;
+	}
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "fb.h"
+#include "types.h"
+
+void vnc_draw_fill_rect(struct Vnc_framebuffer *framebuffer, u16 x, u16 y, u16 width, u16 height,
+			u32 color);
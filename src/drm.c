@@ -1,6 +1,8 @@
+#include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
@@ -8,11 +10,40 @@
 #include "log.h"
 #include "macros.h"
 
-static bool create_and_map_dumb_buffer(int drm_fd, struct Vnc_framebuffer *fb, u32 *drm_fb_id);
+static bool create_and_map_dumb_buffer(int drm_fd, struct Vnc_framebuffer *fb, u32 *handle);
+static bool init_output(struct Vnc_drm *drm, drmModeResPtr resources,
+			drmModeConnectorPtr connector, u32 *used_crtcs);
+static bool find_crtc(struct Vnc_drm *drm, drmModeResPtr resources,
+		      drmModeConnectorPtr connector, u32 used_crtcs, u32 *crtc_index);
+static bool init_atomic(struct Vnc_drm *drm);
+static bool find_primary_plane(struct Vnc_drm *drm, drmModePlaneResPtr planes, u32 output);
+static u32 find_property(int fd, u32 object_id, u32 object_type, const char *name, u64 *value);
+static bool commit_atomic(struct Vnc_drm *drm, u32 output, u32 fb_index,
+			  struct Vnc_rfb_rect *damage, u32 damage_count);
+static u64 now_ns(void);
+static bool flip_buffer(struct Vnc_display *display, u32 output, u32 fb_index,
+			struct Vnc_rfb_rect *damage, u32 damage_count);
+static bool handle_events(struct Vnc_display *display);
+static void mark_dirty(struct Vnc_display *display, u32 output, u32 fb_index,
+		       struct Vnc_rfb_rect *rects, u32 rect_count);
+static bool set_cursor(struct Vnc_display *display, u32 output, u16 hot_x, u16 hot_y);
+static bool hide_cursor(struct Vnc_display *display, u32 output);
+static bool move_cursor(struct Vnc_display *display, u32 output, i32 x, i32 y);
+static void handle_page_flip(int fd, unsigned int sequence, unsigned int tv_sec,
+			     unsigned int tv_usec, void *user_data);
 
 bool vnc_drm_init(struct Vnc_drm *drm)
 {
-	*drm = (struct Vnc_drm){ 0 };
+	*drm = (struct Vnc_drm){
+		.display = {
+			.flip_buffer = flip_buffer,
+			.handle_events = handle_events,
+			.mark_dirty = mark_dirty,
+			.set_cursor = set_cursor,
+			.hide_cursor = hide_cursor,
+			.move_cursor = move_cursor,
+		},
+	};
 	drm->fd = open("/dev/dri/card1", O_RDWR | O_CLOEXEC);
 	// drm->fd = drmOpen(NULL, NULL);
 	if (drm->fd == -1) {
@@ -26,24 +57,68 @@ bool vnc_drm_init(struct Vnc_drm *drm)
 		goto err;
 	}
 
-	u32 connector_id = 0;
-	drmModeConnectorPtr connector = NULL;
+	if (!drmIsMaster(drm->fd)) {
+		if (drmSetMaster(drm->fd) == -1) {
+			vnc_log_error("drmSetMaster failed");
+			goto err;
+		}
+	}
+
+	u32 used_crtcs = 0;
 	for (int i = 0; i < resources->count_connectors; ++i) {
-		connector_id = resources->connectors[i];
-		connector = drmModeGetConnector(drm->fd, connector_id);
+		drmModeConnectorPtr connector =
+			drmModeGetConnector(drm->fd, resources->connectors[i]);
 		if (connector == NULL) {
 			vnc_log_error("drmModeGetConnector failed");
 			goto err;
 		}
-		if (connector->count_modes != 0) {
-			break;
+		bool ok = true;
+		if (connector->connection == DRM_MODE_CONNECTED && connector->count_modes != 0) {
+			if (drm->display.output_count == ARRAY_COUNT(drm->outputs)) {
+				vnc_log_info("DRM: more than %d outputs, leaving connector %u dark",
+					     VNC_DISPLAY_MAX_OUTPUTS, connector->connector_id);
+			} else {
+				ok = init_output(drm, resources, connector, &used_crtcs);
+			}
+		}
+		drmModeFreeConnector(connector);
+		if (!ok) {
+			goto err;
 		}
 	}
-
-	if (connector == NULL) {
+	if (drm->display.output_count == 0) {
 		vnc_log_error("DRM: no suitable connector found");
 		goto err;
 	}
+	vnc_display_place_outputs(&drm->display);
+
+	// The modes are set the legacy way either way, flips only change the planes' framebuffers
+	drm->atomic = init_atomic(drm);
+	drm->display.fd = drm->fd;
+	drmModeFreeResources(resources);
+	return true;
+
+err:
+	if (resources != NULL) {
+		drmModeFreeResources(resources);
+	}
+	drmClose(drm->fd);
+	return false;
+}
+
+// Lights up `connector` in its preferred mode on a CRTC that no other output uses
+static bool init_output(struct Vnc_drm *drm, drmModeResPtr resources,
+			drmModeConnectorPtr connector, u32 *used_crtcs)
+{
+	u32 index = drm->display.output_count;
+	struct Vnc_drm_output *output = &drm->outputs[index];
+	struct Vnc_display_output *display_output = &drm->display.outputs[index];
+	u32 crtc_index;
+	if (!find_crtc(drm, resources, connector, *used_crtcs, &crtc_index)) {
+		vnc_log_info("DRM: no free CRTC for connector %u, leaving it dark",
+			     connector->connector_id);
+		return true;
+	}
 	// According to man drm-kms the first mode is the default and highest
 	// resolution
 	drmModeModeInfo mode = connector->modes[0];
@@ -51,36 +126,55 @@ bool vnc_drm_init(struct Vnc_drm *drm)
 		      mode.hsync_end, mode.htotal, mode.vdisplay, mode.vsync_start, mode.vsync_end,
 		      mode.vtotal, mode.clock);
 
-	if (!drmIsMaster(drm->fd)) {
-		if (drmSetMaster(drm->fd) == -1) {
-			vnc_log_error("drmSetMaster failed");
-			goto err;
-		}
-	}
-
-	for (size_t i = 0; i < ARRAY_COUNT(drm->fbs); ++i) {
-		struct Vnc_framebuffer *fb = &drm->fbs[i];
+	for (size_t i = 0; i < ARRAY_COUNT(display_output->fbs); ++i) {
+		struct Vnc_framebuffer *fb = &display_output->fbs[i];
 		fb->width = mode.hdisplay;
 		fb->height = mode.vdisplay;
-		bool rc = create_and_map_dumb_buffer(drm->fd, fb, &drm->fb_ids[i]);
+		u32 handle;
+		bool rc = create_and_map_dumb_buffer(drm->fd, fb, &handle);
 		if (!rc) {
 			vnc_log_error("Create dumb buffer #1 failed");
-			goto err;
+			return false;
 		}
+		drmModeAddFB(drm->fd, fb->width, fb->height, 24, fb->bpp, fb->pitch, handle,
+			     &output->fb_ids[i]);
+		memset(fb->buffer, 255, fb->size);
 	}
 
-	drm->crtc_id = resources->crtcs[0];
-	drmModeSetCrtc(drm->fd, drm->crtc_id, drm->fb_ids[0], 0, 0, &connector_id, 1, &mode);
-	drmModeFreeConnector(connector);
-	drmModeFreeResources(resources);
+	output->connector_id = connector->connector_id;
+	output->crtc_index = crtc_index;
+	output->crtc_id = resources->crtcs[crtc_index];
+	drmModeSetCrtc(drm->fd, output->crtc_id, output->fb_ids[0], 0, 0, &output->connector_id,
+		       1, &mode);
+	*used_crtcs |= 1u << crtc_index;
+	++drm->display.output_count;
+	vnc_log_info("DRM: output %u is connector %u on CRTC %u, %ux%u", index,
+		     output->connector_id, output->crtc_id, mode.hdisplay, mode.vdisplay);
 	return true;
+}
 
-err:
-	drmClose(drm->fd);
+// The first CRTC that one of the connector's encoders can drive and that is still free
+static bool find_crtc(struct Vnc_drm *drm, drmModeResPtr resources,
+		      drmModeConnectorPtr connector, u32 used_crtcs, u32 *crtc_index)
+{
+	for (int i = 0; i < connector->count_encoders; ++i) {
+		drmModeEncoderPtr encoder = drmModeGetEncoder(drm->fd, connector->encoders[i]);
+		if (encoder == NULL) {
+			continue;
+		}
+		u32 possible_crtcs = encoder->possible_crtcs & ~used_crtcs;
+		drmModeFreeEncoder(encoder);
+		for (int j = 0; j < resources->count_crtcs && j < 32; ++j) {
+			if ((possible_crtcs & (1u << j)) != 0) {
+				*crtc_index = j;
+				return true;
+			}
+		}
+	}
 	return false;
 }
 
-static bool create_and_map_dumb_buffer(int drm_fd, struct Vnc_framebuffer *fb, u32 *drm_fb_id)
+static bool create_and_map_dumb_buffer(int drm_fd, struct Vnc_framebuffer *fb, u32 *handle)
 {
 	fb->bpp = 32;
 	struct drm_mode_create_dumb create_dumb_request = {
@@ -97,9 +191,7 @@ static bool create_and_map_dumb_buffer(int drm_fd, struct Vnc_framebuffer *fb, u
 	}
 	fb->pitch = create_dumb_request.pitch;
 	fb->size = create_dumb_request.size;
-
-	rc = drmModeAddFB(drm_fd, fb->width, fb->height, 24, create_dumb_request.bpp, fb->pitch,
-			  create_dumb_request.handle, drm_fb_id);
+	*handle = create_dumb_request.handle;
 
 	struct drm_mode_map_dumb map_request = {
 		.handle = create_dumb_request.handle,
@@ -115,21 +207,279 @@ static bool create_and_map_dumb_buffer(int drm_fd, struct Vnc_framebuffer *fb, u
 		return false;
 	}
 	fb->buffer = map;
-	memset(fb->buffer, 255, fb->size);
 	return true;
 }
 
 void vnc_drm_deinit(struct Vnc_drm *drm)
 {
+	if (drm->commits > 0) {
+		vnc_log_debug("DRM: %llu %s flips, %.1f us per flip", drm->commits,
+			      drm->atomic ? "atomic" : "legacy",
+			      drm->commit_ns / 1e3 / drm->commits);
+	}
 	vnc_log_debug("DRM deinit");
 	drmDropMaster(drm->fd);
 	drmClose(drm->fd);
-	*drm = (struct Vnc_drm){ 0 };
-	drm->fd = -1;
+	*drm = (struct Vnc_drm){ .fd = -1, .display.fd = -1 };
+}
+
+bool vnc_drm_init_cursor(struct Vnc_drm *drm)
+{
+	u64 width = 64;
+	u64 height = 64;
+	drmGetCap(drm->fd, DRM_CAP_CURSOR_WIDTH, &width);
+	drmGetCap(drm->fd, DRM_CAP_CURSOR_HEIGHT, &height);
+	bool any_cursor = false;
+	for (u32 i = 0; i < drm->display.output_count; ++i) {
+		struct Vnc_display_output *display_output = &drm->display.outputs[i];
+		struct Vnc_drm_output *output = &drm->outputs[i];
+		display_output->cursor_fb.width = width;
+		display_output->cursor_fb.height = height;
+		if (!create_and_map_dumb_buffer(drm->fd, &display_output->cursor_fb,
+						&output->cursor_handle)) {
+			vnc_log_error("DRM: unable to create cursor buffer");
+			return false;
+		}
+		memset(display_output->cursor_fb.buffer, 0, display_output->cursor_fb.size);
+
+		// Probe for a cursor plane, drivers without one (e.g. vkms by default) fail here
+		if (drmModeSetCursor(drm->fd, output->crtc_id, 0, 0, 0) != 0) {
+			vnc_log_debug("DRM: no cursor plane on output %u", i);
+			continue;
+		}
+		display_output->has_cursor = true;
+		any_cursor = true;
+	}
+	return any_cursor;
+}
+
+static bool flip_buffer(struct Vnc_display *display, u32 output, u32 fb_index,
+			struct Vnc_rfb_rect *damage, u32 damage_count)
+{
+	struct Vnc_drm *drm = container_of(display, struct Vnc_drm, display);
+	struct Vnc_drm_output *drm_output = &drm->outputs[output];
+	struct Vnc_display_output *display_output = &display->outputs[output];
+	u64 start_ns = now_ns();
+	if (drm->atomic && !commit_atomic(drm, output, fb_index, damage, damage_count)) {
+		if (errno == EBUSY) {
+			return false;
+		}
+		vnc_log_error("Atomic commit failed: %s, falling back to page flips",
+			      strerror(errno));
+		drm->atomic = false;
+	}
+	// The event comes back with the output, so completions on other CRTCs don't clear it
+	if (!drm->atomic &&
+	    drmModePageFlip(drm->fd, drm_output->crtc_id, drm_output->fb_ids[fb_index],
+			    DRM_MODE_PAGE_FLIP_EVENT, display_output) != 0) {
+		vnc_log_debug("drmModePageFlip failed: %s", strerror(errno));
+		return false;
+	}
+	drm->commit_ns += now_ns() - start_ns;
+	++drm->commits;
+	display_output->flip_pending = true;
+	return true;
+}
+
+static bool handle_events(struct Vnc_display *display)
+{
+	struct Vnc_drm *drm = container_of(display, struct Vnc_drm, display);
+	drmEventContext context = {
+		.version = 2,
+		.page_flip_handler = handle_page_flip,
+	};
+	if (drmHandleEvent(drm->fd, &context) != 0) {
+		vnc_log_error("drmHandleEvent failed");
+		return false;
+	}
+	return true;
 }
 
-bool vnc_drm_flip_buffer(struct Vnc_drm *drm, u32 fb_index)
+static void mark_dirty(struct Vnc_display *display, u32 output, u32 fb_index,
+		       struct Vnc_rfb_rect *rects, u32 rect_count)
 {
-	int rc = drmModePageFlip(drm->fd, drm->crtc_id, drm->fb_ids[fb_index], 0, NULL);
+	struct Vnc_drm *drm = container_of(display, struct Vnc_drm, display);
+	drmModeClip clips[VNC_DISPLAY_MAX_DAMAGE_CLIPS];
+	rect_count = MIN(rect_count, ARRAY_COUNT(clips));
+	for (u32 i = 0; i < rect_count; ++i) {
+		clips[i] = (drmModeClip){
+			.x1 = rects[i].x,
+			.y1 = rects[i].y,
+			.x2 = rects[i].x + rects[i].width,
+			.y2 = rects[i].y + rects[i].height,
+		};
+	}
+	// Only drivers that don't scan out of the buffer directly implement this
+	drmModeDirtyFB(drm->fd, drm->outputs[output].fb_ids[fb_index], clips, rect_count);
+}
+
+static bool set_cursor(struct Vnc_display *display, u32 output, u16 hot_x, u16 hot_y)
+{
+	struct Vnc_drm *drm = container_of(display, struct Vnc_drm, display);
+	struct Vnc_framebuffer *cursor_fb = &display->outputs[output].cursor_fb;
+	int rc = drmModeSetCursor2(drm->fd, drm->outputs[output].crtc_id,
+				   drm->outputs[output].cursor_handle, cursor_fb->width,
+				   cursor_fb->height, hot_x, hot_y);
 	return rc == 0;
 }
+
+static bool hide_cursor(struct Vnc_display *display, u32 output)
+{
+	struct Vnc_drm *drm = container_of(display, struct Vnc_drm, display);
+	return drmModeSetCursor(drm->fd, drm->outputs[output].crtc_id, 0, 0, 0) == 0;
+}
+
+static bool move_cursor(struct Vnc_display *display, u32 output, i32 x, i32 y)
+{
+	struct Vnc_drm *drm = container_of(display, struct Vnc_drm, display);
+	return drmModeMoveCursor(drm->fd, drm->outputs[output].crtc_id, x, y) == 0;
+}
+
+// Only when every output has a primary plane to flip, they all flip the same way
+static bool init_atomic(struct Vnc_drm *drm)
+{
+	if (drmSetClientCap(drm->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) != 0 ||
+	    drmSetClientCap(drm->fd, DRM_CLIENT_CAP_ATOMIC, 1) != 0) {
+		vnc_log_debug("DRM: no atomic modesetting, using page flips");
+		return false;
+	}
+	drmModePlaneResPtr planes = drmModeGetPlaneResources(drm->fd);
+	if (planes == NULL) {
+		vnc_log_error("drmModeGetPlaneResources failed");
+		return false;
+	}
+	bool ok = true;
+	for (u32 i = 0; i < drm->display.output_count && ok; ++i) {
+		ok = find_primary_plane(drm, planes, i);
+	}
+	drmModeFreePlaneResources(planes);
+	return ok;
+}
+
+// Looks up the primary plane of the output's CRTC and the properties a flip sets
+static bool find_primary_plane(struct Vnc_drm *drm, drmModePlaneResPtr planes, u32 output)
+{
+	struct Vnc_drm_output *drm_output = &drm->outputs[output];
+	for (u32 i = 0; i < planes->count_planes && drm_output->plane_id == 0; ++i) {
+		drmModePlanePtr plane = drmModeGetPlane(drm->fd, planes->planes[i]);
+		if (plane == NULL) {
+			continue;
+		}
+		// A plane that can go on several CRTCs may already be taken by an earlier output
+		bool taken = false;
+		for (u32 j = 0; j < output; ++j) {
+			taken |= drm->outputs[j].plane_id == plane->plane_id;
+		}
+		u64 type;
+		if (!taken && (plane->possible_crtcs & (1u << drm_output->crtc_index)) != 0 &&
+		    find_property(drm->fd, plane->plane_id, DRM_MODE_OBJECT_PLANE, "type", &type) &&
+		    type == DRM_PLANE_TYPE_PRIMARY) {
+			drm_output->plane_id = plane->plane_id;
+		}
+		drmModeFreePlane(plane);
+	}
+	if (drm_output->plane_id == 0) {
+		vnc_log_error("DRM: no primary plane for the CRTC of output %u", output);
+		return false;
+	}
+
+	drm_output->plane_fb_id_prop = find_property(drm->fd, drm_output->plane_id,
+						     DRM_MODE_OBJECT_PLANE, "FB_ID", NULL);
+	drm_output->plane_damage_clips_prop = find_property(
+		drm->fd, drm_output->plane_id, DRM_MODE_OBJECT_PLANE, "FB_DAMAGE_CLIPS", NULL);
+	if (drm_output->plane_fb_id_prop == 0) {
+		vnc_log_error("DRM: primary plane without FB_ID");
+		return false;
+	}
+	vnc_log_debug("DRM: output %u flips atomically on plane %u, damage clips %s", output,
+		      drm_output->plane_id,
+		      drm_output->plane_damage_clips_prop != 0 ? "yes" : "no");
+	return true;
+}
+
+// Returns the id of the property called `name`, 0 if the object doesn't have it
+static u32 find_property(int fd, u32 object_id, u32 object_type, const char *name, u64 *value)
+{
+	drmModeObjectPropertiesPtr properties =
+		drmModeObjectGetProperties(fd, object_id, object_type);
+	if (properties == NULL) {
+		return 0;
+	}
+	u32 id = 0;
+	for (u32 i = 0; i < properties->count_props && id == 0; ++i) {
+		drmModePropertyPtr property = drmModeGetProperty(fd, properties->props[i]);
+		if (property == NULL) {
+			continue;
+		}
+		if (strcmp(property->name, name) == 0) {
+			id = property->prop_id;
+			if (value != NULL) {
+				*value = properties->prop_values[i];
+			}
+		}
+		drmModeFreeProperty(property);
+	}
+	drmModeFreeObjectProperties(properties);
+	return id;
+}
+
+// Nonblocking, completes with a page flip event like drmModePageFlip. Only touches the output's
+// plane, so it doesn't wait for flips on other CRTCs. errno is set on failure.
+static bool commit_atomic(struct Vnc_drm *drm, u32 output, u32 fb_index,
+			  struct Vnc_rfb_rect *damage, u32 damage_count)
+{
+	struct Vnc_drm_output *drm_output = &drm->outputs[output];
+	drmModeAtomicReqPtr request = drmModeAtomicAlloc();
+	if (request == NULL) {
+		errno = ENOMEM;
+		return false;
+	}
+	u32 blob_id = 0;
+	bool ok = drmModeAtomicAddProperty(request, drm_output->plane_id,
+					   drm_output->plane_fb_id_prop,
+					   drm_output->fb_ids[fb_index]) >= 0;
+	struct drm_mode_rect clips[VNC_DISPLAY_MAX_DAMAGE_CLIPS];
+	// Without clips the whole framebuffer counts as damaged
+	if (ok && drm_output->plane_damage_clips_prop != 0 && damage_count > 0 &&
+	    damage_count <= ARRAY_COUNT(clips)) {
+		for (u32 i = 0; i < damage_count; ++i) {
+			clips[i] = (struct drm_mode_rect){
+				.x1 = damage[i].x,
+				.y1 = damage[i].y,
+				.x2 = damage[i].x + damage[i].width,
+				.y2 = damage[i].y + damage[i].height,
+			};
+		}
+		ok = drmModeCreatePropertyBlob(drm->fd, clips, damage_count * sizeof(*clips),
+					       &blob_id) == 0 &&
+		     drmModeAtomicAddProperty(request, drm_output->plane_id,
+					      drm_output->plane_damage_clips_prop, blob_id) >= 0;
+	}
+	if (ok) {
+		ok = drmModeAtomicCommit(drm->fd, request,
+					 DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT,
+					 &drm->display.outputs[output]) == 0;
+	}
+	int commit_errno = errno;
+	// The commit holds its own reference to the blob
+	if (blob_id != 0) {
+		drmModeDestroyPropertyBlob(drm->fd, blob_id);
+	}
+	drmModeAtomicFree(request);
+	errno = commit_errno;
+	return ok;
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void handle_page_flip(int fd, unsigned int sequence, unsigned int tv_sec,
+			     unsigned int tv_usec, void *user_data)
+{
+	struct Vnc_display_output *output = user_data;
+	output->flip_pending = false;
+}
@@ -2,16 +2,35 @@
 
 #include <stdbool.h>
 
-#include "fb.h"
+#include "display.h"
 #include "types.h"
 
+// A connected connector and the CRTC that scans out to it
+struct Vnc_drm_output {
+	u32 connector_id;
+	u32 crtc_id;
+	u32 crtc_index;
+	u32 fb_ids[2];
+	u32 plane_id; // Primary plane of the CRTC
+	u32 plane_fb_id_prop;
+	u32 plane_damage_clips_prop;
+	u32 cursor_handle;
+};
+
+// Dumb buffers scanned out by every connected connector, each on a CRTC of its own
 struct Vnc_drm {
+	struct Vnc_display display;
 	int fd;
-	struct Vnc_framebuffer fbs[2];
-	u32 fb_ids[2];
-	u32 crtc_id;
+	struct Vnc_drm_output outputs[VNC_DISPLAY_MAX_OUTPUTS];
+	// Atomic modesetting flips by setting the primary plane's FB_ID, with the damage as
+	// FB_DAMAGE_CLIPS when the driver has it. Otherwise it falls back to drmModePageFlip.
+	// Either way every CRTC is flipped on its own, so each follows its own vblank.
+	bool atomic;
+	u64 commits;
+	u64 commit_ns; // Spent in the flip ioctls
 };
 
 bool vnc_drm_init(struct Vnc_drm *drm);
 void vnc_drm_deinit(struct Vnc_drm *drm);
-bool vnc_drm_flip_buffer(struct Vnc_drm *drm, u32 fb_index);
+// Sets up the cursor planes, without them the cursor is composited in software
+bool vnc_drm_init_cursor(struct Vnc_drm *drm);
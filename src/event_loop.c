@@ -12,6 +12,8 @@
 #define POS_KEY_REPEAT 1
 #define POS_VNC 2
 #define POS_EXIT_EVENT 3
+#define POS_SERVER 4
+#define POS_DISPLAY 5
 
 bool vnc_event_loop_init(struct Vnc_event_loop *event_loop)
 {
@@ -52,6 +54,22 @@ bool vnc_event_loop_register_vnc(struct Vnc_event_loop *event_loop, int fd)
 	return true;
 }
 
+bool vnc_event_loop_register_server(struct Vnc_event_loop *event_loop, int fd)
+{
+	struct pollfd *pollfd = &event_loop->pollfds[POS_SERVER];
+	pollfd->fd = fd;
+	pollfd->events = POLLIN;
+	return true;
+}
+
+bool vnc_event_loop_register_display(struct Vnc_event_loop *event_loop, int fd)
+{
+	struct pollfd *pollfd = &event_loop->pollfds[POS_DISPLAY];
+	pollfd->fd = fd;
+	pollfd->events = POLLIN;
+	return true;
+}
+
 bool vnc_event_loop_process_events(struct Vnc_event_loop *event_loop, u32 *events)
 {
 	int rc;
@@ -72,6 +90,13 @@ bool vnc_event_loop_process_events(struct Vnc_event_loop *event_loop, u32 *event
 		if ((event_loop->pollfds[POS_EXIT_EVENT].revents & POLLIN) > 0) {
 			*events |= VNC_EVENT_TYPE_EXIT;
 		}
+		// A closed connection is picked up by the receive that follows
+		if ((event_loop->pollfds[POS_SERVER].revents & (POLLIN | POLLHUP | POLLERR)) > 0) {
+			*events |= VNC_EVENT_TYPE_SERVER;
+		}
+		if ((event_loop->pollfds[POS_DISPLAY].revents & POLLIN) > 0) {
+			*events |= VNC_EVENT_TYPE_DISPLAY;
+		}
 		return true;
 	}
 	return false;
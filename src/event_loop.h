@@ -7,7 +7,7 @@
 #include "session.h"
 
 struct Vnc_event_loop {
-	struct pollfd pollfds[4];
+	struct pollfd pollfds[6];
 };
 
 enum Vnc_event_type {
@@ -15,11 +15,17 @@ enum Vnc_event_type {
 	VNC_EVENT_TYPE_KEY_REPEAT = 2,
 	VNC_EVENT_TYPE_VNC = 4,
 	VNC_EVENT_TYPE_EXIT = 8,
+	VNC_EVENT_TYPE_SERVER = 16,
+	VNC_EVENT_TYPE_DISPLAY = 32,
 };
 
 bool vnc_event_loop_init(struct Vnc_event_loop *event_loop);
 bool vnc_event_loop_register_libinput(struct Vnc_event_loop *event_loop, int fd);
 bool vnc_event_loop_register_key_repeat(struct Vnc_event_loop *event_loop, int fd);
 bool vnc_event_loop_register_vnc(struct Vnc_event_loop *event_loop, int fd);
+// Only used when the session has no thread of its own
+bool vnc_event_loop_register_server(struct Vnc_event_loop *event_loop, int fd);
+// Page flip completions
+bool vnc_event_loop_register_display(struct Vnc_event_loop *event_loop, int fd);
 bool vnc_event_loop_process_events(struct Vnc_event_loop *event_loop, u32 *events);
 void vnc_event_loop_exit(struct Vnc_event_loop *event_loop);
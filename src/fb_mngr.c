@@ -1,52 +1,640 @@
 #include "fb_mngr.h"
 
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "log.h"
 #include "macros.h"
 
-void vnc_fb_mngr_init(struct Vnc_fb_mngr *mngr, struct Vnc_drm *drm)
+// A flip whose event never arrived doesn't hold back frames after this
+#define FLIP_TIMEOUT_NS 1000000000ull
+
+static bool init_shadow(struct Vnc_fb_mngr *mngr, u32 width, u32 height);
+static void deinit_shadow(struct Vnc_fb_mngr *mngr);
+static u32 split_frame_damage(struct Vnc_fb_mngr *mngr);
+static bool present_or_queue(struct Vnc_fb_mngr *mngr, u32 output);
+static bool present(struct Vnc_fb_mngr *mngr, u32 output);
+static bool map_rect(struct Vnc_fb_mngr *mngr, struct Vnc_rfb_rect *rect,
+		     struct Vnc_rfb_rect *display_rect);
+static size_t copy_to_scanout(struct Vnc_fb_mngr *mngr, u32 output, u32 fb_index,
+			      struct Vnc_rfb_rect *rect);
+static bool erase_software_cursor(struct Vnc_fb_mngr *mngr, u32 output, u32 fb_index);
+static bool draw_software_cursor(struct Vnc_fb_mngr *mngr, u32 output, u32 fb_index);
+static bool cursor_is_current(struct Vnc_fb_mngr *mngr, u32 output, u32 fb_index);
+static void get_cursor_position(struct Vnc_fb_mngr *mngr, u32 output, i32 *x, i32 *y);
+static void add_cursor_rect(struct Vnc_fb_mngr *mngr, u32 output, struct Vnc_rfb_rect *rects,
+			    u32 *count);
+static void merge_rects(struct Vnc_rfb_rect *dest, struct Vnc_rfb_rect *rect);
+static bool intersect_rects(struct Vnc_rfb_rect *a, struct Vnc_rfb_rect *b,
+			    struct Vnc_rfb_rect *intersection);
+static u64 now_ns(void);
+
+bool vnc_fb_mngr_init(struct Vnc_fb_mngr *mngr, struct Vnc_display *display, u32 width,
+		      u32 height, enum Vnc_scale_filter filter)
 {
 	*mngr = (struct Vnc_fb_mngr){ 0 };
-	mngr->drm = drm;
+	mngr->display = display;
+	mngr->filter = filter;
+	vnc_display_get_size(display, &mngr->display_width, &mngr->display_height);
+	// The scanout buffers keep their size, the shadow follows the desktop
+	for (u32 i = 0; i < display->output_count; ++i) {
+		struct Vnc_fb_mngr_output *output = &mngr->outputs[i];
+		struct Vnc_framebuffer *fb = &display->outputs[i].fbs[0];
+		bool ok = vnc_damage_init(&output->flip_damage, fb->width, fb->height);
+		for (size_t j = 0; j < ARRAY_COUNT(output->scanouts) && ok; ++j) {
+			ok = vnc_damage_init(&output->scanouts[j].damage, fb->width, fb->height);
+		}
+		if (!ok) {
+			goto err;
+		}
+	}
+	if (!init_shadow(mngr, width, height)) {
+		goto err;
+	}
+	pthread_mutex_init(&mngr->scanout_mutex, NULL);
+	return true;
+
+err:
+	for (u32 i = 0; i < display->output_count; ++i) {
+		struct Vnc_fb_mngr_output *output = &mngr->outputs[i];
+		vnc_damage_deinit(&output->flip_damage);
+		for (size_t j = 0; j < ARRAY_COUNT(output->scanouts); ++j) {
+			vnc_damage_deinit(&output->scanouts[j].damage);
+		}
+	}
+	return false;
+}
+
+void vnc_fb_mngr_deinit(struct Vnc_fb_mngr *mngr)
+{
+	u64 presented_frames = 0;
+	for (u32 i = 0; i < mngr->display->output_count; ++i) {
+		struct Vnc_fb_mngr_output *output = &mngr->outputs[i];
+		if (output->presented_frames > 0) {
+			vnc_log_debug("Output %u: presented %llu frames, skipped %llu", i,
+				      output->presented_frames, output->skipped_frames);
+		}
+		presented_frames += output->presented_frames;
+		vnc_damage_deinit(&output->flip_damage);
+		for (size_t j = 0; j < ARRAY_COUNT(output->scanouts); ++j) {
+			vnc_damage_deinit(&output->scanouts[j].damage);
+			free(output->scanouts[j].under_cursor);
+		}
+	}
+	if (presented_frames > 0) {
+		vnc_log_debug("%llu bytes copied per presented frame",
+			      mngr->bytes_copied / presented_frames);
+	}
+	pthread_mutex_destroy(&mngr->scanout_mutex);
+	vnc_cursor_deinit(&mngr->cursor);
+	deinit_shadow(mngr);
 }
 
-bool vnc_fb_mngr_register_drawn_rect(struct Vnc_fb_mngr *mngr, struct Vnc_rfb_rect *rect)
+bool vnc_fb_mngr_resize(struct Vnc_fb_mngr *mngr, u32 width, u32 height)
 {
-	if (mngr->rect_backlog_count == ARRAY_COUNT(mngr->rect_backlog)) {
-		// vnc_log_error("BUG: Rect backlog overflow");
+	if (width == mngr->shadow.width && height == mngr->shadow.height) {
+		return true;
+	}
+	pthread_mutex_lock(&mngr->scanout_mutex);
+	deinit_shadow(mngr);
+	bool ok = init_shadow(mngr, width, height);
+	pthread_mutex_unlock(&mngr->scanout_mutex);
+	return ok;
+}
+
+bool vnc_fb_mngr_supports_size(struct Vnc_fb_mngr *mngr, u32 width, u32 height)
+{
+	u32 bytes_per_pixel = mngr->display->outputs[0].fbs[0].bpp / 8;
+	return (u64)width * bytes_per_pixel * height <= UINT32_MAX;
+}
+
+void vnc_fb_mngr_register_drawn_rect(struct Vnc_fb_mngr *mngr, struct Vnc_rfb_rect *rect)
+{
+	vnc_damage_add_rect(&mngr->frame_damage, rect);
+}
+
+struct Vnc_framebuffer *vnc_fb_mngr_get_framebuffer(struct Vnc_fb_mngr *mngr)
+{
+	return &mngr->shadow;
+}
+
+// Copies a region of the shadow onto `rect`, source and destination may overlap either way
+bool vnc_fb_mngr_copy_rect(struct Vnc_fb_mngr *mngr, struct Vnc_rfb_rect *rect, u16 src_x,
+			   u16 src_y)
+{
+	struct Vnc_framebuffer *shadow = &mngr->shadow;
+	if ((u32)src_x + rect->width > shadow->width ||
+	    (u32)src_y + rect->height > shadow->height ||
+	    (u32)rect->x + rect->width > shadow->width ||
+	    (u32)rect->y + rect->height > shadow->height) {
+		vnc_log_error("CopyRect outside of framebuffer");
 		return false;
 	}
 
-	mngr->rect_backlog[mngr->rect_backlog_count++] = *rect;
+	u32 bytes_per_pixel = shadow->bpp / 8;
+	size_t count = rect->width * bytes_per_pixel;
+	char *src = shadow->buffer + src_y * shadow->pitch + src_x * bytes_per_pixel;
+	char *dest = shadow->buffer + rect->y * shadow->pitch + rect->x * bytes_per_pixel;
+	if (rect->y <= src_y) {
+		for (u16 y = 0; y < rect->height; ++y) {
+			memmove(dest + y * shadow->pitch, src + y * shadow->pitch, count);
+		}
+	} else {
+		// Moving down, go bottom up so no source line is overwritten before it is copied
+		for (u16 y = rect->height; y-- > 0;) {
+			memmove(dest + y * shadow->pitch, src + y * shadow->pitch, count);
+		}
+	}
+	vnc_fb_mngr_register_drawn_rect(mngr, rect);
 	return true;
 }
 
-struct Vnc_framebuffer *vnc_fb_mngr_get_framebuffer(struct Vnc_fb_mngr *mngr)
+void vnc_fb_mngr_begin_frame(struct Vnc_fb_mngr *mngr)
 {
-	return &mngr->drm->fbs[mngr->current_fb];
+	pthread_mutex_lock(&mngr->scanout_mutex);
+	mngr->frame_open = true;
+	pthread_mutex_unlock(&mngr->scanout_mutex);
 }
 
+// Both scanout buffers of an output are behind the shadow by the part of the frame's damage
+// that falls on it until they are flipped to. Frames that end while the output's flip is pending
+// are merged, only the last one is flipped to. Outputs the frame didn't touch don't flip, unless
+// an earlier frame waited for this one to end.
 bool vnc_fb_mngr_flip_buffers(struct Vnc_fb_mngr *mngr)
 {
-	// FIXME: required for intel???
-	bool ok = vnc_drm_flip_buffer(mngr->drm, mngr->current_fb);
-
-	// TODO: double buffering
-	/*struct Vnc_framebuffer *front_buffer = vnc_fb_mngr_get_framebuffer(mngr);
-		   bool ok = vnc_drm_flip_buffer(mngr->drm, mngr->current_fb);
-		   mngr->current_fb = (mngr->current_fb + 1) % ARRAY_COUNT(mngr->drm->fbs);
-		   struct Vnc_framebuffer *back_buffer = vnc_fb_mngr_get_framebuffer(mngr);
-
-		   u16 bytes_per_pixel = front_buffer->bpp / 8;
-		   for (size_t i = 0; i < mngr->rect_backlog_count; ++i) {
-		   struct Vnc_rfb_rect *rect = &mngr->rect_backlog[i];
-		   for (u16 y = rect->y; y < rect->y + rect->height; ++y) {
-		   size_t offset = ((rect->y * front_buffer->pitch + rect->x) *
-		   bytes_per_pixel); size_t count = rect->width * bytes_per_pixel;
-		   memcpy(&back_buffer[offset], &front_buffer[offset], count);
-		   }
-		   }
-		   mngr->rect_backlog_count = 0; */
+	pthread_mutex_lock(&mngr->scanout_mutex);
+	mngr->frame_open = false;
+	u32 touched = split_frame_damage(mngr);
+	bool ok = true;
+	for (u32 i = 0; i < mngr->display->output_count; ++i) {
+		if ((touched & (1u << i)) > 0) {
+			ok &= present_or_queue(mngr, i);
+		} else if (mngr->outputs[i].frame_queued &&
+			   !mngr->display->outputs[i].flip_pending) {
+			ok &= present(mngr, i);
+		}
+	}
+	pthread_mutex_unlock(&mngr->scanout_mutex);
+	return ok;
+}
+
+bool vnc_fb_mngr_handle_flip_events(struct Vnc_fb_mngr *mngr)
+{
+	pthread_mutex_lock(&mngr->scanout_mutex);
+	struct Vnc_display *display = mngr->display;
+	bool ok = display->handle_events(display);
+	for (u32 i = 0; i < display->output_count && !mngr->frame_open; ++i) {
+		if (!display->outputs[i].flip_pending && mngr->outputs[i].frame_queued) {
+			ok &= present(mngr, i);
+		}
+	}
+	pthread_mutex_unlock(&mngr->scanout_mutex);
 	return ok;
 }
+
+// Takes over the cursor image, on the cursor planes when it fits there. It is shown on every
+// output, the ones it is not over clip it away.
+bool vnc_fb_mngr_set_cursor(struct Vnc_fb_mngr *mngr, struct Vnc_cursor *cursor)
+{
+	pthread_mutex_lock(&mngr->scanout_mutex);
+	struct Vnc_display *display = mngr->display;
+	struct Vnc_rfb_rect dirty[VNC_DISPLAY_MAX_OUTPUTS][2];
+	u32 dirty_counts[VNC_DISPLAY_MAX_OUTPUTS] = { 0 };
+	for (u32 i = 0; i < display->output_count; ++i) {
+		add_cursor_rect(mngr, i, dirty[i], &dirty_counts[i]);
+		erase_software_cursor(mngr, i, mngr->outputs[i].current_fb);
+	}
+	bool ok = vnc_cursor_copy(&mngr->cursor, cursor);
+	++mngr->cursor_serial;
+	mngr->cursor_visible = ok && cursor->width > 0 && cursor->height > 0;
+
+	// All outputs need a plane, the cursor can't be on a plane on some and drawn on others
+	bool on_plane = mngr->cursor_visible;
+	for (u32 i = 0; i < display->output_count; ++i) {
+		struct Vnc_display_output *output = &display->outputs[i];
+		on_plane = on_plane && output->has_cursor &&
+			   cursor->width <= output->cursor_fb.width &&
+			   cursor->height <= output->cursor_fb.height;
+	}
+	for (u32 i = 0; i < display->output_count && on_plane; ++i) {
+		struct Vnc_framebuffer *plane = &display->outputs[i].cursor_fb;
+		memset(plane->buffer, 0, plane->size);
+		for (u16 y = 0; y < cursor->height; ++y) {
+			memcpy(plane->buffer + y * plane->pitch, cursor->image + y * cursor->width,
+			       cursor->width * sizeof(u32));
+		}
+		i32 x, y;
+		get_cursor_position(mngr, i, &x, &y);
+		on_plane = display->set_cursor(display, i, cursor->hot_x, cursor->hot_y) &&
+			   display->move_cursor(display, i, x, y);
+	}
+	if (!on_plane && mngr->cursor_on_plane) {
+		for (u32 i = 0; i < display->output_count; ++i) {
+			display->hide_cursor(display, i);
+		}
+	}
+	mngr->cursor_on_plane = on_plane;
+
+	// The back buffers get the new cursor on their next flip
+	for (u32 i = 0; i < display->output_count; ++i) {
+		u32 current_fb = mngr->outputs[i].current_fb;
+		draw_software_cursor(mngr, i, current_fb);
+		add_cursor_rect(mngr, i, dirty[i], &dirty_counts[i]);
+		if (dirty_counts[i] > 0) {
+			display->mark_dirty(display, i, current_fb, dirty[i], dirty_counts[i]);
+		}
+	}
+	pthread_mutex_unlock(&mngr->scanout_mutex);
+	return ok;
+}
+
+// Called straight from input handling so the pointer doesn't wait for the server
+bool vnc_fb_mngr_move_cursor(struct Vnc_fb_mngr *mngr, i32 x, i32 y)
+{
+	pthread_mutex_lock(&mngr->scanout_mutex);
+	struct Vnc_display *display = mngr->display;
+	bool on_plane = mngr->cursor_on_plane;
+	if (x == mngr->cursor_x && y == mngr->cursor_y) {
+		pthread_mutex_unlock(&mngr->scanout_mutex);
+		return on_plane;
+	}
+	if (on_plane) {
+		mngr->cursor_x = x;
+		mngr->cursor_y = y;
+		for (u32 i = 0; i < display->output_count; ++i) {
+			get_cursor_position(mngr, i, &x, &y);
+			display->move_cursor(display, i, x, y);
+		}
+	} else if (mngr->cursor_visible) {
+		struct Vnc_rfb_rect dirty[VNC_DISPLAY_MAX_OUTPUTS][2];
+		u32 dirty_counts[VNC_DISPLAY_MAX_OUTPUTS] = { 0 };
+		for (u32 i = 0; i < display->output_count; ++i) {
+			add_cursor_rect(mngr, i, dirty[i], &dirty_counts[i]);
+			erase_software_cursor(mngr, i, mngr->outputs[i].current_fb);
+		}
+		mngr->cursor_x = x;
+		mngr->cursor_y = y;
+		for (u32 i = 0; i < display->output_count; ++i) {
+			u32 current_fb = mngr->outputs[i].current_fb;
+			draw_software_cursor(mngr, i, current_fb);
+			add_cursor_rect(mngr, i, dirty[i], &dirty_counts[i]);
+			if (dirty_counts[i] > 0) {
+				display->mark_dirty(display, i, current_fb, dirty[i],
+						    dirty_counts[i]);
+			}
+		}
+	} else {
+		mngr->cursor_x = x;
+		mngr->cursor_y = y;
+	}
+	pthread_mutex_unlock(&mngr->scanout_mutex);
+	return on_plane;
+}
+
+void vnc_fb_mngr_get_frame_counts(struct Vnc_fb_mngr *mngr, u32 output, u64 *presented,
+				  u64 *skipped)
+{
+	pthread_mutex_lock(&mngr->scanout_mutex);
+	*presented = mngr->outputs[output].presented_frames;
+	*skipped = mngr->outputs[output].skipped_frames;
+	pthread_mutex_unlock(&mngr->scanout_mutex);
+}
+
+// The shadow is as large as the server's desktop, scaled onto the outputs when that differs
+// from the size of their layout
+static bool init_shadow(struct Vnc_fb_mngr *mngr, u32 width, u32 height)
+{
+	struct Vnc_framebuffer *scanout = &mngr->display->outputs[0].fbs[0];
+	struct Vnc_framebuffer *shadow = &mngr->shadow;
+	if (!vnc_fb_mngr_supports_size(mngr, width, height)) {
+		vnc_log_error("Desktop of %ux%u is too large", width, height);
+		return false;
+	}
+	shadow->width = width;
+	shadow->height = height;
+	shadow->bpp = scanout->bpp;
+	shadow->pitch = width * (scanout->bpp / 8);
+	shadow->size = shadow->pitch * shadow->height;
+	shadow->buffer = calloc(1, shadow->size);
+	if (shadow->buffer == NULL) {
+		vnc_log_error("Unable to allocate %u byte shadow framebuffer", shadow->size);
+		goto err;
+	}
+	mngr->scaling = width != mngr->display_width || height != mngr->display_height;
+	if (mngr->scaling &&
+	    !vnc_scaler_init(&mngr->scaler, mngr->filter, width, height, mngr->display_width,
+			     mngr->display_height)) {
+		goto err;
+	}
+	if (!vnc_damage_init(&mngr->frame_damage, width, height)) {
+		goto err;
+	}
+	// No scanout buffer shows the shadow yet
+	for (u32 i = 0; i < mngr->display->output_count; ++i) {
+		struct Vnc_fb_mngr_output *output = &mngr->outputs[i];
+		vnc_damage_add_all(&output->flip_damage);
+		for (size_t j = 0; j < ARRAY_COUNT(output->scanouts); ++j) {
+			vnc_damage_clear(&output->scanouts[j].damage);
+			output->scanouts[j].stale = true;
+		}
+	}
+	return true;
+
+err:
+	deinit_shadow(mngr);
+	return false;
+}
+
+static void deinit_shadow(struct Vnc_fb_mngr *mngr)
+{
+	vnc_damage_deinit(&mngr->frame_damage);
+	mngr->frame_damage = (struct Vnc_damage){ 0 };
+	if (mngr->scaling) {
+		vnc_scaler_deinit(&mngr->scaler);
+		mngr->scaling = false;
+	}
+	free(mngr->shadow.buffer);
+	mngr->shadow = (struct Vnc_framebuffer){ 0 };
+}
+
+// Hands the frame's damage to the outputs it falls on, in their coordinates. Returns a bit for
+// each output that got some.
+static u32 split_frame_damage(struct Vnc_fb_mngr *mngr)
+{
+	u32 touched = 0;
+	struct Vnc_rfb_rect rect;
+	struct Vnc_rfb_rect display_rect;
+	while (vnc_damage_pop_rect(&mngr->frame_damage, &rect)) {
+		if (!map_rect(mngr, &rect, &display_rect)) {
+			continue;
+		}
+		for (u32 i = 0; i < mngr->display->output_count; ++i) {
+			struct Vnc_display_output *display_output = &mngr->display->outputs[i];
+			struct Vnc_fb_mngr_output *output = &mngr->outputs[i];
+			struct Vnc_rfb_rect bounds = {
+				.x = display_output->x,
+				.y = display_output->y,
+				.width = display_output->fbs[0].width,
+				.height = display_output->fbs[0].height,
+			};
+			struct Vnc_rfb_rect output_rect;
+			if (!intersect_rects(&display_rect, &bounds, &output_rect)) {
+				continue;
+			}
+			output_rect.x -= bounds.x;
+			output_rect.y -= bounds.y;
+			for (size_t j = 0; j < ARRAY_COUNT(output->scanouts); ++j) {
+				vnc_damage_add_rect(&output->scanouts[j].damage, &output_rect);
+			}
+			vnc_damage_add_rect(&output->flip_damage, &output_rect);
+			touched |= 1u << i;
+		}
+	}
+	return touched;
+}
+
+// Presents right away unless the output's flip is still pending
+static bool present_or_queue(struct Vnc_fb_mngr *mngr, u32 output)
+{
+	struct Vnc_fb_mngr_output *mngr_output = &mngr->outputs[output];
+	if (mngr->display->outputs[output].flip_pending &&
+	    now_ns() - mngr_output->flip_ns < FLIP_TIMEOUT_NS) {
+		mngr_output->skipped_frames += mngr_output->frame_queued;
+		mngr_output->frame_queued = true;
+		return true;
+	}
+	return present(mngr, output);
+}
+
+// Brings the buffer of the output that is not on screen up to date and flips to it. It missed
+// the damage of the frames since it was last on screen, usually just the one that is now.
+static bool present(struct Vnc_fb_mngr *mngr, u32 output)
+{
+	struct Vnc_display *display = mngr->display;
+	struct Vnc_fb_mngr_output *mngr_output = &mngr->outputs[output];
+	u32 back_fb = mngr_output->current_fb ^ 1;
+	struct Vnc_framebuffer *scanout = &display->outputs[output].fbs[back_fb];
+	struct Vnc_fb_mngr_scanout *back = &mngr_output->scanouts[back_fb];
+	// The cursor may have moved since this buffer was on screen
+	bool cursor_changed = !cursor_is_current(mngr, output, back_fb);
+	// The damage goes underneath the cursor, it is drawn on top again afterwards
+	erase_software_cursor(mngr, output, back_fb);
+	struct Vnc_rfb_rect rect;
+	if (back->stale) {
+		rect = (struct Vnc_rfb_rect){ .width = scanout->width, .height = scanout->height };
+		mngr->bytes_copied += copy_to_scanout(mngr, output, back_fb, &rect);
+		vnc_damage_clear(&back->damage);
+		back->stale = false;
+	}
+	while (vnc_damage_pop_rect(&back->damage, &rect)) {
+		mngr->bytes_copied += copy_to_scanout(mngr, output, back_fb, &rect);
+	}
+	draw_software_cursor(mngr, output, back_fb);
+
+	// What changed compared to the buffer on screen, the cursor included
+	struct Vnc_rfb_rect clips[VNC_DISPLAY_MAX_DAMAGE_CLIPS];
+	u32 clip_count = 0;
+	if (cursor_changed) {
+		struct Vnc_fb_mngr_scanout *front = &mngr_output->scanouts[mngr_output->current_fb];
+		if (front->has_cursor) {
+			vnc_damage_add_rect(&mngr_output->flip_damage, &front->cursor_rect);
+		}
+		if (back->has_cursor) {
+			vnc_damage_add_rect(&mngr_output->flip_damage, &back->cursor_rect);
+		}
+	}
+	while (vnc_damage_pop_rect(&mngr_output->flip_damage, &rect)) {
+		if (clip_count < ARRAY_COUNT(clips)) {
+			clips[clip_count++] = rect;
+		} else {
+			merge_rects(&clips[clip_count - 1], &rect);
+		}
+	}
+
+	// A failed flip leaves the buffer up to date for the next frame
+	mngr_output->frame_queued = false;
+	if (!display->flip_buffer(display, output, back_fb, clips, clip_count)) {
+		for (u32 i = 0; i < clip_count; ++i) {
+			vnc_damage_add_rect(&mngr_output->flip_damage, &clips[i]);
+		}
+		++mngr_output->skipped_frames;
+		return false;
+	}
+	mngr_output->current_fb = back_fb;
+	mngr_output->flip_ns = now_ns();
+	++mngr_output->presented_frames;
+	return true;
+}
+
+// Shadow damage in display coordinates, the footprint of the scaling filter included
+static bool map_rect(struct Vnc_fb_mngr *mngr, struct Vnc_rfb_rect *rect,
+		     struct Vnc_rfb_rect *display_rect)
+{
+	if (mngr->scaling) {
+		return vnc_scaler_map_rect(&mngr->scaler, rect, display_rect);
+	}
+	*display_rect = *rect;
+	return true;
+}
+
+// Redraws `rect` of a scanout buffer of the output from the shadow, scaled when the sizes of the
+// desktop and the display differ
+static size_t copy_to_scanout(struct Vnc_fb_mngr *mngr, u32 output, u32 fb_index,
+			      struct Vnc_rfb_rect *rect)
+{
+	struct Vnc_display_output *display_output = &mngr->display->outputs[output];
+	struct Vnc_framebuffer *scanout = &display_output->fbs[fb_index];
+	struct Vnc_framebuffer *shadow = &mngr->shadow;
+	if (mngr->scaling) {
+		return vnc_scaler_scale(&mngr->scaler, shadow, scanout, display_output->x,
+					display_output->y, rect);
+	}
+	// Where the output doesn't cover the desktop it is left as it is
+	u32 right = MIN((u32)rect->x + rect->width, scanout->width);
+	u32 bottom = MIN((u32)rect->y + rect->height, scanout->height);
+	right = MIN(right, shadow->width - MIN(display_output->x, shadow->width));
+	bottom = MIN(bottom, shadow->height - MIN(display_output->y, shadow->height));
+	if (rect->x >= right || rect->y >= bottom) {
+		return 0;
+	}
+	u32 bytes_per_pixel = shadow->bpp / 8;
+	size_t count = (right - rect->x) * bytes_per_pixel;
+	const char *src = shadow->buffer + display_output->y * shadow->pitch +
+			  display_output->x * bytes_per_pixel;
+	for (u32 y = rect->y; y < bottom; ++y) {
+		size_t x_offset = rect->x * bytes_per_pixel;
+		memcpy(scanout->buffer + y * scanout->pitch + x_offset,
+		       src + y * shadow->pitch + x_offset, count);
+	}
+	return count * (bottom - rect->y);
+}
+
+// Puts back what the software cursor covered in a scanout buffer
+static bool erase_software_cursor(struct Vnc_fb_mngr *mngr, u32 output, u32 fb_index)
+{
+	struct Vnc_fb_mngr_scanout *scanout = &mngr->outputs[output].scanouts[fb_index];
+	struct Vnc_framebuffer *framebuffer = &mngr->display->outputs[output].fbs[fb_index];
+	if (!scanout->has_cursor) {
+		return false;
+	}
+	struct Vnc_rfb_rect *rect = &scanout->cursor_rect;
+	size_t count = rect->width * sizeof(u32);
+	char *dest = framebuffer->buffer + rect->y * framebuffer->pitch + rect->x * sizeof(u32);
+	for (u16 y = 0; y < rect->height; ++y) {
+		memcpy(dest + y * framebuffer->pitch, scanout->under_cursor + y * rect->width,
+		       count);
+	}
+	scanout->has_cursor = false;
+	return true;
+}
+
+// Draws the cursor at its current position, unless it is hidden, on the cursor planes or not
+// over the output
+static bool draw_software_cursor(struct Vnc_fb_mngr *mngr, u32 output, u32 fb_index)
+{
+	struct Vnc_fb_mngr_scanout *scanout = &mngr->outputs[output].scanouts[fb_index];
+	struct Vnc_framebuffer *framebuffer = &mngr->display->outputs[output].fbs[fb_index];
+	i32 x, y;
+	get_cursor_position(mngr, output, &x, &y);
+	struct Vnc_rfb_rect *rect = &scanout->cursor_rect;
+	if (!mngr->cursor_visible || mngr->cursor_on_plane ||
+	    !vnc_cursor_get_rect(&mngr->cursor, x, y, framebuffer, rect)) {
+		return false;
+	}
+	size_t size = (size_t)rect->width * rect->height * sizeof(u32);
+	if (size > scanout->under_cursor_capacity) {
+		u32 *under_cursor = realloc(scanout->under_cursor, size);
+		if (under_cursor == NULL) {
+			vnc_log_error("Unable to allocate %zu bytes to draw the cursor", size);
+			return false;
+		}
+		scanout->under_cursor = under_cursor;
+		scanout->under_cursor_capacity = size;
+	}
+	size_t count = rect->width * sizeof(u32);
+	u32 pitch = framebuffer->pitch;
+	const char *src = framebuffer->buffer + rect->y * pitch + rect->x * sizeof(u32);
+	for (u16 y = 0; y < rect->height; ++y) {
+		memcpy(scanout->under_cursor + y * rect->width, src + y * pitch, count);
+	}
+	vnc_cursor_draw(&mngr->cursor, x, y, &scanout->cursor_rect, framebuffer);
+	scanout->has_cursor = true;
+	scanout->cursor_serial = mngr->cursor_serial;
+	return true;
+}
+
+// Whether the buffer has the cursor drawn as it would be drawn now
+static bool cursor_is_current(struct Vnc_fb_mngr *mngr, u32 output, u32 fb_index)
+{
+	struct Vnc_fb_mngr_scanout *scanout = &mngr->outputs[output].scanouts[fb_index];
+	struct Vnc_framebuffer *framebuffer = &mngr->display->outputs[output].fbs[fb_index];
+	struct Vnc_rfb_rect rect;
+	i32 x, y;
+	get_cursor_position(mngr, output, &x, &y);
+	return scanout->has_cursor && scanout->cursor_serial == mngr->cursor_serial &&
+	       mngr->cursor_visible && !mngr->cursor_on_plane &&
+	       vnc_cursor_get_rect(&mngr->cursor, x, y, framebuffer, &rect) &&
+	       memcmp(&rect, &scanout->cursor_rect, sizeof(rect)) == 0;
+}
+
+// The pointer is in desktop coordinates, where its hotspot is relative to the output
+static void get_cursor_position(struct Vnc_fb_mngr *mngr, u32 output, i32 *x, i32 *y)
+{
+	if (mngr->scaling) {
+		vnc_scaler_map_point(&mngr->scaler, mngr->cursor_x, mngr->cursor_y, x, y);
+	} else {
+		*x = mngr->cursor_x;
+		*y = mngr->cursor_y;
+	}
+	*x -= mngr->display->outputs[output].x;
+	*y -= mngr->display->outputs[output].y;
+}
+
+// Where the software cursor is drawn in the output's buffer on screen, if anywhere
+static void add_cursor_rect(struct Vnc_fb_mngr *mngr, u32 output, struct Vnc_rfb_rect *rects,
+			    u32 *count)
+{
+	struct Vnc_fb_mngr_output *mngr_output = &mngr->outputs[output];
+	struct Vnc_fb_mngr_scanout *front = &mngr_output->scanouts[mngr_output->current_fb];
+	if (front->has_cursor) {
+		rects[(*count)++] = front->cursor_rect;
+	}
+}
+
+// Grows `dest` to the bounding box of both
+static void merge_rects(struct Vnc_rfb_rect *dest, struct Vnc_rfb_rect *rect)
+{
+	u32 right = MAX((u32)dest->x + dest->width, (u32)rect->x + rect->width);
+	u32 bottom = MAX((u32)dest->y + dest->height, (u32)rect->y + rect->height);
+	dest->x = MIN(dest->x, rect->x);
+	dest->y = MIN(dest->y, rect->y);
+	dest->width = right - dest->x;
+	dest->height = bottom - dest->y;
+}
+
+static bool intersect_rects(struct Vnc_rfb_rect *a, struct Vnc_rfb_rect *b,
+			    struct Vnc_rfb_rect *intersection)
+{
+	u32 left = MAX(a->x, b->x);
+	u32 top = MAX(a->y, b->y);
+	u32 right = MIN((u32)a->x + a->width, (u32)b->x + b->width);
+	u32 bottom = MIN((u32)a->y + a->height, (u32)b->y + b->height);
+	if (left >= right || top >= bottom) {
+		return false;
+	}
+	*intersection = (struct Vnc_rfb_rect){
+		.x = left,
+		.y = top,
+		.width = right - left,
+		.height = bottom - top,
+	};
+	return true;
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
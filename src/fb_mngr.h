@@ -1,20 +1,95 @@
 #pragma once
 
-#include <limits.h>
+#include <pthread.h>
 
-#include "drm.h"
+#include "cursor.h"
+#include "damage.h"
+#include "display.h"
 #include "fb.h"
 #include "rfb.h"
+#include "scale.h"
 #include "types.h"
 
+// What one scanout buffer is missing compared to the shadow, in output coordinates
+struct Vnc_fb_mngr_scanout {
+	// Damage since the buffer was last brought up to date, the previous frame's included
+	struct Vnc_damage damage;
+	bool has_cursor; // A software cursor is drawn over cursor_rect
+	struct Vnc_rfb_rect cursor_rect;
+	u32 cursor_serial; // Of the image drawn
+	// What the cursor covers, read back from the buffer as the shadow may be ahead of it. Slow,
+	// but only as large as the cursor.
+	u32 *under_cursor;
+	size_t under_cursor_capacity;
+	bool stale; // Has to be redrawn as a whole, e.g. after the shadow was resized
+};
+
+// An output of the display that is presented on its own vblank schedule
+struct Vnc_fb_mngr_output {
+	u32 current_fb; // On screen, the other one is drawn and flipped to
+	struct Vnc_fb_mngr_scanout scanouts[2];
+	// Since the last flip, handed to the driver with the next
+	struct Vnc_damage flip_damage;
+	bool frame_queued; // Flipped to once the pending flip completes
+	u64 flip_ns;
+	u64 presented_frames;
+	u64 skipped_frames; // Merged into a later frame while a flip was pending
+};
+
 struct Vnc_fb_mngr {
-	struct Vnc_drm *drm;
-	u32 current_fb;
-	struct Vnc_rfb_rect rect_backlog[USHRT_MAX];
-	u16 rect_backlog_count;
+	struct Vnc_display *display;
+	struct Vnc_fb_mngr_output outputs[VNC_DISPLAY_MAX_OUTPUTS];
+	u32 display_width; // Of the desktop the outputs are laid out in
+	u32 display_height;
+	// Cacheable copy of the desktop that decoders draw into and CopyRect reads from. Reading
+	// back from the write-combined scanout buffers is very slow.
+	struct Vnc_framebuffer shadow;
+	// Scales the shadow onto the outputs when the desktop and the display layout differ
+	bool scaling;
+	enum Vnc_scale_filter filter;
+	struct Vnc_scaler scaler;
+	// Damage of the frame that is being decoded, split between the outputs when it ends. Only
+	// touched by the session.
+	struct Vnc_damage frame_damage;
+	// The shadow is half way through an update, the outputs are only presented from it once it
+	// ends. Guarded by scanout_mutex.
+	bool frame_open;
+	u64 bytes_copied; // From the shadow into the scanout buffers
+
+	// Damage is flipped from the session thread while the cursor moves on the main thread
+	pthread_mutex_t scanout_mutex;
+	struct Vnc_cursor cursor;
+	u32 cursor_serial; // Changes with every new image
+	bool cursor_visible;
+	bool cursor_on_plane; // Otherwise composited into the scanout buffers
+	i32 cursor_x; // In shadow coordinates
+	i32 cursor_y;
 };
 
-void vnc_fb_mngr_init(struct Vnc_fb_mngr *mngr, struct Vnc_drm *drm);
-bool vnc_fb_mngr_register_drawn_rect(struct Vnc_fb_mngr *mngr, struct Vnc_rfb_rect *rect);
+// `width` and `height` are the server's desktop size
+bool vnc_fb_mngr_init(struct Vnc_fb_mngr *mngr, struct Vnc_display *display, u32 width,
+		      u32 height, enum Vnc_scale_filter filter);
+void vnc_fb_mngr_deinit(struct Vnc_fb_mngr *mngr);
+// Follows a change of the desktop size, the shadow starts out black. Call from the thread that
+// draws into it.
+bool vnc_fb_mngr_resize(struct Vnc_fb_mngr *mngr, u32 width, u32 height);
+// Whether the shadow of a desktop this size stays within the 4 GiB a framebuffer can address
+bool vnc_fb_mngr_supports_size(struct Vnc_fb_mngr *mngr, u32 width, u32 height);
+void vnc_fb_mngr_register_drawn_rect(struct Vnc_fb_mngr *mngr, struct Vnc_rfb_rect *rect);
 struct Vnc_framebuffer *vnc_fb_mngr_get_framebuffer(struct Vnc_fb_mngr *mngr);
+bool vnc_fb_mngr_copy_rect(struct Vnc_fb_mngr *mngr, struct Vnc_rfb_rect *rect, u16 src_x,
+			   u16 src_y);
+// Call when an update starts coming in, before anything of it is drawn into the shadow
+void vnc_fb_mngr_begin_frame(struct Vnc_fb_mngr *mngr);
+// Ends the frame. Each output it changed shows it with its next vblank the pending flip leaves
+// free, outputs that are slower to flip don't hold back the others.
 bool vnc_fb_mngr_flip_buffers(struct Vnc_fb_mngr *mngr);
+// Call when the display fd is readable, flips outputs to a frame that was waiting for them. While
+// the next frame is being drawn into the shadow that waits until it ends.
+bool vnc_fb_mngr_handle_flip_events(struct Vnc_fb_mngr *mngr);
+bool vnc_fb_mngr_set_cursor(struct Vnc_fb_mngr *mngr, struct Vnc_cursor *cursor);
+// Returns whether the cursor is on the cursor plane rather than composited in software
+bool vnc_fb_mngr_move_cursor(struct Vnc_fb_mngr *mngr, i32 x, i32 y);
+// Frames presented and skipped so far on `output`, safe to call from any thread
+void vnc_fb_mngr_get_frame_counts(struct Vnc_fb_mngr *mngr, u32 output, u64 *presented,
+				  u64 *skipped);
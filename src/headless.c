@@ -0,0 +1,201 @@
+#include "headless.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "macros.h"
+
+static bool arm_timer(struct Vnc_headless *headless);
+static u64 now_ns(void);
+static bool flip_buffer(struct Vnc_display *display, u32 output, u32 fb_index,
+			struct Vnc_rfb_rect *damage, u32 damage_count);
+static bool handle_events(struct Vnc_display *display);
+static void mark_dirty(struct Vnc_display *display, u32 output, u32 fb_index,
+		       struct Vnc_rfb_rect *rects, u32 rect_count);
+
+bool vnc_headless_init(struct Vnc_headless *headless, struct Vnc_headless_options *options)
+{
+	*headless = (struct Vnc_headless){
+		.display = {
+			.fd = -1,
+			.flip_buffer = flip_buffer,
+			.handle_events = handle_events,
+			.mark_dirty = mark_dirty,
+		},
+		.memfd = -1,
+	};
+	if (options->output_count == 0 || options->output_count > VNC_DISPLAY_MAX_OUTPUTS) {
+		vnc_log_error("Headless: invalid number of outputs %u", options->output_count);
+		return false;
+	}
+	u32 bpp = 32;
+	u32 pitches[VNC_DISPLAY_MAX_OUTPUTS];
+	u64 fb_sizes[VNC_DISPLAY_MAX_OUTPUTS];
+	for (u32 i = 0; i < options->output_count; ++i) {
+		struct Vnc_headless_output_options *output = &options->outputs[i];
+		u32 pitch = options->pitch != 0 ? options->pitch : output->width * (bpp / 8);
+		if (output->width == 0 || output->height == 0 ||
+		    pitch < output->width * (bpp / 8) || pitch % (bpp / 8) != 0) {
+			vnc_log_error("Headless: invalid size %ux%u with pitch %u", output->width,
+				      output->height, pitch);
+			return false;
+		}
+		pitches[i] = pitch;
+		fb_sizes[i] = (u64)pitch * output->height;
+		if (fb_sizes[i] > UINT32_MAX) {
+			vnc_log_error("Headless: framebuffer of %llu bytes is too large",
+				      fb_sizes[i]);
+			return false;
+		}
+		headless->map_size += fb_sizes[i] * ARRAY_COUNT(headless->display.outputs[i].fbs);
+	}
+
+	headless->memfd = memfd_create("vnc-headless", MFD_CLOEXEC);
+	if (headless->memfd == -1) {
+		vnc_log_error("memfd_create failed: %s", strerror(errno));
+		goto err;
+	}
+	if (ftruncate(headless->memfd, headless->map_size) != 0) {
+		vnc_log_error("ftruncate failed: %s", strerror(errno));
+		goto err;
+	}
+	headless->map = mmap(NULL, headless->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			     headless->memfd, 0);
+	if (headless->map == MAP_FAILED) {
+		vnc_log_error("mmap failed: %s", strerror(errno));
+		headless->map = NULL;
+		goto err;
+	}
+	char *buffer = headless->map;
+	headless->display.output_count = options->output_count;
+	for (u32 i = 0; i < options->output_count; ++i) {
+		struct Vnc_display_output *output = &headless->display.outputs[i];
+		for (size_t j = 0; j < ARRAY_COUNT(output->fbs); ++j) {
+			struct Vnc_framebuffer *fb = &output->fbs[j];
+			fb->width = options->outputs[i].width;
+			fb->height = options->outputs[i].height;
+			fb->pitch = pitches[i];
+			fb->size = fb_sizes[i];
+			fb->bpp = bpp;
+			fb->buffer = buffer;
+			buffer += fb->size;
+			// Same as the dumb buffers start out
+			memset(fb->buffer, 255, fb->size);
+		}
+		headless->flip_latency_us[i] = options->outputs[i].flip_latency_us;
+	}
+	vnc_display_place_outputs(&headless->display);
+
+	headless->display.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (headless->display.fd == -1) {
+		vnc_log_error("timerfd_create failed: %s", strerror(errno));
+		goto err;
+	}
+	for (u32 i = 0; i < options->output_count; ++i) {
+		struct Vnc_framebuffer *fb = &headless->display.outputs[i].fbs[0];
+		vnc_log_info("Headless output %u: %ux%u at %u,%u, pitch %u, flips take %u us", i,
+			     fb->width, fb->height, headless->display.outputs[i].x,
+			     headless->display.outputs[i].y, fb->pitch,
+			     headless->flip_latency_us[i]);
+	}
+	return true;
+
+err:
+	vnc_headless_deinit(headless);
+	return false;
+}
+
+void vnc_headless_deinit(struct Vnc_headless *headless)
+{
+	for (u32 i = 0; i < headless->display.output_count; ++i) {
+		if (headless->flips[i] > 0) {
+			vnc_log_debug("Headless output %u: %llu flips", i, headless->flips[i]);
+		}
+	}
+	if (headless->display.fd != -1) {
+		close(headless->display.fd);
+	}
+	if (headless->map != NULL) {
+		munmap(headless->map, headless->map_size);
+	}
+	if (headless->memfd != -1) {
+		close(headless->memfd);
+	}
+	*headless = (struct Vnc_headless){ .display.fd = -1, .memfd = -1 };
+}
+
+// For the earliest pending flip, a time that passed already expires right away
+static bool arm_timer(struct Vnc_headless *headless)
+{
+	u64 deadline_ns = 0;
+	for (u32 i = 0; i < headless->display.output_count; ++i) {
+		if (headless->display.outputs[i].flip_pending &&
+		    (deadline_ns == 0 || headless->flip_done_ns[i] < deadline_ns)) {
+			deadline_ns = headless->flip_done_ns[i];
+		}
+	}
+	// Zero disarms it
+	struct itimerspec ts = { 0 };
+	ts.it_value.tv_sec = deadline_ns / 1000000000;
+	ts.it_value.tv_nsec = deadline_ns % 1000000000;
+	if (timerfd_settime(headless->display.fd, TFD_TIMER_ABSTIME, &ts, NULL) != 0) {
+		vnc_log_error("timerfd_settime failed: %s", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool flip_buffer(struct Vnc_display *display, u32 output, u32 fb_index,
+			struct Vnc_rfb_rect *damage, u32 damage_count)
+{
+	struct Vnc_headless *headless = container_of(display, struct Vnc_headless, display);
+	// Like a page flip, only one can be in flight per output
+	if (display->outputs[output].flip_pending) {
+		return false;
+	}
+	headless->flip_done_ns[output] = now_ns() + headless->flip_latency_us[output] * 1000ull;
+	display->outputs[output].flip_pending = true;
+	if (!arm_timer(headless)) {
+		display->outputs[output].flip_pending = false;
+		return false;
+	}
+	++headless->flips[output];
+	return true;
+}
+
+// Completes every flip that is due, the timer may have been armed for another output
+static bool handle_events(struct Vnc_display *display)
+{
+	struct Vnc_headless *headless = container_of(display, struct Vnc_headless, display);
+	u64 expirations;
+	if (read(display->fd, &expirations, sizeof(expirations)) != sizeof(expirations) &&
+	    errno != EAGAIN && errno != EINTR) {
+		vnc_log_error("Reading the headless timer failed: %s", strerror(errno));
+		return false;
+	}
+	u64 now = now_ns();
+	for (u32 i = 0; i < display->output_count; ++i) {
+		if (display->outputs[i].flip_pending && headless->flip_done_ns[i] <= now) {
+			display->outputs[i].flip_pending = false;
+		}
+	}
+	return arm_timer(headless);
+}
+
+// The buffers are only ever read from memory
+static void mark_dirty(struct Vnc_display *display, u32 output, u32 fb_index,
+		       struct Vnc_rfb_rect *rects, u32 rect_count)
+{
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "display.h"
+#include "types.h"
+
+struct Vnc_headless_output_options {
+	u32 width;
+	u32 height;
+	u32 flip_latency_us; // From queueing a flip until it completes, a refresh interval
+};
+
+struct Vnc_headless_options {
+	u32 output_count;
+	struct Vnc_headless_output_options outputs[VNC_DISPLAY_MAX_OUTPUTS];
+	u32 pitch; // Bytes per line, 0 packs the lines
+};
+
+// Scanout buffers in a memfd that nothing scans out, flips complete on a timer. Lets the whole
+// viewer run without a seat or a GPU, to benchmark it or to run it in CI. Each output has its
+// own flip latency, one timer is armed for whichever flip completes first.
+struct Vnc_headless {
+	struct Vnc_display display;
+	int memfd;
+	char *map;
+	size_t map_size;
+	u32 flip_latency_us[VNC_DISPLAY_MAX_OUTPUTS];
+	u64 flip_done_ns[VNC_DISPLAY_MAX_OUTPUTS]; // When the pending flip completes
+	u64 flips[VNC_DISPLAY_MAX_OUTPUTS];
+};
+
+bool vnc_headless_init(struct Vnc_headless *headless, struct Vnc_headless_options *options);
+void vnc_headless_deinit(struct Vnc_headless *headless);
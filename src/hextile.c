@@ -0,0 +1,185 @@
+#include "hextile.h"
+
+#include <string.h>
+#include <sys/socket.h>
+
+#include "draw.h"
+#include "log.h"
+#include "macros.h"
+
+enum {
+	SUBENCODING_RAW = 1 << 0,
+	SUBENCODING_BACKGROUND_SPECIFIED = 1 << 1,
+	SUBENCODING_FOREGROUND_SPECIFIED = 1 << 2,
+	SUBENCODING_ANY_SUBRECTS = 1 << 3,
+	SUBENCODING_SUBRECTS_COLOURED = 1 << 4,
+};
+
+// Background and foreground carry over from one tile to the next within a rect
+struct Colors {
+	u32 background;
+	u32 foreground;
+};
+
+static enum Vnc_rfb_result recv_tile(struct Vnc_rfb_stream *stream, struct Vnc_rfb_rect *tile,
+				     struct Vnc_pixel_converter *converter,
+				     struct Vnc_framebuffer *framebuffer, struct Colors *colors);
+static enum Vnc_rfb_result recv_raw_tile(struct Vnc_rfb_stream *stream, struct Vnc_rfb_rect *tile,
+					 struct Vnc_pixel_converter *converter,
+					 struct Vnc_framebuffer *framebuffer);
+
+// There is no length prefix, the tile headers are walked to find where the rect ends. Tiles
+// already walked are skipped on the next call.
+enum Vnc_rfb_result vnc_hextile_measure_rect(struct Vnc_rfb_stream *stream,
+					     struct Vnc_rfb_rect *rect,
+					     struct Vnc_pixel_converter *converter,
+					     struct Vnc_rfb_rect_progress *progress)
+{
+	u8 pixel_size = converter->bytes_per_pixel;
+	u32 tiles_per_row = (rect->width + VNC_HEXTILE_TILE_SIZE - 1) / VNC_HEXTILE_TILE_SIZE;
+	u32 tile_rows = (rect->height + VNC_HEXTILE_TILE_SIZE - 1) / VNC_HEXTILE_TILE_SIZE;
+	const u8 *data;
+	size_t len = vnc_rfb_stream_buffered(stream, &data);
+	for (; progress->tile < tiles_per_row * tile_rows; ++progress->tile) {
+		size_t pos = progress->size;
+		if (len < pos + 1) {
+			return vnc_rfb_stream_ensure(stream, pos + 1);
+		}
+		u8 subencoding = data[pos++];
+		if (subencoding & SUBENCODING_RAW) {
+			u16 tx = progress->tile % tiles_per_row * VNC_HEXTILE_TILE_SIZE;
+			u16 ty = progress->tile / tiles_per_row * VNC_HEXTILE_TILE_SIZE;
+			u16 width = MIN(VNC_HEXTILE_TILE_SIZE, rect->width - tx);
+			u16 height = MIN(VNC_HEXTILE_TILE_SIZE, rect->height - ty);
+			progress->size = pos + width * height * pixel_size;
+			continue;
+		}
+		if (subencoding & SUBENCODING_BACKGROUND_SPECIFIED) {
+			pos += pixel_size;
+		}
+		if (subencoding & SUBENCODING_FOREGROUND_SPECIFIED) {
+			pos += pixel_size;
+		}
+		if (subencoding & SUBENCODING_ANY_SUBRECTS) {
+			if (len < pos + 1) {
+				return vnc_rfb_stream_ensure(stream, pos + 1);
+			}
+			bool coloured = subencoding & SUBENCODING_SUBRECTS_COLOURED;
+			pos += 1 + data[pos] * ((coloured ? pixel_size : 0) + 2);
+		}
+		progress->size = pos;
+	}
+	return vnc_rfb_stream_ensure(stream, progress->size);
+}
+
+enum Vnc_rfb_result vnc_hextile_recv_rect(struct Vnc_rfb_stream *stream, struct Vnc_rfb_rect *rect,
+					  struct Vnc_pixel_converter *converter,
+					  struct Vnc_framebuffer *framebuffer)
+{
+	struct Colors colors = { 0 };
+	for (u16 ty = 0; ty < rect->height; ty += VNC_HEXTILE_TILE_SIZE) {
+		for (u16 tx = 0; tx < rect->width; tx += VNC_HEXTILE_TILE_SIZE) {
+			struct Vnc_rfb_rect tile = {
+				.x = rect->x + tx,
+				.y = rect->y + ty,
+				.width = MIN(VNC_HEXTILE_TILE_SIZE, rect->width - tx),
+				.height = MIN(VNC_HEXTILE_TILE_SIZE, rect->height - ty),
+			};
+			enum Vnc_rfb_result result =
+				recv_tile(stream, &tile, converter, framebuffer, &colors);
+			if (result != VNC_RFB_RESULT_SUCCESS) {
+				return result;
+			}
+		}
+	}
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+static enum Vnc_rfb_result recv_tile(struct Vnc_rfb_stream *stream, struct Vnc_rfb_rect *tile,
+				     struct Vnc_pixel_converter *converter,
+				     struct Vnc_framebuffer *framebuffer, struct Colors *colors)
+{
+	u8 subencoding;
+	RFB_TRY_READ(stream, &subencoding, sizeof(subencoding));
+	if (subencoding & SUBENCODING_RAW) {
+		return recv_raw_tile(stream, tile, converter, framebuffer);
+	}
+
+	// Everything up to the subrects is read at once: background, foreground and count
+	u8 pixel_size = converter->bytes_per_pixel;
+	u8 header[4 + 4 + 1];
+	size_t header_size = 0;
+	if (subencoding & SUBENCODING_BACKGROUND_SPECIFIED) {
+		header_size += pixel_size;
+	}
+	if (subencoding & SUBENCODING_FOREGROUND_SPECIFIED) {
+		header_size += pixel_size;
+	}
+	if (subencoding & SUBENCODING_ANY_SUBRECTS) {
+		header_size += 1;
+	}
+	RFB_TRY_READ(stream, header, header_size);
+
+	const u8 *data = header;
+	if (subencoding & SUBENCODING_BACKGROUND_SPECIFIED) {
+		colors->background = vnc_pixel_read(converter, data);
+		data += pixel_size;
+	}
+	if (subencoding & SUBENCODING_FOREGROUND_SPECIFIED) {
+		colors->foreground = vnc_pixel_read(converter, data);
+		data += pixel_size;
+	}
+	vnc_draw_fill_rect(framebuffer, tile->x, tile->y, tile->width, tile->height,
+			   colors->background);
+	if ((subencoding & SUBENCODING_ANY_SUBRECTS) == 0) {
+		return VNC_RFB_RESULT_SUCCESS;
+	}
+
+	u8 subrect_count = data[0];
+	bool coloured = subencoding & SUBENCODING_SUBRECTS_COLOURED;
+	size_t subrect_size = (coloured ? pixel_size : 0) + 2;
+	u8 subrects[255 * (4 + 2)];
+	RFB_TRY_READ(stream, subrects, subrect_count * subrect_size);
+
+	data = subrects;
+	for (u8 i = 0; i < subrect_count; ++i) {
+		u32 color = colors->foreground;
+		if (coloured) {
+			color = vnc_pixel_read(converter, data);
+			data += pixel_size;
+		}
+		u8 x = data[0] >> 4;
+		u8 y = data[0] & 0x0f;
+		u8 width = (data[1] >> 4) + 1;
+		u8 height = (data[1] & 0x0f) + 1;
+		data += 2;
+		if (x + width > tile->width || y + height > tile->height) {
+			vnc_log_error("Hextile: subrect %ux%u+%u+%u outside of tile", width, height,
+				      x, y);
+			return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+		}
+		vnc_draw_fill_rect(framebuffer, tile->x + x, tile->y + y, width, height, color);
+	}
+	// The spec leaves the foreground undefined after coloured subrects, keep the last one
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+static enum Vnc_rfb_result recv_raw_tile(struct Vnc_rfb_stream *stream, struct Vnc_rfb_rect *tile,
+					 struct Vnc_pixel_converter *converter,
+					 struct Vnc_framebuffer *framebuffer)
+{
+	u8 pixel_size = converter->bytes_per_pixel;
+	u8 pixels[VNC_HEXTILE_TILE_SIZE * VNC_HEXTILE_TILE_SIZE * 4];
+	size_t row_size = tile->width * pixel_size;
+	RFB_TRY_READ(stream, pixels, row_size * tile->height);
+
+	u32 stride = framebuffer->pitch / sizeof(u32);
+	u32 *dest = (u32 *)framebuffer->buffer + tile->y * stride + tile->x;
+	const u8 *src = pixels;
+	for (u16 y = 0; y < tile->height; ++y) {
+		vnc_pixel_convert_row(converter, src, dest, tile->width);
+		src += row_size;
+		dest += stride;
+	}
+	return VNC_RFB_RESULT_SUCCESS;
+}
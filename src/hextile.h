@@ -0,0 +1,17 @@
+#pragma once
+
+#include "fb.h"
+#include "pixel.h"
+#include "rfb.h"
+#include "types.h"
+
+#define VNC_HEXTILE_TILE_SIZE 16
+
+// Returns VNC_RFB_RESULT_WOULD_BLOCK until all tiles of the rect are buffered
+enum Vnc_rfb_result vnc_hextile_measure_rect(struct Vnc_rfb_stream *stream,
+					     struct Vnc_rfb_rect *rect,
+					     struct Vnc_pixel_converter *converter,
+					     struct Vnc_rfb_rect_progress *progress);
+enum Vnc_rfb_result vnc_hextile_recv_rect(struct Vnc_rfb_stream *stream, struct Vnc_rfb_rect *rect,
+					  struct Vnc_pixel_converter *converter,
+					  struct Vnc_framebuffer *framebuffer);
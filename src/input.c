@@ -95,7 +95,8 @@ void vnc_input_handle_events(struct Vnc_input *vnc_input, struct Vnc_input_actio
 				libinput_event_get_pointer_event(event);
 			double dx = libinput_event_pointer_get_dx(pointer_event);
 			double dy = libinput_event_pointer_get_dy(pointer_event);
-			callbacks->pointer_move(callbacks, dx, dy);
+			u64 timestamp_usec = libinput_event_pointer_get_time_usec(pointer_event);
+			callbacks->pointer_move(callbacks, dx, dy, timestamp_usec);
 			break;
 		}
 		case LIBINPUT_EVENT_POINTER_BUTTON: {
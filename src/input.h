@@ -8,7 +8,8 @@
 #include "types.h"
 
 struct Vnc_input_action {
-	void (*pointer_move)(struct Vnc_input_action *action, double dx, double dy);
+	void (*pointer_move)(struct Vnc_input_action *action, double dx, double dy,
+			     u64 timestamp_usec);
 	void (*pointer_button)(struct Vnc_input_action *action, u32 button, bool pressed);
 	void (*pointer_wheel_scroll)(struct Vnc_input_action *action, double scroll_value);
 	void (*keyboard_key)(struct Vnc_input_action *action, u32 key, bool pressed,
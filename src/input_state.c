@@ -62,10 +62,14 @@ bool vnc_input_state_init(struct Vnc_input_state *input_state)
 	return true;
 }
 
-void vnc_input_state_pointer_move(struct Vnc_input_action *action, double dx, double dy)
+void vnc_input_state_pointer_move(struct Vnc_input_action *action, double dx, double dy,
+				  u64 timestamp_usec)
 {
 	struct Vnc_input_state *input_state =
 		container_of(action, struct Vnc_input_state, callbacks);
+	if (input_state->pointer_move_usec == 0) {
+		input_state->pointer_move_usec = timestamp_usec;
+	}
 	move_pointer(input_state, dx, dy);
 }
 
@@ -20,6 +20,8 @@ struct Vnc_input_state {
 		double x;
 		double y;
 	} pos;
+	// CLOCK_MONOTONIC time of the first motion not yet shown on screen, 0 when there is none
+	u64 pointer_move_usec;
 	struct {
 		double width;
 		double height;
@@ -45,7 +47,8 @@ struct Vnc_input_state {
 
 bool vnc_input_state_init(struct Vnc_input_state *input_state);
 
-void vnc_input_state_pointer_move(struct Vnc_input_action *action, double dx, double dy);
+void vnc_input_state_pointer_move(struct Vnc_input_action *action, double dx, double dy,
+				  u64 timestamp_usec);
 void vnc_input_state_pointer_button(struct Vnc_input_action *action, u32 button, bool pressed);
 void vnc_input_state_pointer_wheel_scroll(struct Vnc_input_action *action, double scroll_value);
 void vnc_input_state_keyboard_key(struct Vnc_input_action *action, u32 key, bool pressed,
@@ -1,5 +1,8 @@
 #pragma once
 
-#define ARRAY_COUNT(X) sizeof(X) / sizeof(*(X))
+#define ARRAY_COUNT(X) (sizeof(X) / sizeof(*(X)))
 
 #define container_of(ptr, type, member) (type *)((char *)(ptr)-offsetof(type, member))
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
@@ -2,29 +2,325 @@
 #include "drm.h"
 #include "event_loop.h"
 #include "fb_mngr.h"
+#include "headless.h"
 #include "input.h"
 #include "input_state.h"
 #include "log.h"
 #include "logind.h"
 #include "macros.h"
 #include "rfb.h"
+#include "scale.h"
 #include "session.h"
 #include "util.h"
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_SERVER_ADDRESS "127.0.0.1:5901"
+// 60 Hz
+#define DEFAULT_FLIP_LATENCY_US 16667
+#define NS_PER_S 1000000000ull
+
+// Printed by headless runs, per output
+struct Vnc_frame_rate {
+	u64 start_ns;
+	u64 last_ns;
+	u64 last_presented[VNC_DISPLAY_MAX_OUTPUTS];
+	u64 last_skipped[VNC_DISPLAY_MAX_OUTPUTS];
+};
+
+// From a libinput motion event until the cursor moved on screen, per cursor path: software, plane
+struct Vnc_pointer_latency {
+	u64 moves[2];
+	u64 total_us[2];
+	u64 max_us[2];
+};
 
 static struct Vnc_event_loop event_loop;
 
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * NS_PER_S + ts.tv_nsec;
+}
+
 static void sigterm_handler(int signo)
 {
 	(void)signo;
 	vnc_event_loop_exit(&event_loop);
 }
 
+// The event loop stalls while reconnecting, input has nowhere to go in the meantime anyway
+static bool handle_server_input(struct Vnc_session *session)
+{
+	while (!vnc_session_handle_input(session)) {
+		if (!vnc_session_reconnect(session)) {
+			return false;
+		}
+		// Whatever came in along with the handshake is not going to wake poll
+		vnc_event_loop_register_server(&event_loop, vnc_session_get_fd(session));
+	}
+	return true;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-C] [-S] [-f] [-u] [-1] [-p format] [-c address] [-r bytes] "
+			"[-w bytes] [-t] [-A file] [-K] [-H size] [-P bytes] [-L us] [-s filter]\n",
+		name);
+	fprintf(stderr, "  -C  composite the cursor in software, even with a cursor plane\n");
+	fprintf(stderr, "  -S  decode Tight zlib streams serially on the session thread\n");
+	fprintf(stderr, "  -f  keep the initial encodings instead of adapting them to the link\n");
+	fprintf(stderr, "  -u  use io_uring for the server connection, if built in\n");
+	fprintf(stderr, "  -1  receive from the server on the main thread, starting no threads\n");
+	fprintf(stderr, "  -p  request a wire pixel format: xrgb8888, rgb565, rgb332 or bgr233\n");
+	fprintf(stderr, "  -c  server to connect to: host:port, [ipv6]:port or unix:/path "
+			"(default " DEFAULT_SERVER_ADDRESS ")\n");
+	fprintf(stderr, "  -r  socket receive buffer size\n");
+	fprintf(stderr, "  -w  socket send buffer size\n");
+	fprintf(stderr, "  -t  require VeNCrypt TLS with a verified X.509 certificate\n");
+	fprintf(stderr, "  -A  CA file to verify the server with, instead of the system's CAs\n");
+	fprintf(stderr, "  -K  keep TLS in user space instead of the kernel, allows TLS 1.3\n");
+	fprintf(stderr, "  -H  run headless on a WIDTHxHEIGHT offscreen display without input, "
+			"printing the frame rate. Outputs side by side are separated by commas: "
+			"1920x1080,1280x1024\n");
+	fprintf(stderr, "  -P  headless framebuffer pitch (default width * 4)\n");
+	fprintf(stderr, "  -L  headless flip latency in microseconds (default %d), per output "
+			"when separated by commas\n",
+		DEFAULT_FLIP_LATENCY_US);
+	fprintf(stderr, "  -s  filter to scale the desktop with when the server can't resize it: "
+			"nearest, bilinear or area (default)\n");
+}
+
+static bool parse_buffer_size(const char *arg, int *size)
+{
+	char *end;
+	errno = 0;
+	long value = strtol(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0' || value <= 0 || value > INT_MAX) {
+		fprintf(stderr, "Invalid buffer size: %s\n", arg);
+		return false;
+	}
+	*size = value;
+	return true;
+}
+
+static bool parse_u32(const char *arg, u32 *value)
+{
+	char *end;
+	errno = 0;
+	unsigned long parsed = strtoul(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0' || arg[0] == '-' || parsed > UINT32_MAX) {
+		fprintf(stderr, "Invalid number: %s\n", arg);
+		return false;
+	}
+	*value = parsed;
+	return true;
+}
+
+static bool parse_size(const char *arg, u32 *width, u32 *height)
+{
+	char *end;
+	unsigned long parsed_width = strtoul(arg, &end, 10);
+	if (end == arg || *end != 'x') {
+		fprintf(stderr, "Invalid size, expected WIDTHxHEIGHT: %s\n", arg);
+		return false;
+	}
+	const char *height_arg = end + 1;
+	unsigned long parsed_height = strtoul(height_arg, &end, 10);
+	if (end == height_arg || *end != '\0' || parsed_width == 0 || parsed_width > USHRT_MAX ||
+	    parsed_height == 0 || parsed_height > USHRT_MAX) {
+		fprintf(stderr, "Invalid size, expected WIDTHxHEIGHT: %s\n", arg);
+		return false;
+	}
+	*width = parsed_width;
+	*height = parsed_height;
+	return true;
+}
+
+// Splits a comma separated list in place
+static u32 split_list(char *arg, char **items, u32 max_items)
+{
+	u32 count = 0;
+	char *save;
+	for (char *item = strtok_r(arg, ",", &save); item != NULL && count < max_items;
+	     item = strtok_r(NULL, ",", &save)) {
+		items[count++] = item;
+	}
+	return count;
+}
+
+static bool parse_headless_outputs(char *arg, struct Vnc_headless_options *options)
+{
+	char *items[VNC_DISPLAY_MAX_OUTPUTS + 1];
+	u32 count = split_list(arg, items, ARRAY_COUNT(items));
+	if (count == 0 || count > VNC_DISPLAY_MAX_OUTPUTS) {
+		fprintf(stderr, "Expected 1 to %d outputs\n", VNC_DISPLAY_MAX_OUTPUTS);
+		return false;
+	}
+	for (u32 i = 0; i < count; ++i) {
+		if (!parse_size(items[i], &options->outputs[i].width,
+				&options->outputs[i].height)) {
+			return false;
+		}
+	}
+	options->output_count = count;
+	return true;
+}
+
+// Outputs without a latency of their own take the last one
+static bool parse_flip_latencies(char *arg, u32 *latencies)
+{
+	char *items[VNC_DISPLAY_MAX_OUTPUTS + 1];
+	u32 count = split_list(arg, items, ARRAY_COUNT(items));
+	if (count == 0 || count > VNC_DISPLAY_MAX_OUTPUTS) {
+		fprintf(stderr, "Expected 1 to %d flip latencies\n", VNC_DISPLAY_MAX_OUTPUTS);
+		return false;
+	}
+	for (u32 i = 0; i < VNC_DISPLAY_MAX_OUTPUTS; ++i) {
+		if (!parse_u32(items[MIN(i, count - 1)], &latencies[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// About once a second, and the average over the whole run when `done`. Outputs are numbered
+// when there are several.
+static void report_frame_rate(struct Vnc_frame_rate *frame_rate, struct Vnc_fb_mngr *fb_mngr,
+			      bool done)
+{
+	u64 now = now_ns();
+	if (!done && now - frame_rate->last_ns < NS_PER_S) {
+		return;
+	}
+	u32 output_count = fb_mngr->display->output_count;
+	for (u32 i = 0; i < output_count; ++i) {
+		u64 presented, skipped;
+		vnc_fb_mngr_get_frame_counts(fb_mngr, i, &presented, &skipped);
+		if (output_count > 1) {
+			printf("Output %u: ", i);
+		}
+		if (done) {
+			double seconds = (double)(now - frame_rate->start_ns) / NS_PER_S;
+			printf("%llu frames in %.1f s: %.1f frames/s, %llu skipped\n",
+			       (unsigned long long)presented, seconds,
+			       seconds > 0 ? presented / seconds : 0,
+			       (unsigned long long)skipped);
+			continue;
+		}
+		double seconds = (double)(now - frame_rate->last_ns) / NS_PER_S;
+		printf("%.1f frames/s, %.1f skipped/s\n",
+		       (presented - frame_rate->last_presented[i]) / seconds,
+		       (skipped - frame_rate->last_skipped[i]) / seconds);
+		frame_rate->last_presented[i] = presented;
+		frame_rate->last_skipped[i] = skipped;
+	}
+	fflush(stdout);
+	frame_rate->last_ns = now;
+}
+
+static void report_pointer_latency(struct Vnc_pointer_latency *latency)
+{
+	static const char *paths[] = { "software cursor", "cursor plane" };
+	for (u32 i = 0; i < ARRAY_COUNT(paths); ++i) {
+		if (latency->moves[i] > 0) {
+			vnc_log_info("Pointer latency with the %s: %llu moves, %llu us mean, "
+				     "%llu us max",
+				     paths[i], (unsigned long long)latency->moves[i],
+				     (unsigned long long)(latency->total_us[i] / latency->moves[i]),
+				     (unsigned long long)latency->max_us[i]);
+		}
+	}
+}
+
 int main(int argc, char **argv)
 {
-	(void)argc;
-	(void)argv;
+	struct Vnc_session_options session_options = { 0 };
+	struct Vnc_transport_options *transport_options = &session_options.transport;
+	session_options.tls.kernel_tls = true;
+	bool software_cursor = false;
+	enum Vnc_scale_filter scale_filter = VNC_SCALE_FILTER_AREA;
+	struct Vnc_headless_options headless_options = { 0 };
+	u32 flip_latencies[VNC_DISPLAY_MAX_OUTPUTS];
+	for (u32 i = 0; i < VNC_DISPLAY_MAX_OUTPUTS; ++i) {
+		flip_latencies[i] = DEFAULT_FLIP_LATENCY_US;
+	}
+	int opt;
+	const char *server_address = DEFAULT_SERVER_ADDRESS;
+	while ((opt = getopt(argc, argv, "CSfu1p:c:r:w:tA:KH:P:L:s:")) != -1) {
+		switch (opt) {
+		case 'C':
+			software_cursor = true;
+			break;
+		case 'S':
+			session_options.serial_decode = true;
+			break;
+		case 'f':
+			session_options.fixed_encodings = true;
+			break;
+		case 'u':
+			session_options.io_uring = true;
+			break;
+		case '1':
+			session_options.single_threaded = true;
+			break;
+		case 'p':
+			session_options.pixel_format = optarg;
+			break;
+		case 'c':
+			server_address = optarg;
+			break;
+		case 'r':
+			if (!parse_buffer_size(optarg, &transport_options->recv_buffer_size)) {
+				return 1;
+			}
+			break;
+		case 'w':
+			if (!parse_buffer_size(optarg, &transport_options->send_buffer_size)) {
+				return 1;
+			}
+			break;
+		case 't':
+			session_options.tls.required = true;
+			break;
+		case 'A':
+			session_options.tls.ca_file = optarg;
+			break;
+		case 'K':
+			session_options.tls.kernel_tls = false;
+			break;
+		case 'H':
+			if (!parse_headless_outputs(optarg, &headless_options)) {
+				return 1;
+			}
+			break;
+		case 'P':
+			if (!parse_u32(optarg, &headless_options.pitch)) {
+				return 1;
+			}
+			break;
+		case 'L':
+			if (!parse_flip_latencies(optarg, flip_latencies)) {
+				return 1;
+			}
+			break;
+		case 's':
+			if (!vnc_scale_filter_from_name(optarg, &scale_filter)) {
+				fprintf(stderr, "Unknown scale filter: %s\n", optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
 
 	vnc_log_init("/tmp/vnc-client.log");
 
@@ -42,13 +338,18 @@ int main(int argc, char **argv)
 		vnc_log_error("Unable to set SIGTERM handler");
 	}
 
+	// A dropped connection shows up as a failed write, which is what reconnecting acts on
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+		vnc_log_error("Unable to ignore SIGPIPE");
+	}
+
 	struct Vnc_session vnc_session;
-	ok = vnc_session_init(&vnc_session);
+	ok = vnc_session_init(&vnc_session, &session_options);
 	if (!ok) {
 		vnc_log_error("vnc_session_init failed");
 		return 1;
 	}
-	ok = vnc_session_connect(&vnc_session, "127.0.0.1", 5901);
+	ok = vnc_session_connect(&vnc_session, server_address);
 	if (!ok) {
 		vnc_log_error("vnc_session_connect failed");
 		return 1;
@@ -69,30 +370,49 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	// Headless runs need neither a seat nor a GPU, so they take no input devices either
+	bool headless_mode = headless_options.output_count > 0;
 	struct Vnc_logind logind_session;
-	ok = vnc_logind_init(&logind_session);
-	if (!ok) {
-		vnc_log_error("logind_session_init failure");
-		return 1;
-	}
+	struct Vnc_input vnc_input;
+	struct Vnc_drm drm;
+	struct Vnc_headless headless;
+	struct Vnc_display *display;
+	if (headless_mode) {
+		for (u32 i = 0; i < headless_options.output_count; ++i) {
+			headless_options.outputs[i].flip_latency_us = flip_latencies[i];
+		}
+		ok = vnc_headless_init(&headless, &headless_options);
+		if (!ok) {
+			return 1;
+		}
+		display = &headless.display;
+	} else {
+		ok = vnc_logind_init(&logind_session);
+		if (!ok) {
+			vnc_log_error("logind_session_init failure");
+			return 1;
+		}
 
-	ok = vnc_logind_take_control(&logind_session);
-	if (!ok) {
-		vnc_log_error("logind_session_take_control failure");
-		return 1;
-	}
+		ok = vnc_logind_take_control(&logind_session);
+		if (!ok) {
+			vnc_log_error("logind_session_take_control failure");
+			return 1;
+		}
 
-	struct Vnc_drm drm;
-	ok = vnc_drm_init(&drm);
-	if (!ok) {
-		return 1;
-	}
+		ok = vnc_drm_init(&drm);
+		if (!ok) {
+			return 1;
+		}
+		if (!software_cursor) {
+			vnc_drm_init_cursor(&drm);
+		}
 
-	struct Vnc_input vnc_input;
-	ok = vnc_input_init(&vnc_input, &logind_session);
-	if (!ok) {
-		vnc_log_error("vnc_input_init failure");
-		return 1;
+		ok = vnc_input_init(&vnc_input, &logind_session);
+		if (!ok) {
+			vnc_log_error("vnc_input_init failure");
+			return 1;
+		}
+		display = &drm.display;
 	}
 
 	ok = vnc_session_send_auth(&vnc_session, password_buf, security);
@@ -102,33 +422,83 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	// One screen per output, laid out the same way
+	u32 display_width, display_height;
+	vnc_display_get_size(display, &display_width, &display_height);
+	if (display_width > UINT16_MAX || display_height > UINT16_MAX) {
+		vnc_log_error("Outputs span %ux%u, more than a desktop can", display_width,
+			      display_height);
+		return 1;
+	}
+	struct Vnc_rfb_screen screens[VNC_DISPLAY_MAX_OUTPUTS];
+	for (u32 i = 0; i < display->output_count; ++i) {
+		struct Vnc_display_output *output = &display->outputs[i];
+		screens[i] = (struct Vnc_rfb_screen){
+			.id = i,
+			.xpos = output->x,
+			.ypos = output->y,
+			.width = output->fbs[0].width,
+			.height = output->fbs[0].height,
+		};
+	}
+
 	bool shared_connection = true;
-	ok = vnc_session_exchange_connection_params(&vnc_session, shared_connection,
-						    drm.fbs[0].width, drm.fbs[0].height);
+	ok = vnc_session_exchange_connection_params(&vnc_session, shared_connection, screens,
+						    display->output_count);
 	if (!ok) {
 		vnc_log_error("Unable to exchange connection parameters");
 		return 1;
 	}
 
+	// The desktop keeps its size until the server agreed to resize it, if it does
+	struct Vnc_rfb_server_init server_settings;
+	vnc_session_get_server_settings(&vnc_session, &server_settings);
 	struct Vnc_fb_mngr fb_mngr;
-	vnc_fb_mngr_init(&fb_mngr, &drm);
+	ok = vnc_fb_mngr_init(&fb_mngr, display, server_settings.width, server_settings.height,
+			      scale_filter);
+	if (!ok) {
+		return 1;
+	}
 
-	vnc_session_start_processing_continuous_updates(&vnc_session, &fb_mngr);
+	ok = vnc_session_start_processing_continuous_updates(&vnc_session, &fb_mngr);
+	if (!ok) {
+		vnc_log_error("Unable to start processing updates");
+		return 1;
+	}
 
 	struct Vnc_input_state input_state;
 	vnc_input_state_init(&input_state);
-	struct Vnc_rfb_server_init server_settings;
-	vnc_session_get_server_settings(&vnc_session, &server_settings);
 	vnc_input_state_desktop_size_update(&input_state, server_settings.width,
 					    server_settings.height);
 
 	vnc_event_loop_register_vnc(&event_loop, vnc_session_get_event_fd(&vnc_session));
-	vnc_event_loop_register_libinput(&event_loop, vnc_input_get_fd(&vnc_input));
+	if (session_options.single_threaded) {
+		vnc_event_loop_register_server(&event_loop, vnc_session_get_fd(&vnc_session));
+	}
+	vnc_event_loop_register_display(&event_loop, display->fd);
+	if (!headless_mode) {
+		vnc_event_loop_register_libinput(&event_loop, vnc_input_get_fd(&vnc_input));
+	}
+	u64 start_ns = now_ns();
+	struct Vnc_frame_rate frame_rate = { .start_ns = start_ns, .last_ns = start_ns };
+	struct Vnc_pointer_latency pointer_latency = { 0 };
 	vnc_event_loop_register_key_repeat(&event_loop,
 					   vnc_input_state_get_key_repeat_tfd(&input_state));
 
 	u32 events;
 	while ((ok = vnc_event_loop_process_events(&event_loop, &events))) {
+		if ((events & VNC_EVENT_TYPE_SERVER) > 0) {
+			if (!handle_server_input(&vnc_session)) {
+				vnc_log_error("Lost the connection to the server");
+				break;
+			}
+		}
+		if ((events & VNC_EVENT_TYPE_DISPLAY) > 0) {
+			vnc_fb_mngr_handle_flip_events(&fb_mngr);
+			if (headless_mode) {
+				report_frame_rate(&frame_rate, &fb_mngr, false);
+			}
+		}
 		if ((events & VNC_EVENT_TYPE_VNC) > 0) {
 			vnc_log_debug("Got vnc event");
 			u64 eventfd_data;
@@ -141,6 +511,17 @@ int main(int argc, char **argv)
 		}
 		if ((events & VNC_EVENT_TYPE_LIBINPUT) > 0) {
 			vnc_input_handle_events(&vnc_input, &input_state.callbacks);
+			bool on_plane = vnc_fb_mngr_move_cursor(&fb_mngr, input_state.pos.x,
+								input_state.pos.y);
+			if (input_state.pointer_move_usec > 0) {
+				// libinput stamps events with CLOCK_MONOTONIC too
+				u64 latency_us = now_ns() / 1000 - input_state.pointer_move_usec;
+				pointer_latency.moves[on_plane] += 1;
+				pointer_latency.total_us[on_plane] += latency_us;
+				pointer_latency.max_us[on_plane] =
+					MAX(pointer_latency.max_us[on_plane], latency_us);
+				input_state.pointer_move_usec = 0;
+			}
 
 			vnc_session_post_process_mouse_input(&vnc_session, input_state.pos.x,
 							     input_state.pos.y,
@@ -162,12 +543,23 @@ int main(int argc, char **argv)
 			vnc_session_handle_key_repeat(&vnc_session, &key_event);
 			vnc_input_state_reset_key_repeat_tfd(&input_state);
 		}
+		// Everything the input of this iteration produced goes out in one write
+		vnc_session_flush(&vnc_session);
 		if ((events & VNC_EVENT_TYPE_EXIT) > 0) {
 			vnc_log_debug("Exit requested");
 			break;
 		}
 	}
 
-	vnc_drm_deinit(&drm);
+	if (headless_mode) {
+		report_frame_rate(&frame_rate, &fb_mngr, true);
+	}
+	report_pointer_latency(&pointer_latency);
+	vnc_fb_mngr_deinit(&fb_mngr);
+	if (headless_mode) {
+		vnc_headless_deinit(&headless);
+	} else {
+		vnc_drm_deinit(&drm);
+	}
 	return 0;
 }
@@ -0,0 +1,797 @@
+#include "pixel.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXEL_AVX2
+#define AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define PIXEL_NEON
+#include <arm_neon.h>
+#endif
+
+#include "log.h"
+#include "macros.h"
+
+struct Named_format {
+	const char *name;
+	struct Vnc_rfb_pixel_format format;
+};
+
+// Row kernels of one instruction set, by wire bytes per pixel
+struct Kernels {
+	const char *name;
+	void (*row8)(const struct Vnc_pixel_converter *converter, const u8 *src, u32 *dest,
+		     u32 count);
+	void (*row16)(const struct Vnc_pixel_converter *converter, const u8 *src, u32 *dest,
+		      u32 count);
+	void (*row32)(const struct Vnc_pixel_converter *converter, const u8 *src, u32 *dest,
+		      u32 count);
+	void (*values32)(const struct Vnc_pixel_converter *converter, const u8 *src, u32 *dest,
+			 u32 count);
+};
+
+static const struct Named_format named_formats[] = {
+	{ "xrgb8888",
+	  { .bpp = 32, .depth = 24, .true_color = 1, .red_max = 255, .green_max = 255,
+	    .blue_max = 255, .red_shift = 16, .green_shift = 8, .blue_shift = 0 } },
+	{ "rgb565",
+	  { .bpp = 16, .depth = 16, .true_color = 1, .red_max = 31, .green_max = 63,
+	    .blue_max = 31, .red_shift = 11, .green_shift = 5, .blue_shift = 0 } },
+	{ "rgb332",
+	  { .bpp = 8, .depth = 8, .true_color = 1, .red_max = 7, .green_max = 7, .blue_max = 3,
+	    .red_shift = 5, .green_shift = 2, .blue_shift = 0 } },
+	{ "bgr233",
+	  { .bpp = 8, .depth = 8, .true_color = 1, .red_max = 7, .green_max = 7, .blue_max = 3,
+	    .red_shift = 0, .green_shift = 3, .blue_shift = 6 } },
+};
+
+static u32 convert_generic(const struct Vnc_rfb_pixel_format *format, u32 pixel);
+static u32 scale_component(u32 pixel, u8 shift, u16 max);
+static bool init_channel(struct Vnc_pixel_channel *channel, u8 shift, u16 max);
+static void select_kernels(struct Vnc_pixel_converter *converter);
+static bool can_vectorize(struct Vnc_pixel_converter *converter);
+static const struct Kernels *find_kernels(const char *name);
+static void use_kernels(struct Vnc_pixel_converter *converter, const struct Kernels *kernels);
+static void convert_row_copy(const struct Vnc_pixel_converter *converter, const u8 *src, u32 *dest,
+			     u32 count);
+static void convert_row_scalar(const struct Vnc_pixel_converter *converter, const u8 *src,
+			       u32 *dest, u32 count);
+static void convert_values_scalar(const struct Vnc_pixel_converter *converter, const u8 *src,
+				  u32 *dest, u32 count);
+
+#if defined(__SSE2__)
+static void convert_row16_sse2(const struct Vnc_pixel_converter *converter, const u8 *src,
+			       u32 *dest, u32 count);
+static void convert_row32_sse2(const struct Vnc_pixel_converter *converter, const u8 *src,
+			       u32 *dest, u32 count);
+static void convert_values32_sse2(const struct Vnc_pixel_converter *converter, const u8 *src,
+				  u32 *dest, u32 count);
+
+// A 256 entry table lookup keeps up with SSE2 for 8 bpp
+static const struct Kernels sse2_kernels = {
+	"sse2", convert_row_scalar, convert_row16_sse2, convert_row32_sse2, convert_values32_sse2,
+};
+#endif
+
+#if defined(PIXEL_AVX2)
+static AVX2 void convert_row8_avx2(const struct Vnc_pixel_converter *converter, const u8 *src,
+				   u32 *dest, u32 count);
+static AVX2 void convert_row16_avx2(const struct Vnc_pixel_converter *converter, const u8 *src,
+				    u32 *dest, u32 count);
+static AVX2 void convert_row32_avx2(const struct Vnc_pixel_converter *converter, const u8 *src,
+				    u32 *dest, u32 count);
+static AVX2 void convert_values32_avx2(const struct Vnc_pixel_converter *converter,
+				       const u8 *src, u32 *dest, u32 count);
+
+static const struct Kernels avx2_kernels = {
+	"avx2", convert_row8_avx2, convert_row16_avx2, convert_row32_avx2, convert_values32_avx2,
+};
+#endif
+
+#if defined(PIXEL_NEON)
+static void convert_row8_neon(const struct Vnc_pixel_converter *converter, const u8 *src,
+			      u32 *dest, u32 count);
+static void convert_row16_neon(const struct Vnc_pixel_converter *converter, const u8 *src,
+			       u32 *dest, u32 count);
+static void convert_row32_neon(const struct Vnc_pixel_converter *converter, const u8 *src,
+			       u32 *dest, u32 count);
+static void convert_values32_neon(const struct Vnc_pixel_converter *converter, const u8 *src,
+				  u32 *dest, u32 count);
+
+static const struct Kernels neon_kernels = {
+	"neon", convert_row8_neon, convert_row16_neon, convert_row32_neon, convert_values32_neon,
+};
+#endif
+
+bool vnc_pixel_converter_init(struct Vnc_pixel_converter *converter,
+			      struct Vnc_rfb_pixel_format *format)
+{
+	*converter = (struct Vnc_pixel_converter){
+		.format = *format,
+		.bytes_per_pixel = format->bpp / 8,
+	};
+	if (!format->true_color || (format->bpp != 8 && format->bpp != 16 && format->bpp != 32) ||
+	    format->red_max == 0 || format->green_max == 0 || format->blue_max == 0 ||
+	    format->red_shift >= format->bpp || format->green_shift >= format->bpp ||
+	    format->blue_shift >= format->bpp) {
+		vnc_log_error("Unsupported pixel format: %u bpp, true colour %u", format->bpp,
+			      format->true_color);
+		return false;
+	}
+
+	converter->identity = format->bpp == 32 && !format->big_endian && format->red_max == 255 &&
+			      format->green_max == 255 && format->blue_max == 255 &&
+			      format->red_shift == 16 && format->green_shift == 8 &&
+			      format->blue_shift == 0;
+	if (format->bpp != 32) {
+		size_t table_len = (size_t)1 << format->bpp;
+		converter->table = malloc(table_len * sizeof(u32));
+		if (converter->table == NULL) {
+			vnc_log_error("Unable to allocate pixel conversion table");
+			return false;
+		}
+		for (size_t i = 0; i < table_len; ++i) {
+			converter->table[i] = convert_generic(format, i);
+		}
+	}
+	select_kernels(converter);
+	vnc_log_info("Converting %u bpp pixels with the %s kernel", format->bpp,
+		     converter->kernel_name);
+	return true;
+}
+
+void vnc_pixel_converter_deinit(struct Vnc_pixel_converter *converter)
+{
+	free(converter->table);
+	*converter = (struct Vnc_pixel_converter){ 0 };
+}
+
+bool vnc_pixel_converter_use_kernels(struct Vnc_pixel_converter *converter, const char *name)
+{
+	if (strcmp(name, "scalar") == 0) {
+		use_kernels(converter, NULL);
+		return true;
+	}
+	const struct Kernels *kernels = find_kernels(name);
+	if (kernels == NULL || !can_vectorize(converter)) {
+		use_kernels(converter, NULL);
+		return false;
+	}
+	use_kernels(converter, kernels);
+	return converter->convert_row != convert_row_scalar;
+}
+
+u32 vnc_pixel_convert(const struct Vnc_pixel_converter *converter, u32 pixel)
+{
+	if (converter->identity) {
+		return pixel;
+	}
+	if (converter->table != NULL) {
+		return converter->table[pixel & ((1u << converter->format.bpp) - 1)];
+	}
+	return convert_generic(&converter->format, pixel);
+}
+
+void vnc_pixel_convert_values(const struct Vnc_pixel_converter *converter, u32 *pixels,
+			      u32 count)
+{
+	if (converter->identity) {
+		return;
+	}
+	if (converter->convert_values != NULL) {
+		converter->convert_values(converter, (const u8 *)pixels, pixels, count);
+		return;
+	}
+	for (u32 i = 0; i < count; ++i) {
+		pixels[i] = vnc_pixel_convert(converter, pixels[i]);
+	}
+}
+
+u32 vnc_pixel_read_value(const struct Vnc_pixel_converter *converter, const u8 *src)
+{
+	switch (converter->bytes_per_pixel) {
+	case 4: {
+		u32 pixel;
+		memcpy(&pixel, src, sizeof(pixel));
+		return converter->format.big_endian ? ntohl(pixel) : pixel;
+	}
+	case 2: {
+		u16 pixel;
+		memcpy(&pixel, src, sizeof(pixel));
+		return converter->format.big_endian ? ntohs(pixel) : pixel;
+	}
+	default:
+		return src[0];
+	}
+}
+
+u32 vnc_pixel_read(const struct Vnc_pixel_converter *converter, const u8 *src)
+{
+	return vnc_pixel_convert(converter, vnc_pixel_read_value(converter, src));
+}
+
+void vnc_pixel_convert_row(const struct Vnc_pixel_converter *converter, const u8 *src, u32 *dest,
+			   u32 count)
+{
+	converter->convert_row(converter, src, dest, count);
+}
+
+bool vnc_pixel_format_from_name(const char *name, struct Vnc_rfb_pixel_format *format)
+{
+	for (size_t i = 0; i < ARRAY_COUNT(named_formats); ++i) {
+		if (strcmp(name, named_formats[i].name) == 0) {
+			*format = named_formats[i].format;
+			return true;
+		}
+	}
+	return false;
+}
+
+static u32 convert_generic(const struct Vnc_rfb_pixel_format *format, u32 pixel)
+{
+	return scale_component(pixel, format->red_shift, format->red_max) << 16 |
+	       scale_component(pixel, format->green_shift, format->green_max) << 8 |
+	       scale_component(pixel, format->blue_shift, format->blue_max);
+}
+
+// Stretches a component to 8 bits so that its maximum becomes 255
+static u32 scale_component(u32 pixel, u8 shift, u16 max)
+{
+	u32 value = (pixel >> shift) & max;
+	if (max == 255) {
+		return value;
+	}
+	return (value * 255 + max / 2) / max;
+}
+
+// Finds the 16 bit multiplier that replaces the division of scale_component in the vector
+// kernels. Fails when no multiplier gives the exact result for every value of the component.
+static bool init_channel(struct Vnc_pixel_channel *channel, u8 shift, u16 max)
+{
+	*channel = (struct Vnc_pixel_channel){ .shift = shift, .max = max };
+	if (max > 255) {
+		return false;
+	}
+	for (int magic_shift = 15; magic_shift >= 0; --magic_shift) {
+		u64 magic = ((1ull << (16 + magic_shift)) + max - 1) / max;
+		if (magic > UINT16_MAX) {
+			continue;
+		}
+		for (u32 value = 0; value <= max; ++value) {
+			u32 scaled = value * 255 + max / 2;
+			if ((scaled * magic) >> (16 + magic_shift) != scaled / max) {
+				return false;
+			}
+		}
+		channel->magic = magic;
+		channel->magic_shift = magic_shift;
+		return true;
+	}
+	return false;
+}
+
+static void select_kernels(struct Vnc_pixel_converter *converter)
+{
+	use_kernels(converter, NULL);
+	if (!can_vectorize(converter)) {
+		return;
+	}
+	const struct Kernels *kernels = NULL;
+#if defined(__SSE2__)
+	kernels = &sse2_kernels;
+#elif defined(PIXEL_NEON)
+	kernels = &neon_kernels;
+#endif
+#if defined(PIXEL_AVX2)
+	if (__builtin_cpu_supports("avx2")) {
+		kernels = &avx2_kernels;
+	}
+#endif
+	if (kernels != NULL) {
+		use_kernels(converter, kernels);
+	}
+}
+
+// Whether the vector kernels can convert the format at all
+static bool can_vectorize(struct Vnc_pixel_converter *converter)
+{
+	struct Vnc_rfb_pixel_format *format = &converter->format;
+	if (converter->identity) {
+		return false;
+	}
+	bool red = init_channel(&converter->channels[0], format->red_shift, format->red_max);
+	bool green = init_channel(&converter->channels[1], format->green_shift, format->green_max);
+	bool blue = init_channel(&converter->channels[2], format->blue_shift, format->blue_max);
+	// The 32 bpp kernels only mask, the 8 and 16 bpp kernels scale in 16 bit lanes
+	return format->bpp == 32 ? format->red_max == 255 && format->green_max == 255 &&
+					   format->blue_max == 255 :
+				   red && green && blue;
+}
+
+// The kernels of the named instruction set, NULL when this build or the CPU lacks them
+static const struct Kernels *find_kernels(const char *name)
+{
+#if defined(__SSE2__)
+	if (strcmp(name, sse2_kernels.name) == 0) {
+		return &sse2_kernels;
+	}
+#endif
+#if defined(PIXEL_AVX2)
+	if (strcmp(name, avx2_kernels.name) == 0 && __builtin_cpu_supports("avx2")) {
+		return &avx2_kernels;
+	}
+#endif
+#if defined(PIXEL_NEON)
+	if (strcmp(name, neon_kernels.name) == 0) {
+		return &neon_kernels;
+	}
+#endif
+	return NULL;
+}
+
+// Picks the kernel of `kernels` for the format, the scalar code when `kernels` is NULL
+static void use_kernels(struct Vnc_pixel_converter *converter, const struct Kernels *kernels)
+{
+	converter->kernel_name = "scalar";
+	converter->convert_row = convert_row_scalar;
+	converter->convert_values = NULL;
+	if (converter->identity) {
+		converter->kernel_name = "copy";
+		converter->convert_row = convert_row_copy;
+		return;
+	}
+	if (kernels == NULL) {
+		return;
+	}
+	switch (converter->format.bpp) {
+	case 8:
+		converter->convert_row = kernels->row8;
+		break;
+	case 16:
+		converter->convert_row = kernels->row16;
+		break;
+	default:
+		converter->convert_row = kernels->row32;
+		converter->convert_values = kernels->values32;
+		break;
+	}
+	if (converter->convert_row != convert_row_scalar) {
+		converter->kernel_name = kernels->name;
+	}
+}
+
+static void convert_row_copy(const struct Vnc_pixel_converter *converter, const u8 *src, u32 *dest,
+			     u32 count)
+{
+	memcpy(dest, src, count * sizeof(u32));
+}
+
+// The reference every vector kernel has to match, which also converts their leftover pixels
+static void convert_row_scalar(const struct Vnc_pixel_converter *converter, const u8 *src,
+			       u32 *dest, u32 count)
+{
+	const u32 *table = converter->table;
+	switch (converter->bytes_per_pixel) {
+	case 1:
+		for (u32 i = 0; i < count; ++i) {
+			dest[i] = table[src[i]];
+		}
+		break;
+	case 2:
+		for (u32 i = 0; i < count; ++i) {
+			u16 pixel = converter->format.big_endian ? src[0] << 8 | src[1] :
+								   src[1] << 8 | src[0];
+			dest[i] = table[pixel];
+			src += 2;
+		}
+		break;
+	default:
+		for (u32 i = 0; i < count; ++i) {
+			dest[i] = convert_generic(&converter->format,
+						  vnc_pixel_read_value(converter, src));
+			src += 4;
+		}
+		break;
+	}
+}
+
+// Converts the values left over by a 32 bpp vector kernel that were already in host byte order
+static void convert_values_scalar(const struct Vnc_pixel_converter *converter, const u8 *src,
+				  u32 *dest, u32 count)
+{
+	for (u32 i = 0; i < count; ++i) {
+		u32 pixel;
+		memcpy(&pixel, src + i * 4, sizeof(pixel));
+		dest[i] = convert_generic(&converter->format, pixel);
+	}
+}
+
+#if defined(__SSE2__)
+// The constants of a component, loaded once per row so that stores to the row can't force a reload
+struct Channel_sse2 {
+	__m128i shift;
+	__m128i max;
+	__m128i half;
+	__m128i magic;
+	__m128i magic_shift;
+};
+
+struct Channels_sse2 {
+	struct Channel_sse2 red;
+	struct Channel_sse2 green;
+	struct Channel_sse2 blue;
+};
+
+static inline struct Channel_sse2 load_channel_sse2(const struct Vnc_pixel_channel *channel)
+{
+	return (struct Channel_sse2){
+		.shift = _mm_cvtsi32_si128(channel->shift),
+		.max = _mm_set1_epi16(channel->max),
+		.half = _mm_set1_epi16(channel->max / 2),
+		.magic = _mm_set1_epi16(channel->magic),
+		.magic_shift = _mm_cvtsi32_si128(channel->magic_shift),
+	};
+}
+
+static inline struct Channels_sse2 load_channels_sse2(const struct Vnc_pixel_converter *converter)
+{
+	return (struct Channels_sse2){
+		.red = load_channel_sse2(&converter->channels[0]),
+		.green = load_channel_sse2(&converter->channels[1]),
+		.blue = load_channel_sse2(&converter->channels[2]),
+	};
+}
+
+// Masks a component out of 16 bit lanes and scales it to 8 bits
+static inline __m128i scale_sse2(__m128i pixels, const struct Channel_sse2 *channel)
+{
+	__m128i value = _mm_and_si128(_mm_srl_epi16(pixels, channel->shift), channel->max);
+	value = _mm_add_epi16(_mm_mullo_epi16(value, _mm_set1_epi16(255)), channel->half);
+	return _mm_srl_epi16(_mm_mulhi_epu16(value, channel->magic), channel->magic_shift);
+}
+
+// Expands eight pixels held in 16 bit lanes
+static inline void expand16_sse2(const struct Channels_sse2 *channels, __m128i pixels, u32 *dest)
+{
+	__m128i red = scale_sse2(pixels, &channels->red);
+	__m128i green = scale_sse2(pixels, &channels->green);
+	__m128i blue = scale_sse2(pixels, &channels->blue);
+	__m128i green_blue = _mm_or_si128(_mm_slli_epi16(green, 8), blue);
+	_mm_storeu_si128((__m128i *)dest, _mm_unpacklo_epi16(green_blue, red));
+	_mm_storeu_si128((__m128i *)(dest + 4), _mm_unpackhi_epi16(green_blue, red));
+}
+
+static void convert_row16_sse2(const struct Vnc_pixel_converter *converter, const u8 *src,
+			       u32 *dest, u32 count)
+{
+	struct Channels_sse2 channels = load_channels_sse2(converter);
+	bool swap = converter->format.big_endian;
+	u32 i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i pixels = _mm_loadu_si128((const __m128i *)(src + i * 2));
+		if (swap) {
+			pixels = _mm_or_si128(_mm_slli_epi16(pixels, 8), _mm_srli_epi16(pixels, 8));
+		}
+		expand16_sse2(&channels, pixels, dest + i);
+	}
+	convert_row_scalar(converter, src + i * 2, dest + i, count - i);
+}
+
+// Converts whole groups of four 32 bpp pixels and returns how many pixels it converted
+static inline u32 convert32_sse2(const struct Vnc_pixel_converter *converter, const u8 *src,
+				 u32 *dest, u32 count, bool swap)
+{
+	__m128i mask = _mm_set1_epi32(255);
+	__m128i red_shift = _mm_cvtsi32_si128(converter->channels[0].shift);
+	__m128i green_shift = _mm_cvtsi32_si128(converter->channels[1].shift);
+	__m128i blue_shift = _mm_cvtsi32_si128(converter->channels[2].shift);
+	u32 i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i pixels = _mm_loadu_si128((const __m128i *)(src + i * 4));
+		if (swap) {
+			pixels = _mm_or_si128(_mm_slli_epi16(pixels, 8), _mm_srli_epi16(pixels, 8));
+			pixels = _mm_shufflehi_epi16(_mm_shufflelo_epi16(pixels, 0xb1), 0xb1);
+		}
+		__m128i red = _mm_and_si128(_mm_srl_epi32(pixels, red_shift), mask);
+		__m128i green = _mm_and_si128(_mm_srl_epi32(pixels, green_shift), mask);
+		__m128i blue = _mm_and_si128(_mm_srl_epi32(pixels, blue_shift), mask);
+		__m128i result = _mm_or_si128(_mm_slli_epi32(red, 16), _mm_slli_epi32(green, 8));
+		_mm_storeu_si128((__m128i *)(dest + i), _mm_or_si128(result, blue));
+	}
+	return i;
+}
+
+static void convert_row32_sse2(const struct Vnc_pixel_converter *converter, const u8 *src,
+			       u32 *dest, u32 count)
+{
+	u32 i = convert32_sse2(converter, src, dest, count, converter->format.big_endian);
+	convert_row_scalar(converter, src + i * 4, dest + i, count - i);
+}
+
+static void convert_values32_sse2(const struct Vnc_pixel_converter *converter, const u8 *src,
+				  u32 *dest, u32 count)
+{
+	u32 i = convert32_sse2(converter, src, dest, count, false);
+	convert_values_scalar(converter, src + i * 4, dest + i, count - i);
+}
+#endif
+
+#if defined(PIXEL_AVX2)
+struct Channel_avx2 {
+	__m128i shift;
+	__m256i max;
+	__m256i half;
+	__m256i magic;
+	__m128i magic_shift;
+};
+
+struct Channels_avx2 {
+	struct Channel_avx2 red;
+	struct Channel_avx2 green;
+	struct Channel_avx2 blue;
+};
+
+static inline AVX2 struct Channel_avx2 load_channel_avx2(const struct Vnc_pixel_channel *channel)
+{
+	return (struct Channel_avx2){
+		.shift = _mm_cvtsi32_si128(channel->shift),
+		.max = _mm256_set1_epi16(channel->max),
+		.half = _mm256_set1_epi16(channel->max / 2),
+		.magic = _mm256_set1_epi16(channel->magic),
+		.magic_shift = _mm_cvtsi32_si128(channel->magic_shift),
+	};
+}
+
+static inline AVX2 struct Channels_avx2
+load_channels_avx2(const struct Vnc_pixel_converter *converter)
+{
+	return (struct Channels_avx2){
+		.red = load_channel_avx2(&converter->channels[0]),
+		.green = load_channel_avx2(&converter->channels[1]),
+		.blue = load_channel_avx2(&converter->channels[2]),
+	};
+}
+
+static inline AVX2 __m256i scale_avx2(__m256i pixels, const struct Channel_avx2 *channel)
+{
+	__m256i value = _mm256_and_si256(_mm256_srl_epi16(pixels, channel->shift), channel->max);
+	value = _mm256_add_epi16(_mm256_mullo_epi16(value, _mm256_set1_epi16(255)), channel->half);
+	return _mm256_srl_epi16(_mm256_mulhi_epu16(value, channel->magic), channel->magic_shift);
+}
+
+// Expands sixteen pixels held in 16 bit lanes. The unpacks work within 128 bit halves, so the
+// halves are put back in order before storing.
+static inline AVX2 void expand16_avx2(const struct Channels_avx2 *channels, __m256i pixels,
+				      u32 *dest)
+{
+	__m256i red = scale_avx2(pixels, &channels->red);
+	__m256i green = scale_avx2(pixels, &channels->green);
+	__m256i blue = scale_avx2(pixels, &channels->blue);
+	__m256i green_blue = _mm256_or_si256(_mm256_slli_epi16(green, 8), blue);
+	__m256i low = _mm256_unpacklo_epi16(green_blue, red);
+	__m256i high = _mm256_unpackhi_epi16(green_blue, red);
+	_mm256_storeu_si256((__m256i *)dest, _mm256_permute2x128_si256(low, high, 0x20));
+	_mm256_storeu_si256((__m256i *)(dest + 8), _mm256_permute2x128_si256(low, high, 0x31));
+}
+
+static AVX2 void convert_row8_avx2(const struct Vnc_pixel_converter *converter, const u8 *src,
+				   u32 *dest, u32 count)
+{
+	struct Channels_avx2 channels = load_channels_avx2(converter);
+	u32 i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m128i pixels = _mm_loadu_si128((const __m128i *)(src + i));
+		expand16_avx2(&channels, _mm256_cvtepu8_epi16(pixels), dest + i);
+	}
+	convert_row_scalar(converter, src + i, dest + i, count - i);
+}
+
+static AVX2 void convert_row16_avx2(const struct Vnc_pixel_converter *converter, const u8 *src,
+				    u32 *dest, u32 count)
+{
+	struct Channels_avx2 channels = load_channels_avx2(converter);
+	__m256i swap_mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+					     1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	bool swap = converter->format.big_endian;
+	u32 i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m256i pixels = _mm256_loadu_si256((const __m256i *)(src + i * 2));
+		if (swap) {
+			pixels = _mm256_shuffle_epi8(pixels, swap_mask);
+		}
+		expand16_avx2(&channels, pixels, dest + i);
+	}
+	convert_row_scalar(converter, src + i * 2, dest + i, count - i);
+}
+
+// With every component on a byte boundary the whole conversion is a single byte shuffle
+static inline AVX2 u32 convert32_avx2(const struct Vnc_pixel_converter *converter, const u8 *src,
+				      u32 *dest, u32 count, bool swap)
+{
+	u8 pattern[32];
+	bool byte_aligned = true;
+	for (u32 i = 0; i < sizeof(pattern); i += 4) {
+		for (u32 c = 0; c < 3; ++c) {
+			u8 byte = converter->channels[c].shift / 8;
+			byte_aligned &= converter->channels[c].shift % 8 == 0;
+			pattern[i + 2 - c] = (i % 16) + (swap ? 3 - byte : byte);
+		}
+		pattern[i + 3] = 0x80;
+	}
+	__m256i shuffle = _mm256_loadu_si256((const __m256i *)pattern);
+	__m256i mask = _mm256_set1_epi32(255);
+	__m128i red_shift = _mm_cvtsi32_si128(converter->channels[0].shift);
+	__m128i green_shift = _mm_cvtsi32_si128(converter->channels[1].shift);
+	__m128i blue_shift = _mm_cvtsi32_si128(converter->channels[2].shift);
+	__m256i swap_mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+					     3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	u32 i = 0;
+	if (byte_aligned) {
+		for (; i + 8 <= count; i += 8) {
+			__m256i pixels = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+			_mm256_storeu_si256((__m256i *)(dest + i),
+					    _mm256_shuffle_epi8(pixels, shuffle));
+		}
+		return i;
+	}
+	for (; i + 8 <= count; i += 8) {
+		__m256i pixels = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+		if (swap) {
+			pixels = _mm256_shuffle_epi8(pixels, swap_mask);
+		}
+		__m256i red = _mm256_and_si256(_mm256_srl_epi32(pixels, red_shift), mask);
+		__m256i green = _mm256_and_si256(_mm256_srl_epi32(pixels, green_shift), mask);
+		__m256i blue = _mm256_and_si256(_mm256_srl_epi32(pixels, blue_shift), mask);
+		__m256i result =
+			_mm256_or_si256(_mm256_slli_epi32(red, 16), _mm256_slli_epi32(green, 8));
+		_mm256_storeu_si256((__m256i *)(dest + i), _mm256_or_si256(result, blue));
+	}
+	return i;
+}
+
+static AVX2 void convert_row32_avx2(const struct Vnc_pixel_converter *converter, const u8 *src,
+				    u32 *dest, u32 count)
+{
+	u32 i = convert32_avx2(converter, src, dest, count, converter->format.big_endian);
+	convert_row_scalar(converter, src + i * 4, dest + i, count - i);
+}
+
+static AVX2 void convert_values32_avx2(const struct Vnc_pixel_converter *converter,
+				       const u8 *src, u32 *dest, u32 count)
+{
+	u32 i = convert32_avx2(converter, src, dest, count, false);
+	convert_values_scalar(converter, src + i * 4, dest + i, count - i);
+}
+#endif
+
+#if defined(PIXEL_NEON)
+struct Channel_neon {
+	int16x8_t shift;
+	uint16x8_t max;
+	uint16x8_t half;
+	uint16_t magic;
+	int32x4_t magic_shift;
+};
+
+struct Channels_neon {
+	struct Channel_neon red;
+	struct Channel_neon green;
+	struct Channel_neon blue;
+};
+
+static inline struct Channel_neon load_channel_neon(const struct Vnc_pixel_channel *channel)
+{
+	return (struct Channel_neon){
+		.shift = vdupq_n_s16(-channel->shift),
+		.max = vdupq_n_u16(channel->max),
+		.half = vdupq_n_u16(channel->max / 2),
+		.magic = channel->magic,
+		.magic_shift = vdupq_n_s32(-16 - channel->magic_shift),
+	};
+}
+
+static inline struct Channels_neon load_channels_neon(const struct Vnc_pixel_converter *converter)
+{
+	return (struct Channels_neon){
+		.red = load_channel_neon(&converter->channels[0]),
+		.green = load_channel_neon(&converter->channels[1]),
+		.blue = load_channel_neon(&converter->channels[2]),
+	};
+}
+
+// NEON has no 16 bit multiply-high, so the product is widened and narrowed again
+static inline uint16x8_t scale_neon(uint16x8_t pixels, const struct Channel_neon *channel)
+{
+	uint16x8_t value = vandq_u16(vshlq_u16(pixels, channel->shift), channel->max);
+	value = vmlaq_n_u16(channel->half, value, 255);
+	uint32x4_t low = vmull_n_u16(vget_low_u16(value), channel->magic);
+	uint32x4_t high = vmull_n_u16(vget_high_u16(value), channel->magic);
+	return vcombine_u16(vmovn_u32(vshlq_u32(low, channel->magic_shift)),
+			    vmovn_u32(vshlq_u32(high, channel->magic_shift)));
+}
+
+static inline void expand16_neon(const struct Channels_neon *channels, uint16x8_t pixels,
+				 u32 *dest)
+{
+	uint16x8_t red = scale_neon(pixels, &channels->red);
+	uint16x8_t green = scale_neon(pixels, &channels->green);
+	uint16x8_t blue = scale_neon(pixels, &channels->blue);
+	uint16x8_t green_blue = vorrq_u16(vshlq_n_u16(green, 8), blue);
+	uint16x8x2_t zipped = vzipq_u16(green_blue, red);
+	vst1q_u32(dest, vreinterpretq_u32_u16(zipped.val[0]));
+	vst1q_u32(dest + 4, vreinterpretq_u32_u16(zipped.val[1]));
+}
+
+static void convert_row8_neon(const struct Vnc_pixel_converter *converter, const u8 *src,
+			      u32 *dest, u32 count)
+{
+	struct Channels_neon channels = load_channels_neon(converter);
+	u32 i = 0;
+	for (; i + 16 <= count; i += 16) {
+		uint8x16_t pixels = vld1q_u8(src + i);
+		expand16_neon(&channels, vmovl_u8(vget_low_u8(pixels)), dest + i);
+		expand16_neon(&channels, vmovl_u8(vget_high_u8(pixels)), dest + i + 8);
+	}
+	convert_row_scalar(converter, src + i, dest + i, count - i);
+}
+
+static void convert_row16_neon(const struct Vnc_pixel_converter *converter, const u8 *src,
+			       u32 *dest, u32 count)
+{
+	struct Channels_neon channels = load_channels_neon(converter);
+	bool swap = converter->format.big_endian;
+	u32 i = 0;
+	for (; i + 8 <= count; i += 8) {
+		uint8x16_t pixels = vld1q_u8(src + i * 2);
+		if (swap) {
+			pixels = vrev16q_u8(pixels);
+		}
+		expand16_neon(&channels, vreinterpretq_u16_u8(pixels), dest + i);
+	}
+	convert_row_scalar(converter, src + i * 2, dest + i, count - i);
+}
+
+static inline u32 convert32_neon(const struct Vnc_pixel_converter *converter, const u8 *src,
+				 u32 *dest, u32 count, bool swap)
+{
+	uint32x4_t mask = vdupq_n_u32(255);
+	int32x4_t red_shift = vdupq_n_s32(-converter->channels[0].shift);
+	int32x4_t green_shift = vdupq_n_s32(-converter->channels[1].shift);
+	int32x4_t blue_shift = vdupq_n_s32(-converter->channels[2].shift);
+	u32 i = 0;
+	for (; i + 4 <= count; i += 4) {
+		uint8x16_t bytes = vld1q_u8(src + i * 4);
+		if (swap) {
+			bytes = vrev32q_u8(bytes);
+		}
+		uint32x4_t pixels = vreinterpretq_u32_u8(bytes);
+		uint32x4_t red = vandq_u32(vshlq_u32(pixels, red_shift), mask);
+		uint32x4_t green = vandq_u32(vshlq_u32(pixels, green_shift), mask);
+		uint32x4_t blue = vandq_u32(vshlq_u32(pixels, blue_shift), mask);
+		uint32x4_t result = vorrq_u32(vshlq_n_u32(red, 16), vshlq_n_u32(green, 8));
+		vst1q_u32(dest + i, vorrq_u32(result, blue));
+	}
+	return i;
+}
+
+static void convert_row32_neon(const struct Vnc_pixel_converter *converter, const u8 *src,
+			       u32 *dest, u32 count)
+{
+	u32 i = convert32_neon(converter, src, dest, count, converter->format.big_endian);
+	convert_row_scalar(converter, src + i * 4, dest + i, count - i);
+}
+
+static void convert_values32_neon(const struct Vnc_pixel_converter *converter, const u8 *src,
+				  u32 *dest, u32 count)
+{
+	u32 i = convert32_neon(converter, src, dest, count, false);
+	convert_values_scalar(converter, src + i * 4, dest + i, count - i);
+}
+#endif
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "rfb.h"
+#include "types.h"
+
+// A colour component of the wire format. The vector kernels scale it to 8 bits as
+// ((value * 255 + max / 2) * magic) >> (16 + magic_shift), which equals the scalar division.
+struct Vnc_pixel_channel {
+	u8 shift;
+	u16 max;
+	u16 magic;
+	u8 magic_shift;
+};
+
+// Expands true colour pixels of the negotiated wire format into the XRGB8888 scanout format
+struct Vnc_pixel_converter {
+	struct Vnc_rfb_pixel_format format;
+	u8 bytes_per_pixel;
+	bool identity; // The wire format already is little endian XRGB8888
+	u32 *table; // Every 8 or 16 bpp wire value mapped to XRGB8888
+	struct Vnc_pixel_channel channels[3]; // Red, green and blue
+	// Kernels picked for the format and the CPU at init
+	const char *kernel_name;
+	void (*convert_row)(const struct Vnc_pixel_converter *converter, const u8 *src, u32 *dest,
+			    u32 count);
+	// Converts 32 bpp values in host byte order, NULL when there is no vector kernel for them
+	void (*convert_values)(const struct Vnc_pixel_converter *converter, const u8 *src,
+			       u32 *dest, u32 count);
+};
+
+bool vnc_pixel_converter_init(struct Vnc_pixel_converter *converter,
+			      struct Vnc_rfb_pixel_format *format);
+void vnc_pixel_converter_deinit(struct Vnc_pixel_converter *converter);
+// Switches to the kernels of the named instruction set or to "scalar", so tests can compare
+// them. Fails, leaving the plain C code, when the build, the CPU or the format rules them out.
+bool vnc_pixel_converter_use_kernels(struct Vnc_pixel_converter *converter, const char *name);
+// Converts a pixel value that is already in host byte order
+u32 vnc_pixel_convert(const struct Vnc_pixel_converter *converter, u32 pixel);
+// Converts pixel values in host byte order in place
+void vnc_pixel_convert_values(const struct Vnc_pixel_converter *converter, u32 *pixels,
+			      u32 count);
+// Reads one PIXEL as sent on the wire into host byte order, without converting it
+u32 vnc_pixel_read_value(const struct Vnc_pixel_converter *converter, const u8 *src);
+// Reads one PIXEL as sent on the wire and converts it
+u32 vnc_pixel_read(const struct Vnc_pixel_converter *converter, const u8 *src);
+// Converts `count` consecutive PIXELs as sent on the wire
+void vnc_pixel_convert_row(const struct Vnc_pixel_converter *converter, const u8 *src, u32 *dest,
+			   u32 count);
+
+// Wire formats by name: xrgb8888, rgb565, rgb332 and bgr233
+bool vnc_pixel_format_from_name(const char *name, struct Vnc_rfb_pixel_format *format);
@@ -2,19 +2,214 @@
 
 #include <assert.h>
 #include <arpa/inet.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include "d3des.h"
 #include "fb_mngr.h"
 #include "log.h"
 #include "macros.h"
+#include "pixel.h"
+#include "uring.h"
 
-enum Vnc_rfb_result vnc_rfb_recv_version(int vnc_fd, enum Vnc_rfb_version *version)
+// Reads of at least this size skip the buffer and go straight into the destination
+#define DIRECT_READ_SIZE (VNC_RFB_STREAM_CAPACITY / 2)
+
+static enum Vnc_rfb_result make_room(struct Vnc_rfb_stream *stream, size_t size);
+static enum Vnc_rfb_result recv_into(struct Vnc_rfb_stream *stream, void *dest, size_t size,
+				     int flags, size_t *received);
+static enum Vnc_rfb_result send_queue_push(struct Vnc_rfb_send_queue *queue, const void *message,
+					   size_t size);
+
+bool vnc_rfb_stream_init(struct Vnc_rfb_stream *stream, int fd)
+{
+	*stream = (struct Vnc_rfb_stream){
+		.fd = fd,
+		.buffer = malloc(VNC_RFB_STREAM_CAPACITY),
+		.capacity = VNC_RFB_STREAM_CAPACITY,
+	};
+	if (stream->buffer == NULL) {
+		vnc_log_error("could not allocate read buffer");
+		return false;
+	}
+	return true;
+}
+
+void vnc_rfb_stream_deinit(struct Vnc_rfb_stream *stream)
+{
+	free(stream->buffer);
+	stream->buffer = NULL;
+}
+
+enum Vnc_rfb_result vnc_rfb_stream_fill(struct Vnc_rfb_stream *stream, size_t size)
+{
+	if (stream->len - stream->pos >= size) {
+		return VNC_RFB_RESULT_SUCCESS;
+	}
+	RFB_TRY(make_room(stream, size));
+	while (stream->len - stream->pos < size) {
+		size_t received;
+		RFB_TRY(recv_into(stream, stream->buffer + stream->len,
+				  stream->capacity - stream->len, 0, &received));
+		stream->len += received;
+	}
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+enum Vnc_rfb_result vnc_rfb_stream_receive(struct Vnc_rfb_stream *stream)
+{
+	if (stream->pos == stream->len) {
+		stream->pos = 0;
+		stream->len = 0;
+	}
+	RFB_TRY(make_room(stream, stream->len - stream->pos + 1));
+	size_t received;
+	RFB_TRY(recv_into(stream, stream->buffer + stream->len, stream->capacity - stream->len,
+			  MSG_DONTWAIT, &received));
+	stream->len += received;
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+enum Vnc_rfb_result vnc_rfb_stream_ensure(struct Vnc_rfb_stream *stream, size_t size)
+{
+	if (stream->len - stream->pos >= size) {
+		return VNC_RFB_RESULT_SUCCESS;
+	}
+	RFB_TRY(make_room(stream, size));
+	return VNC_RFB_RESULT_WOULD_BLOCK;
+}
+
+enum Vnc_rfb_result vnc_rfb_stream_wait(struct Vnc_rfb_stream *stream, int timeout_ms)
+{
+	if (stream->uring != NULL) {
+		return vnc_uring_wait(stream->uring, (i64)timeout_ms * 1000000);
+	}
+	struct pollfd pollfd = { .fd = stream->fd, .events = POLLIN };
+	int rc;
+	do {
+		rc = poll(&pollfd, 1, timeout_ms);
+	} while (rc == -1 && errno == EINTR);
+	if (rc == -1) {
+		return VNC_RFB_RESULT_ERROR_IO;
+	}
+	return rc == 0 ? VNC_RFB_RESULT_ERROR_IO_RECV_TIMEOUT : VNC_RFB_RESULT_SUCCESS;
+}
+
+size_t vnc_rfb_stream_buffered(struct Vnc_rfb_stream *stream, const u8 **data)
+{
+	*data = stream->buffer + stream->pos;
+	return stream->len - stream->pos;
+}
+
+enum Vnc_rfb_result vnc_rfb_stream_read(struct Vnc_rfb_stream *stream, void *dest, size_t size)
+{
+	if (size - MIN(size, stream->len - stream->pos) >= DIRECT_READ_SIZE) {
+		return vnc_rfb_stream_read_direct(stream, dest, size);
+	}
+	RFB_TRY(vnc_rfb_stream_fill(stream, size));
+	memcpy(dest, stream->buffer + stream->pos, size);
+	stream->pos += size;
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+enum Vnc_rfb_result vnc_rfb_stream_read_direct(struct Vnc_rfb_stream *stream, void *dest,
+					       size_t size)
+{
+	u8 *out = dest;
+	size_t buffered = MIN(size, stream->len - stream->pos);
+	memcpy(out, stream->buffer + stream->pos, buffered);
+	stream->pos += buffered;
+	out += buffered;
+	size -= buffered;
+	while (size > 0) {
+		size_t received;
+		RFB_TRY(recv_into(stream, out, size, MSG_WAITALL, &received));
+		out += received;
+		size -= received;
+	}
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+enum Vnc_rfb_result vnc_rfb_stream_read_some(struct Vnc_rfb_stream *stream, void *dest,
+					     size_t size, size_t *received)
+{
+	u8 *out = dest;
+	size_t buffered = MIN(size, stream->len - stream->pos);
+	memcpy(out, stream->buffer + stream->pos, buffered);
+	stream->pos += buffered;
+	*received = buffered;
+	while (*received < size) {
+		size_t count;
+		RFB_TRY(recv_into(stream, out + *received, size - *received, MSG_DONTWAIT, &count));
+		*received += count;
+	}
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+enum Vnc_rfb_result vnc_rfb_stream_peek(struct Vnc_rfb_stream *stream, void *dest, size_t size)
+{
+	RFB_TRY(vnc_rfb_stream_fill(stream, size));
+	memcpy(dest, stream->buffer + stream->pos, size);
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+enum Vnc_rfb_result vnc_rfb_stream_skip(struct Vnc_rfb_stream *stream, size_t size)
+{
+	while (size > 0) {
+		size_t count = MIN(size, stream->capacity);
+		RFB_TRY(vnc_rfb_stream_fill(stream, count));
+		stream->pos += count;
+		size -= count;
+	}
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+enum Vnc_rfb_result vnc_rfb_stream_require(struct Vnc_rfb_stream *stream, size_t size,
+					   const u8 **data)
+{
+	RFB_TRY(vnc_rfb_stream_fill(stream, size));
+	*data = stream->buffer + stream->pos;
+	stream->pos += size;
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+void vnc_rfb_send_queue_init(struct Vnc_rfb_send_queue *queue, int fd)
+{
+	*queue = (struct Vnc_rfb_send_queue){ .fd = fd };
+}
+
+enum Vnc_rfb_result vnc_rfb_send_queue_flush(struct Vnc_rfb_send_queue *queue)
+{
+	if (queue->pending_messages == 0) {
+		return VNC_RFB_RESULT_SUCCESS;
+	}
+	if (queue->uring != NULL) {
+		RFB_TRY(vnc_uring_send(queue->uring, queue->len));
+	} else {
+		RFB_TRY_WRITE(queue->fd, queue->buffer, queue->len);
+	}
+	queue->flushes += 1;
+	queue->messages_sent += queue->pending_messages;
+	queue->max_messages_per_flush = MAX(queue->max_messages_per_flush, queue->pending_messages);
+	queue->len = 0;
+	queue->pending_messages = 0;
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+void vnc_rfb_send_queue_clear(struct Vnc_rfb_send_queue *queue)
+{
+	queue->len = 0;
+	queue->pending_messages = 0;
+}
+
+enum Vnc_rfb_result vnc_rfb_recv_version(struct Vnc_rfb_stream *stream,
+					 enum Vnc_rfb_version *version)
 {
 	char buf[12] = { '\0' };
-	RFB_TRY_READ(vnc_fd, buf, sizeof(buf));
+	RFB_TRY_READ(stream, buf, sizeof(buf));
 	*version = VNC_RFB_VERSION_UNKNOWN;
 	if (strncmp(buf, "RFB 003.003\n", RFB_VERSION_MSG_LEN) == 0) {
 		*version = VNC_RFB_VERSION_33;
@@ -44,17 +239,17 @@ enum Vnc_rfb_result vnc_rfb_send_version(int vnc_fd, enum Vnc_rfb_version versio
 	return VNC_RFB_RESULT_SUCCESS;
 }
 
-enum Vnc_rfb_result vnc_rfb_has_desired_security_type(int vnc_fd,
+enum Vnc_rfb_result vnc_rfb_has_desired_security_type(struct Vnc_rfb_stream *stream,
 						      enum Vnc_rfb_security_type *desired, u8 count,
 						      u8 *best_security_type_index)
 {
 	u8 security_type_count;
-	RFB_TRY_READ(vnc_fd, &security_type_count, sizeof(security_type_count));
+	RFB_TRY_READ(stream, &security_type_count, sizeof(security_type_count));
 
 	int tmp = -1;
 	for (u8 i = 0; i < security_type_count; ++i) {
 		u8 security_type;
-		RFB_TRY_READ(vnc_fd, &security_type, sizeof(security_type));
+		RFB_TRY_READ(stream, &security_type, sizeof(security_type));
 
 		for (u8 j = 0; j < count; ++j) {
 			if (security_type == desired[j] && (j < tmp || tmp == -1)) {
@@ -78,10 +273,11 @@ enum Vnc_rfb_result vnc_rfb_send_security_type(int vnc_fd, enum Vnc_rfb_security
 	return VNC_RFB_RESULT_SUCCESS;
 }
 
-enum Vnc_rfb_result vnc_rfb_recv_challenge(int vnc_fd, struct Vnc_rfb_vncauth_challenge *challenge)
+enum Vnc_rfb_result vnc_rfb_recv_challenge(struct Vnc_rfb_stream *stream,
+					   struct Vnc_rfb_vncauth_challenge *challenge)
 {
 	*challenge = (struct Vnc_rfb_vncauth_challenge){ 0 };
-	RFB_TRY_READ(vnc_fd, challenge->data, ARRAY_COUNT(challenge->data));
+	RFB_TRY_READ(stream, challenge->data, ARRAY_COUNT(challenge->data));
 	return VNC_RFB_RESULT_SUCCESS;
 }
 
@@ -101,14 +297,14 @@ enum Vnc_rfb_result vnc_rfb_send_passwd(int vnc_fd, struct Vnc_rfb_vncauth_chall
 	return VNC_RFB_RESULT_SUCCESS;
 }
 
-enum Vnc_rfb_result vnc_rfb_recv_security_result(int vnc_fd)
+enum Vnc_rfb_result vnc_rfb_recv_security_result(struct Vnc_rfb_stream *stream)
 {
 	u32 status = 0;
-	RFB_TRY_READ(vnc_fd, &status, sizeof(status));
+	RFB_TRY_READ(stream, &status, sizeof(status));
 	status = ntohl(status);
 	if (status == 1) {
 		u32 err_msg_len = 0;
-		RFB_TRY_READ(vnc_fd, &err_msg_len, sizeof(err_msg_len));
+		RFB_TRY_READ(stream, &err_msg_len, sizeof(err_msg_len));
 		err_msg_len = ntohl(err_msg_len);
 
 		char err_msg_buf[256] = { '\0' };
@@ -116,13 +312,71 @@ enum Vnc_rfb_result vnc_rfb_recv_security_result(int vnc_fd)
 			err_msg_len = ARRAY_COUNT(err_msg_buf) - 1;
 		}
 
-		RFB_TRY_READ(vnc_fd, err_msg_buf, err_msg_len);
+		RFB_TRY_READ(stream, err_msg_buf, err_msg_len);
 		vnc_log_error("security error reported: %s", err_msg_buf);
 		return VNC_RFB_RESULT_ERROR_SERVER_SECURITY;
 	}
 	return VNC_RFB_RESULT_SUCCESS;
 }
 
+enum Vnc_rfb_result vnc_rfb_negotiate_vencrypt_version(struct Vnc_rfb_stream *stream, int vnc_fd)
+{
+	u8 server_version[2];
+	RFB_TRY_READ(stream, server_version, sizeof(server_version));
+	if (server_version[0] == 0 && server_version[1] < 2) {
+		return VNC_RFB_RESULT_ERROR_NO_ACCEPTABLE_SECURITY;
+	}
+	u8 client_version[2] = { 0, 2 };
+	RFB_TRY_WRITE(vnc_fd, client_version, sizeof(client_version));
+	u8 status;
+	RFB_TRY_READ(stream, &status, sizeof(status));
+	if (status != 0) {
+		return VNC_RFB_RESULT_ERROR_SERVER_SECURITY;
+	}
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+enum Vnc_rfb_result vnc_rfb_has_desired_vencrypt_subtype(struct Vnc_rfb_stream *stream,
+							 enum Vnc_rfb_vencrypt_subtype *desired,
+							 u8 count, u8 *best_subtype_index)
+{
+	u8 subtype_count;
+	RFB_TRY_READ(stream, &subtype_count, sizeof(subtype_count));
+
+	int tmp = -1;
+	for (u8 i = 0; i < subtype_count; ++i) {
+		u32 subtype;
+		RFB_TRY_READ(stream, &subtype, sizeof(subtype));
+		subtype = ntohl(subtype);
+
+		for (u8 j = 0; j < count; ++j) {
+			if (subtype == desired[j] && (j < tmp || tmp == -1)) {
+				tmp = j;
+				break;
+			}
+		}
+	}
+
+	if (tmp == -1) {
+		return VNC_RFB_RESULT_ERROR_NO_ACCEPTABLE_SECURITY;
+	}
+	*best_subtype_index = tmp;
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+enum Vnc_rfb_result vnc_rfb_select_vencrypt_subtype(struct Vnc_rfb_stream *stream, int vnc_fd,
+						    enum Vnc_rfb_vencrypt_subtype subtype)
+{
+	u32 subtype_value = htonl(subtype);
+	RFB_TRY_WRITE(vnc_fd, &subtype_value, sizeof(subtype_value));
+	u8 accepted;
+	RFB_TRY_READ(stream, &accepted, sizeof(accepted));
+	if (accepted != 1) {
+		return VNC_RFB_RESULT_ERROR_SERVER_SECURITY;
+	}
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
 enum Vnc_rfb_result vnc_rfb_send_client_init(int vnc_fd, bool shared)
 {
 	u8 shared_value = shared ? 1 : 0;
@@ -130,10 +384,11 @@ enum Vnc_rfb_result vnc_rfb_send_client_init(int vnc_fd, bool shared)
 	return VNC_RFB_RESULT_SUCCESS;
 }
 
-enum Vnc_rfb_result vnc_rfb_recv_server_init(int vnc_fd, struct Vnc_rfb_server_init *server_init)
+enum Vnc_rfb_result vnc_rfb_recv_server_init(struct Vnc_rfb_stream *stream,
+					     struct Vnc_rfb_server_init *server_init)
 {
 	*server_init = (struct Vnc_rfb_server_init){ 0 };
-	RFB_TRY_READ(vnc_fd, server_init, offsetof(struct Vnc_rfb_server_init, name));
+	RFB_TRY_READ(stream, server_init, offsetof(struct Vnc_rfb_server_init, name));
 	server_init->width = ntohs(server_init->width);
 	server_init->height = ntohs(server_init->height);
 	server_init->pixel_format.red_max = ntohs(server_init->pixel_format.red_max);
@@ -143,12 +398,30 @@ enum Vnc_rfb_result vnc_rfb_recv_server_init(int vnc_fd, struct Vnc_rfb_server_i
 	if (server_init->name_len > ARRAY_COUNT(server_init->name)) {
 		return VNC_RFB_RESULT_ERROR_SERVER_INIT_NAME_TOO_LONG;
 	}
-	RFB_TRY_READ(vnc_fd, server_init->name, server_init->name_len);
+	RFB_TRY_READ(stream, server_init->name, server_init->name_len);
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+enum Vnc_rfb_result vnc_rfb_send_pixel_format(int vnc_fd,
+					      struct Vnc_rfb_pixel_format *pixel_format)
+{
+	struct {
+		u8 message_type;
+		u8 padding[3];
+		struct Vnc_rfb_pixel_format pixel_format;
+	} RFB_PACKED to_write = {
+		.message_type = (u8)VNC_RFB_CLIENT_MESSAGE_TYPE_SET_PIXEL_FORMAT,
+		.pixel_format = *pixel_format,
+	};
+	to_write.pixel_format.red_max = htons(pixel_format->red_max);
+	to_write.pixel_format.green_max = htons(pixel_format->green_max);
+	to_write.pixel_format.blue_max = htons(pixel_format->blue_max);
+	RFB_TRY_WRITE(vnc_fd, &to_write, sizeof(to_write));
 	return VNC_RFB_RESULT_SUCCESS;
 }
 
-enum Vnc_rfb_result vnc_rfb_send_encodings(int vnc_fd, enum Vnc_rfb_encoding *encodings,
-					   u16 encoding_count)
+enum Vnc_rfb_result vnc_rfb_send_encodings(struct Vnc_rfb_send_queue *queue,
+					   enum Vnc_rfb_encoding *encodings, u16 encoding_count)
 {
 	char buf[256];
 	struct {
@@ -167,21 +440,32 @@ enum Vnc_rfb_result vnc_rfb_send_encodings(int vnc_fd, enum Vnc_rfb_encoding *en
 		memcpy(buf + offset, &encoding, sizeof(encoding));
 		offset += sizeof(encoding);
 	}
-	RFB_TRY_WRITE(vnc_fd, buf, offset);
-	return VNC_RFB_RESULT_SUCCESS;
+	return send_queue_push(queue, buf, offset);
 }
 
-enum Vnc_rfb_result vnc_rfb_peek_message_type(int vnc_fd, u8 *message_type)
+enum Vnc_rfb_result vnc_rfb_peek_message_type(struct Vnc_rfb_stream *stream, u8 *message_type)
 {
-	RFB_TRY_PEEK(vnc_fd, message_type, sizeof(*message_type));
+	RFB_TRY(vnc_rfb_stream_ensure(stream, sizeof(*message_type)));
+	RFB_TRY_PEEK(stream, message_type, sizeof(*message_type));
 	return VNC_RFB_RESULT_SUCCESS;
 }
 
-enum Vnc_rfb_result vnc_rfb_recv_fence(int vnc_fd, struct Vnc_rfb_fence *fence)
+enum Vnc_rfb_result vnc_rfb_recv_fence(struct Vnc_rfb_stream *stream, struct Vnc_rfb_fence *fence)
 {
-	RFB_TRY_READ(vnc_fd, fence, sizeof(*fence) - sizeof(fence->payload));
+	size_t header_size = sizeof(*fence) - sizeof(fence->payload);
+	RFB_TRY(vnc_rfb_stream_ensure(stream, header_size));
+	const u8 *data;
+	vnc_rfb_stream_buffered(stream, &data);
+	u8 length = data[header_size - 1];
+	if (length > sizeof(fence->payload)) {
+		vnc_log_error("Fence payload of %u bytes is larger than %zu", length,
+			      sizeof(fence->payload));
+		return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+	}
+	RFB_TRY(vnc_rfb_stream_ensure(stream, header_size + length));
+	RFB_TRY_READ(stream, fence, header_size);
 	fence->flags = ntohl(fence->flags);
-	RFB_TRY_READ(vnc_fd, fence->payload, fence->length);
+	RFB_TRY_READ(stream, fence->payload, fence->length);
 
 	/*bool response_required = (server_fence.flags & (1u << 31)) > 0;
 		   if (response_required) {
@@ -206,48 +490,73 @@ enum Vnc_rfb_result vnc_rfb_recv_fence(int vnc_fd, struct Vnc_rfb_fence *fence)
 	return VNC_RFB_RESULT_SUCCESS;
 }
 
-enum Vnc_rfb_result vnc_rfb_send_fence(int vnc_fd, struct Vnc_rfb_fence *fence)
+enum Vnc_rfb_result vnc_rfb_send_fence(struct Vnc_rfb_send_queue *queue,
+				       struct Vnc_rfb_fence *fence)
 {
-	RFB_TRY_WRITE(vnc_fd, fence, offsetof(struct Vnc_rfb_fence, payload) + fence->length);
-	return VNC_RFB_RESULT_SUCCESS;
+	return send_queue_push(queue, fence,
+			       offsetof(struct Vnc_rfb_fence, payload) + fence->length);
 }
 
 enum Vnc_rfb_result
-vnc_rfb_send_enable_continuous_updates(int vnc_fd,
+vnc_rfb_send_enable_continuous_updates(struct Vnc_rfb_send_queue *queue,
 				       struct Vnc_rfb_enable_continuous_updates *updates)
 {
-	RFB_TRY_WRITE(vnc_fd, updates, sizeof(*updates));
-	return VNC_RFB_RESULT_SUCCESS;
+	return send_queue_push(queue, updates, sizeof(*updates));
+}
+
+enum Vnc_rfb_result
+vnc_rfb_send_framebuffer_update_request(struct Vnc_rfb_send_queue *queue,
+					struct Vnc_rfb_framebuffer_update_request *request)
+{
+	return send_queue_push(queue, request, sizeof(*request));
 }
 
 enum Vnc_rfb_result
-vnc_rfb_recv_framebuffer_update(int vnc_fd, struct Vnc_rfb_framebuffer_update_action *action)
+vnc_rfb_recv_framebuffer_update_header(struct Vnc_rfb_stream *stream,
+				       struct Vnc_rfb_framebuffer_update *update)
 {
 	struct {
 		u8 message_type;
 		u8 padding;
 		u16 number_of_rectangles;
 	} RFB_PACKED hdr;
-	RFB_TRY_READ(vnc_fd, &hdr, sizeof(hdr));
-	hdr.number_of_rectangles = ntohs(hdr.number_of_rectangles);
-
-	for (u16 i = 0; i < hdr.number_of_rectangles; ++i) {
-		struct Vnc_rfb_rect rect;
-		RFB_TRY_READ(vnc_fd, &rect, sizeof(rect));
+	RFB_TRY(vnc_rfb_stream_ensure(stream, sizeof(hdr)));
+	RFB_TRY_READ(stream, &hdr, sizeof(hdr));
+	*update = (struct Vnc_rfb_framebuffer_update){
+		.rects_left = ntohs(hdr.number_of_rectangles),
+	};
+	return VNC_RFB_RESULT_SUCCESS;
+}
 
-		rect.x = ntohs(rect.x);
-		rect.y = ntohs(rect.y);
-		rect.width = ntohs(rect.width);
-		rect.height = ntohs(rect.height);
-		rect.encoding = ntohl(rect.encoding);
+enum Vnc_rfb_result
+vnc_rfb_recv_framebuffer_update(struct Vnc_rfb_stream *stream,
+				struct Vnc_rfb_framebuffer_update *update,
+				struct Vnc_rfb_framebuffer_update_action *action)
+{
+	while (update->rects_left > 0) {
+		struct Vnc_rfb_rect *rect = &update->rect;
+		if (!update->in_rect) {
+			RFB_TRY(vnc_rfb_stream_ensure(stream, sizeof(*rect)));
+			RFB_TRY_READ(stream, rect, sizeof(*rect));
+
+			rect->x = ntohs(rect->x);
+			rect->y = ntohs(rect->y);
+			rect->width = ntohs(rect->width);
+			rect->height = ntohs(rect->height);
+			rect->encoding = ntohl(rect->encoding);
+			update->in_rect = true;
+			update->progress = (struct Vnc_rfb_rect_progress){ 0 };
+		}
 
-		enum Vnc_rfb_result result = action->handle_rect(action, &rect);
+		enum Vnc_rfb_result result = action->handle_rect(action, rect, &update->progress);
 		if (result != VNC_RFB_RESULT_SUCCESS) {
 			return result;
 		}
+		update->in_rect = false;
+		update->rects_left -= 1;
 	}
 
-	return VNC_RFB_RESULT_SUCCESS;
+	return action->end_update(action);
 }
 
 const char *vnc_rfb_result_to_str(enum Vnc_rfb_result result)
@@ -265,28 +574,36 @@ const char *vnc_rfb_result_to_str(enum Vnc_rfb_result result)
 		return "server security";
 	case VNC_RFB_RESULT_ERROR_SERVER_INIT_NAME_TOO_LONG:
 		return "ServerInit name too long";
+	case VNC_RFB_RESULT_ERROR_INVALID_DATA:
+		return "invalid data";
+	case VNC_RFB_RESULT_ERROR_OUT_OF_MEMORY:
+		return "out of memory";
+	case VNC_RFB_RESULT_ERROR_CONNECTION_CLOSED:
+		return "connection closed";
+	case VNC_RFB_RESULT_WOULD_BLOCK:
+		return "would block";
 	default:
 		return "unknown";
 	}
 }
 
-enum Vnc_rfb_result vnc_rfb_send_key_event(int vnc_id, struct Vnc_rfb_key_event *key_event)
+enum Vnc_rfb_result vnc_rfb_send_key_event(struct Vnc_rfb_send_queue *queue,
+					   struct Vnc_rfb_key_event *key_event)
 {
-	RFB_TRY_WRITE(vnc_id, key_event, sizeof(*key_event));
-	return VNC_RFB_RESULT_SUCCESS;
+	return send_queue_push(queue, key_event, sizeof(*key_event));
 }
 
-enum Vnc_rfb_result vnc_rfb_send_pointer_event(int vnc_id,
+enum Vnc_rfb_result vnc_rfb_send_pointer_event(struct Vnc_rfb_send_queue *queue,
 					       struct Vnc_rfb_pointer_event *pointer_event)
 {
-	RFB_TRY_WRITE(vnc_id, pointer_event, sizeof(*pointer_event));
-	return VNC_RFB_RESULT_SUCCESS;
+	return send_queue_push(queue, pointer_event, sizeof(*pointer_event));
 }
 
 enum Vnc_rfb_result vnc_rfb_send_set_desktop_size(int vnc_id,
 						  struct Vnc_rfb_set_desktop_size *set_desktop_size)
 {
-	assert(set_desktop_size->number_of_screens == 1);
+	assert(set_desktop_size->number_of_screens > 0 &&
+	       set_desktop_size->number_of_screens <= ARRAY_COUNT(set_desktop_size->screens));
 	RFB_TRY_WRITE(vnc_id, set_desktop_size,
 		      offsetof(struct Vnc_rfb_set_desktop_size, screens) +
 			      set_desktop_size->number_of_screens *
@@ -294,33 +611,143 @@ enum Vnc_rfb_result vnc_rfb_send_set_desktop_size(int vnc_id,
 	return VNC_RFB_RESULT_SUCCESS;
 }
 
-enum Vnc_rfb_result vnc_rfb_recv_number_of_screens(int vnc_fd, u8 *number_of_screens)
+enum Vnc_rfb_result vnc_rfb_recv_number_of_screens(struct Vnc_rfb_stream *stream,
+						   u8 *number_of_screens)
 {
 	u8 buf[4];
-	RFB_TRY_READ(vnc_fd, buf, sizeof(buf));
+	RFB_TRY_READ(stream, buf, sizeof(buf));
 	*number_of_screens = buf[0];
 	return VNC_RFB_RESULT_SUCCESS;
 }
 
-enum Vnc_rfb_result vnc_rfb_recv_screens(int vnc_fd, struct Vnc_rfb_screen *screens,
-					 u8 number_of_screens)
+enum Vnc_rfb_result vnc_rfb_recv_screens(struct Vnc_rfb_stream *stream,
+					 struct Vnc_rfb_screen *screens, u8 number_of_screens)
 {
-	RFB_TRY_READ(vnc_fd, screens, sizeof(*screens) * number_of_screens);
+	RFB_TRY_READ(stream, screens, sizeof(*screens) * number_of_screens);
 	return VNC_RFB_RESULT_SUCCESS;
 }
 
-enum Vnc_rfb_result vnc_rfb_recv_rect_raw(int vnc_fd, struct Vnc_rfb_rect *rect, u32 bpp, u32 pitch,
-					  char *dest)
+enum Vnc_rfb_result vnc_rfb_recv_rect_raw(struct Vnc_rfb_stream *stream, struct Vnc_rfb_rect *rect,
+					  struct Vnc_pixel_converter *converter,
+					  struct Vnc_framebuffer *framebuffer, size_t *done)
 {
-	for (u16 y = rect->y; y < rect->y + rect->height; ++y) {
-		RFB_TRY_READ(vnc_fd, &dest[pitch * y + rect->x * (bpp / 8)],
-			     rect->width * (bpp / 8));
+	u32 bytes_per_pixel = framebuffer->bpp / 8;
+	// A rect of whole shadow rows is one contiguous run, read into it as it arrives
+	if (converter->identity && rect->x == 0 &&
+	    rect->width * bytes_per_pixel == framebuffer->pitch) {
+		char *dest = framebuffer->buffer + framebuffer->pitch * rect->y;
+		size_t received;
+		enum Vnc_rfb_result result = vnc_rfb_stream_read_some(
+			stream, dest + *done, (size_t)framebuffer->pitch * rect->height - *done,
+			&received);
+		*done += received;
+		return result;
 	}
+	// Anything else is taken a row at a time
+	size_t row_size = (size_t)rect->width * converter->bytes_per_pixel;
+	if (row_size == 0) {
+		return VNC_RFB_RESULT_SUCCESS;
+	}
+	for (u16 y = rect->y + *done / row_size; y < rect->y + rect->height; ++y) {
+		RFB_TRY(vnc_rfb_stream_ensure(stream, row_size));
+		char *dest =
+			framebuffer->buffer + framebuffer->pitch * y + rect->x * bytes_per_pixel;
+		if (converter->identity) {
+			RFB_TRY_READ(stream, dest, row_size);
+		} else {
+			// Smaller wire pixels are expanded straight out of the read buffer
+			const u8 *wire;
+			RFB_TRY(vnc_rfb_stream_require(stream, row_size, &wire));
+			vnc_pixel_convert_row(converter, wire, (u32 *)dest, rect->width);
+		}
+		*done += row_size;
+	}
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+enum Vnc_rfb_result vnc_rfb_recv_copy_rect(struct Vnc_rfb_stream *stream,
+					   struct Vnc_rfb_copy_rect *copy_rect)
+{
+	RFB_TRY_READ(stream, copy_rect, sizeof(*copy_rect));
+	copy_rect->src_x = ntohs(copy_rect->src_x);
+	copy_rect->src_y = ntohs(copy_rect->src_y);
 	return VNC_RFB_RESULT_SUCCESS;
 }
 
-enum Vnc_rfb_result vnc_rfb_recv_cut_text(int vnc_fd, struct Vnc_rfb_cut_text *cut_text)
+enum Vnc_rfb_result vnc_rfb_recv_cut_text(struct Vnc_rfb_stream *stream,
+					  struct Vnc_rfb_cut_text *cut_text)
 {
-	RFB_TRY_READ(vnc_fd, cut_text, sizeof(*cut_text));
+	RFB_TRY(vnc_rfb_stream_ensure(stream, sizeof(*cut_text)));
+	RFB_TRY_READ(stream, cut_text, sizeof(*cut_text));
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+// Moves the unread bytes to the front of the buffer, and grows it when `size` still don't fit
+static enum Vnc_rfb_result make_room(struct Vnc_rfb_stream *stream, size_t size)
+{
+	if (stream->pos + size <= stream->capacity) {
+		return VNC_RFB_RESULT_SUCCESS;
+	}
+	memmove(stream->buffer, stream->buffer + stream->pos, stream->len - stream->pos);
+	stream->len -= stream->pos;
+	stream->pos = 0;
+	if (size <= stream->capacity) {
+		return VNC_RFB_RESULT_SUCCESS;
+	}
+	if (size > VNC_RFB_STREAM_MAX_CAPACITY) {
+		vnc_log_error("Refusing to buffer %zu bytes of a single message", size);
+		return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+	}
+	size_t capacity = MIN(MAX(size, stream->capacity * 2), VNC_RFB_STREAM_MAX_CAPACITY);
+	u8 *buffer = realloc(stream->buffer, capacity);
+	if (buffer == NULL) {
+		vnc_log_error("could not grow read buffer to %zu bytes", capacity);
+		return VNC_RFB_RESULT_ERROR_OUT_OF_MEMORY;
+	}
+	stream->buffer = buffer;
+	stream->capacity = capacity;
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+static enum Vnc_rfb_result recv_into(struct Vnc_rfb_stream *stream, void *dest, size_t size,
+				     int flags, size_t *received)
+{
+	if (stream->uring != NULL) {
+		RFB_TRY(vnc_uring_recv(stream->uring, dest, size, flags, received));
+		stream->bytes_received += *received;
+		return VNC_RFB_RESULT_SUCCESS;
+	}
+	while (true) {
+		ssize_t bytes_read = recv(stream->fd, dest, size, flags);
+		stream->recv_calls += 1;
+		if (bytes_read > 0) {
+			stream->bytes_received += bytes_read;
+			*received = bytes_read;
+			return VNC_RFB_RESULT_SUCCESS;
+		}
+		if (bytes_read == 0) {
+			return VNC_RFB_RESULT_ERROR_CONNECTION_CLOSED;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return (flags & MSG_DONTWAIT) != 0 ? VNC_RFB_RESULT_WOULD_BLOCK :
+							     VNC_RFB_RESULT_ERROR_IO_RECV_TIMEOUT;
+		}
+		return VNC_RFB_RESULT_ERROR_IO;
+	}
+}
+
+static enum Vnc_rfb_result send_queue_push(struct Vnc_rfb_send_queue *queue, const void *message,
+					   size_t size)
+{
+	assert(size <= sizeof(queue->buffer));
+	if (queue->len + size > sizeof(queue->buffer)) {
+		RFB_TRY(vnc_rfb_send_queue_flush(queue));
+	}
+	memcpy(queue->buffer + queue->len, message, size);
+	queue->len += size;
+	queue->pending_messages += 1;
 	return VNC_RFB_RESULT_SUCCESS;
 }
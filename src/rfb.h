@@ -6,30 +6,34 @@
 #include "fb.h"
 #include "types.h"
 
+struct Vnc_pixel_converter;
+struct Vnc_uring;
+
 #define RFB_VERSION_MSG_LEN 12
 #define RFB_PACKED __attribute__((__packed__))
 
-#define RFB_TRY_READ_IMPL(vnc_fd, dest, size, flags) \
+#define VNC_RFB_FENCE_FLAG_REQUEST (1u << 31)
+
+// Initial read buffer of the server connection, large enough for the widest row of 32 bpp
+// pixels. It grows when a rect that can only be decoded whole doesn't fit.
+#define VNC_RFB_STREAM_CAPACITY (256 * 1024)
+// A rect that needs more than this buffered is taken for corrupt rather than allocated for
+#define VNC_RFB_STREAM_MAX_CAPACITY (256 * 1024 * 1024)
+
+// Screens sent with SetDesktopSize, the server may report up to 255
+#define VNC_RFB_MAX_SCREENS 16
+
+#define RFB_TRY(expr) \
 	do { \
-		size_t total_bytes_read = 0; \
-		while (total_bytes_read < (size)) { \
-			ssize_t bytes_read = recv((vnc_fd), ((u8 *)(dest)) + total_bytes_read, \
-						  (size)-total_bytes_read, flags); \
-			if (bytes_read < 0) { \
-				if (errno == EINTR) { \
-					continue; \
-				} \
-				if (errno == EAGAIN || errno == EWOULDBLOCK) { \
-					return VNC_RFB_RESULT_ERROR_IO_RECV_TIMEOUT; \
-				} \
-				return VNC_RFB_RESULT_ERROR_IO; \
-			} \
-			total_bytes_read += bytes_read; \
+		enum Vnc_rfb_result rfb_try_result = (expr); \
+		if (rfb_try_result != VNC_RFB_RESULT_SUCCESS) { \
+			return rfb_try_result; \
 		} \
 	} while (0);
 
-#define RFB_TRY_READ(vnc_fd, dest, size) RFB_TRY_READ_IMPL(vnc_fd, dest, size, 0)
-#define RFB_TRY_PEEK(vnc_fd, dest, size) RFB_TRY_READ_IMPL(vnc_fd, dest, size, MSG_PEEK)
+#define RFB_TRY_READ(stream, dest, size) RFB_TRY(vnc_rfb_stream_read((stream), (dest), (size)))
+#define RFB_TRY_PEEK(stream, dest, size) RFB_TRY(vnc_rfb_stream_peek((stream), (dest), (size)))
+#define RFB_TRY_DISCARD(stream, size) RFB_TRY(vnc_rfb_stream_skip((stream), (size)))
 
 #define RFB_TRY_WRITE(vnc_fd, buf, size) \
 	do { \
@@ -45,28 +49,6 @@
 		} \
 	} while (0);
 
-#define RFB_TRY_DISCARD(vnc_fd, size) \
-	do { \
-		size_t to_discard = size; \
-		while (to_discard > 0) { \
-			char discard_buf[8192]; \
-			ssize_t bytes_read = read(vnc_fd, discard_buf, \
-						  to_discard > sizeof(discard_buf) ? \
-							  sizeof(discard_buf) : \
-							  to_discard); \
-			if (bytes_read < 0) { \
-				if (errno == EINTR) { \
-					continue; \
-				} \
-				if (errno == EAGAIN || errno == EWOULDBLOCK) { \
-					return VNC_RFB_RESULT_ERROR_IO_RECV_TIMEOUT; \
-				} \
-				return VNC_RFB_RESULT_ERROR_IO; \
-			} \
-			to_discard -= bytes_read; \
-		} \
-	} while (0);
-
 struct Vnc_fb_mngr;
 
 enum Vnc_rfb_version {
@@ -80,6 +62,13 @@ enum Vnc_rfb_security_type {
 	VNC_RFB_SECURITY_TYPE_INVALID = 0,
 	VNC_RFB_SECURITY_TYPE_NONE = 1,
 	VNC_RFB_SECURITY_TYPE_VNCAUTH = 2,
+	VNC_RFB_SECURITY_TYPE_VENCRYPT = 19,
+};
+
+// VeNCrypt subtypes that verify the server's X.509 certificate, before authenticating inside TLS
+enum Vnc_rfb_vencrypt_subtype {
+	VNC_RFB_VENCRYPT_SUBTYPE_X509_NONE = 260,
+	VNC_RFB_VENCRYPT_SUBTYPE_X509_VNC = 261,
 };
 
 enum Vnc_rfb_encoding {
@@ -87,10 +76,13 @@ enum Vnc_rfb_encoding {
 	VNC_RFB_ENCODING_COPY_RECT = 1,
 	VNC_RFB_ENCODING_RRE = 2,
 	VNC_RFB_ENCODING_HEXTILE = 5,
+	VNC_RFB_ENCODING_TIGHT = 7,
 	VNC_RFB_ENCODING_TRLE = 15,
 	VNC_RFB_ENCODING_ZRLE = 16,
+	VNC_RFB_ENCODING_QUALITY_LEVEL_0_PSEUDO = -32,
 	VNC_RFB_ENCODING_DESKTOP_SIZE_PSEUDO = -223,
 	VNC_RFB_ENCODING_CURSOR_PSEUDO = -239,
+	VNC_RFB_ENCODING_COMPRESS_LEVEL_0_PSEUDO = -256,
 	VNC_RFB_ENCODING_EXTENDED_DESKTOP_SIZE_PSEUDO = -308,
 	VNC_RFB_ENCODING_FENCE_PSEUDO = -312,
 	VNC_RFB_ENCODING_CONTINUOUS_UPDATES_PSEUDO = -313,
@@ -105,6 +97,7 @@ enum Vnc_rfb_server_message_type {
 };
 
 enum Vnc_rfb_client_message_type {
+	VNC_RFB_CLIENT_MESSAGE_TYPE_SET_PIXEL_FORMAT = 0,
 	VNC_RFB_CLIENT_MESSAGE_TYPE_SET_ENCODING = 2,
 	VNC_RFB_CLIENT_MESSAGE_TYPE_FRAMEBUFFER_UPDATE_REQUEST = 3,
 	VNC_RFB_CLIENT_MESSAGE_TYPE_KEY_EVENT = 4,
@@ -121,6 +114,37 @@ enum Vnc_rfb_result {
 	VNC_RFB_RESULT_ERROR_NO_ACCEPTABLE_SECURITY = -4,
 	VNC_RFB_RESULT_ERROR_SERVER_SECURITY = -5,
 	VNC_RFB_RESULT_ERROR_SERVER_INIT_NAME_TOO_LONG = -6,
+	VNC_RFB_RESULT_ERROR_INVALID_DATA = -7,
+	VNC_RFB_RESULT_ERROR_OUT_OF_MEMORY = -8,
+	VNC_RFB_RESULT_ERROR_CONNECTION_CLOSED = -9,
+	// Not an error, the message goes on in bytes that haven't been received yet
+	VNC_RFB_RESULT_WOULD_BLOCK = 1,
+};
+
+// Buffered reader of the server connection. Every recv asks for as much as fits in the buffer,
+// so message headers and small fields are parsed out of memory instead of costing a syscall.
+struct Vnc_rfb_stream {
+	int fd;
+	u8 *buffer;
+	size_t capacity;
+	size_t pos;
+	size_t len;
+	u64 bytes_received;
+	u64 recv_calls;
+	struct Vnc_uring *uring; // Receives through io_uring instead of recv() when set
+};
+
+// Small client messages collected while handling one batch of input, so they leave the client
+// in a single write instead of a TCP segment each
+struct Vnc_rfb_send_queue {
+	int fd;
+	u8 buffer[4096];
+	size_t len;
+	u32 pending_messages;
+	u64 flushes;
+	u64 messages_sent;
+	u32 max_messages_per_flush;
+	struct Vnc_uring *uring; // Writes through io_uring, from `buffer` registered with it
 };
 
 struct Vnc_rfb_vncauth_challenge {
@@ -155,6 +179,11 @@ struct Vnc_rfb_rect {
 	i32 encoding;
 } RFB_PACKED;
 
+struct Vnc_rfb_copy_rect {
+	u16 src_x;
+	u16 src_y;
+} RFB_PACKED;
+
 struct Vnc_rfb_fence {
 	u8 message_type;
 	u8 padding[3];
@@ -163,6 +192,15 @@ struct Vnc_rfb_fence {
 	u8 payload[64];
 } RFB_PACKED;
 
+struct Vnc_rfb_framebuffer_update_request {
+	u8 message_type;
+	u8 incremental;
+	u16 x;
+	u16 y;
+	u16 width;
+	u16 height;
+} RFB_PACKED;
+
 struct Vnc_rfb_enable_continuous_updates {
 	u8 message_type;
 	u8 enable;
@@ -202,7 +240,7 @@ struct Vnc_rfb_set_desktop_size {
 	u16 height;
 	u8 number_of_screens;
 	u8 padding2;
-	struct Vnc_rfb_screen screens[1];
+	struct Vnc_rfb_screen screens[VNC_RFB_MAX_SCREENS];
 } RFB_PACKED;
 
 struct Vnc_rfb_cut_text {
@@ -211,51 +249,138 @@ struct Vnc_rfb_cut_text {
 	u32 length;
 } RFB_PACKED;
 
+// How far a rect got, kept between attempts while its bytes come in
+struct Vnc_rfb_rect_progress {
+	size_t size; // Bytes of the rect handled, or looked at to work out its size
+	u32 tile; // Next tile to look at, for encodings that are sized a tile at a time
+	u8 palette_size; // TRLE palette that carries over into that tile
+};
+
+// A FramebufferUpdate taken off the stream over as many calls as it takes to arrive
+struct Vnc_rfb_framebuffer_update {
+	u16 rects_left;
+	bool in_rect; // The header of `rect` has been read, its data not all handled yet
+	struct Vnc_rfb_rect rect;
+	struct Vnc_rfb_rect_progress progress;
+};
+
 struct Vnc_rfb_framebuffer_update_action {
+	// Returns VNC_RFB_RESULT_WOULD_BLOCK when the rect needs more bytes than are buffered, it
+	// is called again with the same `progress` once more arrived
 	enum Vnc_rfb_result (*handle_rect)(struct Vnc_rfb_framebuffer_update_action *action,
-					   struct Vnc_rfb_rect *rect);
+					   struct Vnc_rfb_rect *rect,
+					   struct Vnc_rfb_rect_progress *progress);
+	// Called once all rects of a FramebufferUpdate have been handled
+	enum Vnc_rfb_result (*end_update)(struct Vnc_rfb_framebuffer_update_action *action);
 };
 
-enum Vnc_rfb_result vnc_rfb_recv_version(int vnc_fd, enum Vnc_rfb_version *version);
+bool vnc_rfb_stream_init(struct Vnc_rfb_stream *stream, int fd);
+void vnc_rfb_stream_deinit(struct Vnc_rfb_stream *stream);
+// Makes at least `size` bytes available in the buffer, waiting for them
+enum Vnc_rfb_result vnc_rfb_stream_fill(struct Vnc_rfb_stream *stream, size_t size);
+// Takes whatever the server has sent without waiting, VNC_RFB_RESULT_WOULD_BLOCK if nothing
+enum Vnc_rfb_result vnc_rfb_stream_receive(struct Vnc_rfb_stream *stream);
+// Returns VNC_RFB_RESULT_WOULD_BLOCK until `size` bytes are buffered, making room for them
+enum Vnc_rfb_result vnc_rfb_stream_ensure(struct Vnc_rfb_stream *stream, size_t size);
+// Waits up to `timeout_ms` for the server to send something, VNC_RFB_RESULT_ERROR_IO_RECV_TIMEOUT
+// when it didn't
+enum Vnc_rfb_result vnc_rfb_stream_wait(struct Vnc_rfb_stream *stream, int timeout_ms);
+// Points `data` at the bytes received but not read yet and returns their count
+size_t vnc_rfb_stream_buffered(struct Vnc_rfb_stream *stream, const u8 **data);
+enum Vnc_rfb_result vnc_rfb_stream_read(struct Vnc_rfb_stream *stream, void *dest, size_t size);
+// Receives into `dest` without passing through the buffer, for bytes that are stored as sent
+enum Vnc_rfb_result vnc_rfb_stream_read_direct(struct Vnc_rfb_stream *stream, void *dest,
+					       size_t size);
+// Reads what is buffered and then whatever the socket has straight into `dest`, without waiting.
+// Returns VNC_RFB_RESULT_WOULD_BLOCK when that is less than `size`.
+enum Vnc_rfb_result vnc_rfb_stream_read_some(struct Vnc_rfb_stream *stream, void *dest,
+					     size_t size, size_t *received);
+enum Vnc_rfb_result vnc_rfb_stream_peek(struct Vnc_rfb_stream *stream, void *dest, size_t size);
+enum Vnc_rfb_result vnc_rfb_stream_skip(struct Vnc_rfb_stream *stream, size_t size);
+// Consumes `size` bytes and points `data` at them in the buffer, valid until the next call
+enum Vnc_rfb_result vnc_rfb_stream_require(struct Vnc_rfb_stream *stream, size_t size,
+					   const u8 **data);
+
+void vnc_rfb_send_queue_init(struct Vnc_rfb_send_queue *queue, int fd);
+// Writes out everything queued so far, in the order it was queued
+enum Vnc_rfb_result vnc_rfb_send_queue_flush(struct Vnc_rfb_send_queue *queue);
+// Drops everything queued so far, for when there is no connection to write it to
+void vnc_rfb_send_queue_clear(struct Vnc_rfb_send_queue *queue);
+
+enum Vnc_rfb_result vnc_rfb_recv_version(struct Vnc_rfb_stream *stream,
+					 enum Vnc_rfb_version *version);
 enum Vnc_rfb_result vnc_rfb_send_version(int vnc_fd, enum Vnc_rfb_version version);
 
-enum Vnc_rfb_result vnc_rfb_has_desired_security_type(int vnc_fd,
+enum Vnc_rfb_result vnc_rfb_has_desired_security_type(struct Vnc_rfb_stream *stream,
 						      enum Vnc_rfb_security_type *desired, u8 count,
 						      u8 *best_security_type_index);
 enum Vnc_rfb_result vnc_rfb_send_security_type(int vnc_fd, enum Vnc_rfb_security_type type);
-enum Vnc_rfb_result vnc_rfb_recv_challenge(int vnc_fd, struct Vnc_rfb_vncauth_challenge *challenge);
+enum Vnc_rfb_result vnc_rfb_recv_challenge(struct Vnc_rfb_stream *stream,
+					   struct Vnc_rfb_vncauth_challenge *challenge);
 enum Vnc_rfb_result vnc_rfb_send_passwd(int vnc_fd, struct Vnc_rfb_vncauth_challenge *challenge,
 					const char *passwd);
-enum Vnc_rfb_result vnc_rfb_recv_security_result(int vnc_id);
+enum Vnc_rfb_result vnc_rfb_recv_security_result(struct Vnc_rfb_stream *stream);
+// Agrees on VeNCrypt version 0.2 with the server
+enum Vnc_rfb_result vnc_rfb_negotiate_vencrypt_version(struct Vnc_rfb_stream *stream, int vnc_fd);
+enum Vnc_rfb_result vnc_rfb_has_desired_vencrypt_subtype(struct Vnc_rfb_stream *stream,
+							 enum Vnc_rfb_vencrypt_subtype *desired,
+							 u8 count, u8 *best_subtype_index);
+// Sends the chosen subtype, the TLS handshake starts once the server accepted it
+enum Vnc_rfb_result vnc_rfb_select_vencrypt_subtype(struct Vnc_rfb_stream *stream, int vnc_fd,
+						    enum Vnc_rfb_vencrypt_subtype subtype);
 
 enum Vnc_rfb_result vnc_rfb_send_client_init(int vnc_fd, bool shared);
-enum Vnc_rfb_result vnc_rfb_recv_server_init(int vnc_fd, struct Vnc_rfb_server_init *server_init);
-enum Vnc_rfb_result vnc_rfb_send_encodings(int vnc_fd, enum Vnc_rfb_encoding *encodings,
-					   u16 encoding_count);
-
-enum Vnc_rfb_result vnc_rfb_peek_message_type(int vnc_fd, u8 *message_type);
-
-enum Vnc_rfb_result vnc_rfb_recv_fence(int vnc_fd, struct Vnc_rfb_fence *fence);
-enum Vnc_rfb_result vnc_rfb_send_fence(int vnc_fd, struct Vnc_rfb_fence *fence);
+enum Vnc_rfb_result vnc_rfb_recv_server_init(struct Vnc_rfb_stream *stream,
+					     struct Vnc_rfb_server_init *server_init);
+enum Vnc_rfb_result vnc_rfb_send_pixel_format(int vnc_fd,
+					      struct Vnc_rfb_pixel_format *pixel_format);
+// Queued like input, they go out with the next vnc_rfb_send_queue_flush
+enum Vnc_rfb_result vnc_rfb_send_encodings(struct Vnc_rfb_send_queue *queue,
+					   enum Vnc_rfb_encoding *encodings, u16 encoding_count);
+
+// Server messages are only taken off the stream once all of their bytes are buffered, until
+// then these return VNC_RFB_RESULT_WOULD_BLOCK
+enum Vnc_rfb_result vnc_rfb_peek_message_type(struct Vnc_rfb_stream *stream, u8 *message_type);
+
+enum Vnc_rfb_result vnc_rfb_recv_fence(struct Vnc_rfb_stream *stream, struct Vnc_rfb_fence *fence);
+enum Vnc_rfb_result vnc_rfb_send_fence(struct Vnc_rfb_send_queue *queue,
+				       struct Vnc_rfb_fence *fence);
 enum Vnc_rfb_result
-vnc_rfb_send_enable_continuous_updates(int vnc_fd,
+vnc_rfb_send_enable_continuous_updates(struct Vnc_rfb_send_queue *queue,
 				       struct Vnc_rfb_enable_continuous_updates *updates);
-
 enum Vnc_rfb_result
-vnc_rfb_recv_framebuffer_update(int vnc_fd, struct Vnc_rfb_framebuffer_update_action *action);
-enum Vnc_rfb_result vnc_rfb_recv_rect_raw(int vnc_fd, struct Vnc_rfb_rect *rect, u32 bpp, u32 pitch,
-					  char *dest);
+vnc_rfb_send_framebuffer_update_request(struct Vnc_rfb_send_queue *queue,
+					struct Vnc_rfb_framebuffer_update_request *request);
 
-enum Vnc_rfb_result vnc_rfb_send_pointer_event(int vnc_id,
+enum Vnc_rfb_result
+vnc_rfb_recv_framebuffer_update_header(struct Vnc_rfb_stream *stream,
+				       struct Vnc_rfb_framebuffer_update *update);
+// Handles the rects that have arrived, returns VNC_RFB_RESULT_SUCCESS after the last one
+enum Vnc_rfb_result
+vnc_rfb_recv_framebuffer_update(struct Vnc_rfb_stream *stream,
+				struct Vnc_rfb_framebuffer_update *update,
+				struct Vnc_rfb_framebuffer_update_action *action);
+// Takes the part of the rect that has arrived, `*done` counts its bytes handled so far
+enum Vnc_rfb_result vnc_rfb_recv_rect_raw(struct Vnc_rfb_stream *stream, struct Vnc_rfb_rect *rect,
+					  struct Vnc_pixel_converter *converter,
+					  struct Vnc_framebuffer *framebuffer, size_t *done);
+enum Vnc_rfb_result vnc_rfb_recv_copy_rect(struct Vnc_rfb_stream *stream,
+					   struct Vnc_rfb_copy_rect *copy_rect);
+
+// Queued, they go out with the next vnc_rfb_send_queue_flush
+enum Vnc_rfb_result vnc_rfb_send_pointer_event(struct Vnc_rfb_send_queue *queue,
 					       struct Vnc_rfb_pointer_event *pointer_event);
-enum Vnc_rfb_result vnc_rfb_send_key_event(int vnc_id, struct Vnc_rfb_key_event *key_event);
+enum Vnc_rfb_result vnc_rfb_send_key_event(struct Vnc_rfb_send_queue *queue,
+					   struct Vnc_rfb_key_event *key_event);
 
 enum Vnc_rfb_result
 vnc_rfb_send_set_desktop_size(int vnc_id, struct Vnc_rfb_set_desktop_size *set_desktop_size);
-enum Vnc_rfb_result vnc_rfb_recv_number_of_screens(int vnc_fd, u8 *number_of_screens);
-enum Vnc_rfb_result vnc_rfb_recv_screens(int vnc_fd, struct Vnc_rfb_screen *screen,
-					 u8 screen_count);
+enum Vnc_rfb_result vnc_rfb_recv_number_of_screens(struct Vnc_rfb_stream *stream,
+						   u8 *number_of_screens);
+enum Vnc_rfb_result vnc_rfb_recv_screens(struct Vnc_rfb_stream *stream,
+					 struct Vnc_rfb_screen *screen, u8 screen_count);
 
-enum Vnc_rfb_result vnc_rfb_recv_cut_text(int vnc_fd, struct Vnc_rfb_cut_text *cut_text);
+enum Vnc_rfb_result vnc_rfb_recv_cut_text(struct Vnc_rfb_stream *stream,
+					  struct Vnc_rfb_cut_text *cut_text);
 
 const char *vnc_rfb_result_to_str(enum Vnc_rfb_result result);
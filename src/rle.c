@@ -0,0 +1,414 @@
+#include "rle.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include "log.h"
+#include "macros.h"
+
+enum {
+	SUBENCODING_RAW = 0,
+	SUBENCODING_SOLID = 1,
+	SUBENCODING_PACKED_PALETTE_MAX = 16,
+	SUBENCODING_PACKED_PALETTE_REUSE = 127,
+	SUBENCODING_PLAIN_RLE = 128,
+	SUBENCODING_PALETTE_RLE_REUSE = 129,
+	SUBENCODING_PALETTE_RLE_MIN = 130,
+};
+
+enum { MAX_RUN_LENGTH = VNC_RLE_MAX_TILE_SIZE * VNC_RLE_MAX_TILE_SIZE };
+
+struct Tile {
+	u32 *dest; // Top left pixel of the tile inside the framebuffer
+	u32 stride; // Framebuffer line length in pixels
+	u16 width;
+	u16 height;
+};
+
+static enum Vnc_rfb_result measure_tile(struct Vnc_rle_decoder *decoder, const u8 *data,
+					size_t len, u8 pixel_size, u16 width, u16 height,
+					u8 *palette_size, size_t *size);
+static enum Vnc_rfb_result measure_runs(const u8 *data, size_t len, u32 pixel_count,
+					u8 pixel_size, u8 palette_size, size_t *pos);
+static bool decode_tile(struct Vnc_rle_decoder *decoder, struct Tile *tile);
+static bool decode_packed_palette(struct Vnc_rle_decoder *decoder, struct Tile *tile);
+static bool decode_palette_rle(struct Vnc_rle_decoder *decoder, struct Tile *tile);
+static bool read_palette(struct Vnc_rle_decoder *decoder, u8 palette_size);
+static bool read_run_length(struct Vnc_rle_decoder *decoder, u32 *run_length);
+static bool fill_run(struct Tile *tile, u32 *pos, u32 run_length, u32 color);
+static struct Vnc_rle_cpixel_format get_cpixel_format(struct Vnc_rfb_pixel_format *pixel_format);
+static u32 read_cpixel(const u8 *src, struct Vnc_rle_cpixel_format *cpixel);
+
+void vnc_rle_decoder_init(struct Vnc_rle_decoder *decoder, struct Vnc_rle_source *source,
+			  u16 tile_size, bool palette_reuse)
+{
+	*decoder = (struct Vnc_rle_decoder){
+		.source = source,
+		.tile_size = MIN(tile_size, VNC_RLE_MAX_TILE_SIZE),
+		.palette_reuse = palette_reuse,
+	};
+}
+
+bool vnc_rle_decode_rect(struct Vnc_rle_decoder *decoder, struct Vnc_rfb_rect *rect,
+			 struct Vnc_pixel_converter *converter,
+			 struct Vnc_framebuffer *framebuffer)
+{
+	u16 tile_size = decoder->tile_size;
+	decoder->converter = converter;
+	decoder->cpixel = get_cpixel_format(&converter->format);
+	u32 stride = framebuffer->pitch / sizeof(u32);
+	u32 *dest = (u32 *)framebuffer->buffer + rect->y * stride + rect->x;
+	for (u16 ty = 0; ty < rect->height; ty += tile_size) {
+		for (u16 tx = 0; tx < rect->width; tx += tile_size) {
+			struct Tile tile = {
+				.dest = dest + ty * stride + tx,
+				.stride = stride,
+				.width = MIN(tile_size, rect->width - tx),
+				.height = MIN(tile_size, rect->height - ty),
+			};
+			if (!decode_tile(decoder, &tile)) {
+				vnc_log_error("RLE: invalid tile at %u,%u", rect->x + tx,
+					      rect->y + ty);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+enum Vnc_rfb_result vnc_rle_measure_rect(struct Vnc_rle_decoder *decoder, const u8 *data,
+					 size_t len, struct Vnc_rfb_rect *rect,
+					 struct Vnc_pixel_converter *converter,
+					 struct Vnc_rfb_rect_progress *progress, size_t *needed)
+{
+	u16 tile_size = decoder->tile_size;
+	u32 tiles_per_row = (rect->width + tile_size - 1) / tile_size;
+	u32 tile_rows = (rect->height + tile_size - 1) / tile_size;
+	u8 pixel_size = get_cpixel_format(&converter->format).size;
+	if (progress->tile == 0 && progress->size == 0) {
+		progress->palette_size = decoder->palette_size;
+	}
+	for (; progress->tile < tiles_per_row * tile_rows; ++progress->tile) {
+		u16 tx = progress->tile % tiles_per_row * tile_size;
+		u16 ty = progress->tile / tiles_per_row * tile_size;
+		// Tiles are only passed once complete, so the palette they leave is the final one
+		u8 palette_size = progress->palette_size;
+		size_t size;
+		enum Vnc_rfb_result result =
+			measure_tile(decoder, data + progress->size, len - progress->size,
+				     pixel_size, MIN(tile_size, rect->width - tx),
+				     MIN(tile_size, rect->height - ty), &palette_size, &size);
+		if (result == VNC_RFB_RESULT_WOULD_BLOCK) {
+			*needed = progress->size + size;
+		}
+		if (result != VNC_RFB_RESULT_SUCCESS) {
+			return result;
+		}
+		progress->size += size;
+		progress->palette_size = palette_size;
+	}
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+// Sizes a tile the way decode_tile reads it. Returns VNC_RFB_RESULT_WOULD_BLOCK with the bytes
+// needed to get further in `size`.
+static enum Vnc_rfb_result measure_tile(struct Vnc_rle_decoder *decoder, const u8 *data,
+					size_t len, u8 pixel_size, u16 width, u16 height,
+					u8 *palette_size, size_t *size)
+{
+	u32 pixel_count = (u32)width * height;
+	*size = 1;
+	if (len < *size) {
+		return VNC_RFB_RESULT_WOULD_BLOCK;
+	}
+	u8 subencoding = data[0];
+	bool reuse = decoder->palette_reuse && *palette_size > 0;
+	if (subencoding == SUBENCODING_RAW) {
+		*size += pixel_count * pixel_size;
+	} else if (subencoding == SUBENCODING_SOLID) {
+		*size += pixel_size;
+		*palette_size = 1;
+	} else if (subencoding <= SUBENCODING_PACKED_PALETTE_MAX ||
+		   (subencoding == SUBENCODING_PACKED_PALETTE_REUSE && reuse)) {
+		if (subencoding <= SUBENCODING_PACKED_PALETTE_MAX) {
+			*palette_size = subencoding;
+			*size += subencoding * pixel_size;
+		}
+		u8 bits = *palette_size <= 2 ? 1 : *palette_size <= 4 ? 2 : 4;
+		*size += (width * bits + 7) / 8 * height;
+	} else if (subencoding == SUBENCODING_PLAIN_RLE) {
+		return measure_runs(data, len, pixel_count, pixel_size, 0, size);
+	} else if (subencoding >= SUBENCODING_PALETTE_RLE_MIN ||
+		   (subencoding == SUBENCODING_PALETTE_RLE_REUSE && reuse)) {
+		if (subencoding >= SUBENCODING_PALETTE_RLE_MIN) {
+			*palette_size = subencoding - SUBENCODING_PLAIN_RLE;
+			*size += *palette_size * pixel_size;
+		}
+		return measure_runs(data, len, pixel_count, 0, *palette_size, size);
+	} else {
+		vnc_log_error("RLE: invalid subencoding %u", subencoding);
+		return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+	}
+	return len < *size ? VNC_RFB_RESULT_WOULD_BLOCK : VNC_RFB_RESULT_SUCCESS;
+}
+
+// Walks the runs of a tile from `*pos`, each a colour of `pixel_size` bytes or, without one, a
+// palette index. Mirrors the checks of decode_tile so invalid runs are caught either way.
+static enum Vnc_rfb_result measure_runs(const u8 *data, size_t len, u32 pixel_count,
+					u8 pixel_size, u8 palette_size, size_t *pos)
+{
+	u32 pixels = 0;
+	while (pixels < pixel_count) {
+		u32 run_length = 1;
+		bool has_run_length = true;
+		if (pixel_size > 0) {
+			*pos += pixel_size;
+		} else {
+			if (len < *pos + 1) {
+				*pos += 1;
+				return VNC_RFB_RESULT_WOULD_BLOCK;
+			}
+			u8 index = data[*pos] & 0x7f;
+			has_run_length = (data[*pos] & 0x80) > 0;
+			*pos += 1;
+			if (index >= palette_size) {
+				return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+			}
+		}
+		while (has_run_length) {
+			if (len < *pos + 1) {
+				*pos += 1;
+				return VNC_RFB_RESULT_WOULD_BLOCK;
+			}
+			if (run_length > MAX_RUN_LENGTH) {
+				return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+			}
+			run_length += data[*pos];
+			has_run_length = data[*pos] == 255;
+			*pos += 1;
+		}
+		if (run_length > pixel_count - pixels) {
+			return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+		}
+		pixels += run_length;
+	}
+	return len < *pos ? VNC_RFB_RESULT_WOULD_BLOCK : VNC_RFB_RESULT_SUCCESS;
+}
+
+static bool decode_tile(struct Vnc_rle_decoder *decoder, struct Tile *tile)
+{
+	struct Vnc_rle_cpixel_format *cpixel = &decoder->cpixel;
+	const u8 *data = decoder->source->require(decoder->source, 1);
+	if (data == NULL) {
+		return false;
+	}
+	u8 subencoding = data[0];
+
+	if (subencoding == SUBENCODING_RAW) {
+		data = decoder->source->require(decoder->source,
+						tile->width * tile->height * cpixel->size);
+		if (data == NULL) {
+			return false;
+		}
+		for (u16 y = 0; y < tile->height; ++y) {
+			u32 *row = tile->dest + y * tile->stride;
+			if (cpixel->size == decoder->converter->bytes_per_pixel) {
+				vnc_pixel_convert_row(decoder->converter, data, row, tile->width);
+				data += tile->width * cpixel->size;
+				continue;
+			}
+			for (u16 x = 0; x < tile->width; ++x) {
+				row[x] = read_cpixel(data, cpixel);
+				data += cpixel->size;
+			}
+			vnc_pixel_convert_values(decoder->converter, row, tile->width);
+		}
+		return true;
+	}
+	if (subencoding == SUBENCODING_SOLID) {
+		if (!read_palette(decoder, 1)) {
+			return false;
+		}
+		u32 pos = 0;
+		return fill_run(tile, &pos, tile->width * tile->height, decoder->palette[0]);
+	}
+	if (subencoding <= SUBENCODING_PACKED_PALETTE_MAX) {
+		return read_palette(decoder, subencoding) && decode_packed_palette(decoder, tile);
+	}
+	if (subencoding == SUBENCODING_PLAIN_RLE) {
+		u32 pos = 0;
+		while (pos < (u32)tile->width * tile->height) {
+			data = decoder->source->require(decoder->source, cpixel->size);
+			if (data == NULL) {
+				return false;
+			}
+			u32 color = read_cpixel(data, cpixel);
+			color = vnc_pixel_convert(decoder->converter, color);
+			u32 run_length;
+			if (!read_run_length(decoder, &run_length) ||
+			    !fill_run(tile, &pos, run_length, color)) {
+				return false;
+			}
+		}
+		return true;
+	}
+	if (subencoding >= SUBENCODING_PALETTE_RLE_MIN) {
+		return read_palette(decoder, subencoding - SUBENCODING_PLAIN_RLE) &&
+		       decode_palette_rle(decoder, tile);
+	}
+	if (decoder->palette_reuse && decoder->palette_size > 0) {
+		if (subencoding == SUBENCODING_PACKED_PALETTE_REUSE) {
+			return decode_packed_palette(decoder, tile);
+		}
+		if (subencoding == SUBENCODING_PALETTE_RLE_REUSE) {
+			return decode_palette_rle(decoder, tile);
+		}
+	}
+	vnc_log_error("RLE: invalid subencoding %u", subencoding);
+	return false;
+}
+
+static bool decode_packed_palette(struct Vnc_rle_decoder *decoder, struct Tile *tile)
+{
+	u8 palette_size = decoder->palette_size;
+	u8 bits = palette_size <= 2 ? 1 : palette_size <= 4 ? 2 : 4;
+	u8 mask = (1 << bits) - 1;
+	u32 row_bytes = (tile->width * bits + 7) / 8;
+	const u8 *data = decoder->source->require(decoder->source, row_bytes * tile->height);
+	if (data == NULL) {
+		return false;
+	}
+	// Indices past a palette of fewer than 2^bits entries read as 0 rather than garbage
+	u32 palette[16] = { 0 };
+	memcpy(palette, decoder->palette, MIN(palette_size, ARRAY_COUNT(palette)) * sizeof(u32));
+	for (u16 y = 0; y < tile->height; ++y) {
+		u32 *row = tile->dest + y * tile->stride;
+		const u8 *packed = data + y * row_bytes;
+		for (u16 x = 0; x < tile->width; ++x) {
+			u32 bit = x * bits;
+			u8 shift = 8 - bits - (bit % 8);
+			row[x] = palette[(packed[bit / 8] >> shift) & mask];
+		}
+	}
+	return true;
+}
+
+static bool decode_palette_rle(struct Vnc_rle_decoder *decoder, struct Tile *tile)
+{
+	u32 pos = 0;
+	while (pos < (u32)tile->width * tile->height) {
+		const u8 *data = decoder->source->require(decoder->source, 1);
+		if (data == NULL) {
+			return false;
+		}
+		u8 index = data[0] & 0x7f;
+		bool has_run_length = (data[0] & 0x80) > 0;
+		if (index >= decoder->palette_size) {
+			return false;
+		}
+		u32 run_length = 1;
+		if (has_run_length && !read_run_length(decoder, &run_length)) {
+			return false;
+		}
+		if (!fill_run(tile, &pos, run_length, decoder->palette[index])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool read_palette(struct Vnc_rle_decoder *decoder, u8 palette_size)
+{
+	struct Vnc_rle_cpixel_format *cpixel = &decoder->cpixel;
+	const u8 *data = decoder->source->require(decoder->source, palette_size * cpixel->size);
+	if (data == NULL) {
+		return false;
+	}
+	for (u8 i = 0; i < palette_size; ++i) {
+		u32 color = read_cpixel(data, cpixel);
+		decoder->palette[i] = vnc_pixel_convert(decoder->converter, color);
+		data += cpixel->size;
+	}
+	decoder->palette_size = palette_size;
+	return true;
+}
+
+static bool read_run_length(struct Vnc_rle_decoder *decoder, u32 *run_length)
+{
+	u32 length = 1;
+	const u8 *data;
+	do {
+		data = decoder->source->require(decoder->source, 1);
+		if (data == NULL || length > MAX_RUN_LENGTH) {
+			return false;
+		}
+		length += data[0];
+	} while (data[0] == 255);
+	*run_length = length;
+	return true;
+}
+
+static bool fill_run(struct Tile *tile, u32 *pos, u32 run_length, u32 color)
+{
+	if (run_length > (u32)tile->width * tile->height - *pos) {
+		return false;
+	}
+
+	u32 x = *pos % tile->width;
+	u32 y = *pos / tile->width;
+	*pos += run_length;
+	while (run_length > 0) {
+		u32 count = MIN(tile->width - x, run_length);
+		u32 *dest = tile->dest + y * tile->stride + x;
+		for (u32 i = 0; i < count; ++i) {
+			dest[i] = color;
+		}
+		run_length -= count;
+		x = 0;
+		y += 1;
+	}
+	return true;
+}
+
+// A CPIXEL drops the unused byte of a 32 bpp pixel when the colour fits in the other three
+static struct Vnc_rle_cpixel_format get_cpixel_format(struct Vnc_rfb_pixel_format *pixel_format)
+{
+	struct Vnc_rle_cpixel_format cpixel = {
+		.size = pixel_format->bpp / 8,
+		.big_endian = pixel_format->big_endian,
+	};
+	if (pixel_format->bpp != 32 || pixel_format->depth > 24 || !pixel_format->true_color) {
+		return cpixel;
+	}
+
+	u32 used_bits = (u32)pixel_format->red_max << pixel_format->red_shift |
+			(u32)pixel_format->green_max << pixel_format->green_shift |
+			(u32)pixel_format->blue_max << pixel_format->blue_shift;
+	if ((used_bits & 0xff000000) == 0) {
+		cpixel.size = 3;
+	} else if ((used_bits & 0x000000ff) == 0) {
+		cpixel.size = 3;
+		cpixel.shift = 8;
+	}
+	return cpixel;
+}
+
+static u32 read_cpixel(const u8 *src, struct Vnc_rle_cpixel_format *cpixel)
+{
+	if (cpixel->size == 3) {
+		u32 pixel = cpixel->big_endian ? (u32)src[0] << 16 | (u32)src[1] << 8 | src[2] :
+						 (u32)src[2] << 16 | (u32)src[1] << 8 | src[0];
+		return pixel << cpixel->shift;
+	}
+	if (cpixel->size == 4) {
+		u32 pixel;
+		memcpy(&pixel, src, sizeof(pixel));
+		return cpixel->big_endian ? ntohl(pixel) : pixel;
+	}
+	if (cpixel->size == 2) {
+		u16 pixel;
+		memcpy(&pixel, src, sizeof(pixel));
+		return cpixel->big_endian ? ntohs(pixel) : pixel;
+	}
+	return src[0];
+}
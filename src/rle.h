@@ -0,0 +1,44 @@
+#pragma once
+
+#include "fb.h"
+#include "pixel.h"
+#include "rfb.h"
+#include "types.h"
+
+// Largest tile of any RLE based encoding, ZRLE uses 64x64 and TRLE 16x16
+#define VNC_RLE_MAX_TILE_SIZE 64
+
+// Supplies the tile data, ZRLE inflates it and TRLE reads it straight off the socket
+struct Vnc_rle_source {
+	// Returns a pointer to the next `size` bytes or NULL when they can't be produced
+	const u8 *(*require)(struct Vnc_rle_source *source, size_t size);
+};
+
+struct Vnc_rle_cpixel_format {
+	u8 size;
+	u8 shift; // Set when the colour lives in the most significant three bytes
+	bool big_endian;
+};
+
+struct Vnc_rle_decoder {
+	struct Vnc_rle_source *source;
+	u16 tile_size;
+	bool palette_reuse; // TRLE subencodings 127 and 129
+	struct Vnc_rle_cpixel_format cpixel;
+	struct Vnc_pixel_converter *converter;
+	u32 palette[128];
+	u8 palette_size;
+};
+
+void vnc_rle_decoder_init(struct Vnc_rle_decoder *decoder, struct Vnc_rle_source *source,
+			  u16 tile_size, bool palette_reuse);
+// Works out from the `len` bytes at `data` where the tiles of a rect end, for TRLE which has no
+// length prefix. Tiles already walked are skipped. Returns VNC_RFB_RESULT_WOULD_BLOCK with the
+// bytes it takes to get further in `needed`, or success with the size in `progress`.
+enum Vnc_rfb_result vnc_rle_measure_rect(struct Vnc_rle_decoder *decoder, const u8 *data,
+					 size_t len, struct Vnc_rfb_rect *rect,
+					 struct Vnc_pixel_converter *converter,
+					 struct Vnc_rfb_rect_progress *progress, size_t *needed);
+bool vnc_rle_decode_rect(struct Vnc_rle_decoder *decoder, struct Vnc_rfb_rect *rect,
+			 struct Vnc_pixel_converter *converter,
+			 struct Vnc_framebuffer *framebuffer);
@@ -0,0 +1,70 @@
+#include "rre.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "draw.h"
+#include "log.h"
+#include "macros.h"
+
+// Subrects are read off the socket in batches of this many
+enum { SUBRECT_BATCH = 256 };
+
+enum Vnc_rfb_result vnc_rre_measure_rect(struct Vnc_rfb_stream *stream,
+					 struct Vnc_pixel_converter *converter)
+{
+	RFB_TRY(vnc_rfb_stream_ensure(stream, sizeof(u32)));
+	const u8 *data;
+	vnc_rfb_stream_buffered(stream, &data);
+	u32 subrect_count;
+	memcpy(&subrect_count, data, sizeof(subrect_count));
+	subrect_count = ntohl(subrect_count);
+	u8 pixel_size = converter->bytes_per_pixel;
+	size_t subrect_size = pixel_size + 4 * sizeof(u16);
+	return vnc_rfb_stream_ensure(stream, sizeof(u32) + pixel_size +
+						     (size_t)subrect_count * subrect_size);
+}
+
+enum Vnc_rfb_result vnc_rre_recv_rect(struct Vnc_rfb_stream *stream, struct Vnc_rfb_rect *rect,
+				      struct Vnc_pixel_converter *converter,
+				      struct Vnc_framebuffer *framebuffer)
+{
+	u8 pixel_size = converter->bytes_per_pixel;
+	u8 header[sizeof(u32) + 4];
+	RFB_TRY_READ(stream, header, sizeof(u32) + pixel_size);
+	u32 subrect_count;
+	memcpy(&subrect_count, header, sizeof(subrect_count));
+	subrect_count = ntohl(subrect_count);
+	u32 background = vnc_pixel_read(converter, header + sizeof(u32));
+	vnc_draw_fill_rect(framebuffer, rect->x, rect->y, rect->width, rect->height, background);
+
+	// Each subrect is a pixel followed by x, y, width and height
+	size_t subrect_size = pixel_size + 4 * sizeof(u16);
+	u8 subrects[SUBRECT_BATCH * (4 + 4 * sizeof(u16))];
+	while (subrect_count > 0) {
+		u32 count = MIN(subrect_count, SUBRECT_BATCH);
+		RFB_TRY_READ(stream, subrects, count * subrect_size);
+		subrect_count -= count;
+
+		const u8 *data = subrects;
+		for (u32 i = 0; i < count; ++i) {
+			u32 color = vnc_pixel_read(converter, data);
+			u16 geometry[4];
+			memcpy(geometry, data + pixel_size, sizeof(geometry));
+			data += subrect_size;
+			u16 x = ntohs(geometry[0]);
+			u16 y = ntohs(geometry[1]);
+			u16 width = ntohs(geometry[2]);
+			u16 height = ntohs(geometry[3]);
+			if ((u32)x + width > rect->width || (u32)y + height > rect->height) {
+				vnc_log_error("RRE: subrect %ux%u+%u+%u outside of rect", width,
+					      height, x, y);
+				return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+			}
+			vnc_draw_fill_rect(framebuffer, rect->x + x, rect->y + y, width, height,
+					   color);
+		}
+	}
+	return VNC_RFB_RESULT_SUCCESS;
+}
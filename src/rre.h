@@ -0,0 +1,13 @@
+#pragma once
+
+#include "fb.h"
+#include "pixel.h"
+#include "rfb.h"
+#include "types.h"
+
+// Returns VNC_RFB_RESULT_WOULD_BLOCK until all subrects of the rect are buffered
+enum Vnc_rfb_result vnc_rre_measure_rect(struct Vnc_rfb_stream *stream,
+					 struct Vnc_pixel_converter *converter);
+enum Vnc_rfb_result vnc_rre_recv_rect(struct Vnc_rfb_stream *stream, struct Vnc_rfb_rect *rect,
+				      struct Vnc_pixel_converter *converter,
+				      struct Vnc_framebuffer *framebuffer);
@@ -0,0 +1,655 @@
+#include "scale.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCALE_AVX2
+#define AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SCALE_NEON
+#include <arm_neon.h>
+#endif
+
+#include "log.h"
+#include "macros.h"
+
+// Downscaling by more than about 30 with the area filter
+#define MAX_TAPS 32
+// Weights are fixed point with 8 fractional bits, so a channel times a weight fits in 16 bits
+#define WEIGHT_ONE 256
+
+// Row kernels of one instruction set
+struct Kernels {
+	const char *name;
+	void (*gather)(const u32 *src, const u32 *first, u32 *dest, u32 count);
+	void (*blend_rows)(const u32 *const *rows, const u16 *weights, u32 taps, u32 *dest,
+			   u32 count);
+	void (*blend_columns)(const u32 *src, const u32 *first, const u16 *weights, u32 taps,
+			      u32 *dest, u32 count);
+};
+
+static const char *filter_names[] = {
+	[VNC_SCALE_FILTER_NEAREST] = "nearest",
+	[VNC_SCALE_FILTER_BILINEAR] = "bilinear",
+	[VNC_SCALE_FILTER_AREA] = "area",
+};
+
+static bool init_axis(struct Vnc_scale_axis *axis, enum Vnc_scale_filter filter, u32 src_len,
+		      u32 dest_len);
+static void add_contribution(double *contributions, u32 first, u32 taps, u32 src_len, i32 index,
+			     double weight);
+static void quantize_weights(const double *contributions, u32 taps, u16 *weights);
+static bool map_span(struct Vnc_scale_axis *axis, u32 dest_len, u32 start, u32 end,
+		     u32 *dest_start, u32 *dest_end);
+static void scale_row(struct Vnc_scaler *scaler, struct Vnc_framebuffer *src, u32 dest_y,
+		      u32 dest_x, u32 dest_end, u32 *dest);
+static void select_kernels(struct Vnc_scaler *scaler);
+static const struct Kernels *find_kernels(const char *name);
+static void use_kernels(struct Vnc_scaler *scaler, const struct Kernels *kernels);
+static void gather_scalar(const u32 *src, const u32 *first, u32 *dest, u32 count);
+static void blend_rows_scalar(const u32 *const *rows, const u16 *weights, u32 taps, u32 *dest,
+			      u32 count);
+static void blend_columns_scalar(const u32 *src, const u32 *first, const u16 *weights, u32 taps,
+				 u32 *dest, u32 count);
+static inline void blend_rows_range(const u32 *const *rows, const u16 *weights, u32 taps,
+				    u32 *dest, u32 start, u32 end);
+static inline void blend_columns_range(const u32 *src, const u32 *first, const u16 *weights,
+				       u32 taps, u32 *dest, u32 start, u32 end);
+
+static const struct Kernels scalar_kernels = {
+	"scalar", gather_scalar, blend_rows_scalar, blend_columns_scalar,
+};
+
+#if defined(__SSE2__)
+static void blend_rows_sse2(const u32 *const *rows, const u16 *weights, u32 taps, u32 *dest,
+			    u32 count);
+static void blend_columns_sse2(const u32 *src, const u32 *first, const u16 *weights, u32 taps,
+			       u32 *dest, u32 count);
+
+// Gathers don't get any faster with SSE2
+static const struct Kernels sse2_kernels = {
+	"sse2", gather_scalar, blend_rows_sse2, blend_columns_sse2,
+};
+#endif
+
+#if defined(SCALE_AVX2)
+static AVX2 void gather_avx2(const u32 *src, const u32 *first, u32 *dest, u32 count);
+static AVX2 void blend_rows_avx2(const u32 *const *rows, const u16 *weights, u32 taps,
+				 u32 *dest, u32 count);
+static AVX2 void blend_columns_avx2(const u32 *src, const u32 *first, const u16 *weights,
+				    u32 taps, u32 *dest, u32 count);
+
+static const struct Kernels avx2_kernels = {
+	"avx2", gather_avx2, blend_rows_avx2, blend_columns_avx2,
+};
+#endif
+
+#if defined(SCALE_NEON)
+static void blend_rows_neon(const u32 *const *rows, const u16 *weights, u32 taps, u32 *dest,
+			    u32 count);
+static void blend_columns_neon(const u32 *src, const u32 *first, const u16 *weights, u32 taps,
+			       u32 *dest, u32 count);
+
+static const struct Kernels neon_kernels = {
+	"neon", gather_scalar, blend_rows_neon, blend_columns_neon,
+};
+#endif
+
+bool vnc_scaler_init(struct Vnc_scaler *scaler, enum Vnc_scale_filter filter, u32 src_width,
+		     u32 src_height, u32 dest_width, u32 dest_height)
+{
+	*scaler = (struct Vnc_scaler){
+		.filter = filter,
+		.src_width = src_width,
+		.src_height = src_height,
+	};
+	if (src_width == 0 || src_height == 0 || dest_width == 0 || dest_height == 0) {
+		vnc_log_error("Unable to scale %ux%u onto %ux%u", src_width, src_height, dest_width,
+			      dest_height);
+		return false;
+	}
+	// As large as fits, centered
+	u64 fit_width = (u64)src_width * dest_height;
+	u64 fit_height = (u64)src_height * dest_width;
+	u32 width = dest_width;
+	u32 height = dest_height;
+	if (fit_width > fit_height) {
+		height = MAX((fit_height + src_width / 2) / src_width, 1);
+	} else {
+		width = MAX((fit_width + src_height / 2) / src_height, 1);
+	}
+	scaler->area = (struct Vnc_rfb_rect){
+		.x = (dest_width - width) / 2,
+		.y = (dest_height - height) / 2,
+		.width = width,
+		.height = height,
+	};
+
+	if (!init_axis(&scaler->columns, filter, src_width, width) ||
+	    !init_axis(&scaler->rows, filter, src_height, height)) {
+		goto err;
+	}
+	scaler->row_buffer = malloc(src_width * sizeof(u32));
+	if (scaler->row_buffer == NULL) {
+		vnc_log_error("Unable to allocate the scaler row buffer");
+		goto err;
+	}
+	select_kernels(scaler);
+	vnc_log_info("Scaling %ux%u onto %ux%u at %u,%u, %s filter with the %s kernels",
+		     src_width, src_height, width, height, scaler->area.x, scaler->area.y,
+		     filter_names[filter], scaler->kernel_name);
+	return true;
+
+err:
+	vnc_scaler_deinit(scaler);
+	return false;
+}
+
+void vnc_scaler_deinit(struct Vnc_scaler *scaler)
+{
+	free(scaler->columns.first);
+	free(scaler->columns.weights);
+	free(scaler->rows.first);
+	free(scaler->rows.weights);
+	free(scaler->row_buffer);
+	*scaler = (struct Vnc_scaler){ 0 };
+}
+
+bool vnc_scaler_map_rect(struct Vnc_scaler *scaler, struct Vnc_rfb_rect *rect,
+			 struct Vnc_rfb_rect *dest_rect)
+{
+	u32 x, right, y, bottom;
+	if (!map_span(&scaler->columns, scaler->area.width, rect->x, (u32)rect->x + rect->width,
+		      &x, &right) ||
+	    !map_span(&scaler->rows, scaler->area.height, rect->y, (u32)rect->y + rect->height,
+		      &y, &bottom)) {
+		return false;
+	}
+	*dest_rect = (struct Vnc_rfb_rect){
+		.x = scaler->area.x + x,
+		.y = scaler->area.y + y,
+		.width = right - x,
+		.height = bottom - y,
+	};
+	return true;
+}
+
+void vnc_scaler_map_point(struct Vnc_scaler *scaler, i32 x, i32 y, i32 *dest_x, i32 *dest_y)
+{
+	*dest_x = scaler->area.x + (i64)x * scaler->area.width / scaler->src_width;
+	*dest_y = scaler->area.y + (i64)y * scaler->area.height / scaler->src_height;
+}
+
+size_t vnc_scaler_scale(struct Vnc_scaler *scaler, struct Vnc_framebuffer *src,
+			struct Vnc_framebuffer *dest, u32 origin_x, u32 origin_y,
+			struct Vnc_rfb_rect *rect)
+{
+	u32 right = MIN((u32)rect->x + rect->width, dest->width);
+	u32 bottom = MIN((u32)rect->y + rect->height, dest->height);
+	if (rect->x >= right || rect->y >= bottom) {
+		return 0;
+	}
+	// From here on in destination coordinates
+	u32 left = origin_x + rect->x;
+	u32 top = origin_y + rect->y;
+	right += origin_x;
+	bottom += origin_y;
+	struct Vnc_rfb_rect *area = &scaler->area;
+	u32 area_right = area->x + area->width;
+	u32 area_bottom = area->y + area->height;
+	u32 x = MAX(left, area->x);
+	u32 end = MIN(right, area_right);
+	for (u32 y = top; y < bottom; ++y) {
+		u32 *row = (u32 *)(dest->buffer + (y - origin_y) * dest->pitch);
+		if (y < area->y || y >= area_bottom || x >= end) {
+			memset(row + (left - origin_x), 0, (right - left) * sizeof(u32));
+			continue;
+		}
+		// The bars left and right of the area
+		if (left < x) {
+			memset(row + (left - origin_x), 0, (x - left) * sizeof(u32));
+		}
+		if (end < right) {
+			memset(row + (end - origin_x), 0, (right - end) * sizeof(u32));
+		}
+		scale_row(scaler, src, y - area->y, x - area->x, end - area->x,
+			  row + (x - origin_x));
+	}
+	return (size_t)(right - left) * (bottom - top) * sizeof(u32);
+}
+
+bool vnc_scaler_use_kernels(struct Vnc_scaler *scaler, const char *name)
+{
+	if (strcmp(name, scalar_kernels.name) == 0) {
+		use_kernels(scaler, &scalar_kernels);
+		return true;
+	}
+	const struct Kernels *kernels = find_kernels(name);
+	use_kernels(scaler, kernels != NULL ? kernels : &scalar_kernels);
+	return kernels != NULL;
+}
+
+bool vnc_scale_filter_from_name(const char *name, enum Vnc_scale_filter *filter)
+{
+	for (size_t i = 0; i < ARRAY_COUNT(filter_names); ++i) {
+		if (strcmp(name, filter_names[i]) == 0) {
+			*filter = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool init_axis(struct Vnc_scale_axis *axis, enum Vnc_scale_filter filter, u32 src_len,
+		      u32 dest_len)
+{
+	double scale = (double)src_len / dest_len;
+	u32 taps = 1;
+	if (filter == VNC_SCALE_FILTER_BILINEAR) {
+		taps = 2;
+	} else if (filter == VNC_SCALE_FILTER_AREA) {
+		// A destination pixel covers `scale` source pixels, partly covering one more
+		taps = (u32)scale + 2;
+	}
+	taps = MIN(taps, src_len);
+	if (taps > MAX_TAPS) {
+		vnc_log_error("Unable to scale down %u to %u with the %s filter", src_len, dest_len,
+			      filter_names[filter]);
+		return false;
+	}
+	axis->taps = taps;
+	axis->first = malloc(dest_len * sizeof(u32));
+	// The AVX2 kernel reads the weights 32 bits at a time
+	axis->weights = malloc(((size_t)dest_len * taps + 1) * sizeof(u16));
+	if (axis->first == NULL || axis->weights == NULL) {
+		vnc_log_error("Unable to allocate the scaler weights");
+		return false;
+	}
+
+	double contributions[MAX_TAPS];
+	for (u32 d = 0; d < dest_len; ++d) {
+		memset(contributions, 0, sizeof(contributions));
+		// Pixel centers are at .5, and so is the position sampled
+		double center = (d + 0.5) * scale;
+		double begin = d * scale;
+		double end = (d + 1) * scale;
+		i32 start = filter == VNC_SCALE_FILTER_BILINEAR ? (i32)(center + 0.5) - 1 :
+				filter == VNC_SCALE_FILTER_AREA ? (i32)begin :
+								  (i32)center;
+		u32 first = MIN((u32)MAX(start, 0), src_len - taps);
+		switch (filter) {
+		case VNC_SCALE_FILTER_NEAREST:
+			add_contribution(contributions, first, taps, src_len, start, 1);
+			break;
+		case VNC_SCALE_FILTER_BILINEAR: {
+			double fraction = center - 0.5 - start;
+			add_contribution(contributions, first, taps, src_len, start, 1 - fraction);
+			add_contribution(contributions, first, taps, src_len, start + 1, fraction);
+		} break;
+		case VNC_SCALE_FILTER_AREA:
+			for (i32 i = start; i < end && i < (i32)src_len; ++i) {
+				double overlap = MIN(end, i + 1) - MAX(begin, i);
+				add_contribution(contributions, first, taps, src_len, i,
+						 overlap / scale);
+			}
+			break;
+		}
+		axis->first[d] = first;
+		quantize_weights(contributions, taps, axis->weights + d * taps);
+	}
+	return true;
+}
+
+// Source pixels past the edges repeat the edge pixel
+static void add_contribution(double *contributions, u32 first, u32 taps, u32 src_len, i32 index,
+			     double weight)
+{
+	u32 clamped = MIN((u32)MAX(index, 0), src_len - 1);
+	contributions[MIN(clamped - first, taps - 1)] += weight;
+}
+
+// Rounds to fixed point, the rounding error goes to the largest weight so they add up exactly
+static void quantize_weights(const double *contributions, u32 taps, u16 *weights)
+{
+	i32 sum = 0;
+	u32 largest = 0;
+	for (u32 k = 0; k < taps; ++k) {
+		weights[k] = contributions[k] * WEIGHT_ONE + 0.5;
+		sum += weights[k];
+		if (weights[k] > weights[largest]) {
+			largest = k;
+		}
+	}
+	weights[largest] += WEIGHT_ONE - sum;
+}
+
+// Destination pixels [dest_start, dest_end) are the ones that sample any of source [start, end)
+static bool map_span(struct Vnc_scale_axis *axis, u32 dest_len, u32 start, u32 end,
+		     u32 *dest_start, u32 *dest_end)
+{
+	// The first sampled source pixels only ever grow, the spans are found by bisecting
+	u32 low = 0;
+	u32 high = dest_len;
+	while (low < high) {
+		u32 middle = low + (high - low) / 2;
+		if (axis->first[middle] + axis->taps > start) {
+			high = middle;
+		} else {
+			low = middle + 1;
+		}
+	}
+	*dest_start = low;
+	high = dest_len;
+	while (low < high) {
+		u32 middle = low + (high - low) / 2;
+		if (axis->first[middle] >= end) {
+			high = middle;
+		} else {
+			low = middle + 1;
+		}
+	}
+	*dest_end = low;
+	return *dest_start < *dest_end;
+}
+
+// Destination pixels [dest_x, dest_end) of the area's row `dest_y`
+static void scale_row(struct Vnc_scaler *scaler, struct Vnc_framebuffer *src, u32 dest_y,
+		      u32 dest_x, u32 dest_end, u32 *dest)
+{
+	struct Vnc_scale_axis *rows = &scaler->rows;
+	struct Vnc_scale_axis *columns = &scaler->columns;
+	u32 first_row = rows->first[dest_y];
+	const u32 *row = (const u32 *)(src->buffer + first_row * src->pitch);
+	if (rows->taps > 1) {
+		// Only the source columns the destination pixels sample
+		u32 begin = columns->first[dest_x];
+		u32 end = columns->first[dest_end - 1] + columns->taps;
+		const u32 *src_rows[MAX_TAPS];
+		for (u32 k = 0; k < rows->taps; ++k) {
+			const char *line = src->buffer + (first_row + k) * src->pitch;
+			src_rows[k] = (const u32 *)line + begin;
+		}
+		scaler->blend_rows(src_rows, rows->weights + dest_y * rows->taps, rows->taps,
+				   scaler->row_buffer + begin, end - begin);
+		row = scaler->row_buffer;
+	}
+	if (columns->taps == 1) {
+		scaler->gather(row, columns->first + dest_x, dest, dest_end - dest_x);
+	} else {
+		scaler->blend_columns(row, columns->first + dest_x,
+				      columns->weights + dest_x * columns->taps, columns->taps,
+				      dest, dest_end - dest_x);
+	}
+}
+
+static void select_kernels(struct Vnc_scaler *scaler)
+{
+	const struct Kernels *kernels = &scalar_kernels;
+#if defined(__SSE2__)
+	kernels = &sse2_kernels;
+#elif defined(SCALE_NEON)
+	kernels = &neon_kernels;
+#endif
+#if defined(SCALE_AVX2)
+	if (__builtin_cpu_supports("avx2")) {
+		kernels = &avx2_kernels;
+	}
+#endif
+	use_kernels(scaler, kernels);
+}
+
+static const struct Kernels *find_kernels(const char *name)
+{
+#if defined(__SSE2__)
+	if (strcmp(name, sse2_kernels.name) == 0) {
+		return &sse2_kernels;
+	}
+#endif
+#if defined(SCALE_AVX2)
+	if (strcmp(name, avx2_kernels.name) == 0 && __builtin_cpu_supports("avx2")) {
+		return &avx2_kernels;
+	}
+#endif
+#if defined(SCALE_NEON)
+	if (strcmp(name, neon_kernels.name) == 0) {
+		return &neon_kernels;
+	}
+#endif
+	return NULL;
+}
+
+static void use_kernels(struct Vnc_scaler *scaler, const struct Kernels *kernels)
+{
+	scaler->kernel_name = kernels->name;
+	scaler->gather = kernels->gather;
+	scaler->blend_rows = kernels->blend_rows;
+	scaler->blend_columns = kernels->blend_columns;
+}
+
+static void gather_scalar(const u32 *src, const u32 *first, u32 *dest, u32 count)
+{
+	for (u32 i = 0; i < count; ++i) {
+		dest[i] = src[first[i]];
+	}
+}
+
+static void blend_rows_scalar(const u32 *const *rows, const u16 *weights, u32 taps, u32 *dest,
+			      u32 count)
+{
+	blend_rows_range(rows, weights, taps, dest, 0, count);
+}
+
+static void blend_columns_scalar(const u32 *src, const u32 *first, const u16 *weights, u32 taps,
+				 u32 *dest, u32 count)
+{
+	blend_columns_range(src, first, weights, taps, dest, 0, count);
+}
+
+// Two channels at a time in the 16 bit halves of a word, the weights add up to 256 so no
+// channel carries into the next
+static inline void blend_rows_range(const u32 *const *rows, const u16 *weights, u32 taps,
+				    u32 *dest, u32 start, u32 end)
+{
+	for (u32 i = start; i < end; ++i) {
+		u32 red_blue = 0x00800080;
+		u32 alpha_green = 0x00800080;
+		for (u32 k = 0; k < taps; ++k) {
+			u32 pixel = rows[k][i];
+			red_blue += (pixel & 0x00ff00ff) * weights[k];
+			alpha_green += ((pixel >> 8) & 0x00ff00ff) * weights[k];
+		}
+		dest[i] = ((red_blue >> 8) & 0x00ff00ff) | (alpha_green & 0xff00ff00);
+	}
+}
+
+static inline void blend_columns_range(const u32 *src, const u32 *first, const u16 *weights,
+				       u32 taps, u32 *dest, u32 start, u32 end)
+{
+	for (u32 i = start; i < end; ++i) {
+		const u32 *pixels = src + first[i];
+		const u16 *pixel_weights = weights + i * taps;
+		u32 red_blue = 0x00800080;
+		u32 alpha_green = 0x00800080;
+		for (u32 k = 0; k < taps; ++k) {
+			red_blue += (pixels[k] & 0x00ff00ff) * pixel_weights[k];
+			alpha_green += ((pixels[k] >> 8) & 0x00ff00ff) * pixel_weights[k];
+		}
+		dest[i] = ((red_blue >> 8) & 0x00ff00ff) | (alpha_green & 0xff00ff00);
+	}
+}
+
+#if defined(__SSE2__)
+// Channels are widened to 16 bits, multiplied and summed there, and narrowed again
+static void blend_rows_sse2(const u32 *const *rows, const u16 *weights, u32 taps, u32 *dest,
+			    u32 count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i half = _mm_set1_epi16(WEIGHT_ONE / 2);
+	u32 i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i low = half;
+		__m128i high = half;
+		for (u32 k = 0; k < taps; ++k) {
+			__m128i weight = _mm_set1_epi16(weights[k]);
+			__m128i pixels = _mm_loadu_si128((const __m128i *)(rows[k] + i));
+			__m128i low_pixels = _mm_unpacklo_epi8(pixels, zero);
+			__m128i high_pixels = _mm_unpackhi_epi8(pixels, zero);
+			low = _mm_add_epi16(low, _mm_mullo_epi16(low_pixels, weight));
+			high = _mm_add_epi16(high, _mm_mullo_epi16(high_pixels, weight));
+		}
+		__m128i result = _mm_packus_epi16(_mm_srli_epi16(low, 8), _mm_srli_epi16(high, 8));
+		_mm_storeu_si128((__m128i *)(dest + i), result);
+	}
+	blend_rows_range(rows, weights, taps, dest, i, count);
+}
+
+// Two destination pixels at a time, one in each half
+static void blend_columns_sse2(const u32 *src, const u32 *first, const u16 *weights, u32 taps,
+			       u32 *dest, u32 count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i half = _mm_set1_epi16(WEIGHT_ONE / 2);
+	u32 i = 0;
+	for (; i + 2 <= count; i += 2) {
+		const u32 *left = src + first[i];
+		const u32 *right = src + first[i + 1];
+		const u16 *left_weights = weights + i * taps;
+		const u16 *right_weights = left_weights + taps;
+		__m128i sum = half;
+		for (u32 k = 0; k < taps; ++k) {
+			__m128i pixels = _mm_unpacklo_epi32(_mm_cvtsi32_si128(left[k]),
+							    _mm_cvtsi32_si128(right[k]));
+			__m128i weight = _mm_unpacklo_epi64(_mm_set1_epi16(left_weights[k]),
+							    _mm_set1_epi16(right_weights[k]));
+			pixels = _mm_unpacklo_epi8(pixels, zero);
+			sum = _mm_add_epi16(sum, _mm_mullo_epi16(pixels, weight));
+		}
+		sum = _mm_srli_epi16(sum, 8);
+		_mm_storel_epi64((__m128i *)(dest + i), _mm_packus_epi16(sum, sum));
+	}
+	blend_columns_range(src, first, weights, taps, dest, i, count);
+}
+#endif
+
+#if defined(SCALE_AVX2)
+static AVX2 void gather_avx2(const u32 *src, const u32 *first, u32 *dest, u32 count)
+{
+	u32 i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i index = _mm256_loadu_si256((const __m256i *)(first + i));
+		__m256i pixels = _mm256_i32gather_epi32((const int *)src, index, 4);
+		_mm256_storeu_si256((__m256i *)(dest + i), pixels);
+	}
+	gather_scalar(src, first + i, dest + i, count - i);
+}
+
+static AVX2 void blend_rows_avx2(const u32 *const *rows, const u16 *weights, u32 taps,
+				 u32 *dest, u32 count)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i half = _mm256_set1_epi16(WEIGHT_ONE / 2);
+	u32 i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i low = half;
+		__m256i high = half;
+		for (u32 k = 0; k < taps; ++k) {
+			__m256i weight = _mm256_set1_epi16(weights[k]);
+			__m256i pixels = _mm256_loadu_si256((const __m256i *)(rows[k] + i));
+			__m256i low_pixels = _mm256_unpacklo_epi8(pixels, zero);
+			__m256i high_pixels = _mm256_unpackhi_epi8(pixels, zero);
+			low = _mm256_add_epi16(low, _mm256_mullo_epi16(low_pixels, weight));
+			high = _mm256_add_epi16(high, _mm256_mullo_epi16(high_pixels, weight));
+		}
+		// Unpacking and packing both work within 128 bit lanes, the order comes out right
+		__m256i result =
+			_mm256_packus_epi16(_mm256_srli_epi16(low, 8), _mm256_srli_epi16(high, 8));
+		_mm256_storeu_si256((__m256i *)(dest + i), result);
+	}
+	blend_rows_range(rows, weights, taps, dest, i, count);
+}
+
+// Eight destination pixels at a time, their taps and weights gathered
+static AVX2 void blend_columns_avx2(const u32 *src, const u32 *first, const u16 *weights,
+				    u32 taps, u32 *dest, u32 count)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i half = _mm256_set1_epi16(WEIGHT_ONE / 2);
+	const __m256i weight_mask = _mm256_set1_epi32(0xffff);
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i weight_stride = _mm256_mullo_epi32(lanes, _mm256_set1_epi32(taps));
+	u32 i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i index = _mm256_loadu_si256((const __m256i *)(first + i));
+		__m256i weight_index =
+			_mm256_add_epi32(weight_stride, _mm256_set1_epi32(i * taps));
+		__m256i low = half;
+		__m256i high = half;
+		for (u32 k = 0; k < taps; ++k) {
+			__m256i tap = _mm256_add_epi32(index, _mm256_set1_epi32(k));
+			__m256i pixels = _mm256_i32gather_epi32((const int *)src, tap, 4);
+			const int *tap_weights = (const int *)(weights + k);
+			__m256i weight = _mm256_and_si256(
+				_mm256_i32gather_epi32(tap_weights, weight_index, 2), weight_mask);
+			// The weight of each pixel in all four of its 16 bit channels
+			weight = _mm256_or_si256(weight, _mm256_slli_epi32(weight, 16));
+			__m256i low_pixels = _mm256_unpacklo_epi8(pixels, zero);
+			__m256i high_pixels = _mm256_unpackhi_epi8(pixels, zero);
+			__m256i low_weight = _mm256_unpacklo_epi32(weight, weight);
+			__m256i high_weight = _mm256_unpackhi_epi32(weight, weight);
+			low = _mm256_add_epi16(low, _mm256_mullo_epi16(low_pixels, low_weight));
+			high = _mm256_add_epi16(high, _mm256_mullo_epi16(high_pixels, high_weight));
+		}
+		__m256i result =
+			_mm256_packus_epi16(_mm256_srli_epi16(low, 8), _mm256_srli_epi16(high, 8));
+		_mm256_storeu_si256((__m256i *)(dest + i), result);
+	}
+	blend_columns_range(src, first, weights, taps, dest, i, count);
+}
+#endif
+
+#if defined(SCALE_NEON)
+static void blend_rows_neon(const u32 *const *rows, const u16 *weights, u32 taps, u32 *dest,
+			    u32 count)
+{
+	u32 i = 0;
+	for (; i + 4 <= count; i += 4) {
+		uint16x8_t low = vdupq_n_u16(0);
+		uint16x8_t high = vdupq_n_u16(0);
+		for (u32 k = 0; k < taps; ++k) {
+			uint8x16_t pixels = vld1q_u8((const u8 *)(rows[k] + i));
+			low = vmlaq_n_u16(low, vmovl_u8(vget_low_u8(pixels)), weights[k]);
+			high = vmlaq_n_u16(high, vmovl_u8(vget_high_u8(pixels)), weights[k]);
+		}
+		// Rounds by adding half before the shift
+		uint8x16_t result = vcombine_u8(vrshrn_n_u16(low, 8), vrshrn_n_u16(high, 8));
+		vst1q_u8((u8 *)(dest + i), result);
+	}
+	blend_rows_range(rows, weights, taps, dest, i, count);
+}
+
+static void blend_columns_neon(const u32 *src, const u32 *first, const u16 *weights, u32 taps,
+			       u32 *dest, u32 count)
+{
+	u32 i = 0;
+	for (; i + 2 <= count; i += 2) {
+		const u32 *left = src + first[i];
+		const u32 *right = src + first[i + 1];
+		const u16 *left_weights = weights + i * taps;
+		const u16 *right_weights = left_weights + taps;
+		uint16x8_t sum = vdupq_n_u16(0);
+		for (u32 k = 0; k < taps; ++k) {
+			uint32x2_t pixels = vset_lane_u32(right[k], vdup_n_u32(left[k]), 1);
+			uint16x8_t weight = vcombine_u16(vdup_n_u16(left_weights[k]),
+							 vdup_n_u16(right_weights[k]));
+			sum = vmlaq_u16(sum, vmovl_u8(vreinterpret_u8_u32(pixels)), weight);
+		}
+		vst1_u8((u8 *)(dest + i), vrshrn_n_u16(sum, 8));
+	}
+	blend_columns_range(src, first, weights, taps, dest, i, count);
+}
+#endif
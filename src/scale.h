@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "fb.h"
+#include "rfb.h"
+#include "types.h"
+
+enum Vnc_scale_filter {
+	VNC_SCALE_FILTER_NEAREST,
+	VNC_SCALE_FILTER_BILINEAR,
+	VNC_SCALE_FILTER_AREA, // Average of the source pixels a destination pixel covers
+};
+
+// How one axis of the destination samples the source
+struct Vnc_scale_axis {
+	u32 taps; // Source pixels per destination pixel, unused ones have a weight of 0
+	u32 *first; // Per destination pixel, the first source pixel it samples
+	u16 *weights; // `taps` per destination pixel in 1/256, adding up to 256
+};
+
+// Maps an XRGB8888 framebuffer onto one of another size, keeping the aspect ratio. Source rows
+// are blended into a row buffer first, which is then blended into the destination row.
+struct Vnc_scaler {
+	enum Vnc_scale_filter filter;
+	u32 src_width;
+	u32 src_height;
+	struct Vnc_rfb_rect area; // Of the destination that is scaled onto, the rest is black
+	struct Vnc_scale_axis columns;
+	struct Vnc_scale_axis rows;
+	u32 *row_buffer;
+	// Kernels picked for the CPU at init
+	const char *kernel_name;
+	void (*gather)(const u32 *src, const u32 *first, u32 *dest, u32 count);
+	void (*blend_rows)(const u32 *const *rows, const u16 *weights, u32 taps, u32 *dest,
+			   u32 count);
+	void (*blend_columns)(const u32 *src, const u32 *first, const u16 *weights, u32 taps,
+			      u32 *dest, u32 count);
+};
+
+bool vnc_scaler_init(struct Vnc_scaler *scaler, enum Vnc_scale_filter filter, u32 src_width,
+		     u32 src_height, u32 dest_width, u32 dest_height);
+void vnc_scaler_deinit(struct Vnc_scaler *scaler);
+// The destination pixels that sample `rect` of the source, false if there are none
+bool vnc_scaler_map_rect(struct Vnc_scaler *scaler, struct Vnc_rfb_rect *rect,
+			 struct Vnc_rfb_rect *dest_rect);
+// Where a source position ends up on the destination
+void vnc_scaler_map_point(struct Vnc_scaler *scaler, i32 x, i32 y, i32 *dest_x, i32 *dest_y);
+// Redraws `rect` of `dest` from the source, returns the bytes written. `dest` shows the part of
+// the destination from `origin_x`,`origin_y` on, `rect` is relative to it.
+size_t vnc_scaler_scale(struct Vnc_scaler *scaler, struct Vnc_framebuffer *src,
+			struct Vnc_framebuffer *dest, u32 origin_x, u32 origin_y,
+			struct Vnc_rfb_rect *rect);
+// Switches to the kernels of the named instruction set or to "scalar", so tests can compare
+// them. Fails, leaving the scalar kernels, when the build or the CPU rules them out.
+bool vnc_scaler_use_kernels(struct Vnc_scaler *scaler, const char *name);
+
+// Filters by name: nearest, bilinear and area
+bool vnc_scale_filter_from_name(const char *name, enum Vnc_scale_filter *filter);
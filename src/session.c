@@ -2,32 +2,63 @@
 
 #include <assert.h>
 #include <arpa/inet.h>
-#include <netinet/in.h>
-#include <netinet/tcp.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/eventfd.h>
-#include <sys/socket.h>
-#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "hextile.h"
 #include "log.h"
 #include "macros.h"
+#include "rre.h"
+
+// How long the session thread waits for the server before it looks at the link metrics anyway
+#define IDLE_TIMEOUT_MS 1000
+// Bounds the work of one vnc_session_handle_input call while the server keeps sending, so the
+// event loop gets to the input in between
+#define MAX_RECEIVES_PER_CALL 16
+// Delay before the first reconnect attempt, doubled after every failed one up to the maximum
+#define RECONNECT_MIN_DELAY_MS 250
+#define RECONNECT_MAX_DELAY_MS 8000
+// Gives up after about three and a half minutes
+#define RECONNECT_MAX_ATTEMPTS 30
 
 struct Vnc_session_thread_args {
 	struct Vnc_session *session;
 };
 
 static void *vnc_session_thread(void *args);
+static enum Vnc_rfb_result recv_message(struct Vnc_session *session);
+static void enable_continuous_updates(struct Vnc_session *session);
+static void log_stats(struct Vnc_session *session);
 static bool vnc_rfb_pointer_event_eq(struct Vnc_rfb_pointer_event *a,
 				     struct Vnc_rfb_pointer_event *b);
 static bool set_event(struct Vnc_session *session, enum Vnc_session_event event);
-static bool handle_fence(struct Vnc_session *session);
+static enum Vnc_rfb_result handle_fence(struct Vnc_session *session);
+static bool send_encodings(struct Vnc_session *session);
+static bool adapt(struct Vnc_session *session);
 static enum Vnc_rfb_result handle_rect(struct Vnc_rfb_framebuffer_update_action *action,
-				       struct Vnc_rfb_rect *rect);
+				       struct Vnc_rfb_rect *rect,
+				       struct Vnc_rfb_rect_progress *progress);
+static enum Vnc_rfb_result measure_rect(struct Vnc_session *session, struct Vnc_rfb_rect *rect,
+					struct Vnc_rfb_rect_progress *progress);
+static enum Vnc_rfb_result handle_end_update(struct Vnc_rfb_framebuffer_update_action *action);
+static enum Vnc_rfb_result flip_buffers(struct Vnc_session *session);
+static enum Vnc_rfb_result get_framebuffer_for_rect(struct Vnc_session *session,
+						    struct Vnc_rfb_rect *rect,
+						    struct Vnc_framebuffer **framebuffer);
+static bool resize_framebuffer(struct Vnc_session *session);
+static bool setup_io_uring(struct Vnc_session *session);
+static bool send_vncauth(struct Vnc_session *session, const char *passwd);
+static bool send_vencrypt_auth(struct Vnc_session *session, const char *passwd);
+static void disconnect(struct Vnc_session *session);
+static bool connect_again(struct Vnc_session *session);
+static u64 now_ns(void);
 static u8 pointer_toggle_wheel_scroll_button_mask(
 	u8 button_mask, enum Vnc_input_state_wheel_scroll_direction scroll_direction);
 
-bool vnc_session_init(struct Vnc_session *session)
+bool vnc_session_init(struct Vnc_session *session, struct Vnc_session_options *options)
 {
 	*session = (struct Vnc_session){
 		.last_sent_pointer_event = {
@@ -36,75 +67,67 @@ bool vnc_session_init(struct Vnc_session *session)
 		},
 		.event_fd = eventfd(0, EFD_CLOEXEC),
 		.event_mutex = PTHREAD_MUTEX_INITIALIZER,
+		.send_mutex = PTHREAD_MUTEX_INITIALIZER,
 		.fbu_actions = {
 			.handle_rect = handle_rect,
+			.end_update = handle_end_update,
 		},
 	};
 	if (session->event_fd == -1) {
 		return false;
 	}
+	struct Vnc_adaptive_settings initial_settings = {
+		.profile = VNC_ADAPTIVE_PROFILE_TIGHT,
+		.quality_level = 8,
+		.compress_level = 2,
+	};
+	vnc_adaptive_init(&session->adaptive, !options->fixed_encodings, &initial_settings);
+	session->use_io_uring = options->io_uring;
+	session->transport_options = options->transport;
+	session->tls_options = options->tls;
+	session->single_threaded = options->single_threaded;
+	// Stream workers only pay off when they can run on separate cores
+	session->parallel_decode = !options->serial_decode && !options->single_threaded &&
+				   sysconf(_SC_NPROCESSORS_ONLN) > 1;
+	if (!vnc_zrle_init(&session->zrle) ||
+	    !vnc_tight_init(&session->tight, session->parallel_decode)) {
+		return false;
+	}
+	vnc_trle_init(&session->trle);
+	if (options->pixel_format != NULL) {
+		session->pixel_format_requested = true;
+		if (!vnc_pixel_format_from_name(options->pixel_format,
+						&session->requested_pixel_format)) {
+			vnc_log_error("Unknown pixel format: %s", options->pixel_format);
+			return false;
+		}
+	}
 	return true;
 }
 
-bool vnc_session_connect(struct Vnc_session *session, const char *address, u16 port)
+bool vnc_session_connect(struct Vnc_session *session, const char *address)
 {
-	int sock = socket(AF_INET, SOCK_STREAM, 0);
-	if (sock == -1) {
-		vnc_log_error("Socket create failed");
+	session->address = address;
+	session->fd = vnc_transport_connect(address, &session->transport_options);
+	if (session->fd == -1) {
 		return false;
 	}
-	session->fd = sock;
-
-	struct timeval tv = { 1, 0 };
-	int rc = setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-	if (rc != 0) {
-		vnc_log_error("setsockopt failed");
-		goto err;
-	}
-
-	rc = setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-	if (rc != 0) {
-		vnc_log_error("setsockopt failed");
-		goto err;
-	}
-
-	int flag = 1;
-	rc = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
-	if (rc != 0) {
-		vnc_log_error("setsockopt failed");
-		goto err;
-	}
-
-	in_addr_t encoded_addr = inet_addr(address);
-	if (encoded_addr == INADDR_NONE) {
-		vnc_log_error("Encode address failed");
-		goto err;
-	}
-
-	struct sockaddr_in addr = {
-		.sin_family = AF_INET,
-		.sin_port = htons(port),
-		.sin_addr = { encoded_addr },
-	};
-
-	rc = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
-	if (rc == -1) {
-		vnc_log_error("connect failed");
-		goto err;
+	if (!vnc_rfb_stream_init(&session->stream, session->fd)) {
+		close(session->fd);
+		session->fd = -1;
+		return false;
 	}
-
+	pthread_mutex_lock(&session->send_mutex);
+	vnc_rfb_send_queue_init(&session->send_queue, session->fd);
+	pthread_mutex_unlock(&session->send_mutex);
 	return true;
-
-err:
-	close(sock);
-	return false;
 }
 
 bool vnc_session_initial_handshake(struct Vnc_session *session,
 				   enum Vnc_rfb_security_type *security)
 {
 	enum Vnc_rfb_version version = VNC_RFB_VERSION_UNKNOWN;
-	enum Vnc_rfb_result result = vnc_rfb_recv_version(session->fd, &version);
+	enum Vnc_rfb_result result = vnc_rfb_recv_version(&session->stream, &version);
 	if (result != VNC_RFB_RESULT_SUCCESS) {
 		vnc_log_error("Unable to read server RFB version (%s)",
 			      vnc_rfb_result_to_str(result));
@@ -124,14 +147,17 @@ bool vnc_session_initial_handshake(struct Vnc_session *session,
 		return false;
 	}
 
+	// Most preferred first, only the first when TLS is required
 	enum Vnc_rfb_security_type acceptable_securities[] = {
+		VNC_RFB_SECURITY_TYPE_VENCRYPT,
 		VNC_RFB_SECURITY_TYPE_NONE,
 		VNC_RFB_SECURITY_TYPE_VNCAUTH,
 	};
 	u8 best_security_index;
-	result = vnc_rfb_has_desired_security_type(session->fd, acceptable_securities,
-						   ARRAY_COUNT(acceptable_securities),
-						   &best_security_index);
+	result = vnc_rfb_has_desired_security_type(
+		&session->stream, acceptable_securities,
+		session->tls_options.required ? 1 : ARRAY_COUNT(acceptable_securities),
+		&best_security_index);
 	if (result != VNC_RFB_RESULT_SUCCESS) {
 		vnc_log_error("Handshake failed: no acceptable security type found");
 		return false;
@@ -144,6 +170,9 @@ bool vnc_session_initial_handshake(struct Vnc_session *session,
 bool vnc_session_send_auth(struct Vnc_session *session, const char *passwd,
 			   enum Vnc_rfb_security_type security)
 {
+	if (passwd != session->passwd) {
+		snprintf(session->passwd, sizeof(session->passwd), "%s", passwd);
+	}
 	switch (security) {
 	case VNC_RFB_SECURITY_TYPE_INVALID:
 		vnc_log_error("Invalid security type");
@@ -152,88 +181,209 @@ bool vnc_session_send_auth(struct Vnc_session *session, const char *passwd,
 		vnc_rfb_send_security_type(session->fd, security);
 		break;
 	case VNC_RFB_SECURITY_TYPE_VNCAUTH:
-		if (vnc_rfb_send_security_type(session->fd, security) == VNC_RFB_RESULT_SUCCESS) {
-			struct Vnc_rfb_vncauth_challenge challenge = { 0 };
-			enum Vnc_rfb_result result =
-				vnc_rfb_recv_challenge(session->fd, &challenge);
-			if (result != VNC_RFB_RESULT_SUCCESS) {
-				vnc_log_error("Unable to get challenge: %s",
-					      vnc_rfb_result_to_str(result));
-				return false;
-			}
-
-			result = vnc_rfb_send_passwd(session->fd, &challenge, passwd);
-			if (result != VNC_RFB_RESULT_SUCCESS) {
-				vnc_log_error("Unable to send password: %s",
-					      vnc_rfb_result_to_str(result));
-				return false;
-			}
-
-			result = vnc_rfb_recv_security_result(session->fd);
-			if (result != VNC_RFB_RESULT_SUCCESS) {
-				vnc_log_error("Security negotiation failed: %s",
-					      vnc_rfb_result_to_str(result));
-				return false;
-			}
+		if (vnc_rfb_send_security_type(session->fd, security) == VNC_RFB_RESULT_SUCCESS &&
+		    !send_vncauth(session, passwd)) {
+			return false;
 		}
 		break;
+	case VNC_RFB_SECURITY_TYPE_VENCRYPT:
+		if (!send_vencrypt_auth(session, passwd)) {
+			return false;
+		}
+		break;
+	}
+
+	// Only now the socket is final, TLS may have swapped it for a relay
+	pthread_mutex_lock(&session->send_mutex);
+	if (session->use_io_uring && !setup_io_uring(session)) {
+		vnc_log_info("io_uring unavailable, using recv and write");
+	}
+	pthread_mutex_unlock(&session->send_mutex);
+	return true;
+}
+
+static bool send_vncauth(struct Vnc_session *session, const char *passwd)
+{
+	struct Vnc_rfb_vncauth_challenge challenge = { 0 };
+	enum Vnc_rfb_result result = vnc_rfb_recv_challenge(&session->stream, &challenge);
+	if (result != VNC_RFB_RESULT_SUCCESS) {
+		vnc_log_error("Unable to get challenge: %s", vnc_rfb_result_to_str(result));
+		return false;
+	}
+
+	result = vnc_rfb_send_passwd(session->fd, &challenge, passwd);
+	if (result != VNC_RFB_RESULT_SUCCESS) {
+		vnc_log_error("Unable to send password: %s", vnc_rfb_result_to_str(result));
+		return false;
+	}
+
+	result = vnc_rfb_recv_security_result(&session->stream);
+	if (result != VNC_RFB_RESULT_SUCCESS) {
+		vnc_log_error("Security negotiation failed: %s", vnc_rfb_result_to_str(result));
+		return false;
+	}
+	return true;
+}
+
+// Wraps the connection in TLS, then authenticates inside it like the plain security types do
+static bool send_vencrypt_auth(struct Vnc_session *session, const char *passwd)
+{
+	enum Vnc_rfb_result result =
+		vnc_rfb_send_security_type(session->fd, VNC_RFB_SECURITY_TYPE_VENCRYPT);
+	if (result == VNC_RFB_RESULT_SUCCESS) {
+		result = vnc_rfb_negotiate_vencrypt_version(&session->stream, session->fd);
+	}
+	if (result != VNC_RFB_RESULT_SUCCESS) {
+		vnc_log_error("VeNCrypt negotiation failed: %s", vnc_rfb_result_to_str(result));
+		return false;
+	}
+
+	enum Vnc_rfb_vencrypt_subtype acceptable_subtypes[] = {
+		VNC_RFB_VENCRYPT_SUBTYPE_X509_VNC,
+		VNC_RFB_VENCRYPT_SUBTYPE_X509_NONE,
+	};
+	u8 best_subtype_index;
+	result = vnc_rfb_has_desired_vencrypt_subtype(&session->stream, acceptable_subtypes,
+						      ARRAY_COUNT(acceptable_subtypes),
+						      &best_subtype_index);
+	if (result != VNC_RFB_RESULT_SUCCESS) {
+		vnc_log_error("VeNCrypt: the server offers no X.509 subtype");
+		return false;
+	}
+	enum Vnc_rfb_vencrypt_subtype subtype = acceptable_subtypes[best_subtype_index];
+	result = vnc_rfb_select_vencrypt_subtype(&session->stream, session->fd, subtype);
+	if (result != VNC_RFB_RESULT_SUCCESS) {
+		vnc_log_error("VeNCrypt subtype %u refused: %s", subtype,
+			      vnc_rfb_result_to_str(result));
+		return false;
+	}
+
+	// From here on the socket belongs to TLS, nothing may have been read ahead of it
+	const u8 *data;
+	if (vnc_rfb_stream_buffered(&session->stream, &data) != 0) {
+		vnc_log_error("VeNCrypt: unexpected data before the TLS handshake");
+		return false;
+	}
+	char host[256];
+	bool have_host = vnc_transport_get_host(session->address, host, sizeof(host));
+	int plain_fd;
+	if (!vnc_tls_connect(&session->tls, session->fd, have_host ? host : NULL,
+			     &session->tls_options, &plain_fd)) {
+		return false;
+	}
+	if (plain_fd != session->fd) {
+		session->fd = plain_fd;
+		session->stream.fd = plain_fd;
+		pthread_mutex_lock(&session->send_mutex);
+		session->send_queue.fd = plain_fd;
+		pthread_mutex_unlock(&session->send_mutex);
+	}
+
+	if (subtype == VNC_RFB_VENCRYPT_SUBTYPE_X509_VNC) {
+		return send_vncauth(session, passwd);
+	}
+	result = vnc_rfb_recv_security_result(&session->stream);
+	if (result != VNC_RFB_RESULT_SUCCESS) {
+		vnc_log_error("Security negotiation failed: %s", vnc_rfb_result_to_str(result));
+		return false;
 	}
 	return true;
 }
 
 int vnc_session_get_fd(struct Vnc_session *session)
 {
+	// With io_uring the data is already taken off the socket, its completions are what to poll
+	if (session->stream.uring != NULL) {
+		return session->stream.uring->ring_fd;
+	}
 	return session->fd;
 }
 
 bool vnc_session_exchange_connection_params(struct Vnc_session *session, bool shared_connection,
-					    u16 screen_width, u16 screen_height)
+					    const struct Vnc_rfb_screen *screens,
+					    u8 screen_count)
 {
+	session->shared_connection = shared_connection;
+	screen_count = MIN(screen_count, ARRAY_COUNT(session->screens));
+	// Reconnecting passes the session's own copy
+	memmove(session->screens, screens, screen_count * sizeof(*screens));
+	session->screen_count = screen_count;
 	enum Vnc_rfb_result result = vnc_rfb_send_client_init(session->fd, shared_connection);
 	if (result != VNC_RFB_RESULT_SUCCESS) {
 		vnc_log_error("vnc_rfb_send_client_init failed: %s", vnc_rfb_result_to_str(result));
 		return false;
 	}
 
-	result = vnc_rfb_recv_server_init(session->fd, &session->server_settings);
+	// Main reads the settings while a reconnect fills them in again
+	struct Vnc_rfb_server_init server_settings;
+	result = vnc_rfb_recv_server_init(&session->stream, &server_settings);
 	if (result != VNC_RFB_RESULT_SUCCESS) {
 		vnc_log_error("vnc_rfb_recv_server_init failed: %s", vnc_rfb_result_to_str(result));
 		return false;
 	}
 	vnc_log_debug("Server settings -- w: %u h: %u bpp: %u depth: %u name len: %u name: \"%s\"",
-		      session->server_settings.width, session->server_settings.height,
-		      session->server_settings.pixel_format.bpp,
-		      session->server_settings.pixel_format.depth,
-		      session->server_settings.name_len, session->server_settings.name);
+		      server_settings.width, server_settings.height,
+		      server_settings.pixel_format.bpp, server_settings.pixel_format.depth,
+		      server_settings.name_len, server_settings.name);
 
-	enum Vnc_rfb_encoding encodings[] = {
-		VNC_RFB_ENCODING_RAW,
-		VNC_RFB_ENCODING_CONTINUOUS_UPDATES_PSEUDO,
-		VNC_RFB_ENCODING_FENCE_PSEUDO,
-		VNC_RFB_ENCODING_EXTENDED_DESKTOP_SIZE_PSEUDO,
-	};
-	result = vnc_rfb_send_encodings(session->fd, encodings, ARRAY_COUNT(encodings));
-	if (result != VNC_RFB_RESULT_SUCCESS) {
-		vnc_log_error("vnc_rfb_send_encodings failed: %s", vnc_rfb_result_to_str(result));
+	// Ask for XRGB8888 if the native format is one we can't convert
+	struct Vnc_rfb_pixel_format *pixel_format = &server_settings.pixel_format;
+	if (!session->pixel_format_requested &&
+	    (!pixel_format->true_color ||
+	     (pixel_format->bpp != 8 && pixel_format->bpp != 16 && pixel_format->bpp != 32))) {
+		session->pixel_format_requested = true;
+		vnc_pixel_format_from_name("xrgb8888", &session->requested_pixel_format);
+	}
+	if (session->pixel_format_requested) {
+		result = vnc_rfb_send_pixel_format(session->fd, &session->requested_pixel_format);
+		if (result != VNC_RFB_RESULT_SUCCESS) {
+			vnc_log_error("vnc_rfb_send_pixel_format failed: %s",
+				      vnc_rfb_result_to_str(result));
+			return false;
+		}
+		*pixel_format = session->requested_pixel_format;
+	}
+	vnc_log_debug("Wire pixel format -- bpp: %u depth: %u max: %u/%u/%u shift: %u/%u/%u",
+		      pixel_format->bpp, pixel_format->depth, pixel_format->red_max,
+		      pixel_format->green_max, pixel_format->blue_max, pixel_format->red_shift,
+		      pixel_format->green_shift, pixel_format->blue_shift);
+	if (!vnc_pixel_converter_init(&session->pixel_converter, pixel_format)) {
 		return false;
 	}
+	pthread_mutex_lock(&session->event_mutex);
+	session->server_settings = server_settings;
+	pthread_mutex_unlock(&session->event_mutex);
 
-	if (session->server_settings.width != screen_width ||
-	    session->server_settings.height != screen_height) {
+	if (!send_encodings(session)) {
+		return false;
+	}
+
+	// The desktop is the bounding box of the screens
+	u16 desktop_width = 0;
+	u16 desktop_height = 0;
+	for (u8 i = 0; i < screen_count; ++i) {
+		desktop_width = MAX(desktop_width, screens[i].xpos + screens[i].width);
+		desktop_height = MAX(desktop_height, screens[i].ypos + screens[i].height);
+	}
+	// The server's layout is unknown, with several screens it's asked for either way
+	if (screen_count > 1 || session->server_settings.width != desktop_width ||
+	    session->server_settings.height != desktop_height) {
 		struct Vnc_rfb_set_desktop_size set_desktop_size = {
 			.message_type = VNC_RFB_CLIENT_MESSAGE_TYPE_SET_DESKTOP_SIZE,
-			.width = htons(screen_width),
-			.height = htons(screen_height),
-			.number_of_screens = 1,
-			.screens = { {
-				.id = htonl(0),
-				.xpos = htons(0),
-				.ypos = htons(0),
-				.width = htons(screen_width),
-				.height = htons(screen_height),
-				.flags = htonl(0),
-			} }
+			.width = htons(desktop_width),
+			.height = htons(desktop_height),
+			.number_of_screens = screen_count,
 		};
+		for (u8 i = 0; i < screen_count; ++i) {
+			set_desktop_size.screens[i] = (struct Vnc_rfb_screen){
+				.id = htonl(screens[i].id),
+				.xpos = htons(screens[i].xpos),
+				.ypos = htons(screens[i].ypos),
+				.width = htons(screens[i].width),
+				.height = htons(screens[i].height),
+				.flags = htonl(screens[i].flags),
+			};
+		}
 		enum Vnc_rfb_result result =
 			vnc_rfb_send_set_desktop_size(session->fd, &set_desktop_size);
 		if (result != VNC_RFB_RESULT_SUCCESS) {
@@ -242,81 +392,174 @@ bool vnc_session_exchange_connection_params(struct Vnc_session *session, bool sh
 		}
 	}
 
+	pthread_mutex_lock(&session->send_mutex);
+	session->connected = true;
+	pthread_mutex_unlock(&session->send_mutex);
 	return true;
 }
 
-bool vnc_session_handle_message(struct Vnc_session *session)
+bool vnc_session_handle_input(struct Vnc_session *session)
 {
-	u8 message_type;
-	enum Vnc_rfb_result result = vnc_rfb_peek_message_type(session->fd, &message_type);
-	if (result == VNC_RFB_RESULT_ERROR_IO_RECV_TIMEOUT) {
-		return true;
+	u32 receives = 0;
+	while (true) {
+		enum Vnc_rfb_result result = recv_message(session);
+		if (result == VNC_RFB_RESULT_SUCCESS) {
+			continue;
+		}
+		if (result == VNC_RFB_RESULT_WOULD_BLOCK) {
+			// Data io_uring took off the socket already leaves its fd unreadable
+			struct Vnc_uring *uring = session->stream.uring;
+			bool taken = uring != NULL && uring->has_current;
+			if (receives >= MAX_RECEIVES_PER_CALL && !taken) {
+				break;
+			}
+			result = vnc_rfb_stream_receive(&session->stream);
+			receives += 1;
+		}
+		if (result == VNC_RFB_RESULT_WOULD_BLOCK) {
+			break;
+		}
+		if (result != VNC_RFB_RESULT_SUCCESS) {
+			vnc_log_error("Receiving from the server failed: %s",
+				      vnc_rfb_result_to_str(result));
+			log_stats(session);
+			return false;
+		}
+	}
+	return adapt(session);
+}
+
+bool vnc_session_reconnect(struct Vnc_session *session)
+{
+	session->disconnected_ns = now_ns();
+	disconnect(session);
+	u32 delay_ms = RECONNECT_MIN_DELAY_MS;
+	for (u32 attempt = 1; attempt <= RECONNECT_MAX_ATTEMPTS; ++attempt) {
+		struct timespec delay = { delay_ms / 1000, (delay_ms % 1000) * 1000000l };
+		nanosleep(&delay, NULL);
+		delay_ms = MIN(delay_ms * 2, RECONNECT_MAX_DELAY_MS);
+
+		vnc_log_info("Reconnecting to %s (attempt %u)", session->address, attempt);
+		if (connect_again(session)) {
+			session->reconnect_attempts = attempt;
+			vnc_log_info("Reconnected %.1f ms after the connection dropped",
+				     (now_ns() - session->disconnected_ns) / 1e6);
+			return true;
+		}
+		disconnect(session);
+	}
+	vnc_log_error("Giving up after %u reconnect attempts", RECONNECT_MAX_ATTEMPTS);
+	return false;
+}
+
+// Takes the next message off the buffered bytes, or as much of it as there is
+static enum Vnc_rfb_result recv_message(struct Vnc_session *session)
+{
+	struct Vnc_rfb_stream *stream = &session->stream;
+	switch (session->recv_state) {
+	case VNC_SESSION_RECV_STATE_MESSAGE:
+		break;
+	case VNC_SESSION_RECV_STATE_FRAMEBUFFER_UPDATE:
+		RFB_TRY(vnc_rfb_recv_framebuffer_update(stream, &session->update,
+							&session->fbu_actions));
+		session->recv_state = VNC_SESSION_RECV_STATE_MESSAGE;
+		enable_continuous_updates(session);
+		return VNC_RFB_RESULT_SUCCESS;
+	case VNC_SESSION_RECV_STATE_CUT_TEXT: {
+		// The text isn't used, it is dropped as it comes in
+		const u8 *data;
+		size_t count = MIN(session->cut_text_left, vnc_rfb_stream_buffered(stream, &data));
+		RFB_TRY_DISCARD(stream, count);
+		session->cut_text_left -= count;
+		if (session->cut_text_left > 0) {
+			return VNC_RFB_RESULT_WOULD_BLOCK;
+		}
+		session->recv_state = VNC_SESSION_RECV_STATE_MESSAGE;
+		enable_continuous_updates(session);
+		return VNC_RFB_RESULT_SUCCESS;
 	}
-	if (result != VNC_RFB_RESULT_SUCCESS) {
-		// vnc_log_error("vnc_rfb_read_message_type failed: %s",
-		// vnc_rfb_get_error());
-		return false;
 	}
 
+	u8 message_type;
+	RFB_TRY(vnc_rfb_peek_message_type(stream, &message_type));
 	switch ((enum Vnc_rfb_server_message_type)message_type) {
 	case VNC_RFB_SERVER_MESSAGE_TYPE_FENCE:
-		return handle_fence(session);
+		RFB_TRY(handle_fence(session));
+		break;
 	case VNC_RFB_SERVER_MESSAGE_TYPE_END_OF_CONTINUOUS_UPDATES: {
 		vnc_log_debug("recvd end of continuous updates");
 		session->server_supports_continuous_updates = true;
 		session->continuous_updates_enabled = false;
 
 		// Discard message type byte
-		RFB_TRY_DISCARD(session->fd, 1);
+		RFB_TRY_DISCARD(stream, 1);
 	} break;
 	case VNC_RFB_SERVER_MESSAGE_TYPE_FRAMEBUFFER_UPDATE:
-		vnc_rfb_recv_framebuffer_update(session->fd, &session->fbu_actions);
-		break;
+		RFB_TRY(vnc_rfb_recv_framebuffer_update_header(stream, &session->update));
+		vnc_adaptive_update_started(&session->adaptive, stream->bytes_received);
+		// Until it ends, frames waiting for a flip are not presented from the shadow
+		vnc_fb_mngr_begin_frame(session->fb_mngr);
+		session->recv_state = VNC_SESSION_RECV_STATE_FRAMEBUFFER_UPDATE;
+		return VNC_RFB_RESULT_SUCCESS;
 	case VNC_RFB_SERVER_MESSAGE_TYPE_CUT_TEXT: {
 		struct Vnc_rfb_cut_text cut_text;
-		enum Vnc_rfb_result result = vnc_rfb_recv_cut_text(session->fd, &cut_text);
-		if (result == VNC_RFB_RESULT_SUCCESS) {
-			size_t to_read = ntohl(cut_text.length);
-			RFB_TRY_DISCARD(session->fd, to_read);
-		}
-	} break;
+		RFB_TRY(vnc_rfb_recv_cut_text(stream, &cut_text));
+		session->cut_text_left = ntohl(cut_text.length);
+		session->recv_state = VNC_SESSION_RECV_STATE_CUT_TEXT;
+		return VNC_RFB_RESULT_SUCCESS;
+	}
 	case VNC_RFB_SERVER_MESSAGE_TYPE_BELL:
 		// Discard message type byte
-		RFB_TRY_DISCARD(session->fd, 1);
+		RFB_TRY_DISCARD(stream, 1);
 		break;
 	default:
 		vnc_log_error("BUG: unhandled message type %u", message_type);
 		assert(false);
 	}
+	enable_continuous_updates(session);
+	return VNC_RFB_RESULT_SUCCESS;
+}
 
-	if (!session->continuous_updates_enabled && session->server_supports_fence &&
-	    session->server_supports_continuous_updates) {
-		struct Vnc_rfb_enable_continuous_updates updates = {
-			.message_type = VNC_RFB_CLIENT_MESSAGE_TYPE_CONTINUOUS_UPDATES,
-			.enable = true,
-			.x = htons(0),
-			.y = htons(0),
-			.width = htons(session->server_settings.width),
-			.height = htons(session->server_settings.height),
-		};
-		enum Vnc_rfb_result result =
-			vnc_rfb_send_enable_continuous_updates(session->fd, &updates);
-		if (result != VNC_RFB_RESULT_SUCCESS) {
-			vnc_log_error("Enable continuous updates failed: %s",
-				      vnc_rfb_result_to_str(result));
-		} else {
-			session->continuous_updates_enabled = true;
-		}
+static void enable_continuous_updates(struct Vnc_session *session)
+{
+	if (session->continuous_updates_enabled || !session->server_supports_fence ||
+	    !session->server_supports_continuous_updates) {
+		return;
+	}
+	struct Vnc_rfb_enable_continuous_updates updates = {
+		.message_type = VNC_RFB_CLIENT_MESSAGE_TYPE_CONTINUOUS_UPDATES,
+		.enable = true,
+		.x = htons(0),
+		.y = htons(0),
+		.width = htons(session->server_settings.width),
+		.height = htons(session->server_settings.height),
+	};
+	pthread_mutex_lock(&session->send_mutex);
+	enum Vnc_rfb_result result =
+		vnc_rfb_send_enable_continuous_updates(&session->send_queue, &updates);
+	if (result == VNC_RFB_RESULT_SUCCESS) {
+		result = vnc_rfb_send_queue_flush(&session->send_queue);
+	}
+	pthread_mutex_unlock(&session->send_mutex);
+	if (result != VNC_RFB_RESULT_SUCCESS) {
+		vnc_log_error("Enable continuous updates failed: %s",
+			      vnc_rfb_result_to_str(result));
+	} else {
+		session->continuous_updates_enabled = true;
 	}
-	return true;
 }
 
 bool vnc_session_start_processing_continuous_updates(struct Vnc_session *session,
 						     struct Vnc_fb_mngr *fb_mngr)
 {
+	session->fb_mngr = fb_mngr;
+	// Without a thread the event loop calls vnc_session_handle_input once the fd is readable,
+	// what came in along with the handshake is taken right away
+	if (session->single_threaded) {
+		return vnc_session_handle_input(session);
+	}
 	struct Vnc_session_thread_args *thread_args = calloc(1, sizeof(*thread_args));
 	thread_args->session = session;
-	session->fb_mngr = fb_mngr;
 	int rc = pthread_create(&session->thread_id, NULL, &vnc_session_thread, thread_args);
 	if (rc != 0) {
 		return false;
@@ -328,16 +571,47 @@ bool vnc_session_start_processing_continuous_updates(struct Vnc_session *session
 static void *vnc_session_thread(void *args)
 {
 	struct Vnc_session_thread_args *thread_args = args;
+	struct Vnc_session *session = thread_args->session;
 	for (;;) {
-		if (!vnc_session_handle_message(thread_args->session)) {
+		bool ok = vnc_session_handle_input(session);
+		if (ok) {
+			enum Vnc_rfb_result result =
+				vnc_rfb_stream_wait(&session->stream, IDLE_TIMEOUT_MS);
+			ok = result == VNC_RFB_RESULT_SUCCESS ||
+			     result == VNC_RFB_RESULT_ERROR_IO_RECV_TIMEOUT;
+			if (!ok) {
+				vnc_log_error("Waiting for the server failed: %s",
+					      vnc_rfb_result_to_str(result));
+				log_stats(session);
+			}
+		}
+		if (!ok && !vnc_session_reconnect(session)) {
 			vnc_log_error("vnc_session_thread encountered an error");
 			break;
 		}
 	}
-	vnc_log_debug("thread done");
 	pthread_exit(NULL);
 }
 
+static void log_stats(struct Vnc_session *session)
+{
+	struct Vnc_rfb_stream *stream = &session->stream;
+	vnc_log_debug("%llu bytes received in %llu recv calls",
+		      (unsigned long long)stream->bytes_received,
+		      (unsigned long long)stream->recv_calls);
+	struct Vnc_rfb_send_queue *queue = &session->send_queue;
+	pthread_mutex_lock(&session->send_mutex);
+	vnc_log_debug("%llu messages sent in %llu writes, at most %u per write",
+		      (unsigned long long)queue->messages_sent, (unsigned long long)queue->flushes,
+		      queue->max_messages_per_flush);
+	pthread_mutex_unlock(&session->send_mutex);
+	if (stream->uring != NULL) {
+		vnc_log_debug("io_uring: %llu completions in %llu io_uring_enter calls",
+			      (unsigned long long)stream->uring->completions,
+			      (unsigned long long)stream->uring->enter_calls);
+	}
+}
+
 bool vnc_session_send_pointer_event(struct Vnc_session *session, u16 xpos, u16 ypos, u8 button_mask)
 {
 	struct Vnc_rfb_pointer_event pointer_event = {
@@ -346,16 +620,16 @@ bool vnc_session_send_pointer_event(struct Vnc_session *session, u16 xpos, u16 y
 		.xpos = htons(xpos),
 		.ypos = htons(ypos),
 	};
+	enum Vnc_rfb_result result = VNC_RFB_RESULT_SUCCESS;
+	pthread_mutex_lock(&session->send_mutex);
 	if (!vnc_rfb_pointer_event_eq(&pointer_event, &session->last_sent_pointer_event)) {
-		enum Vnc_rfb_result result =
-			vnc_rfb_send_pointer_event(session->fd, &pointer_event);
+		result = vnc_rfb_send_pointer_event(&session->send_queue, &pointer_event);
 		if (result == VNC_RFB_RESULT_SUCCESS) {
 			session->last_sent_pointer_event = pointer_event;
-			return true;
 		}
-		return false;
 	}
-	return true;
+	pthread_mutex_unlock(&session->send_mutex);
+	return result == VNC_RFB_RESULT_SUCCESS;
 }
 
 bool vnc_session_send_key_event(struct Vnc_session *session,
@@ -366,10 +640,30 @@ bool vnc_session_send_key_event(struct Vnc_session *session,
 		.down = key_event->pressed,
 		.key = htonl(key_event->keysym),
 	};
-	enum Vnc_rfb_result result = vnc_rfb_send_key_event(session->fd, &rfb_key_event);
+	pthread_mutex_lock(&session->send_mutex);
+	enum Vnc_rfb_result result = vnc_rfb_send_key_event(&session->send_queue, &rfb_key_event);
+	pthread_mutex_unlock(&session->send_mutex);
 	return result == VNC_RFB_RESULT_SUCCESS;
 }
 
+bool vnc_session_flush(struct Vnc_session *session)
+{
+	pthread_mutex_lock(&session->send_mutex);
+	// Input made while reconnecting is stale by the time there is a server to send it to
+	if (!session->connected) {
+		vnc_rfb_send_queue_clear(&session->send_queue);
+		pthread_mutex_unlock(&session->send_mutex);
+		return true;
+	}
+	enum Vnc_rfb_result result = vnc_rfb_send_queue_flush(&session->send_queue);
+	pthread_mutex_unlock(&session->send_mutex);
+	if (result != VNC_RFB_RESULT_SUCCESS) {
+		vnc_log_error("vnc_rfb_send_queue_flush failed: %s", vnc_rfb_result_to_str(result));
+		return false;
+	}
+	return true;
+}
+
 static bool vnc_rfb_pointer_event_eq(struct Vnc_rfb_pointer_event *a,
 				     struct Vnc_rfb_pointer_event *b)
 {
@@ -399,81 +693,181 @@ static bool set_event(struct Vnc_session *session, enum Vnc_session_event event)
 	return bytes_written == sizeof(to_write);
 }
 
-static bool handle_fence(struct Vnc_session *session)
+static enum Vnc_rfb_result handle_fence(struct Vnc_session *session)
 {
 	session->server_supports_fence = true;
 	struct Vnc_rfb_fence fence;
-	enum Vnc_rfb_result result = vnc_rfb_recv_fence(session->fd, &fence);
+	enum Vnc_rfb_result result = vnc_rfb_recv_fence(&session->stream, &fence);
 	if (result != VNC_RFB_RESULT_SUCCESS) {
-		vnc_log_error("recv fence failed");
-		return false;
+		if (result != VNC_RFB_RESULT_WOULD_BLOCK) {
+			vnc_log_error("recv fence failed");
+		}
+		return result;
+	}
+	if (vnc_adaptive_fence_returned(&session->adaptive, &fence)) {
+		return VNC_RFB_RESULT_SUCCESS;
 	}
 
-	if ((fence.flags & (1u << 31)) > 0) {
-		fence.flags = htonl(fence.flags & (~(1u << 31)));
-		result = vnc_rfb_send_fence(session->fd, &fence);
+	if ((fence.flags & VNC_RFB_FENCE_FLAG_REQUEST) > 0) {
+		// Everything before the fence is handled once the reply goes out, that ends a frame
+		RFB_TRY(flip_buffers(session));
+		fence.flags = htonl(fence.flags & ~VNC_RFB_FENCE_FLAG_REQUEST);
+		pthread_mutex_lock(&session->send_mutex);
+		result = vnc_rfb_send_fence(&session->send_queue, &fence);
+		pthread_mutex_unlock(&session->send_mutex);
 		if (result != VNC_RFB_RESULT_SUCCESS) {
 			vnc_log_error("send fence failed");
-			return false;
+			return result;
+		}
+		if (!vnc_session_flush(session)) {
+			return VNC_RFB_RESULT_ERROR_IO;
 		}
 	}
-	return true;
+	return VNC_RFB_RESULT_SUCCESS;
 }
 
 static enum Vnc_rfb_result handle_rect(struct Vnc_rfb_framebuffer_update_action *action,
-				       struct Vnc_rfb_rect *rect)
+				       struct Vnc_rfb_rect *rect,
+				       struct Vnc_rfb_rect_progress *progress)
 {
 	enum Vnc_rfb_result result = VNC_RFB_RESULT_SUCCESS;
 	struct Vnc_session *session = container_of(action, struct Vnc_session, fbu_actions);
+	// Raw rects are taken a row at a time, everything else is decoded once it is all buffered
+	if (rect->encoding != VNC_RFB_ENCODING_RAW) {
+		RFB_TRY(measure_rect(session, rect, progress));
+	}
 	// vnc_log_debug("rect -- x: %d y: %d w: %d h: %d enc: %d", rect->x, rect->y, rect->width, rect->height, rect->encoding);
 	switch (rect->encoding) {
 	case VNC_RFB_ENCODING_RAW: {
-		struct Vnc_framebuffer *framebuffer = vnc_fb_mngr_get_framebuffer(session->fb_mngr);
-		size_t bottom_right_pixel_index =
-			(rect->y + rect->height - 1) * framebuffer->pitch +
-			(rect->x + rect->width - 1) *
-				(session->server_settings.pixel_format.bpp / 8);
-		if (framebuffer->bpp < session->server_settings.pixel_format.bpp ||
-		    bottom_right_pixel_index >= framebuffer->size) {
-			vnc_log_error("RFB data does not fit in DRM buffer (%u vs %lu)",
-				      framebuffer->size, bottom_right_pixel_index);
-			exit(1);
+		struct Vnc_framebuffer *framebuffer;
+		RFB_TRY(get_framebuffer_for_rect(session, rect, &framebuffer));
+		result = vnc_rfb_recv_rect_raw(&session->stream, rect, &session->pixel_converter,
+					       framebuffer, &progress->size);
+		if (result != VNC_RFB_RESULT_SUCCESS) {
+			return result;
+		}
+		vnc_fb_mngr_register_drawn_rect(session->fb_mngr, rect);
+	} break;
+	case VNC_RFB_ENCODING_COPY_RECT: {
+		struct Vnc_rfb_copy_rect copy_rect;
+		result = vnc_rfb_recv_copy_rect(&session->stream, &copy_rect);
+		if (result != VNC_RFB_RESULT_SUCCESS) {
+			return result;
+		}
+		// The source may still be decoding on a Tight stream worker
+		result = vnc_tight_sync(&session->tight);
+		if (result != VNC_RFB_RESULT_SUCCESS) {
+			vnc_log_error("Tight decode failed: %s", vnc_rfb_result_to_str(result));
+			return result;
+		}
+		if (!vnc_fb_mngr_copy_rect(session->fb_mngr, rect, copy_rect.src_x,
+					   copy_rect.src_y)) {
+			return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+		}
+	} break;
+	case VNC_RFB_ENCODING_ZRLE: {
+		struct Vnc_framebuffer *framebuffer;
+		RFB_TRY(get_framebuffer_for_rect(session, rect, &framebuffer));
+		result = vnc_zrle_recv_rect(&session->zrle, &session->stream, rect,
+					    &session->pixel_converter, framebuffer);
+		if (result != VNC_RFB_RESULT_SUCCESS) {
+			vnc_log_error("ZRLE decode failed: %s", vnc_rfb_result_to_str(result));
+			return result;
 		}
-		result = vnc_rfb_recv_rect_raw(session->fd, rect, framebuffer->bpp,
-					       framebuffer->pitch, framebuffer->buffer);
 		vnc_fb_mngr_register_drawn_rect(session->fb_mngr, rect);
-		vnc_fb_mngr_flip_buffers(session->fb_mngr);
+	} break;
+	case VNC_RFB_ENCODING_TRLE: {
+		struct Vnc_framebuffer *framebuffer;
+		RFB_TRY(get_framebuffer_for_rect(session, rect, &framebuffer));
+		result = vnc_trle_recv_rect(&session->trle, &session->stream, rect,
+					    &session->pixel_converter, framebuffer);
+		if (result != VNC_RFB_RESULT_SUCCESS) {
+			vnc_log_error("TRLE decode failed: %s", vnc_rfb_result_to_str(result));
+			return result;
+		}
+		vnc_fb_mngr_register_drawn_rect(session->fb_mngr, rect);
+	} break;
+	case VNC_RFB_ENCODING_HEXTILE: {
+		struct Vnc_framebuffer *framebuffer;
+		RFB_TRY(get_framebuffer_for_rect(session, rect, &framebuffer));
+		result = vnc_hextile_recv_rect(&session->stream, rect,
+					       &session->pixel_converter, framebuffer);
+		if (result != VNC_RFB_RESULT_SUCCESS) {
+			vnc_log_error("Hextile decode failed: %s", vnc_rfb_result_to_str(result));
+			return result;
+		}
+		vnc_fb_mngr_register_drawn_rect(session->fb_mngr, rect);
+	} break;
+	case VNC_RFB_ENCODING_RRE: {
+		struct Vnc_framebuffer *framebuffer;
+		RFB_TRY(get_framebuffer_for_rect(session, rect, &framebuffer));
+		result = vnc_rre_recv_rect(&session->stream, rect, &session->pixel_converter,
+					   framebuffer);
+		if (result != VNC_RFB_RESULT_SUCCESS) {
+			vnc_log_error("RRE decode failed: %s", vnc_rfb_result_to_str(result));
+			return result;
+		}
+		vnc_fb_mngr_register_drawn_rect(session->fb_mngr, rect);
+	} break;
+	case VNC_RFB_ENCODING_TIGHT: {
+		struct Vnc_framebuffer *framebuffer;
+		RFB_TRY(get_framebuffer_for_rect(session, rect, &framebuffer));
+		result = vnc_tight_recv_rect(&session->tight, &session->stream, rect,
+					     &session->pixel_converter, framebuffer);
+		if (result != VNC_RFB_RESULT_SUCCESS) {
+			vnc_log_error("Tight decode failed: %s", vnc_rfb_result_to_str(result));
+			return result;
+		}
+		// Basic rects may still be decoding on a stream worker until the flip syncs them
+		vnc_fb_mngr_register_drawn_rect(session->fb_mngr, rect);
+	} break;
+	case VNC_RFB_ENCODING_CURSOR_PSEUDO: {
+		result = vnc_cursor_recv(&session->cursor, &session->stream, rect,
+					 &session->pixel_converter);
+		if (result != VNC_RFB_RESULT_SUCCESS) {
+			vnc_log_error("Cursor decode failed: %s", vnc_rfb_result_to_str(result));
+			return result;
+		}
+		vnc_fb_mngr_set_cursor(session->fb_mngr, &session->cursor);
 	} break;
 	case VNC_RFB_ENCODING_EXTENDED_DESKTOP_SIZE_PSEUDO: {
 		vnc_log_debug(
 			"set desktop size response -- reason: %u status code: %u new width: %u new height: %u",
 			rect->x, rect->y, rect->width, rect->height);
 		u8 number_of_screens;
-		result = vnc_rfb_recv_number_of_screens(session->fd, &number_of_screens);
+		result = vnc_rfb_recv_number_of_screens(&session->stream, &number_of_screens);
 		if (result != VNC_RFB_RESULT_SUCCESS) {
 			return result;
 		}
 
-		struct Vnc_rfb_screen screens[1];
-		if (number_of_screens > ARRAY_COUNT(screens)) {
-			vnc_log_error("unsupported number of screens: %u", number_of_screens);
-			exit(1);
-		}
-
-		result = vnc_rfb_recv_screens(session->fd, screens, number_of_screens);
-		if (result != VNC_RFB_RESULT_SUCCESS) {
-			return result;
+		// Only the size of the desktop is used, the screens are just logged
+		for (u8 i = 0; i < number_of_screens; ++i) {
+			struct Vnc_rfb_screen screen;
+			result = vnc_rfb_recv_screens(&session->stream, &screen, 1);
+			if (result != VNC_RFB_RESULT_SUCCESS) {
+				return result;
+			}
+			vnc_log_debug("Screen %u: %ux%u at %u,%u", ntohl(screen.id),
+				      ntohs(screen.width), ntohs(screen.height), ntohs(screen.xpos),
+				      ntohs(screen.ypos));
 		}
 
 		if (rect->y != 0) {
-			vnc_log_error("server denied setting desktop size");
+			vnc_log_info("Server denied setting the desktop size, scaling it instead");
 			return result;
 		}
 
+		if (!vnc_fb_mngr_supports_size(session->fb_mngr, rect->width, rect->height)) {
+			vnc_log_error("Desktop of %ux%u is too large", rect->width, rect->height);
+			return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+		}
 		pthread_mutex_lock(&session->event_mutex);
 		session->server_settings.width = rect->width;
 		session->server_settings.height = rect->height;
 		pthread_mutex_unlock(&session->event_mutex);
+		if (!resize_framebuffer(session)) {
+			return VNC_RFB_RESULT_ERROR_OUT_OF_MEMORY;
+		}
 		if (!set_event(session, VNC_SESSION_EVENT_SET_DESKTOP_SIZE)) {
 			vnc_log_error("unable to set desktop size event");
 			exit(1);
@@ -487,7 +881,12 @@ static enum Vnc_rfb_result handle_rect(struct Vnc_rfb_framebuffer_update_action
 			.width = htons(session->server_settings.width),
 			.height = htons(session->server_settings.height),
 		};
-		result = vnc_rfb_send_enable_continuous_updates(session->fd, &updates);
+		pthread_mutex_lock(&session->send_mutex);
+		result = vnc_rfb_send_enable_continuous_updates(&session->send_queue, &updates);
+		if (result == VNC_RFB_RESULT_SUCCESS) {
+			result = vnc_rfb_send_queue_flush(&session->send_queue);
+		}
+		pthread_mutex_unlock(&session->send_mutex);
 		if (result != VNC_RFB_RESULT_SUCCESS) {
 			vnc_log_error("Enable continuous updates failed: %s",
 				      vnc_rfb_result_to_str(result));
@@ -501,6 +900,171 @@ static enum Vnc_rfb_result handle_rect(struct Vnc_rfb_framebuffer_update_action
 	return result;
 }
 
+static enum Vnc_rfb_result measure_rect(struct Vnc_session *session, struct Vnc_rfb_rect *rect,
+					struct Vnc_rfb_rect_progress *progress)
+{
+	struct Vnc_rfb_stream *stream = &session->stream;
+	struct Vnc_pixel_converter *converter = &session->pixel_converter;
+	switch (rect->encoding) {
+	case VNC_RFB_ENCODING_COPY_RECT:
+		return vnc_rfb_stream_ensure(stream, sizeof(struct Vnc_rfb_copy_rect));
+	case VNC_RFB_ENCODING_ZRLE:
+		return vnc_zrle_measure_rect(stream, rect, converter);
+	case VNC_RFB_ENCODING_TRLE:
+		return vnc_trle_measure_rect(&session->trle, stream, rect, converter, progress);
+	case VNC_RFB_ENCODING_HEXTILE:
+		return vnc_hextile_measure_rect(stream, rect, converter, progress);
+	case VNC_RFB_ENCODING_RRE:
+		return vnc_rre_measure_rect(stream, converter);
+	case VNC_RFB_ENCODING_TIGHT:
+		return vnc_tight_measure_rect(stream, rect, converter);
+	case VNC_RFB_ENCODING_CURSOR_PSEUDO:
+		return vnc_cursor_measure(stream, rect, converter);
+	case VNC_RFB_ENCODING_EXTENDED_DESKTOP_SIZE_PSEUDO: {
+		// Number of screens and 3 bytes padding, then the screens
+		RFB_TRY(vnc_rfb_stream_ensure(stream, 4));
+		const u8 *data;
+		vnc_rfb_stream_buffered(stream, &data);
+		return vnc_rfb_stream_ensure(stream, 4 + data[0] * sizeof(struct Vnc_rfb_screen));
+	}
+	default:
+		return VNC_RFB_RESULT_SUCCESS;
+	}
+}
+
+// The whole update goes on screen at once, one flip per frame
+static enum Vnc_rfb_result handle_end_update(struct Vnc_rfb_framebuffer_update_action *action)
+{
+	struct Vnc_session *session = container_of(action, struct Vnc_session, fbu_actions);
+	enum Vnc_rfb_result result = flip_buffers(session);
+	vnc_adaptive_update_finished(&session->adaptive, session->stream.bytes_received);
+	return result;
+}
+
+// The preferred encoding goes first, the others stay as fallbacks for servers without it
+static bool send_encodings(struct Vnc_session *session)
+{
+	struct Vnc_adaptive_settings *settings = &session->adaptive.settings;
+	enum Vnc_rfb_encoding preferred[3];
+	switch (settings->profile) {
+	case VNC_ADAPTIVE_PROFILE_RAW:
+		preferred[0] = VNC_RFB_ENCODING_RAW;
+		preferred[1] = VNC_RFB_ENCODING_ZRLE;
+		preferred[2] = VNC_RFB_ENCODING_TIGHT;
+		break;
+	case VNC_ADAPTIVE_PROFILE_ZRLE:
+		preferred[0] = VNC_RFB_ENCODING_ZRLE;
+		preferred[1] = VNC_RFB_ENCODING_TIGHT;
+		preferred[2] = VNC_RFB_ENCODING_RAW;
+		break;
+	default:
+		preferred[0] = VNC_RFB_ENCODING_TIGHT;
+		preferred[1] = VNC_RFB_ENCODING_ZRLE;
+		preferred[2] = VNC_RFB_ENCODING_RAW;
+		break;
+	}
+	enum Vnc_rfb_encoding encodings[] = {
+		VNC_RFB_ENCODING_COPY_RECT,
+		preferred[0],
+		preferred[1],
+		preferred[2],
+		VNC_RFB_ENCODING_TRLE,
+		VNC_RFB_ENCODING_HEXTILE,
+		VNC_RFB_ENCODING_RRE,
+		VNC_RFB_ENCODING_CURSOR_PSEUDO,
+		VNC_RFB_ENCODING_CONTINUOUS_UPDATES_PSEUDO,
+		VNC_RFB_ENCODING_FENCE_PSEUDO,
+		VNC_RFB_ENCODING_EXTENDED_DESKTOP_SIZE_PSEUDO,
+		VNC_RFB_ENCODING_QUALITY_LEVEL_0_PSEUDO + settings->quality_level,
+		VNC_RFB_ENCODING_COMPRESS_LEVEL_0_PSEUDO + settings->compress_level,
+	};
+	// Flushed right away, the handshake sends this before the session counts as connected
+	pthread_mutex_lock(&session->send_mutex);
+	enum Vnc_rfb_result result =
+		vnc_rfb_send_encodings(&session->send_queue, encodings, ARRAY_COUNT(encodings));
+	if (result == VNC_RFB_RESULT_SUCCESS) {
+		result = vnc_rfb_send_queue_flush(&session->send_queue);
+	}
+	pthread_mutex_unlock(&session->send_mutex);
+	if (result != VNC_RFB_RESULT_SUCCESS) {
+		vnc_log_error("vnc_rfb_send_encodings failed: %s", vnc_rfb_result_to_str(result));
+		return false;
+	}
+	return true;
+}
+
+// Probes the round trip time and moves the server to other encodings when the link changes
+static bool adapt(struct Vnc_session *session)
+{
+	struct Vnc_rfb_fence fence;
+	if (session->server_supports_fence &&
+	    vnc_adaptive_fence_due(&session->adaptive, &fence)) {
+		pthread_mutex_lock(&session->send_mutex);
+		enum Vnc_rfb_result result = vnc_rfb_send_fence(&session->send_queue, &fence);
+		pthread_mutex_unlock(&session->send_mutex);
+		// The round trip is timed from now, the fence can't wait for input to come along
+		if (result != VNC_RFB_RESULT_SUCCESS || !vnc_session_flush(session)) {
+			vnc_log_error("send fence failed");
+			return false;
+		}
+	}
+	struct Vnc_adaptive_settings settings;
+	if (vnc_adaptive_evaluate(&session->adaptive, &settings)) {
+		return send_encodings(session);
+	}
+	return true;
+}
+
+// Damage is copied from the shadow on flip, so queued Tight rects have to land first
+static enum Vnc_rfb_result flip_buffers(struct Vnc_session *session)
+{
+	enum Vnc_rfb_result result = vnc_tight_sync(&session->tight);
+	if (result != VNC_RFB_RESULT_SUCCESS) {
+		vnc_log_error("Tight decode failed: %s", vnc_rfb_result_to_str(result));
+		return result;
+	}
+	vnc_fb_mngr_flip_buffers(session->fb_mngr);
+	if (session->disconnected_ns != 0) {
+		vnc_log_info("Screen repainted %.1f ms after the connection dropped (%u attempts)",
+			     (now_ns() - session->disconnected_ns) / 1e6,
+			     session->reconnect_attempts);
+		session->disconnected_ns = 0;
+	}
+	return result;
+}
+
+// The shadow is as large as the desktop, a rect outside of it is a broken server
+static enum Vnc_rfb_result get_framebuffer_for_rect(struct Vnc_session *session,
+						    struct Vnc_rfb_rect *rect,
+						    struct Vnc_framebuffer **framebuffer)
+{
+	*framebuffer = vnc_fb_mngr_get_framebuffer(session->fb_mngr);
+	if ((u32)rect->x + rect->width > (*framebuffer)->width ||
+	    (u32)rect->y + rect->height > (*framebuffer)->height) {
+		vnc_log_error("Rect %ux%u at %u,%u is outside of the %ux%u desktop", rect->width,
+			      rect->height, rect->x, rect->y, (*framebuffer)->width,
+			      (*framebuffer)->height);
+		return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+	}
+	// Other encodings draw right away, on top of Tight rects still decoding there
+	if (rect->encoding != VNC_RFB_ENCODING_TIGHT) {
+		vnc_tight_wait_for_rect(&session->tight, rect);
+	}
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+// Tight rects still decoding land in the old shadow before it goes
+static bool resize_framebuffer(struct Vnc_session *session)
+{
+	enum Vnc_rfb_result result = vnc_tight_sync(&session->tight);
+	if (result != VNC_RFB_RESULT_SUCCESS) {
+		vnc_log_error("Tight decode failed: %s", vnc_rfb_result_to_str(result));
+		return false;
+	}
+	return vnc_fb_mngr_resize(session->fb_mngr, session->server_settings.width,
+				  session->server_settings.height);
+}
+
 void vnc_session_get_server_settings(struct Vnc_session *session,
 				     struct Vnc_rfb_server_init *server_settings)
 {
@@ -530,6 +1094,38 @@ void vnc_session_post_process_mouse_input(
 	}
 }
 
+// Multishot receives fill these while the session thread is still decoding the previous ones
+#define URING_RECV_BUFFER_COUNT 8
+#define URING_RECV_BUFFER_SIZE VNC_RFB_STREAM_CAPACITY
+
+static bool setup_io_uring(struct Vnc_session *session)
+{
+	if (!vnc_uring_init(&session->recv_uring, session->fd, 4)) {
+		return false;
+	}
+	if (!vnc_uring_setup_recv(&session->recv_uring, URING_RECV_BUFFER_COUNT,
+				  URING_RECV_BUFFER_SIZE)) {
+		goto err_recv;
+	}
+	if (!vnc_uring_init(&session->send_uring, session->fd, 4)) {
+		goto err_recv;
+	}
+	if (!vnc_uring_setup_send(&session->send_uring, session->send_queue.buffer,
+				  sizeof(session->send_queue.buffer))) {
+		goto err_send;
+	}
+	session->stream.uring = &session->recv_uring;
+	session->send_queue.uring = &session->send_uring;
+	vnc_log_info("Using io_uring for the server connection");
+	return true;
+
+err_send:
+	vnc_uring_deinit(&session->send_uring);
+err_recv:
+	vnc_uring_deinit(&session->recv_uring);
+	return false;
+}
+
 static u8 pointer_toggle_wheel_scroll_button_mask(
 	u8 button_mask, enum Vnc_input_state_wheel_scroll_direction scroll_direction)
 {
@@ -561,3 +1157,86 @@ void vnc_session_handle_key_repeat(struct Vnc_session *session,
 {
 	vnc_session_send_key_event(session, key_event);
 }
+
+// Drops everything that belongs to the connection, the framebuffers and the input state stay
+static void disconnect(struct Vnc_session *session)
+{
+	pthread_mutex_lock(&session->send_mutex);
+	session->connected = false;
+	if (session->stream.uring != NULL) {
+		vnc_uring_deinit(&session->recv_uring);
+		vnc_uring_deinit(&session->send_uring);
+		session->stream.uring = NULL;
+		session->send_queue.uring = NULL;
+	}
+	vnc_rfb_send_queue_clear(&session->send_queue);
+	session->last_sent_pointer_event.xpos = -1;
+	session->last_sent_pointer_event.ypos = -1;
+	pthread_mutex_unlock(&session->send_mutex);
+	vnc_rfb_stream_deinit(&session->stream);
+	if (session->fd != -1) {
+		close(session->fd);
+		session->fd = -1;
+	}
+	vnc_tls_deinit(&session->tls);
+
+	// The zlib streams carry over from rect to rect, a new connection starts them afresh
+	vnc_zrle_deinit(&session->zrle);
+	vnc_tight_deinit(&session->tight);
+	vnc_trle_init(&session->trle);
+	session->recv_state = VNC_SESSION_RECV_STATE_MESSAGE;
+	session->cut_text_left = 0;
+	session->server_supports_fence = false;
+	session->server_supports_continuous_updates = false;
+	session->continuous_updates_enabled = false;
+	// Keep the encoding the link was last measured to suit
+	struct Vnc_adaptive_settings settings = session->adaptive.settings;
+	vnc_adaptive_init(&session->adaptive, session->adaptive.enabled, &settings);
+}
+
+// Runs the same handshake main does at startup, then asks for the whole screen. What the server
+// sends goes to the back buffer, so the old frame stays up until the first update completes.
+static bool connect_again(struct Vnc_session *session)
+{
+	if (!vnc_zrle_init(&session->zrle) ||
+	    !vnc_tight_init(&session->tight, session->parallel_decode)) {
+		return false;
+	}
+	enum Vnc_rfb_security_type security;
+	if (!vnc_session_connect(session, session->address) ||
+	    !vnc_session_initial_handshake(session, &security) ||
+	    !vnc_session_send_auth(session, session->passwd, security) ||
+	    !vnc_session_exchange_connection_params(session, session->shared_connection,
+						    session->screens, session->screen_count) ||
+	    !resize_framebuffer(session)) {
+		return false;
+	}
+	struct Vnc_rfb_framebuffer_update_request request = {
+		.message_type = VNC_RFB_CLIENT_MESSAGE_TYPE_FRAMEBUFFER_UPDATE_REQUEST,
+		.incremental = false,
+		.x = htons(0),
+		.y = htons(0),
+		.width = htons(session->server_settings.width),
+		.height = htons(session->server_settings.height),
+	};
+	pthread_mutex_lock(&session->send_mutex);
+	enum Vnc_rfb_result result =
+		vnc_rfb_send_framebuffer_update_request(&session->send_queue, &request);
+	if (result == VNC_RFB_RESULT_SUCCESS) {
+		result = vnc_rfb_send_queue_flush(&session->send_queue);
+	}
+	pthread_mutex_unlock(&session->send_mutex);
+	if (result != VNC_RFB_RESULT_SUCCESS) {
+		vnc_log_error("Requesting a full update failed: %s", vnc_rfb_result_to_str(result));
+		return false;
+	}
+	// The desktop may have been resized while the connection was down
+	return set_event(session, VNC_SESSION_EVENT_SET_DESKTOP_SIZE);
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
@@ -2,18 +2,64 @@
 
 #include <pthread.h>
 
+#include "adaptive.h"
+#include "cursor.h"
 #include "fb.h"
 #include "fb_mngr.h"
 #include "input_state.h"
+#include "pixel.h"
 #include "rfb.h"
+#include "tight.h"
+#include "tls.h"
+#include "transport.h"
+#include "trle.h"
 #include "types.h"
+#include "uring.h"
+#include "zrle.h"
 
 enum Vnc_session_event {
 	VNC_SESSION_EVENT_SET_DESKTOP_SIZE = 1,
 };
 
+// Where the next received bytes go
+enum Vnc_session_recv_state {
+	VNC_SESSION_RECV_STATE_MESSAGE,
+	VNC_SESSION_RECV_STATE_FRAMEBUFFER_UPDATE,
+	VNC_SESSION_RECV_STATE_CUT_TEXT,
+};
+
+struct Vnc_session_options {
+	bool serial_decode; // Decode Tight's zlib streams on the session thread only
+	const char *pixel_format; // Wire format to request by name, NULL keeps the server's
+	bool fixed_encodings; // Keep the initial encodings instead of adapting them to the link
+	bool io_uring; // Receive and send through io_uring instead of recv() and write()
+	bool single_threaded; // Receive on the main thread from the event loop, no threads at all
+	struct Vnc_transport_options transport;
+	struct Vnc_tls_options tls;
+};
+
 struct Vnc_session {
 	int fd;
+	// What it takes to connect again when the connection drops
+	const char *address;
+	struct Vnc_transport_options transport_options;
+	struct Vnc_tls_options tls_options;
+	struct Vnc_tls tls;
+	char passwd[9]; // VNC authentication only uses the first 8 characters
+	bool shared_connection;
+	// The display's outputs as the desktop layout asked for, in host byte order
+	struct Vnc_rfb_screen screens[VNC_RFB_MAX_SCREENS];
+	u8 screen_count;
+	bool connected; // Input is dropped while there is no connection, guarded by send_mutex
+	u64 disconnected_ns; // When the connection dropped, until the first update after it
+	u32 reconnect_attempts;
+	bool parallel_decode;
+	struct Vnc_rfb_stream stream;
+	pthread_mutex_t send_mutex; // Input is queued on the main thread, fences on the session's
+	struct Vnc_rfb_send_queue send_queue;
+	bool use_io_uring;
+	struct Vnc_uring recv_uring;
+	struct Vnc_uring send_uring;
 	int event_fd;
 	u32 event_bitmask;
 	pthread_mutex_t event_mutex;
@@ -21,28 +67,50 @@ struct Vnc_session {
 	bool server_supports_continuous_updates;
 	bool server_supports_fence;
 	bool continuous_updates_enabled;
-	struct Vnc_rfb_pointer_event last_sent_pointer_event;
+	struct Vnc_rfb_pointer_event last_sent_pointer_event; // Guarded by send_mutex
+	bool single_threaded;
 	pthread_t thread_id;
+	enum Vnc_session_recv_state recv_state;
+	struct Vnc_rfb_framebuffer_update update; // The one being received
+	u32 cut_text_left;
 	struct Vnc_rfb_framebuffer_update_action fbu_actions;
 	struct Vnc_fb_mngr *fb_mngr;
+	struct Vnc_zrle zrle;
+	struct Vnc_trle trle;
+	struct Vnc_cursor cursor;
+	bool pixel_format_requested;
+	struct Vnc_rfb_pixel_format requested_pixel_format;
+	struct Vnc_pixel_converter pixel_converter;
+	struct Vnc_tight tight;
+	struct Vnc_adaptive adaptive;
 };
 
-bool vnc_session_init(struct Vnc_session *session);
-bool vnc_session_connect(struct Vnc_session *session, const char *address, u16 port);
+bool vnc_session_init(struct Vnc_session *session, struct Vnc_session_options *options);
+// `address` as vnc_transport_connect takes it, kept for reconnecting
+bool vnc_session_connect(struct Vnc_session *session, const char *address);
 bool vnc_session_initial_handshake(struct Vnc_session *session,
 				   enum Vnc_rfb_security_type *security);
 bool vnc_session_send_auth(struct Vnc_session *session, const char *passwd,
 			   enum Vnc_rfb_security_type security);
+// Becomes readable when the server sent something
 int vnc_session_get_fd(struct Vnc_session *session);
+// Asks the server to lay its desktop out like `screens`, one per output of the display
 bool vnc_session_exchange_connection_params(struct Vnc_session *session, bool shared_connection,
-					    u16 screen_width, u16 screen_height);
-bool vnc_session_handle_message(struct Vnc_session *session);
+					    const struct Vnc_rfb_screen *screens,
+					    u8 screen_count);
+// Processes whatever the server sent so far, never waiting for more
+bool vnc_session_handle_input(struct Vnc_session *session);
+// Drops the broken connection and connects again, waiting longer after each failed attempt. The
+// framebuffers stay as they are until the server sent them again. Returns false when giving up.
+bool vnc_session_reconnect(struct Vnc_session *session);
 bool vnc_session_start_processing_continuous_updates(struct Vnc_session *session,
 						     struct Vnc_fb_mngr *fb_mngr);
 bool vnc_session_send_pointer_event(struct Vnc_session *session, u16 xpos, u16 ypos,
 				    u8 button_mask);
 bool vnc_session_send_key_event(struct Vnc_session *session,
 				struct Vnc_input_state_key_event *key_event);
+// Sends the pointer, key and fence messages queued since the last flush
+bool vnc_session_flush(struct Vnc_session *session);
 int vnc_session_get_event_fd(struct Vnc_session *session);
 u32 vnc_session_get_events(struct Vnc_session *session);
 bool vnc_session_handle_fence(struct Vnc_session *session);
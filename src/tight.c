@@ -0,0 +1,856 @@
+#include "tight.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TIGHT_SSSE3
+#define SSSE3 __attribute__((target("ssse3")))
+#include <immintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "draw.h"
+#include "log.h"
+#include "macros.h"
+
+enum {
+	COMPRESSION_FILL = 0x8,
+	COMPRESSION_JPEG = 0x9,
+	COMPRESSION_BASIC_MAX = 0x7,
+	COMPRESSION_READ_FILTER = 0x4,
+	COMPRESSION_STREAM_MASK = 0x3,
+};
+
+enum {
+	FILTER_COPY = 0,
+	FILTER_PALETTE = 1,
+	FILTER_GRADIENT = 2,
+};
+
+// Data shorter than this is sent without zlib compression
+enum { MIN_TO_COMPRESS = 12 };
+
+static enum Vnc_rfb_result recv_fill(struct Vnc_tight *tight, struct Vnc_rfb_stream *rfb_stream,
+				     struct Vnc_rfb_rect *rect,
+				     struct Vnc_pixel_converter *converter,
+				     struct Vnc_framebuffer *framebuffer);
+static enum Vnc_rfb_result recv_jpeg(struct Vnc_tight *tight, struct Vnc_rfb_stream *rfb_stream,
+				     struct Vnc_rfb_rect *rect,
+				     struct Vnc_framebuffer *framebuffer);
+static enum Vnc_rfb_result recv_basic(struct Vnc_tight *tight, struct Vnc_rfb_stream *rfb_stream,
+				      u8 compression, struct Vnc_rfb_rect *rect,
+				      struct Vnc_pixel_converter *converter,
+				      struct Vnc_framebuffer *framebuffer);
+static enum Vnc_rfb_result recv_compact_length(struct Vnc_rfb_stream *rfb_stream, u32 *length);
+static enum Vnc_rfb_result peek_compact_length(struct Vnc_rfb_stream *rfb_stream, size_t *pos,
+					       u32 *length);
+static struct Vnc_tight_job *acquire_job(struct Vnc_tight *tight,
+					 struct Vnc_tight_stream *stream);
+static enum Vnc_rfb_result submit_job(struct Vnc_tight *tight, struct Vnc_tight_stream *stream);
+static void wait_for_stream(struct Vnc_tight_stream *stream, struct Vnc_rfb_rect *rect);
+static bool queued_job_intersects(struct Vnc_tight_stream *stream, struct Vnc_rfb_rect *rect);
+static void *stream_worker(void *args);
+static bool decode_job(struct Vnc_tight_stream *stream, struct Vnc_tight_job *job);
+static bool inflate_job(struct Vnc_tight_stream *stream, struct Vnc_tight_job *job);
+static void copy_filter(const u8 *src, u16 width, u16 height,
+			const struct Vnc_pixel_converter *converter, u32 *dest, u32 stride);
+static void expand_palette_bits(const u8 *src, const u32 *palette, u16 width, u16 height,
+				u32 *dest, u32 stride);
+#if defined(TIGHT_SSSE3)
+static SSSE3 void expand_palette16_ssse3(const u8 *src, const u32 *palette, u16 width,
+					 u16 height, u32 *dest, u32 stride);
+#endif
+static bool ensure_capacity(void **buf, size_t *capacity, size_t size);
+static u8 get_tpixel_size(const struct Vnc_rfb_pixel_format *pixel_format);
+static u32 read_tpixel(const u8 *src, const struct Vnc_pixel_converter *converter);
+static void jpeg_error_exit(j_common_ptr cinfo);
+
+bool vnc_tight_init(struct Vnc_tight *tight, bool parallel)
+{
+	*tight = (struct Vnc_tight){ .parallel = parallel };
+	for (size_t i = 0; i < ARRAY_COUNT(tight->streams); ++i) {
+		struct Vnc_tight_stream *stream = &tight->streams[i];
+		int rc = inflateInit(&stream->zstream);
+		if (rc != Z_OK) {
+			vnc_log_error("Tight: inflateInit failed (%d)", rc);
+			vnc_tight_deinit(tight);
+			return false;
+		}
+		stream->initialized = true;
+
+		if (parallel) {
+			pthread_mutex_init(&stream->mutex, NULL);
+			pthread_cond_init(&stream->work_cond, NULL);
+			pthread_cond_init(&stream->idle_cond, NULL);
+			rc = pthread_create(&stream->thread, NULL, stream_worker, stream);
+			if (rc != 0) {
+				vnc_log_error("Tight: unable to start worker for stream %zu", i);
+				pthread_cond_destroy(&stream->idle_cond);
+				pthread_cond_destroy(&stream->work_cond);
+				pthread_mutex_destroy(&stream->mutex);
+				vnc_tight_deinit(tight);
+				return false;
+			}
+			stream->thread_running = true;
+			(void)pthread_setname_np(stream->thread, "vnc_tight");
+		}
+	}
+
+	tight->jpeg.err = jpeg_std_error(&tight->jpeg_error.mgr);
+	tight->jpeg_error.mgr.error_exit = jpeg_error_exit;
+	jpeg_create_decompress(&tight->jpeg);
+	tight->jpeg_initialized = true;
+	return true;
+}
+
+void vnc_tight_deinit(struct Vnc_tight *tight)
+{
+	for (size_t i = 0; i < ARRAY_COUNT(tight->streams); ++i) {
+		struct Vnc_tight_stream *stream = &tight->streams[i];
+		if (stream->thread_running) {
+			pthread_mutex_lock(&stream->mutex);
+			stream->exit = true;
+			pthread_cond_signal(&stream->work_cond);
+			pthread_mutex_unlock(&stream->mutex);
+			pthread_join(stream->thread, NULL);
+			pthread_cond_destroy(&stream->idle_cond);
+			pthread_cond_destroy(&stream->work_cond);
+			pthread_mutex_destroy(&stream->mutex);
+		}
+		if (stream->initialized) {
+			inflateEnd(&stream->zstream);
+		}
+		for (size_t j = 0; j < ARRAY_COUNT(stream->jobs); ++j) {
+			free(stream->jobs[j].data);
+		}
+		free(stream->uncompressed);
+		free(stream->gradient_rows);
+	}
+	if (tight->jpeg_initialized) {
+		jpeg_destroy_decompress(&tight->jpeg);
+	}
+	free(tight->serial_job.data);
+	free(tight->jpeg_data);
+	*tight = (struct Vnc_tight){ 0 };
+}
+
+// Follows the header fields of vnc_tight_recv_rect up to the length of the data
+enum Vnc_rfb_result vnc_tight_measure_rect(struct Vnc_rfb_stream *rfb_stream,
+					   struct Vnc_rfb_rect *rect,
+					   struct Vnc_pixel_converter *converter)
+{
+	const u8 *data;
+	size_t len = vnc_rfb_stream_buffered(rfb_stream, &data);
+	size_t pos = 1;
+	if (len < pos) {
+		return vnc_rfb_stream_ensure(rfb_stream, pos);
+	}
+	u8 compression = data[0] >> 4;
+	u8 tpixel_size = get_tpixel_size(&converter->format);
+	u32 length;
+	if (compression == COMPRESSION_FILL) {
+		return vnc_rfb_stream_ensure(rfb_stream, pos + tpixel_size);
+	}
+	if (compression == COMPRESSION_JPEG) {
+		RFB_TRY(peek_compact_length(rfb_stream, &pos, &length));
+		return vnc_rfb_stream_ensure(rfb_stream, pos + length);
+	}
+	if (compression > COMPRESSION_BASIC_MAX) {
+		return VNC_RFB_RESULT_SUCCESS;
+	}
+
+	u8 filter = FILTER_COPY;
+	if ((compression & COMPRESSION_READ_FILTER) > 0) {
+		if (len < pos + 1) {
+			return vnc_rfb_stream_ensure(rfb_stream, pos + 1);
+		}
+		filter = data[pos++];
+	}
+	size_t row_size = rect->width * tpixel_size;
+	if (filter == FILTER_PALETTE) {
+		if (len < pos + 1) {
+			return vnc_rfb_stream_ensure(rfb_stream, pos + 1);
+		}
+		u16 palette_size = data[pos++] + 1;
+		pos += palette_size * tpixel_size;
+		row_size = palette_size == 2 ? (rect->width + 7) / 8 : rect->width;
+	}
+	if (row_size * rect->height < MIN_TO_COMPRESS) {
+		return vnc_rfb_stream_ensure(rfb_stream, pos + row_size * rect->height);
+	}
+	RFB_TRY(peek_compact_length(rfb_stream, &pos, &length));
+	return vnc_rfb_stream_ensure(rfb_stream, pos + length);
+}
+
+enum Vnc_rfb_result vnc_tight_recv_rect(struct Vnc_tight *tight, struct Vnc_rfb_stream *rfb_stream,
+					struct Vnc_rfb_rect *rect,
+					struct Vnc_pixel_converter *converter,
+					struct Vnc_framebuffer *framebuffer)
+{
+	u8 compression;
+	RFB_TRY_READ(rfb_stream, &compression, sizeof(compression));
+	// Resets are ordered with the stream's queued rects by applying them at its next rect
+	for (size_t i = 0; i < ARRAY_COUNT(tight->streams); ++i) {
+		if ((compression & (1 << i)) > 0) {
+			tight->streams[i].pending_reset = true;
+		}
+	}
+
+	compression >>= 4;
+	if (compression == COMPRESSION_FILL) {
+		return recv_fill(tight, rfb_stream, rect, converter, framebuffer);
+	}
+	if (compression == COMPRESSION_JPEG) {
+		return recv_jpeg(tight, rfb_stream, rect, framebuffer);
+	}
+	if (compression <= COMPRESSION_BASIC_MAX) {
+		return recv_basic(tight, rfb_stream, compression, rect, converter, framebuffer);
+	}
+	vnc_log_error("Tight: unsupported compression type %u", compression);
+	return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+}
+
+enum Vnc_rfb_result vnc_tight_sync(struct Vnc_tight *tight)
+{
+	if (!tight->parallel) {
+		return VNC_RFB_RESULT_SUCCESS;
+	}
+
+	bool failed = false;
+	for (size_t i = 0; i < ARRAY_COUNT(tight->streams); ++i) {
+		struct Vnc_tight_stream *stream = &tight->streams[i];
+		pthread_mutex_lock(&stream->mutex);
+		while (stream->job_count > 0 || stream->busy) {
+			pthread_cond_wait(&stream->idle_cond, &stream->mutex);
+		}
+		failed |= stream->failed;
+		stream->failed = false;
+		pthread_mutex_unlock(&stream->mutex);
+	}
+	return failed ? VNC_RFB_RESULT_ERROR_INVALID_DATA : VNC_RFB_RESULT_SUCCESS;
+}
+
+void vnc_tight_wait_for_rect(struct Vnc_tight *tight, struct Vnc_rfb_rect *rect)
+{
+	if (!tight->parallel) {
+		return;
+	}
+	for (size_t i = 0; i < ARRAY_COUNT(tight->streams); ++i) {
+		wait_for_stream(&tight->streams[i], rect);
+	}
+}
+
+static enum Vnc_rfb_result recv_fill(struct Vnc_tight *tight, struct Vnc_rfb_stream *rfb_stream,
+				     struct Vnc_rfb_rect *rect,
+				     struct Vnc_pixel_converter *converter,
+				     struct Vnc_framebuffer *framebuffer)
+{
+	u8 buf[4];
+	RFB_TRY_READ(rfb_stream, buf, get_tpixel_size(&converter->format));
+	u32 color = read_tpixel(buf, converter);
+	vnc_tight_wait_for_rect(tight, rect);
+	vnc_draw_fill_rect(framebuffer, rect->x, rect->y, rect->width, rect->height, color);
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+// JPEG data is always RGB; libjpeg-turbo writes BGRX which is XRGB8888 on little endian
+static enum Vnc_rfb_result recv_jpeg(struct Vnc_tight *tight, struct Vnc_rfb_stream *rfb_stream,
+				     struct Vnc_rfb_rect *rect, struct Vnc_framebuffer *framebuffer)
+{
+	u32 length;
+	enum Vnc_rfb_result result = recv_compact_length(rfb_stream, &length);
+	if (result != VNC_RFB_RESULT_SUCCESS) {
+		return result;
+	}
+	if (!ensure_capacity((void **)&tight->jpeg_data, &tight->jpeg_data_capacity, length)) {
+		return VNC_RFB_RESULT_ERROR_OUT_OF_MEMORY;
+	}
+	RFB_TRY_READ(rfb_stream, tight->jpeg_data, length);
+
+	struct jpeg_decompress_struct *jpeg = &tight->jpeg;
+	if (setjmp(tight->jpeg_error.jmp) != 0) {
+		jpeg_abort_decompress(jpeg);
+		return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+	}
+
+	jpeg_mem_src(jpeg, tight->jpeg_data, length);
+	jpeg_read_header(jpeg, TRUE);
+	jpeg->out_color_space = JCS_EXT_BGRX;
+	jpeg_start_decompress(jpeg);
+	if (jpeg->output_width != rect->width || jpeg->output_height != rect->height) {
+		vnc_log_error("Tight: JPEG size %ux%u does not match rect %ux%u",
+			      jpeg->output_width, jpeg->output_height, rect->width, rect->height);
+		jpeg_abort_decompress(jpeg);
+		return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+	}
+
+	vnc_tight_wait_for_rect(tight, rect);
+	u8 *dest = (u8 *)framebuffer->buffer + rect->y * framebuffer->pitch +
+		   rect->x * sizeof(u32);
+	while (jpeg->output_scanline < jpeg->output_height) {
+		JSAMPROW rows[16];
+		u32 row_count = MIN(ARRAY_COUNT(rows), jpeg->output_height - jpeg->output_scanline);
+		for (u32 i = 0; i < row_count; ++i) {
+			rows[i] = dest + (jpeg->output_scanline + i) * framebuffer->pitch;
+		}
+		jpeg_read_scanlines(jpeg, rows, row_count);
+	}
+	jpeg_finish_decompress(jpeg);
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+static enum Vnc_rfb_result recv_basic(struct Vnc_tight *tight, struct Vnc_rfb_stream *rfb_stream,
+				      u8 compression, struct Vnc_rfb_rect *rect,
+				      struct Vnc_pixel_converter *converter,
+				      struct Vnc_framebuffer *framebuffer)
+{
+	u8 filter = FILTER_COPY;
+	if ((compression & COMPRESSION_READ_FILTER) > 0) {
+		RFB_TRY_READ(rfb_stream, &filter, sizeof(filter));
+	}
+
+	struct Vnc_tight_stream *stream = &tight->streams[compression & COMPRESSION_STREAM_MASK];
+	struct Vnc_tight_job *job = acquire_job(tight, stream);
+	u8 tpixel_size = get_tpixel_size(&converter->format);
+	u32 stride = framebuffer->pitch / sizeof(u32);
+	job->filter = filter;
+	job->x = rect->x;
+	job->y = rect->y;
+	job->width = rect->width;
+	job->height = rect->height;
+	job->dest = (u32 *)framebuffer->buffer + rect->y * stride + rect->x;
+	job->stride = stride;
+	job->converter = converter;
+	job->palette_size = 0;
+
+	size_t row_size = rect->width * tpixel_size;
+	switch (filter) {
+	case FILTER_COPY:
+	case FILTER_GRADIENT:
+		break;
+	case FILTER_PALETTE: {
+		u8 max_index;
+		RFB_TRY_READ(rfb_stream, &max_index, sizeof(max_index));
+		job->palette_size = max_index + 1;
+
+		u8 buf[ARRAY_COUNT(job->palette) * 4];
+		RFB_TRY_READ(rfb_stream, buf, job->palette_size * tpixel_size);
+		memset(job->palette, 0, sizeof(job->palette));
+		for (u16 i = 0; i < job->palette_size; ++i) {
+			job->palette[i] = read_tpixel(&buf[i * tpixel_size], converter);
+		}
+		row_size = job->palette_size == 2 ? (rect->width + 7) / 8 : rect->width;
+	} break;
+	default:
+		vnc_log_error("Tight: unsupported filter %u", filter);
+		return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+	}
+
+	job->uncompressed_size = row_size * rect->height;
+	job->compressed = job->uncompressed_size >= MIN_TO_COMPRESS;
+	job->data_len = job->uncompressed_size;
+	if (job->compressed) {
+		u32 length;
+		enum Vnc_rfb_result result = recv_compact_length(rfb_stream, &length);
+		if (result != VNC_RFB_RESULT_SUCCESS) {
+			return result;
+		}
+		job->data_len = length;
+	}
+	if (!ensure_capacity((void **)&job->data, &job->data_capacity, job->data_len)) {
+		return VNC_RFB_RESULT_ERROR_OUT_OF_MEMORY;
+	}
+	RFB_TRY_READ(rfb_stream, job->data, job->data_len);
+
+	job->reset_stream = stream->pending_reset;
+	stream->pending_reset = false;
+	// Rects of one stream land in order, other streams have to be done with the area first
+	for (size_t i = 0; i < ARRAY_COUNT(tight->streams) && tight->parallel; ++i) {
+		if (&tight->streams[i] != stream) {
+			wait_for_stream(&tight->streams[i], rect);
+		}
+	}
+	return submit_job(tight, stream);
+}
+
+static enum Vnc_rfb_result recv_compact_length(struct Vnc_rfb_stream *rfb_stream, u32 *length)
+{
+	*length = 0;
+	for (u8 i = 0; i < 3; ++i) {
+		u8 byte;
+		RFB_TRY_READ(rfb_stream, &byte, sizeof(byte));
+		if (i == 2) {
+			*length |= (u32)byte << 14;
+			break;
+		}
+		*length |= (u32)(byte & 0x7f) << (7 * i);
+		if ((byte & 0x80) == 0) {
+			break;
+		}
+	}
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+// Reads the compact length at `*pos` into the buffered bytes and moves `*pos` past it
+static enum Vnc_rfb_result peek_compact_length(struct Vnc_rfb_stream *rfb_stream, size_t *pos,
+					       u32 *length)
+{
+	const u8 *data;
+	size_t len = vnc_rfb_stream_buffered(rfb_stream, &data);
+	*length = 0;
+	for (u8 i = 0; i < 3; ++i) {
+		if (len < *pos + 1) {
+			return vnc_rfb_stream_ensure(rfb_stream, *pos + 1);
+		}
+		u8 byte = data[(*pos)++];
+		if (i == 2) {
+			*length |= (u32)byte << 14;
+			break;
+		}
+		*length |= (u32)(byte & 0x7f) << (7 * i);
+		if ((byte & 0x80) == 0) {
+			break;
+		}
+	}
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+// Returns the next free job slot; in worker mode it is only handed to the worker by submit_job
+static struct Vnc_tight_job *acquire_job(struct Vnc_tight *tight,
+					 struct Vnc_tight_stream *stream)
+{
+	if (!tight->parallel) {
+		return &tight->serial_job;
+	}
+
+	pthread_mutex_lock(&stream->mutex);
+	while (stream->job_count == ARRAY_COUNT(stream->jobs)) {
+		pthread_cond_wait(&stream->idle_cond, &stream->mutex);
+	}
+	size_t index = (stream->job_head + stream->job_count) % ARRAY_COUNT(stream->jobs);
+	pthread_mutex_unlock(&stream->mutex);
+	return &stream->jobs[index];
+}
+
+static enum Vnc_rfb_result submit_job(struct Vnc_tight *tight, struct Vnc_tight_stream *stream)
+{
+	if (!tight->parallel) {
+		return decode_job(stream, &tight->serial_job) ? VNC_RFB_RESULT_SUCCESS :
+								VNC_RFB_RESULT_ERROR_INVALID_DATA;
+	}
+
+	pthread_mutex_lock(&stream->mutex);
+	stream->job_count += 1;
+	pthread_cond_signal(&stream->work_cond);
+	pthread_mutex_unlock(&stream->mutex);
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+static void wait_for_stream(struct Vnc_tight_stream *stream, struct Vnc_rfb_rect *rect)
+{
+	pthread_mutex_lock(&stream->mutex);
+	while (queued_job_intersects(stream, rect)) {
+		pthread_cond_wait(&stream->idle_cond, &stream->mutex);
+	}
+	pthread_mutex_unlock(&stream->mutex);
+}
+
+// The job being decoded stays queued until it is done. Call with the stream's mutex held.
+static bool queued_job_intersects(struct Vnc_tight_stream *stream, struct Vnc_rfb_rect *rect)
+{
+	for (size_t i = 0; i < stream->job_count; ++i) {
+		struct Vnc_tight_job *job =
+			&stream->jobs[(stream->job_head + i) % ARRAY_COUNT(stream->jobs)];
+		if ((u32)job->x < (u32)rect->x + rect->width &&
+		    (u32)rect->x < (u32)job->x + job->width &&
+		    (u32)job->y < (u32)rect->y + rect->height &&
+		    (u32)rect->y < (u32)job->y + job->height) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void *stream_worker(void *args)
+{
+	struct Vnc_tight_stream *stream = args;
+	pthread_mutex_lock(&stream->mutex);
+	for (;;) {
+		while (stream->job_count == 0 && !stream->exit) {
+			pthread_cond_wait(&stream->work_cond, &stream->mutex);
+		}
+		if (stream->exit) {
+			break;
+		}
+
+		struct Vnc_tight_job *job = &stream->jobs[stream->job_head];
+		stream->busy = true;
+		pthread_mutex_unlock(&stream->mutex);
+
+		bool ok = decode_job(stream, job);
+
+		pthread_mutex_lock(&stream->mutex);
+		stream->failed |= !ok;
+		stream->job_head = (stream->job_head + 1) % ARRAY_COUNT(stream->jobs);
+		stream->job_count -= 1;
+		stream->busy = false;
+		pthread_cond_broadcast(&stream->idle_cond);
+	}
+	pthread_mutex_unlock(&stream->mutex);
+	return NULL;
+}
+
+static bool decode_job(struct Vnc_tight_stream *stream, struct Vnc_tight_job *job)
+{
+	if (job->reset_stream) {
+		inflateReset(&stream->zstream);
+	}
+
+	const u8 *data = job->data;
+	if (job->compressed) {
+		if (!inflate_job(stream, job)) {
+			return false;
+		}
+		data = stream->uncompressed;
+	}
+
+	switch (job->filter) {
+	case FILTER_COPY:
+		copy_filter(data, job->width, job->height, job->converter, job->dest, job->stride);
+		break;
+	case FILTER_PALETTE:
+		vnc_tight_expand_palette(data, job->palette, job->palette_size, job->width,
+					 job->height, job->dest, job->stride);
+		break;
+	case FILTER_GRADIENT: {
+		size_t rows_size = VNC_TIGHT_GRADIENT_ROWS_LEN(job->width) * sizeof(u16);
+		if (!ensure_capacity((void **)&stream->gradient_rows,
+				     &stream->gradient_rows_capacity, rows_size)) {
+			return false;
+		}
+		vnc_tight_gradient_filter(data, stream->gradient_rows, job->width, job->height,
+					  job->converter, job->dest, job->stride);
+	} break;
+	}
+	return true;
+}
+
+static bool inflate_job(struct Vnc_tight_stream *stream, struct Vnc_tight_job *job)
+{
+	if (!ensure_capacity((void **)&stream->uncompressed, &stream->uncompressed_capacity,
+			     job->uncompressed_size)) {
+		return false;
+	}
+
+	z_stream *zstream = &stream->zstream;
+	zstream->next_in = job->data;
+	zstream->avail_in = job->data_len;
+	zstream->next_out = stream->uncompressed;
+	zstream->avail_out = job->uncompressed_size;
+	int rc = inflate(zstream, Z_SYNC_FLUSH);
+	if ((rc != Z_OK && rc != Z_STREAM_END) || zstream->avail_out != 0) {
+		vnc_log_error("Tight: inflate failed (%d)", rc);
+		return false;
+	}
+
+	// Consume the trailing sync flush marker, which inflates to nothing
+	while (zstream->avail_in > 0) {
+		u8 discard[64];
+		zstream->next_out = discard;
+		zstream->avail_out = sizeof(discard);
+		rc = inflate(zstream, Z_SYNC_FLUSH);
+		if (rc != Z_OK || zstream->avail_out != sizeof(discard)) {
+			vnc_log_error("Tight: trailing data after rect");
+			return false;
+		}
+	}
+	return true;
+}
+
+static void copy_filter(const u8 *src, u16 width, u16 height,
+			const struct Vnc_pixel_converter *converter, u32 *dest, u32 stride)
+{
+	u8 tpixel_size = get_tpixel_size(&converter->format);
+	for (u16 y = 0; y < height; ++y) {
+		u32 *row = dest + y * stride;
+		if (tpixel_size != 3) {
+			vnc_pixel_convert_row(converter, src, row, width);
+			src += width * tpixel_size;
+			continue;
+		}
+		for (u16 x = 0; x < width; ++x) {
+			row[x] = read_tpixel(src, converter);
+			src += tpixel_size;
+		}
+	}
+}
+
+/*
+ * Each colour component is predicted as left + above - above-left, clamped to the component
+ * range, and the wire carries the difference. The clamp makes every pixel depend on the one to
+ * its left, so a row can't be split into vector lanes. With SSE2 the three components of one
+ * pixel are the lanes instead. The row is kept as four components per pixel in XRGB8888 byte
+ * order, so a whole row of TPIXELs is packed into the destination four pixels at a time.
+ */
+void vnc_tight_gradient_filter(const u8 *src, u16 *rows, u16 width, u16 height,
+			       const struct Vnc_pixel_converter *converter, u32 *dest, u32 stride)
+{
+	const struct Vnc_rfb_pixel_format *pixel_format = &converter->format;
+	u8 tpixel_size = get_tpixel_size(pixel_format);
+	// Components in blue, green, red order, as they lie in XRGB8888
+	u8 shifts[3] = { pixel_format->blue_shift, pixel_format->green_shift,
+			 pixel_format->red_shift };
+	u16 max[3] = { pixel_format->blue_max, pixel_format->green_max, pixel_format->red_max };
+	// TPIXEL components land in XRGB8888 directly, other pixels are rebuilt and converted
+	if (tpixel_size == 3) {
+		max[0] = max[1] = max[2] = 255;
+		shifts[0] = 0;
+		shifts[1] = 8;
+		shifts[2] = 16;
+	}
+
+	size_t row_len = VNC_TIGHT_GRADIENT_ROWS_LEN(width) / 2;
+	u16 *prev_row = rows;
+	u16 *cur_row = rows + row_len;
+	memset(prev_row, 0, row_len * sizeof(*prev_row));
+
+	for (u16 y = 0; y < height; ++y) {
+		u32 *out = dest + y * stride;
+#ifdef __SSE2__
+		if (tpixel_size == 3) {
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i component_max = _mm_set1_epi16(255);
+			__m128i left = zero;
+			__m128i up_left = zero;
+			for (u16 x = 0; x < width; ++x) {
+				__m128i up = _mm_loadl_epi64((const __m128i *)&prev_row[x * 4]);
+				u32 packed_diff = src[2] | (u32)src[1] << 8 | (u32)src[0] << 16;
+				__m128i diff =
+					_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed_diff), zero);
+				__m128i predicted = _mm_sub_epi16(_mm_add_epi16(left, up), up_left);
+				predicted = _mm_min_epi16(predicted, component_max);
+				predicted = _mm_max_epi16(predicted, zero);
+				__m128i value = _mm_and_si128(_mm_add_epi16(predicted, diff),
+							      component_max);
+				_mm_storel_epi64((__m128i *)&cur_row[x * 4], value);
+				left = value;
+				up_left = up;
+				src += 3;
+			}
+			u16 x = 0;
+			for (; x + 4 <= width; x += 4) {
+				const __m128i *components = (const __m128i *)&cur_row[x * 4];
+				__m128i low = _mm_loadu_si128(components);
+				__m128i high = _mm_loadu_si128(components + 1);
+				_mm_storeu_si128((__m128i *)&out[x], _mm_packus_epi16(low, high));
+			}
+			for (; x < width; ++x) {
+				const u16 *components = &cur_row[x * 4];
+				out[x] = (u32)components[2] << 16 | (u32)components[1] << 8 |
+					 components[0];
+			}
+
+			u16 *tmp = prev_row;
+			prev_row = cur_row;
+			cur_row = tmp;
+			continue;
+		}
+#endif
+		i32 left[3] = { 0 };
+		i32 up_left[3] = { 0 };
+		for (u16 x = 0; x < width; ++x) {
+			u32 diff[3];
+			if (tpixel_size == 3) {
+				diff[0] = src[2];
+				diff[1] = src[1];
+				diff[2] = src[0];
+			} else {
+				u32 pixel = vnc_pixel_read_value(converter, src);
+				for (u8 c = 0; c < 3; ++c) {
+					diff[c] = pixel >> shifts[c];
+				}
+			}
+			src += tpixel_size;
+
+			u32 pixel = 0;
+			for (u8 c = 0; c < 3; ++c) {
+				i32 up = prev_row[x * 4 + c];
+				i32 predicted = left[c] + up - up_left[c];
+				predicted = MIN(MAX(predicted, 0), max[c]);
+				u16 value = (predicted + diff[c]) & max[c];
+				cur_row[x * 4 + c] = value;
+				pixel |= (u32)value << shifts[c];
+				left[c] = value;
+				up_left[c] = up;
+			}
+			out[x] = tpixel_size == 3 ? pixel : vnc_pixel_convert(converter, pixel);
+		}
+
+		u16 *tmp = prev_row;
+		prev_row = cur_row;
+		cur_row = tmp;
+	}
+}
+
+void vnc_tight_expand_palette(const u8 *src, const u32 *palette, u16 palette_size, u16 width,
+			      u16 height, u32 *dest, u32 stride)
+{
+	if (palette_size == 2) {
+		expand_palette_bits(src, palette, width, height, dest, stride);
+		return;
+	}
+#if defined(TIGHT_SSSE3)
+	if (palette_size <= 16 && __builtin_cpu_supports("ssse3")) {
+		expand_palette16_ssse3(src, palette, width, height, dest, stride);
+		return;
+	}
+#endif
+	for (u16 y = 0; y < height; ++y) {
+		u32 *row = dest + y * stride;
+		for (u16 x = 0; x < width; ++x) {
+			row[x] = palette[*src++];
+		}
+	}
+}
+
+// One bit per pixel, rows padded to whole bytes
+static void expand_palette_bits(const u8 *src, const u32 *palette, u16 width, u16 height,
+				u32 *dest, u32 stride)
+{
+#ifdef __SSE2__
+	// Each byte is spread over eight lanes, and the lanes whose bit is set pick colour 1
+	const __m128i high_bits = _mm_set_epi32(0x10, 0x20, 0x40, 0x80);
+	const __m128i low_bits = _mm_set_epi32(0x1, 0x2, 0x4, 0x8);
+	const __m128i color0 = _mm_set1_epi32(palette[0]);
+	const __m128i color1 = _mm_set1_epi32(palette[1]);
+#endif
+	for (u16 y = 0; y < height; ++y) {
+		u32 *row = dest + y * stride;
+		u16 x = 0;
+		for (; x + 8 <= width; x += 8) {
+			u8 bits = *src++;
+#ifdef __SSE2__
+			__m128i spread = _mm_set1_epi32(bits);
+			__m128i high = _mm_cmpeq_epi32(_mm_and_si128(spread, high_bits), high_bits);
+			__m128i low = _mm_cmpeq_epi32(_mm_and_si128(spread, low_bits), low_bits);
+			_mm_storeu_si128((__m128i *)&row[x],
+					 _mm_or_si128(_mm_and_si128(high, color1),
+						      _mm_andnot_si128(high, color0)));
+			_mm_storeu_si128((__m128i *)&row[x + 4],
+					 _mm_or_si128(_mm_and_si128(low, color1),
+						      _mm_andnot_si128(low, color0)));
+#else
+			row[x] = palette[bits >> 7];
+			row[x + 1] = palette[(bits >> 6) & 1];
+			row[x + 2] = palette[(bits >> 5) & 1];
+			row[x + 3] = palette[(bits >> 4) & 1];
+			row[x + 4] = palette[(bits >> 3) & 1];
+			row[x + 5] = palette[(bits >> 2) & 1];
+			row[x + 6] = palette[(bits >> 1) & 1];
+			row[x + 7] = palette[bits & 1];
+#endif
+		}
+		if (x < width) {
+			u8 bits = *src++;
+			for (u8 bit = 7; x < width; ++x, --bit) {
+				row[x] = palette[(bits >> bit) & 1];
+			}
+		}
+	}
+}
+
+#if defined(TIGHT_SSSE3)
+// The palette split into byte planes, each of them a 16 entry pshufb table. Indices past the
+// palette get its zeroed entries like in the scalar code, indices past 16 get 0 as well.
+static SSSE3 void expand_palette16_ssse3(const u8 *src, const u32 *palette, u16 width,
+					 u16 height, u32 *dest, u32 stride)
+{
+	u8 planes[4][16];
+	for (u8 i = 0; i < 16; ++i) {
+		for (u8 b = 0; b < 4; ++b) {
+			planes[b][i] = palette[i] >> (b * 8);
+		}
+	}
+	const __m128i plane0 = _mm_loadu_si128((const __m128i *)planes[0]);
+	const __m128i plane1 = _mm_loadu_si128((const __m128i *)planes[1]);
+	const __m128i plane2 = _mm_loadu_si128((const __m128i *)planes[2]);
+	const __m128i plane3 = _mm_loadu_si128((const __m128i *)planes[3]);
+	const __m128i last_index = _mm_set1_epi8(15);
+	for (u16 y = 0; y < height; ++y) {
+		u32 *row = dest + y * stride;
+		u16 x = 0;
+		for (; x + 16 <= width; x += 16) {
+			__m128i indices = _mm_loadu_si128((const __m128i *)&src[x]);
+			// pshufb gives 0 for indices with the top bit set
+			indices = _mm_or_si128(indices, _mm_cmpgt_epi8(indices, last_index));
+			__m128i bytes0 = _mm_shuffle_epi8(plane0, indices);
+			__m128i bytes1 = _mm_shuffle_epi8(plane1, indices);
+			__m128i bytes2 = _mm_shuffle_epi8(plane2, indices);
+			__m128i bytes3 = _mm_shuffle_epi8(plane3, indices);
+			__m128i low01 = _mm_unpacklo_epi8(bytes0, bytes1);
+			__m128i high01 = _mm_unpackhi_epi8(bytes0, bytes1);
+			__m128i low23 = _mm_unpacklo_epi8(bytes2, bytes3);
+			__m128i high23 = _mm_unpackhi_epi8(bytes2, bytes3);
+			_mm_storeu_si128((__m128i *)&row[x], _mm_unpacklo_epi16(low01, low23));
+			_mm_storeu_si128((__m128i *)&row[x + 4], _mm_unpackhi_epi16(low01, low23));
+			_mm_storeu_si128((__m128i *)&row[x + 8],
+					 _mm_unpacklo_epi16(high01, high23));
+			_mm_storeu_si128((__m128i *)&row[x + 12],
+					 _mm_unpackhi_epi16(high01, high23));
+		}
+		for (; x < width; ++x) {
+			row[x] = palette[src[x]];
+		}
+		src += width;
+	}
+}
+#endif
+
+static bool ensure_capacity(void **buf, size_t *capacity, size_t size)
+{
+	if (size <= *capacity) {
+		return true;
+	}
+	void *resized = realloc(*buf, size);
+	if (resized == NULL) {
+		vnc_log_error("Tight: unable to allocate %zu bytes", size);
+		return false;
+	}
+	*buf = resized;
+	*capacity = size;
+	return true;
+}
+
+// A TPIXEL is three bytes of red, green and blue for 24 bit colour in a 32 bpp pixel
+static u8 get_tpixel_size(const struct Vnc_rfb_pixel_format *pixel_format)
+{
+	if (pixel_format->bpp == 32 && pixel_format->depth == 24 && pixel_format->true_color &&
+	    pixel_format->red_max == 255 && pixel_format->green_max == 255 &&
+	    pixel_format->blue_max == 255) {
+		return 3;
+	}
+	return pixel_format->bpp / 8;
+}
+
+// TPIXELs are in red, green, blue order whatever the shifts, everything else is a PIXEL
+static u32 read_tpixel(const u8 *src, const struct Vnc_pixel_converter *converter)
+{
+	if (get_tpixel_size(&converter->format) == 3) {
+		return (u32)src[0] << 16 | (u32)src[1] << 8 | src[2];
+	}
+	return vnc_pixel_read(converter, src);
+}
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	struct Vnc_tight_jpeg_error *error = (struct Vnc_tight_jpeg_error *)cinfo->err;
+	char msg[JMSG_LENGTH_MAX];
+	cinfo->err->format_message(cinfo, msg);
+	vnc_log_error("Tight: JPEG decode failed: %s", msg);
+	longjmp(error->jmp, 1);
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <jpeglib.h>
+#include <zlib.h>
+
+#include "fb.h"
+#include "pixel.h"
+#include "rfb.h"
+#include "types.h"
+
+#define VNC_TIGHT_STREAM_COUNT 4
+#define VNC_TIGHT_QUEUE_LEN 16
+// Components the gradient filter keeps for its two rows, four per pixel
+#define VNC_TIGHT_GRADIENT_ROWS_LEN(width) (2 * 4 * (size_t)(width))
+
+struct Vnc_tight_jpeg_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jmp;
+};
+
+// A basic compression rect read off the wire, waiting to be inflated and filtered
+struct Vnc_tight_job {
+	bool reset_stream;
+	u8 filter;
+	bool compressed;
+	u16 x;
+	u16 y;
+	u16 width;
+	u16 height;
+	u32 *dest;
+	u32 stride;
+	const struct Vnc_pixel_converter *converter;
+	u16 palette_size;
+	u32 palette[256];
+	size_t uncompressed_size;
+	u8 *data;
+	size_t data_len;
+	size_t data_capacity;
+};
+
+struct Vnc_tight_stream {
+	z_stream zstream;
+	bool initialized;
+	bool pending_reset;
+	u8 *uncompressed;
+	size_t uncompressed_capacity;
+	// VNC_TIGHT_GRADIENT_ROWS_LEN unfiltered colour components for the gradient filter
+	u16 *gradient_rows;
+	size_t gradient_rows_capacity;
+
+	// Worker mode: jobs for this stream are decoded in order on a thread of its own
+	pthread_t thread;
+	bool thread_running;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t idle_cond;
+	struct Vnc_tight_job jobs[VNC_TIGHT_QUEUE_LEN];
+	size_t job_head;
+	size_t job_count;
+	bool busy;
+	bool failed;
+	bool exit;
+};
+
+struct Vnc_tight {
+	struct Vnc_tight_stream streams[VNC_TIGHT_STREAM_COUNT];
+	bool parallel;
+	struct Vnc_tight_job serial_job;
+	struct jpeg_decompress_struct jpeg;
+	struct Vnc_tight_jpeg_error jpeg_error;
+	bool jpeg_initialized;
+	u8 *jpeg_data;
+	size_t jpeg_data_capacity;
+};
+
+bool vnc_tight_init(struct Vnc_tight *tight, bool parallel);
+void vnc_tight_deinit(struct Vnc_tight *tight);
+// Returns VNC_RFB_RESULT_WOULD_BLOCK until all data of the rect is buffered
+enum Vnc_rfb_result vnc_tight_measure_rect(struct Vnc_rfb_stream *rfb_stream,
+					   struct Vnc_rfb_rect *rect,
+					   struct Vnc_pixel_converter *converter);
+enum Vnc_rfb_result vnc_tight_recv_rect(struct Vnc_tight *tight, struct Vnc_rfb_stream *rfb_stream,
+					struct Vnc_rfb_rect *rect,
+					struct Vnc_pixel_converter *converter,
+					struct Vnc_framebuffer *framebuffer);
+// Waits until every queued rect is in the framebuffer
+enum Vnc_rfb_result vnc_tight_sync(struct Vnc_tight *tight);
+// Waits until no queued rect overlaps `rect`, so drawing into it lands on top of them
+void vnc_tight_wait_for_rect(struct Vnc_tight *tight, struct Vnc_rfb_rect *rect);
+// Expands palette indices, a bit per pixel for two colours and a byte otherwise
+void vnc_tight_expand_palette(const u8 *src, const u32 *palette, u16 palette_size, u16 width,
+			      u16 height, u32 *dest, u32 stride);
+// Undoes the gradient filter, `rows` has room for VNC_TIGHT_GRADIENT_ROWS_LEN(width) components
+void vnc_tight_gradient_filter(const u8 *src, u16 *rows, u16 width, u16 height,
+			       const struct Vnc_pixel_converter *converter, u32 *dest, u32 stride);
@@ -0,0 +1,222 @@
+#include "tls.h"
+
+#include <errno.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+// Ciphers the kernel can take over
+#define CIPHER_LIST "ECDHE+AESGCM:ECDHE+CHACHA20"
+// One TLS record of plaintext
+#define RELAY_BUFFER_SIZE 16384
+
+static bool start_relay(struct Vnc_tls *tls, int sock_fd, int *plain_fd);
+static void *relay_thread(void *args);
+static bool relay_to_plain(struct Vnc_tls *tls, u8 *buffer);
+static bool relay_to_tls(struct Vnc_tls *tls, u8 *buffer);
+static void log_ssl_error(const char *what);
+
+bool vnc_tls_connect(struct Vnc_tls *tls, int sock_fd, const char *host,
+		     struct Vnc_tls_options *options, int *plain_fd)
+{
+	*tls = (struct Vnc_tls){ .sock_fd = -1, .relay_fd = -1 };
+	tls->ctx = SSL_CTX_new(TLS_client_method());
+	if (tls->ctx == NULL) {
+		log_ssl_error("SSL_CTX_new");
+		return false;
+	}
+	SSL_CTX_set_min_proto_version(tls->ctx, TLS1_2_VERSION);
+	if (options->kernel_tls) {
+		// TLS 1.3 servers send session tickets after the handshake, plain recv() can't take
+		// those from the kernel
+		SSL_CTX_set_max_proto_version(tls->ctx, TLS1_2_VERSION);
+		SSL_CTX_set_options(tls->ctx, SSL_OP_ENABLE_KTLS);
+	}
+	if (SSL_CTX_set_cipher_list(tls->ctx, CIPHER_LIST) != 1) {
+		log_ssl_error("SSL_CTX_set_cipher_list");
+		goto err;
+	}
+	SSL_CTX_set_verify(tls->ctx, SSL_VERIFY_PEER, NULL);
+	int rc = options->ca_file != NULL ?
+			 SSL_CTX_load_verify_locations(tls->ctx, options->ca_file, NULL) :
+			 SSL_CTX_set_default_verify_paths(tls->ctx);
+	if (rc != 1) {
+		log_ssl_error("Loading CA certificates");
+		goto err;
+	}
+
+	tls->ssl = SSL_new(tls->ctx);
+	if (tls->ssl == NULL || SSL_set_fd(tls->ssl, sock_fd) != 1) {
+		log_ssl_error("SSL_new");
+		goto err;
+	}
+	if (host != NULL && SSL_set1_host(tls->ssl, host) != 1) {
+		log_ssl_error("SSL_set1_host");
+		goto err;
+	}
+	if (SSL_connect(tls->ssl) != 1) {
+		long verify_result = SSL_get_verify_result(tls->ssl);
+		if (verify_result != X509_V_OK) {
+			vnc_log_error("Server certificate rejected: %s",
+				      X509_verify_cert_error_string(verify_result));
+		} else {
+			log_ssl_error("TLS handshake");
+		}
+		goto err;
+	}
+
+	bool ktls_send = BIO_get_ktls_send(SSL_get_wbio(tls->ssl));
+	bool ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(tls->ssl));
+	vnc_log_info("%s %s, kernel TLS: send %s, receive %s", SSL_get_version(tls->ssl),
+		     SSL_get_cipher_name(tls->ssl), ktls_send ? "yes" : "no",
+		     ktls_recv ? "yes" : "no");
+	if (ktls_send && ktls_recv) {
+		*plain_fd = sock_fd;
+		return true;
+	}
+	if (!start_relay(tls, sock_fd, plain_fd)) {
+		goto err;
+	}
+	return true;
+
+err:
+	SSL_free(tls->ssl);
+	SSL_CTX_free(tls->ctx);
+	*tls = (struct Vnc_tls){ .sock_fd = -1, .relay_fd = -1 };
+	return false;
+}
+
+void vnc_tls_deinit(struct Vnc_tls *tls)
+{
+	if (tls->relaying) {
+		// Wakes the relay out of a blocking read on either side
+		shutdown(tls->sock_fd, SHUT_RDWR);
+		shutdown(tls->relay_fd, SHUT_RDWR);
+		pthread_join(tls->relay_thread, NULL);
+		close(tls->relay_fd);
+		close(tls->sock_fd);
+	}
+	SSL_free(tls->ssl);
+	SSL_CTX_free(tls->ctx);
+	*tls = (struct Vnc_tls){ .sock_fd = -1, .relay_fd = -1 };
+}
+
+static bool start_relay(struct Vnc_tls *tls, int sock_fd, int *plain_fd)
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+		vnc_log_error("socketpair failed: %s", strerror(errno));
+		return false;
+	}
+	// Same timeouts as on the server socket, the handshake reads block
+	struct timeval tv = { 1, 0 };
+	if (setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0 ||
+	    setsockopt(fds[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) != 0) {
+		vnc_log_error("setsockopt failed: %s", strerror(errno));
+		goto err;
+	}
+	tls->sock_fd = sock_fd;
+	tls->relay_fd = fds[1];
+	if (pthread_create(&tls->relay_thread, NULL, relay_thread, tls) != 0) {
+		vnc_log_error("Unable to start the TLS relay");
+		goto err;
+	}
+	(void)pthread_setname_np(tls->relay_thread, "vnc_tls");
+	tls->relaying = true;
+	vnc_log_info("Decrypting in user space");
+	*plain_fd = fds[0];
+	return true;
+
+err:
+	close(fds[0]);
+	close(fds[1]);
+	tls->sock_fd = -1;
+	tls->relay_fd = -1;
+	return false;
+}
+
+// The only user of the SSL object once the handshake is done, so it needs no lock
+static void *relay_thread(void *args)
+{
+	struct Vnc_tls *tls = args;
+	u8 buffer[RELAY_BUFFER_SIZE];
+	struct pollfd pollfds[2] = {
+		{ .fd = tls->sock_fd, .events = POLLIN },
+		{ .fd = tls->relay_fd, .events = POLLIN },
+	};
+	for (;;) {
+		// Records already read off the socket don't make it readable again
+		if (SSL_pending(tls->ssl) > 0) {
+			pollfds[0].revents = POLLIN;
+			pollfds[1].revents = 0;
+		} else if (poll(pollfds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (pollfds[0].revents != 0 && !relay_to_plain(tls, buffer)) {
+			break;
+		}
+		if (pollfds[1].revents != 0 && !relay_to_tls(tls, buffer)) {
+			break;
+		}
+	}
+	// The session sees the connection close
+	shutdown(tls->relay_fd, SHUT_RDWR);
+	return NULL;
+}
+
+static bool relay_to_plain(struct Vnc_tls *tls, u8 *buffer)
+{
+	int len = SSL_read(tls->ssl, buffer, RELAY_BUFFER_SIZE);
+	if (len <= 0) {
+		int error = SSL_get_error(tls->ssl, len);
+		// A partial record, or the socket timing out in the middle of one
+		return error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE;
+	}
+	for (int done = 0; done < len;) {
+		ssize_t written = send(tls->relay_fd, buffer + done, len - done, MSG_NOSIGNAL);
+		if (written < 0 && errno != EINTR && errno != EAGAIN) {
+			return false;
+		}
+		done += written > 0 ? written : 0;
+	}
+	return true;
+}
+
+static bool relay_to_tls(struct Vnc_tls *tls, u8 *buffer)
+{
+	ssize_t len = recv(tls->relay_fd, buffer, RELAY_BUFFER_SIZE, MSG_DONTWAIT);
+	if (len <= 0) {
+		return len < 0 && (errno == EINTR || errno == EAGAIN);
+	}
+	for (;;) {
+		int written = SSL_write(tls->ssl, buffer, len);
+		if (written > 0) {
+			return true;
+		}
+		int error = SSL_get_error(tls->ssl, written);
+		if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+			return false;
+		}
+	}
+}
+
+static void log_ssl_error(const char *what)
+{
+	unsigned long error = ERR_get_error();
+	char buf[256] = "unknown error";
+	if (error != 0) {
+		ERR_error_string_n(error, buf, sizeof(buf));
+	}
+	vnc_log_error("%s failed: %s", what, buf);
+	ERR_clear_error();
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "types.h"
+
+struct ssl_ctx_st;
+struct ssl_st;
+
+struct Vnc_tls_options {
+	bool required; // Refuse servers that don't offer VeNCrypt with X.509
+	const char *ca_file; // Certificates to verify the server with, NULL uses the system's
+	bool kernel_tls; // Hand the record layer to the kernel after the handshake when it can
+};
+
+// TLS on top of the server socket. Once the kernel took over the record layer the socket itself
+// carries plaintext. Otherwise a thread relays between the socket and one end of a socket pair,
+// so the rest of the client reads and writes plaintext through an fd either way.
+struct Vnc_tls {
+	struct ssl_ctx_st *ctx;
+	struct ssl_st *ssl;
+	bool relaying;
+	int sock_fd; // Owned while relaying
+	int relay_fd; // The relay's end of the socket pair
+	pthread_t relay_thread;
+};
+
+// Runs the handshake on `sock_fd` and verifies the server certificate, its name against `host`
+// unless that is NULL. `plain_fd` is set to the fd to use from then on: `sock_fd` with kernel TLS,
+// the other end of the socket pair when relaying.
+bool vnc_tls_connect(struct Vnc_tls *tls, int sock_fd, const char *host,
+		     struct Vnc_tls_options *options, int *plain_fd);
+// Call after closing `plain_fd`, stops the relay
+void vnc_tls_deinit(struct Vnc_tls *tls);
@@ -0,0 +1,177 @@
+#include "transport.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define UNIX_PREFIX "unix:"
+
+static int connect_unix(const char *path, struct Vnc_transport_options *options);
+static int connect_tcp(const char *address, struct Vnc_transport_options *options);
+static bool split_host_port(const char *address, char *host, size_t host_size,
+			    const char **port);
+static bool set_socket_options(int sock, bool tcp, struct Vnc_transport_options *options);
+
+int vnc_transport_connect(const char *address, struct Vnc_transport_options *options)
+{
+	if (strncmp(address, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0) {
+		return connect_unix(address + strlen(UNIX_PREFIX), options);
+	}
+	return connect_tcp(address, options);
+}
+
+bool vnc_transport_get_host(const char *address, char *host, size_t host_size)
+{
+	if (strncmp(address, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0) {
+		return false;
+	}
+	const char *port;
+	return split_host_port(address, host, host_size, &port);
+}
+
+static int connect_unix(const char *path, struct Vnc_transport_options *options)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		vnc_log_error("Unix socket path too long: %s", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1) {
+		vnc_log_error("Socket create failed: %s", strerror(errno));
+		return -1;
+	}
+	if (!set_socket_options(sock, false, options)) {
+		close(sock);
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		vnc_log_error("connect to %s failed: %s", path, strerror(errno));
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static int connect_tcp(const char *address, struct Vnc_transport_options *options)
+{
+	char host[256];
+	const char *port;
+	if (!split_host_port(address, host, sizeof(host), &port)) {
+		vnc_log_error("Invalid server address: %s", address);
+		return -1;
+	}
+
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_ADDRCONFIG,
+	};
+	struct addrinfo *addrs;
+	int rc = getaddrinfo(host, port, &hints, &addrs);
+	if (rc != 0) {
+		vnc_log_error("Resolving %s failed: %s", host, gai_strerror(rc));
+		return -1;
+	}
+
+	int sock = -1;
+	for (struct addrinfo *ai = addrs; ai != NULL && sock == -1; ai = ai->ai_next) {
+		sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (sock == -1) {
+			continue;
+		}
+		if (!set_socket_options(sock, true, options) ||
+		    connect(sock, ai->ai_addr, ai->ai_addrlen) == -1) {
+			vnc_log_debug("connect to %s port %s failed: %s", host, port,
+				      strerror(errno));
+			close(sock);
+			sock = -1;
+		}
+	}
+	freeaddrinfo(addrs);
+	if (sock == -1) {
+		vnc_log_error("connect to %s failed", address);
+	}
+	return sock;
+}
+
+// IPv6 addresses have colons of their own, with a port they are written in brackets
+static bool split_host_port(const char *address, char *host, size_t host_size, const char **port)
+{
+	const char *host_start = address;
+	size_t host_len;
+	const char *rest;
+	if (address[0] == '[') {
+		const char *end = strchr(address, ']');
+		if (end == NULL) {
+			return false;
+		}
+		host_start = address + 1;
+		host_len = end - host_start;
+		rest = end + 1;
+	} else {
+		const char *colon = strchr(address, ':');
+		if (colon == NULL || strchr(colon + 1, ':') != NULL) {
+			// No port, or a bare IPv6 address
+			colon = address + strlen(address);
+		}
+		host_len = colon - address;
+		rest = colon;
+	}
+
+	if (rest[0] == '\0') {
+		*port = VNC_TRANSPORT_DEFAULT_PORT;
+	} else if (rest[0] == ':' && rest[1] != '\0') {
+		*port = rest + 1;
+	} else {
+		return false;
+	}
+	if (host_len == 0 || host_len >= host_size) {
+		return false;
+	}
+	memcpy(host, host_start, host_len);
+	host[host_len] = '\0';
+	return true;
+}
+
+static bool set_socket_options(int sock, bool tcp, struct Vnc_transport_options *options)
+{
+	// The handshake reads block, a server that stops answering must not hang them forever
+	struct timeval tv = { 1, 0 };
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0 ||
+	    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) != 0) {
+		vnc_log_error("setsockopt failed: %s", strerror(errno));
+		return false;
+	}
+
+	int flag = 1;
+	if (tcp && setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) != 0) {
+		vnc_log_error("setsockopt failed: %s", strerror(errno));
+		return false;
+	}
+
+	// Set before connect, so TCP can scale its window to the receive buffer
+	if (options->recv_buffer_size > 0 &&
+	    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &options->recv_buffer_size,
+		       sizeof(options->recv_buffer_size)) != 0) {
+		vnc_log_error("Setting the receive buffer size failed: %s", strerror(errno));
+		return false;
+	}
+	if (options->send_buffer_size > 0 &&
+	    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &options->send_buffer_size,
+		       sizeof(options->send_buffer_size)) != 0) {
+		vnc_log_error("Setting the send buffer size failed: %s", strerror(errno));
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "types.h"
+
+// Used when the address names no port
+#define VNC_TRANSPORT_DEFAULT_PORT "5900"
+
+struct Vnc_transport_options {
+	int recv_buffer_size; // SO_RCVBUF in bytes, 0 keeps the system default
+	int send_buffer_size; // SO_SNDBUF in bytes, 0 keeps the system default
+};
+
+// Connects to "unix:/path/to/socket", "host:port", "[ipv6 address]:port" or a host on the default
+// port. Host names are resolved, every address they resolve to is tried in turn. Returns the
+// connected socket or -1.
+int vnc_transport_connect(const char *address, struct Vnc_transport_options *options);
+// Host name or address part of a TCP `address`, what its certificate has to be issued for. Returns
+// false for Unix sockets.
+bool vnc_transport_get_host(const char *address, char *host, size_t host_size);
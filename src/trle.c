@@ -0,0 +1,53 @@
+#include "trle.h"
+
+#include "log.h"
+#include "macros.h"
+
+static const u8 *require(struct Vnc_rle_source *source, size_t size);
+
+void vnc_trle_init(struct Vnc_trle *trle)
+{
+	*trle = (struct Vnc_trle){ .source.require = require };
+	vnc_rle_decoder_init(&trle->decoder, &trle->source, VNC_TRLE_TILE_SIZE, true);
+}
+
+enum Vnc_rfb_result vnc_trle_measure_rect(struct Vnc_trle *trle, struct Vnc_rfb_stream *stream,
+					  struct Vnc_rfb_rect *rect,
+					  struct Vnc_pixel_converter *converter,
+					  struct Vnc_rfb_rect_progress *progress)
+{
+	const u8 *data;
+	size_t len = vnc_rfb_stream_buffered(stream, &data);
+	size_t needed;
+	enum Vnc_rfb_result result =
+		vnc_rle_measure_rect(&trle->decoder, data, len, rect, converter, progress, &needed);
+	if (result == VNC_RFB_RESULT_WOULD_BLOCK) {
+		return vnc_rfb_stream_ensure(stream, needed);
+	}
+	return result;
+}
+
+enum Vnc_rfb_result vnc_trle_recv_rect(struct Vnc_trle *trle, struct Vnc_rfb_stream *stream,
+				       struct Vnc_rfb_rect *rect,
+				       struct Vnc_pixel_converter *converter,
+				       struct Vnc_framebuffer *framebuffer)
+{
+	trle->stream = stream;
+	if (!vnc_rle_decode_rect(&trle->decoder, rect, converter, framebuffer)) {
+		return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+	}
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+// TRLE has no length prefix, the tiles are decoded straight out of the read buffer
+static const u8 *require(struct Vnc_rle_source *source, size_t size)
+{
+	struct Vnc_trle *trle = container_of(source, struct Vnc_trle, source);
+	const u8 *data;
+	enum Vnc_rfb_result result = vnc_rfb_stream_require(trle->stream, size, &data);
+	if (result != VNC_RFB_RESULT_SUCCESS) {
+		vnc_log_error("TRLE: read failed: %s", vnc_rfb_result_to_str(result));
+		return NULL;
+	}
+	return data;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "fb.h"
+#include "rfb.h"
+#include "rle.h"
+#include "types.h"
+
+#define VNC_TRLE_TILE_SIZE 16
+
+struct Vnc_trle {
+	struct Vnc_rfb_stream *stream;
+	struct Vnc_rle_source source;
+	struct Vnc_rle_decoder decoder;
+};
+
+void vnc_trle_init(struct Vnc_trle *trle);
+// Returns VNC_RFB_RESULT_WOULD_BLOCK until all tiles of the rect are buffered
+enum Vnc_rfb_result vnc_trle_measure_rect(struct Vnc_trle *trle, struct Vnc_rfb_stream *stream,
+					  struct Vnc_rfb_rect *rect,
+					  struct Vnc_pixel_converter *converter,
+					  struct Vnc_rfb_rect_progress *progress);
+enum Vnc_rfb_result vnc_trle_recv_rect(struct Vnc_trle *trle, struct Vnc_rfb_stream *stream,
+				       struct Vnc_rfb_rect *rect,
+				       struct Vnc_pixel_converter *converter,
+				       struct Vnc_framebuffer *framebuffer);
@@ -0,0 +1,394 @@
+#include "uring.h"
+
+#ifdef VNC_IO_URING
+
+#include <assert.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "macros.h"
+
+#define BUFFER_GROUP 0
+#define USER_DATA_RECV 1
+#define USER_DATA_SEND 2
+
+static void submit(struct Vnc_uring *uring, struct io_uring_sqe *sqe);
+static enum Vnc_rfb_result wait_cq(struct Vnc_uring *uring, i64 timeout_ns);
+static enum Vnc_rfb_result wait_cqe(struct Vnc_uring *uring, struct io_uring_cqe *cqe,
+				    i64 timeout_ns);
+static void arm_recv(struct Vnc_uring *uring);
+static void recycle_buffer(struct Vnc_uring *uring, u16 id);
+static i64 now_ns(void);
+
+bool vnc_uring_init(struct Vnc_uring *uring, int sock_fd, u32 entries)
+{
+	*uring = (struct Vnc_uring){ .ring_fd = -1, .sock_fd = sock_fd };
+	// Completions are only looked at from io_uring_enter, no need to interrupt the thread early
+	struct io_uring_params params = { .flags = IORING_SETUP_COOP_TASKRUN };
+	uring->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (uring->ring_fd < 0 && errno == EINVAL) {
+		params = (struct io_uring_params){ 0 };
+		uring->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+	}
+	if (uring->ring_fd < 0) {
+		vnc_log_error("io_uring_setup failed: %s", strerror(errno));
+		return false;
+	}
+	if ((params.features & IORING_FEAT_EXT_ARG) == 0) {
+		vnc_log_error("io_uring: kernel lacks timeouts on io_uring_enter");
+		goto err;
+	}
+
+	uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+	uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		uring->sq_ring_size = MAX(uring->sq_ring_size, uring->cq_ring_size);
+	}
+	uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+	if (uring->sq_ring == MAP_FAILED) {
+		uring->sq_ring = NULL;
+		vnc_log_error("io_uring: mapping the submission ring failed");
+		goto err;
+	}
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		uring->cq_ring = uring->sq_ring;
+	} else {
+		uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE,
+				      MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+				      IORING_OFF_CQ_RING);
+		if (uring->cq_ring == MAP_FAILED) {
+			uring->cq_ring = NULL;
+			vnc_log_error("io_uring: mapping the completion ring failed");
+			goto err;
+		}
+	}
+	uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		uring->sqes = NULL;
+		vnc_log_error("io_uring: mapping the submission entries failed");
+		goto err;
+	}
+
+	u8 *sq = uring->sq_ring;
+	uring->sq_head = (u32 *)(sq + params.sq_off.head);
+	uring->sq_tail = (u32 *)(sq + params.sq_off.tail);
+	uring->sq_mask = *(u32 *)(sq + params.sq_off.ring_mask);
+	uring->sq_array = (u32 *)(sq + params.sq_off.array);
+	u8 *cq = uring->cq_ring;
+	uring->cq_head = (u32 *)(cq + params.cq_off.head);
+	uring->cq_tail = (u32 *)(cq + params.cq_off.tail);
+	uring->cq_mask = *(u32 *)(cq + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return true;
+
+err:
+	vnc_uring_deinit(uring);
+	return false;
+}
+
+void vnc_uring_deinit(struct Vnc_uring *uring)
+{
+	if (uring->buf_ring != NULL) {
+		munmap(uring->buf_ring, uring->buf_ring_size);
+	}
+	free(uring->recv_buffers);
+	if (uring->sqes != NULL) {
+		munmap(uring->sqes, uring->sqes_size);
+	}
+	if (uring->cq_ring != NULL && uring->cq_ring != uring->sq_ring) {
+		munmap(uring->cq_ring, uring->cq_ring_size);
+	}
+	if (uring->sq_ring != NULL) {
+		munmap(uring->sq_ring, uring->sq_ring_size);
+	}
+	if (uring->ring_fd >= 0) {
+		close(uring->ring_fd);
+	}
+	*uring = (struct Vnc_uring){ .ring_fd = -1, .sock_fd = -1 };
+}
+
+bool vnc_uring_setup_recv(struct Vnc_uring *uring, u16 buffer_count, u32 buffer_size)
+{
+	// The kernel indexes the ring with a mask
+	assert((buffer_count & (buffer_count - 1)) == 0);
+	uring->buffer_count = buffer_count;
+	uring->buffer_size = buffer_size;
+	uring->buf_ring_size = buffer_count * sizeof(struct io_uring_buf);
+	uring->buf_ring = mmap(NULL, uring->buf_ring_size, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (uring->buf_ring == MAP_FAILED) {
+		uring->buf_ring = NULL;
+		vnc_log_error("io_uring: could not allocate the buffer ring");
+		return false;
+	}
+	uring->recv_buffers = malloc((size_t)buffer_count * buffer_size);
+	if (uring->recv_buffers == NULL) {
+		vnc_log_error("io_uring: could not allocate receive buffers");
+		return false;
+	}
+
+	struct io_uring_buf_reg reg = {
+		.ring_addr = (u64)(uintptr_t)uring->buf_ring,
+		.ring_entries = buffer_count,
+		.bgid = BUFFER_GROUP,
+	};
+	long rc =
+		syscall(__NR_io_uring_register, uring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+	if (rc < 0) {
+		vnc_log_error("io_uring: registering the buffer ring failed: %s", strerror(errno));
+		return false;
+	}
+	for (u16 id = 0; id < buffer_count; ++id) {
+		recycle_buffer(uring, id);
+	}
+	return true;
+}
+
+bool vnc_uring_setup_send(struct Vnc_uring *uring, const u8 *buffer, size_t size)
+{
+	struct iovec iov = { .iov_base = (void *)buffer, .iov_len = size };
+	long rc = syscall(__NR_io_uring_register, uring->ring_fd, IORING_REGISTER_BUFFERS, &iov, 1);
+	if (rc < 0) {
+		vnc_log_error("io_uring: registering the send buffer failed: %s", strerror(errno));
+		return false;
+	}
+	uring->send_buffer = buffer;
+	uring->send_buffer_size = size;
+	return true;
+}
+
+enum Vnc_rfb_result vnc_uring_recv(struct Vnc_uring *uring, void *dest, size_t size, int flags,
+				   size_t *received)
+{
+	while (!uring->has_current) {
+		if (!uring->recv_armed) {
+			arm_recv(uring);
+		}
+		struct io_uring_cqe cqe;
+		RFB_TRY(wait_cqe(uring, &cqe, (flags & MSG_DONTWAIT) != 0 ? 0 : -1));
+		if ((cqe.flags & IORING_CQE_F_MORE) == 0) {
+			uring->recv_armed = false;
+		}
+		if (cqe.res == -ENOBUFS) {
+			// All buffers were in use, the recv is armed again once some are recycled
+			continue;
+		}
+		if (cqe.res == 0) {
+			return VNC_RFB_RESULT_ERROR_CONNECTION_CLOSED;
+		}
+		if (cqe.res < 0) {
+			vnc_log_error("io_uring: recv failed: %s", strerror(-cqe.res));
+			return VNC_RFB_RESULT_ERROR_IO;
+		}
+		uring->current = (struct Vnc_uring_recv_buffer){
+			.id = cqe.flags >> IORING_CQE_BUFFER_SHIFT,
+			.len = cqe.res,
+		};
+		uring->has_current = true;
+	}
+
+	struct Vnc_uring_recv_buffer *current = &uring->current;
+	size_t count = MIN(size, current->len - current->pos);
+	memcpy(dest, uring->recv_buffers + (size_t)current->id * uring->buffer_size + current->pos,
+	       count);
+	current->pos += count;
+	if (current->pos == current->len) {
+		recycle_buffer(uring, current->id);
+		uring->has_current = false;
+	}
+	*received = count;
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+enum Vnc_rfb_result vnc_uring_wait(struct Vnc_uring *uring, i64 timeout_ns)
+{
+	if (uring->has_current) {
+		return VNC_RFB_RESULT_SUCCESS;
+	}
+	if (!uring->recv_armed) {
+		arm_recv(uring);
+	}
+	return wait_cq(uring, timeout_ns);
+}
+
+enum Vnc_rfb_result vnc_uring_send(struct Vnc_uring *uring, size_t size)
+{
+	assert(size <= uring->send_buffer_size);
+	size_t sent = 0;
+	while (sent < size) {
+		struct io_uring_sqe sqe = {
+			.opcode = IORING_OP_WRITE_FIXED,
+			.fd = uring->sock_fd,
+			.addr = (u64)(uintptr_t)(uring->send_buffer + sent),
+			.len = size - sent,
+			.buf_index = 0,
+			.user_data = USER_DATA_SEND,
+		};
+		submit(uring, &sqe);
+		struct io_uring_cqe cqe;
+		RFB_TRY(wait_cqe(uring, &cqe, -1));
+		if (cqe.res <= 0) {
+			vnc_log_error("io_uring: send failed: %s", strerror(-cqe.res));
+			return VNC_RFB_RESULT_ERROR_IO;
+		}
+		sent += cqe.res;
+	}
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+static void submit(struct Vnc_uring *uring, struct io_uring_sqe *sqe)
+{
+	u32 tail = *uring->sq_tail;
+	// Every submission is waited for before the next one, so the ring never fills up
+	assert(tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) <= uring->sq_mask);
+	u32 index = tail & uring->sq_mask;
+	uring->sqes[index] = *sqe;
+	uring->sq_array[index] = index;
+	__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	uring->to_submit += 1;
+}
+
+// Submits what is pending and waits up to `timeout_ns` for a completion, forever when negative
+static enum Vnc_rfb_result wait_cq(struct Vnc_uring *uring, i64 timeout_ns)
+{
+	i64 deadline_ns = now_ns() + timeout_ns;
+	bool entered = false;
+	while (true) {
+		if (*uring->cq_head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+			return VNC_RFB_RESULT_SUCCESS;
+		}
+
+		// A call that submits returns once it did so, even when it also waited, so every
+		// call only gets what is left of the timeout. Entering also runs the task work that
+		// posts completions, so even a zero timeout enters once.
+		i64 remaining_ns = timeout_ns < 0 ? 0 : MAX(deadline_ns - now_ns(), 0);
+		if (timeout_ns >= 0 && remaining_ns == 0 && entered) {
+			return timeout_ns == 0 ? VNC_RFB_RESULT_WOULD_BLOCK :
+						 VNC_RFB_RESULT_ERROR_IO_RECV_TIMEOUT;
+		}
+		struct __kernel_timespec timeout = {
+			.tv_sec = remaining_ns / 1000000000,
+			.tv_nsec = remaining_ns % 1000000000,
+		};
+		// Without a timespec it waits for as long as it takes
+		struct io_uring_getevents_arg arg = {
+			.ts = timeout_ns < 0 ? 0 : (u64)(uintptr_t)&timeout,
+		};
+		u32 min_complete = timeout_ns < 0 || remaining_ns > 0 ? 1 : 0;
+		u32 flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		int rc = syscall(__NR_io_uring_enter, uring->ring_fd, uring->to_submit,
+				 min_complete, flags, &arg, sizeof(arg));
+		uring->enter_calls += 1;
+		entered = true;
+		if (rc >= 0) {
+			uring->to_submit -= MIN((u32)rc, uring->to_submit);
+			continue;
+		}
+		if (errno == EINTR || errno == EAGAIN || errno == EBUSY || errno == ETIME) {
+			continue;
+		}
+		vnc_log_error("io_uring_enter failed: %s", strerror(errno));
+		return VNC_RFB_RESULT_ERROR_IO;
+	}
+}
+
+// Returns the next completion, waiting for it like wait_cq
+static enum Vnc_rfb_result wait_cqe(struct Vnc_uring *uring, struct io_uring_cqe *cqe,
+				    i64 timeout_ns)
+{
+	RFB_TRY(wait_cq(uring, timeout_ns));
+	u32 head = *uring->cq_head;
+	*cqe = uring->cqes[head & uring->cq_mask];
+	__atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+	uring->completions += 1;
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+static void arm_recv(struct Vnc_uring *uring)
+{
+	struct io_uring_sqe sqe = {
+		.opcode = IORING_OP_RECV,
+		.flags = IOSQE_BUFFER_SELECT,
+		.ioprio = IORING_RECV_MULTISHOT,
+		.fd = uring->sock_fd,
+		.buf_group = BUFFER_GROUP,
+		.user_data = USER_DATA_RECV,
+	};
+	submit(uring, &sqe);
+	uring->recv_armed = true;
+}
+
+static void recycle_buffer(struct Vnc_uring *uring, u16 id)
+{
+	struct io_uring_buf_ring *ring = uring->buf_ring;
+	u16 tail = ring->tail;
+	ring->bufs[tail & (uring->buffer_count - 1)] = (struct io_uring_buf){
+		.addr = (u64)(uintptr_t)(uring->recv_buffers + (size_t)id * uring->buffer_size),
+		.len = uring->buffer_size,
+		.bid = id,
+	};
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static i64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (i64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#else
+
+#include "log.h"
+
+bool vnc_uring_init(struct Vnc_uring *uring, int sock_fd, u32 entries)
+{
+	*uring = (struct Vnc_uring){ .ring_fd = -1, .sock_fd = sock_fd };
+	vnc_log_error("Built without io_uring support");
+	return false;
+}
+
+void vnc_uring_deinit(struct Vnc_uring *uring)
+{
+}
+
+bool vnc_uring_setup_recv(struct Vnc_uring *uring, u16 buffer_count, u32 buffer_size)
+{
+	return false;
+}
+
+bool vnc_uring_setup_send(struct Vnc_uring *uring, const u8 *buffer, size_t size)
+{
+	return false;
+}
+
+enum Vnc_rfb_result vnc_uring_recv(struct Vnc_uring *uring, void *dest, size_t size, int flags,
+				   size_t *received)
+{
+	return VNC_RFB_RESULT_ERROR_IO;
+}
+
+enum Vnc_rfb_result vnc_uring_wait(struct Vnc_uring *uring, i64 timeout_ns)
+{
+	return VNC_RFB_RESULT_ERROR_IO;
+}
+
+enum Vnc_rfb_result vnc_uring_send(struct Vnc_uring *uring, size_t size)
+{
+	return VNC_RFB_RESULT_ERROR_IO;
+}
+
+#endif
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "rfb.h"
+#include "types.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+// Received data of one completion, handed out until it is used up and the buffer recycled
+struct Vnc_uring_recv_buffer {
+	u16 id;
+	u32 len;
+	u32 pos;
+};
+
+// An io_uring instance driving one direction of the server connection. The receiving side keeps
+// a multishot recv armed that fills buffers from a provided buffer ring, the sending side writes
+// out of a registered buffer.
+struct Vnc_uring {
+	int ring_fd;
+	int sock_fd;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	u32 *sq_head;
+	u32 *sq_tail;
+	u32 *sq_array;
+	u32 sq_mask;
+	u32 *cq_head;
+	u32 *cq_tail;
+	u32 cq_mask;
+	struct io_uring_cqe *cqes;
+	u32 to_submit;
+
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_size;
+	u8 *recv_buffers;
+	u16 buffer_count;
+	u32 buffer_size;
+	bool recv_armed;
+	bool has_current;
+	struct Vnc_uring_recv_buffer current;
+
+	const u8 *send_buffer;
+	size_t send_buffer_size;
+
+	u64 enter_calls;
+	u64 completions;
+};
+
+bool vnc_uring_init(struct Vnc_uring *uring, int sock_fd, u32 entries);
+void vnc_uring_deinit(struct Vnc_uring *uring);
+// Registers `buffer_count` buffers of `buffer_size` bytes for the kernel to receive into
+bool vnc_uring_setup_recv(struct Vnc_uring *uring, u16 buffer_count, u32 buffer_size);
+// Registers the memory that vnc_uring_send writes from
+bool vnc_uring_setup_send(struct Vnc_uring *uring, const u8 *buffer, size_t size);
+// Same contract as recv(): returns between 1 and `size` bytes, with MSG_DONTWAIT in `flags`
+// VNC_RFB_RESULT_WOULD_BLOCK rather than waiting for them
+enum Vnc_rfb_result vnc_uring_recv(struct Vnc_uring *uring, void *dest, size_t size, int flags,
+				   size_t *received);
+// Waits up to `timeout_ns` for received data, without taking it
+enum Vnc_rfb_result vnc_uring_wait(struct Vnc_uring *uring, i64 timeout_ns);
+// Writes `size` bytes from the start of the registered buffer
+enum Vnc_rfb_result vnc_uring_send(struct Vnc_uring *uring, size_t size);
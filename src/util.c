@@ -1,5 +1,6 @@
 #include "util.h"
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <termios.h>
@@ -8,25 +9,25 @@
 int read_password(char *dest, size_t len)
 {
 	struct termios old_terminal;
+	// Piped in, e.g. when running headless from a script, there is no echo to turn off
+	bool terminal = tcgetattr(STDIN_FILENO, &old_terminal) == 0;
 
-	if (tcgetattr(STDIN_FILENO, &old_terminal) == -1) {
-		return -1;
-	}
+	if (terminal) {
+		struct termios new_terminal = old_terminal;
+		new_terminal.c_lflag &= ~(ECHO);
 
-	struct termios new_terminal = old_terminal;
-	new_terminal.c_lflag &= ~(ECHO);
-
-	if (tcsetattr(STDIN_FILENO, TCSANOW, &new_terminal) == -1) {
-		return -1;
+		if (tcsetattr(STDIN_FILENO, TCSANOW, &new_terminal) == -1) {
+			return -1;
+		}
 	}
 	// the \n is stored, we replace it with \0
 	if (fgets(dest, len, stdin) == NULL) {
 		dest[0] = '\0';
 	} else {
-		dest[strlen(dest) - 1] = '\0';
+		dest[strcspn(dest, "\n")] = '\0';
 	}
 
-	if (tcsetattr(STDIN_FILENO, TCSANOW, &old_terminal)) {
+	if (terminal && tcsetattr(STDIN_FILENO, TCSANOW, &old_terminal)) {
 		return -1;
 	}
 
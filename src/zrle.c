@@ -0,0 +1,144 @@
+#include "zrle.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "macros.h"
+
+static bool check_length(struct Vnc_rfb_rect *rect, struct Vnc_pixel_converter *converter,
+			 u32 length);
+static const u8 *require(struct Vnc_rle_source *source, size_t size);
+
+bool vnc_zrle_init(struct Vnc_zrle *zrle)
+{
+	*zrle = (struct Vnc_zrle){ 0 };
+	int rc = inflateInit(&zrle->stream);
+	if (rc != Z_OK) {
+		vnc_log_error("ZRLE: inflateInit failed (%d)", rc);
+		return false;
+	}
+	zrle->stream_initialized = true;
+	zrle->source.require = require;
+	vnc_rle_decoder_init(&zrle->decoder, &zrle->source, VNC_ZRLE_TILE_SIZE, false);
+	return true;
+}
+
+void vnc_zrle_deinit(struct Vnc_zrle *zrle)
+{
+	if (zrle->stream_initialized) {
+		inflateEnd(&zrle->stream);
+	}
+	free(zrle->compressed);
+	*zrle = (struct Vnc_zrle){ 0 };
+}
+
+enum Vnc_rfb_result vnc_zrle_measure_rect(struct Vnc_rfb_stream *stream,
+					  struct Vnc_rfb_rect *rect,
+					  struct Vnc_pixel_converter *converter)
+{
+	u32 length;
+	RFB_TRY(vnc_rfb_stream_ensure(stream, sizeof(length)));
+	RFB_TRY_PEEK(stream, &length, sizeof(length));
+	length = ntohl(length);
+	if (!check_length(rect, converter, length)) {
+		return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+	}
+	return vnc_rfb_stream_ensure(stream, sizeof(length) + (size_t)length);
+}
+
+enum Vnc_rfb_result vnc_zrle_recv_rect(struct Vnc_zrle *zrle, struct Vnc_rfb_stream *stream,
+				       struct Vnc_rfb_rect *rect,
+				       struct Vnc_pixel_converter *converter,
+				       struct Vnc_framebuffer *framebuffer)
+{
+	u32 length;
+	RFB_TRY_READ(stream, &length, sizeof(length));
+	length = ntohl(length);
+	if (!check_length(rect, converter, length)) {
+		return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+	}
+	if (length > zrle->compressed_capacity) {
+		u8 *compressed = realloc(zrle->compressed, length);
+		if (compressed == NULL) {
+			vnc_log_error("ZRLE: unable to allocate %u bytes", length);
+			return VNC_RFB_RESULT_ERROR_OUT_OF_MEMORY;
+		}
+		zrle->compressed = compressed;
+		zrle->compressed_capacity = length;
+	}
+	RFB_TRY_READ(stream, zrle->compressed, length);
+
+	zrle->stream.next_in = zrle->compressed;
+	zrle->stream.avail_in = length;
+	zrle->inflated_pos = 0;
+	zrle->inflated_len = 0;
+
+	if (!vnc_rle_decode_rect(&zrle->decoder, rect, converter, framebuffer)) {
+		return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+	}
+
+	// Consume the sync flush marker so the next rect starts on a fresh block
+	while (zrle->stream.avail_in > 0) {
+		zrle->stream.next_out = zrle->inflated;
+		zrle->stream.avail_out = sizeof(zrle->inflated);
+		int rc = inflate(&zrle->stream, Z_SYNC_FLUSH);
+		if (rc != Z_OK) {
+			vnc_log_error("ZRLE: inflate failed (%d)", rc);
+			return VNC_RFB_RESULT_ERROR_INVALID_DATA;
+		}
+	}
+	return VNC_RFB_RESULT_SUCCESS;
+}
+
+// The least compressible tiles take a subencoding byte and a palette, then at most a pixel and a
+// run length byte per pixel. zlib can't make that larger than its bound.
+static bool check_length(struct Vnc_rfb_rect *rect, struct Vnc_pixel_converter *converter,
+			 u32 length)
+{
+	u64 pixel_size = converter->bytes_per_pixel;
+	u64 tiles = (u64)((rect->width + VNC_ZRLE_TILE_SIZE - 1) / VNC_ZRLE_TILE_SIZE) *
+		    ((rect->height + VNC_ZRLE_TILE_SIZE - 1) / VNC_ZRLE_TILE_SIZE);
+	u64 tile_data = (u64)rect->width * rect->height * (pixel_size + 1) +
+			tiles * (1 + 127 * pixel_size);
+	if (length > compressBound(MIN(tile_data, UINT32_MAX))) {
+		vnc_log_error("ZRLE: %u bytes of data for a %ux%u rect", length, rect->width,
+			      rect->height);
+		return false;
+	}
+	return true;
+}
+
+// Returns a pointer to the next `size` inflated bytes, inflating more input when needed
+static const u8 *require(struct Vnc_rle_source *source, size_t size)
+{
+	struct Vnc_zrle *zrle = container_of(source, struct Vnc_zrle, source);
+	assert(size <= sizeof(zrle->inflated));
+	size_t available = zrle->inflated_len - zrle->inflated_pos;
+	if (available < size) {
+		memmove(zrle->inflated, zrle->inflated + zrle->inflated_pos, available);
+		zrle->inflated_pos = 0;
+		zrle->inflated_len = available;
+		while (zrle->inflated_len < size) {
+			if (zrle->stream.avail_in == 0) {
+				return NULL;
+			}
+			size_t space = sizeof(zrle->inflated) - zrle->inflated_len;
+			zrle->stream.next_out = zrle->inflated + zrle->inflated_len;
+			zrle->stream.avail_out = space;
+			int rc = inflate(&zrle->stream, Z_SYNC_FLUSH);
+			if (rc != Z_OK) {
+				vnc_log_error("ZRLE: inflate failed (%d)", rc);
+				return NULL;
+			}
+			zrle->inflated_len += space - zrle->stream.avail_out;
+		}
+	}
+
+	const u8 *data = zrle->inflated + zrle->inflated_pos;
+	zrle->inflated_pos += size;
+	return data;
+}
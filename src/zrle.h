@@ -0,0 +1,34 @@
+#pragma once
+
+#include <zlib.h>
+
+#include "fb.h"
+#include "rfb.h"
+#include "rle.h"
+#include "types.h"
+
+#define VNC_ZRLE_TILE_SIZE 64
+
+struct Vnc_zrle {
+	z_stream stream;
+	bool stream_initialized;
+	u8 *compressed;
+	size_t compressed_capacity;
+	// Inflated bytes not yet consumed by the tile decoder
+	u8 inflated[65536];
+	size_t inflated_pos;
+	size_t inflated_len;
+	struct Vnc_rle_source source;
+	struct Vnc_rle_decoder decoder;
+};
+
+bool vnc_zrle_init(struct Vnc_zrle *zrle);
+void vnc_zrle_deinit(struct Vnc_zrle *zrle);
+// Returns VNC_RFB_RESULT_WOULD_BLOCK until the compressed data of the rect is buffered
+enum Vnc_rfb_result vnc_zrle_measure_rect(struct Vnc_rfb_stream *stream,
+					  struct Vnc_rfb_rect *rect,
+					  struct Vnc_pixel_converter *converter);
+enum Vnc_rfb_result vnc_zrle_recv_rect(struct Vnc_zrle *zrle, struct Vnc_rfb_stream *stream,
+				       struct Vnc_rfb_rect *rect,
+				       struct Vnc_pixel_converter *converter,
+				       struct Vnc_framebuffer *framebuffer);
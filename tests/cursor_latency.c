@@ -0,0 +1,216 @@
+// Moves the software cursor over a headless display at the rate of a 1000 Hz mouse, on an idle
+// desktop and while a session thread keeps drawing updates, and times each move from when the
+// motion was due until the cursor is in the buffer on screen. A timerfd stands in for the input
+// device, its expiry the time libinput would stamp the event with, so waking up the main thread
+// counts too. Scanout adds up to a refresh interval on top.
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fb_mngr.h"
+#include "headless.h"
+#include "log.h"
+#include "macros.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+// 60 Hz
+#define FLIP_LATENCY_US 16667
+#define MOVE_INTERVAL_NS 1000000
+#define MOVES 2000
+#define CURSOR_SIZE 32
+// The desktop is drawn without it, so the cursor can be told apart
+#define CURSOR_COLOR 0xff00ff
+#define UPDATE_WIDTH 400
+#define UPDATE_HEIGHT 300
+
+struct Session {
+	struct Vnc_fb_mngr *mngr;
+	pthread_mutex_t mutex;
+	bool stop;
+	u64 frames;
+};
+
+static bool run(struct Vnc_headless *headless, struct Vnc_fb_mngr *mngr, const char *name);
+static bool move_cursor(struct Vnc_headless *headless, struct Vnc_fb_mngr *mngr, u32 move,
+			u64 *shown_ns);
+static void *draw_updates(void *args);
+static int compare_u64(const void *a, const void *b);
+static u32 random_u32(void);
+static u64 now_ns(void);
+
+int main(void)
+{
+	vnc_log_init("cursor_latency.log");
+	struct Vnc_headless_options options = {
+		.output_count = 1,
+		.outputs = { {
+			.width = WIDTH,
+			.height = HEIGHT,
+			.flip_latency_us = FLIP_LATENCY_US,
+		} },
+	};
+	struct Vnc_headless headless;
+	struct Vnc_fb_mngr mngr;
+	if (!vnc_headless_init(&headless, &options) ||
+	    !vnc_fb_mngr_init(&mngr, &headless.display, WIDTH, HEIGHT, VNC_SCALE_FILTER_AREA)) {
+		return 1;
+	}
+	u32 image[CURSOR_SIZE * CURSOR_SIZE];
+	for (u32 i = 0; i < ARRAY_COUNT(image); ++i) {
+		image[i] = 0xff000000 | CURSOR_COLOR;
+	}
+	struct Vnc_cursor cursor = {
+		.image = image,
+		.width = CURSOR_SIZE,
+		.height = CURSOR_SIZE,
+	};
+	vnc_fb_mngr_set_cursor(&mngr, &cursor);
+
+	printf("%d moves of a %dx%d software cursor at 1000 Hz on %dx%d, flips take %d us\n",
+	       MOVES, CURSOR_SIZE, CURSOR_SIZE, WIDTH, HEIGHT, FLIP_LATENCY_US);
+	bool ok = run(&headless, &mngr, "idle");
+
+	struct Session session = { .mngr = &mngr };
+	pthread_mutex_init(&session.mutex, NULL);
+	pthread_t thread;
+	pthread_create(&thread, NULL, draw_updates, &session);
+	ok &= run(&headless, &mngr, "drawing");
+	pthread_mutex_lock(&session.mutex);
+	session.stop = true;
+	pthread_mutex_unlock(&session.mutex);
+	pthread_join(thread, NULL);
+	pthread_mutex_destroy(&session.mutex);
+	printf("%llu %dx%d updates drawn meanwhile\n", (unsigned long long)session.frames,
+	       UPDATE_WIDTH, UPDATE_HEIGHT);
+
+	vnc_fb_mngr_deinit(&mngr);
+	vnc_headless_deinit(&headless);
+	return ok ? 0 : 1;
+}
+
+// The main loop of the viewer cut down to motion and flip events
+static bool run(struct Vnc_headless *headless, struct Vnc_fb_mngr *mngr, const char *name)
+{
+	int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	u64 start_ns = now_ns() + MOVE_INTERVAL_NS;
+	struct itimerspec ts = {
+		.it_interval = { .tv_nsec = MOVE_INTERVAL_NS },
+		.it_value = { .tv_sec = start_ns / 1000000000, .tv_nsec = start_ns % 1000000000 },
+	};
+	if (tfd == -1 || timerfd_settime(tfd, TFD_TIMER_ABSTIME, &ts, NULL) != 0) {
+		perror("timerfd");
+		return false;
+	}
+	u64 *latencies = malloc(MOVES * sizeof(u64));
+	u64 expirations = 0;
+	u32 moves = 0;
+	u32 misses = 0;
+	while (moves < MOVES) {
+		struct pollfd fds[] = {
+			{ .fd = tfd, .events = POLLIN },
+			{ .fd = headless->display.fd, .events = POLLIN },
+		};
+		poll(fds, ARRAY_COUNT(fds), -1);
+		if ((fds[1].revents & POLLIN) != 0) {
+			vnc_fb_mngr_handle_flip_events(mngr);
+		}
+		u64 count;
+		if ((fds[0].revents & POLLIN) != 0 && read(tfd, &count, sizeof(count)) > 0) {
+			// Motion that piled up is handled in one go, timed from the oldest
+			u64 event_ns = start_ns + expirations * MOVE_INTERVAL_NS;
+			expirations += count;
+			u64 shown_ns;
+			misses += !move_cursor(headless, mngr, moves, &shown_ns);
+			latencies[moves++] = shown_ns - event_ns;
+		}
+	}
+	close(tfd);
+
+	qsort(latencies, MOVES, sizeof(u64), compare_u64);
+	printf("%-8s: median %5.1f us, p99 %6.1f us, max %7.1f us, %llu events in %u moves\n",
+	       name, latencies[MOVES / 2] / 1e3, latencies[MOVES * 99 / 100] / 1e3,
+	       latencies[MOVES - 1] / 1e3, (unsigned long long)expirations, MOVES);
+	if (misses > 0) {
+		printf("%-8s: the cursor was not on screen after %u moves\n", name, misses);
+	}
+	free(latencies);
+	return misses == 0;
+}
+
+// Along a diagonal, checks the hotspot pixel of the buffer on screen once the move returned
+static bool move_cursor(struct Vnc_headless *headless, struct Vnc_fb_mngr *mngr, u32 move,
+			u64 *shown_ns)
+{
+	i32 x = move % (WIDTH - CURSOR_SIZE);
+	i32 y = move % (HEIGHT - CURSOR_SIZE);
+	vnc_fb_mngr_move_cursor(mngr, x, y);
+	*shown_ns = now_ns();
+	pthread_mutex_lock(&mngr->scanout_mutex);
+	struct Vnc_framebuffer *on_screen =
+		&headless->display.outputs[0].fbs[mngr->outputs[0].current_fb];
+	u32 pixel = ((u32 *)on_screen->buffer)[y * on_screen->pitch / sizeof(u32) + x];
+	pthread_mutex_unlock(&mngr->scanout_mutex);
+	return (pixel & 0xffffff) == CURSOR_COLOR;
+}
+
+// Like the session thread, one rect per update as fast as the fb manager takes them
+static void *draw_updates(void *args)
+{
+	struct Session *session = args;
+	for (;;) {
+		pthread_mutex_lock(&session->mutex);
+		bool stop = session->stop;
+		pthread_mutex_unlock(&session->mutex);
+		if (stop) {
+			return NULL;
+		}
+		vnc_fb_mngr_begin_frame(session->mngr);
+		struct Vnc_framebuffer *shadow = vnc_fb_mngr_get_framebuffer(session->mngr);
+		struct Vnc_rfb_rect rect = {
+			.x = random_u32() % (WIDTH - UPDATE_WIDTH),
+			.y = random_u32() % (HEIGHT - UPDATE_HEIGHT),
+			.width = UPDATE_WIDTH,
+			.height = UPDATE_HEIGHT,
+		};
+		u32 color = random_u32() & 0x7f7f7f;
+		for (u32 y = rect.y; y < (u32)rect.y + rect.height; ++y) {
+			u32 *row = (u32 *)shadow->buffer + y * shadow->pitch / sizeof(u32);
+			for (u32 x = rect.x; x < (u32)rect.x + rect.width; ++x) {
+				row[x] = color;
+			}
+		}
+		vnc_fb_mngr_register_drawn_rect(session->mngr, &rect);
+		vnc_fb_mngr_flip_buffers(session->mngr);
+		++session->frames;
+	}
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	u64 left = *(const u64 *)a;
+	u64 right = *(const u64 *)b;
+	return left < right ? -1 : left > right;
+}
+
+// xorshift32
+static u32 random_u32(void)
+{
+	static u32 state = 1;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
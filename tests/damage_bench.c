@@ -0,0 +1,213 @@
+// Times adding and popping damage for rect streams that are hard on the tile bitmap, and checks
+// that what is popped covers exactly the tiles that were touched, each once.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "damage.h"
+#include "log.h"
+#include "macros.h"
+
+#define WIDTH 3840
+#define HEIGHT 2160
+#define TILE_SIZE 16
+#define COLUMNS (WIDTH / TILE_SIZE)
+#define ROWS (HEIGHT / TILE_SIZE)
+#define MAX_RECTS 200000
+#define ITERATIONS 20
+
+struct Stream {
+	const char *name;
+	u32 (*generate)(struct Vnc_rfb_rect *rects);
+};
+
+static bool run(const struct Stream *stream, struct Vnc_damage *damage,
+		struct Vnc_rfb_rect *rects);
+static bool check_popped(struct Vnc_damage *damage, struct Vnc_rfb_rect *rects, u32 count);
+static u32 scattered_pixels(struct Vnc_rfb_rect *rects);
+static u32 checkerboard(struct Vnc_rfb_rect *rects);
+static u32 staircase(struct Vnc_rfb_rect *rects);
+static u32 vertical_lines(struct Vnc_rfb_rect *rects);
+static u32 unaligned_overlapping(struct Vnc_rfb_rect *rects);
+static u32 full_screen(struct Vnc_rfb_rect *rects);
+static struct Vnc_rfb_rect make_rect(u32 x, u32 y, u32 width, u32 height);
+static u64 now_ns(void);
+
+int main(void)
+{
+	vnc_log_init("damage_bench.log");
+	static const struct Stream streams[] = {
+		{ "scattered pixels", scattered_pixels },
+		{ "checkerboard tiles", checkerboard },
+		{ "staircase", staircase },
+		{ "vertical lines", vertical_lines },
+		{ "unaligned overlapping", unaligned_overlapping },
+		{ "full screen", full_screen },
+	};
+	struct Vnc_rfb_rect *rects = malloc(MAX_RECTS * sizeof(*rects));
+	struct Vnc_damage damage;
+	if (rects == NULL || !vnc_damage_init(&damage, WIDTH, HEIGHT)) {
+		return 1;
+	}
+	bool ok = true;
+	for (size_t i = 0; i < ARRAY_COUNT(streams); ++i) {
+		ok &= run(&streams[i], &damage, rects);
+	}
+	vnc_damage_deinit(&damage);
+	free(rects);
+	return ok ? 0 : 1;
+}
+
+static bool run(const struct Stream *stream, struct Vnc_damage *damage,
+		struct Vnc_rfb_rect *rects)
+{
+	srand(1);
+	u32 count = stream->generate(rects);
+	for (u32 i = 0; i < count; ++i) {
+		vnc_damage_add_rect(damage, &rects[i]);
+	}
+	if (!check_popped(damage, rects, count)) {
+		printf("%s: popped rects don't match the damage\n", stream->name);
+		return false;
+	}
+
+	u64 add_ns = 0;
+	u64 pop_ns = 0;
+	u32 popped = 0;
+	for (u32 iteration = 0; iteration < ITERATIONS; ++iteration) {
+		u64 start_ns = now_ns();
+		for (u32 i = 0; i < count; ++i) {
+			vnc_damage_add_rect(damage, &rects[i]);
+		}
+		u64 added_ns = now_ns();
+		struct Vnc_rfb_rect rect;
+		popped = 0;
+		while (vnc_damage_pop_rect(damage, &rect)) {
+			++popped;
+		}
+		pop_ns += now_ns() - added_ns;
+		add_ns += added_ns - start_ns;
+	}
+	printf("%-22s %6u rects in, %6u out: add %7.1f ns/rect, pop %8.1f us\n", stream->name,
+	       count, popped, (double)add_ns / ITERATIONS / count, pop_ns / ITERATIONS / 1e3);
+	return true;
+}
+
+// Every tile a rect touched is popped once, and nothing else is
+static bool check_popped(struct Vnc_damage *damage, struct Vnc_rfb_rect *rects, u32 count)
+{
+	static u8 tiles[ROWS][COLUMNS];
+	memset(tiles, 0, sizeof(tiles));
+	for (u32 i = 0; i < count; ++i) {
+		struct Vnc_rfb_rect *rect = &rects[i];
+		u32 right = MIN((u32)rect->x + rect->width, WIDTH);
+		u32 bottom = MIN((u32)rect->y + rect->height, HEIGHT);
+		if (rect->x >= right || rect->y >= bottom) {
+			continue;
+		}
+		for (u32 row = rect->y / TILE_SIZE; row <= (bottom - 1) / TILE_SIZE; ++row) {
+			for (u32 column = rect->x / TILE_SIZE; column <= (right - 1) / TILE_SIZE;
+			     ++column) {
+				tiles[row][column] = 1;
+			}
+		}
+	}
+	struct Vnc_rfb_rect rect;
+	bool ok = true;
+	while (vnc_damage_pop_rect(damage, &rect)) {
+		if (rect.x % TILE_SIZE != 0 || rect.y % TILE_SIZE != 0 ||
+		    rect.width % TILE_SIZE != 0 || rect.height % TILE_SIZE != 0) {
+			ok = false;
+			continue;
+		}
+		for (u32 row = rect.y / TILE_SIZE; row < (u32)(rect.y + rect.height) / TILE_SIZE;
+		     ++row) {
+			for (u32 column = rect.x / TILE_SIZE;
+			     column < (u32)(rect.x + rect.width) / TILE_SIZE; ++column) {
+				ok &= tiles[row][column] == 1;
+				tiles[row][column] = 2;
+			}
+		}
+	}
+	for (u32 row = 0; row < ROWS; ++row) {
+		for (u32 column = 0; column < COLUMNS; ++column) {
+			ok &= tiles[row][column] != 1;
+		}
+	}
+	return ok && vnc_damage_is_empty(damage);
+}
+
+static u32 scattered_pixels(struct Vnc_rfb_rect *rects)
+{
+	u32 count = 100000;
+	for (u32 i = 0; i < count; ++i) {
+		rects[i] = make_rect(rand() % WIDTH, rand() % HEIGHT, 1, 1);
+	}
+	return count;
+}
+
+// The most rects a pop can give back
+static u32 checkerboard(struct Vnc_rfb_rect *rects)
+{
+	u32 count = 0;
+	for (u32 row = 0; row < ROWS; ++row) {
+		for (u32 column = row % 2; column < COLUMNS; column += 2) {
+			rects[count++] = make_rect(column * TILE_SIZE, row * TILE_SIZE, TILE_SIZE,
+						   TILE_SIZE);
+		}
+	}
+	return count;
+}
+
+// Rows a pixel high moving right, none of them aligned to the tiles
+static u32 staircase(struct Vnc_rfb_rect *rects)
+{
+	u32 count = 0;
+	for (u32 y = 0; y < HEIGHT; ++y) {
+		rects[count++] = make_rect(y % (WIDTH - 64), y, 64, 1);
+	}
+	return count;
+}
+
+static u32 vertical_lines(struct Vnc_rfb_rect *rects)
+{
+	u32 count = 0;
+	for (u32 x = 0; x < WIDTH; x += 3) {
+		rects[count++] = make_rect(x, 0, 1, HEIGHT);
+	}
+	return count;
+}
+
+static u32 unaligned_overlapping(struct Vnc_rfb_rect *rects)
+{
+	u32 count = 10000;
+	for (u32 i = 0; i < count; ++i) {
+		u32 width = 1 + rand() % 300;
+		u32 height = 1 + rand() % 300;
+		u32 x = rand() % (WIDTH - width);
+		rects[i] = make_rect(x, rand() % (HEIGHT - height), width, height);
+	}
+	return count;
+}
+
+static u32 full_screen(struct Vnc_rfb_rect *rects)
+{
+	u32 count = 1000;
+	for (u32 i = 0; i < count; ++i) {
+		rects[i] = make_rect(0, 0, WIDTH, HEIGHT);
+	}
+	return count;
+}
+
+static struct Vnc_rfb_rect make_rect(u32 x, u32 y, u32 width, u32 height)
+{
+	return (struct Vnc_rfb_rect){ .x = x, .y = y, .width = width, .height = height };
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
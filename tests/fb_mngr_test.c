@@ -0,0 +1,259 @@
+// Draws random partial updates into the shadow of two outputs that flip on their own schedule,
+// with the software cursor moving in between. Every buffer that is flipped to has to show a
+// whole frame, and the buffer on screen never changes but for the cursor.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fb_mngr.h"
+#include "log.h"
+#include "macros.h"
+
+#define FRAMES 2000
+#define OUTPUT_COUNT 2
+#define CURSOR_SIZE 16
+
+struct Test {
+	struct Vnc_display display;
+	struct Vnc_fb_mngr mngr;
+	// What was flipped to last on each output, without the cursor
+	struct Vnc_framebuffer presented[OUTPUT_COUNT];
+	struct Vnc_framebuffer expected;
+	bool mid_frame;
+	u32 flips;
+	u32 errors;
+};
+
+static struct Test test;
+
+static bool flip_buffer(struct Vnc_display *display, u32 output, u32 fb_index,
+			struct Vnc_rfb_rect *damage, u32 damage_count);
+static bool handle_events(struct Vnc_display *display);
+static void mark_dirty(struct Vnc_display *display, u32 output, u32 fb_index,
+		       struct Vnc_rfb_rect *rects, u32 rect_count);
+static void check_on_screen(const char *when);
+static bool matches_frame(u32 output, struct Vnc_framebuffer *frame,
+			  struct Vnc_framebuffer *framebuffer);
+static void copy_from_shadow(u32 output, struct Vnc_framebuffer *dest);
+static void draw_random_rect(void);
+static void set_random_cursor(void);
+static void init_framebuffer(struct Vnc_framebuffer *framebuffer, u32 width, u32 height,
+			     u32 padding);
+
+int main(void)
+{
+	vnc_log_init("fb_mngr_test.log");
+	struct Vnc_display *display = &test.display;
+	*display = (struct Vnc_display){
+		.output_count = OUTPUT_COUNT,
+		.flip_buffer = flip_buffer,
+		.handle_events = handle_events,
+		.mark_dirty = mark_dirty,
+	};
+	u32 widths[OUTPUT_COUNT] = { 200, 120 };
+	u32 heights[OUTPUT_COUNT] = { 100, 80 };
+	for (u32 i = 0; i < OUTPUT_COUNT; ++i) {
+		for (u32 j = 0; j < ARRAY_COUNT(display->outputs[i].fbs); ++j) {
+			init_framebuffer(&display->outputs[i].fbs[j], widths[i], heights[i], 16);
+		}
+		// Nothing was presented yet, the buffer on screen keeps what it had
+		init_framebuffer(&test.presented[i], widths[i], heights[i], 0);
+	}
+	init_framebuffer(&test.expected, widths[0], heights[0], 0);
+	vnc_display_place_outputs(display);
+	u32 width, height;
+	vnc_display_get_size(display, &width, &height);
+	if (!vnc_fb_mngr_init(&test.mngr, display, width, height, VNC_SCALE_FILTER_AREA)) {
+		return 1;
+	}
+
+	srand(1);
+	set_random_cursor();
+	for (u32 frame = 0; frame < FRAMES; ++frame) {
+		vnc_fb_mngr_begin_frame(&test.mngr);
+		test.mid_frame = true;
+		u32 rect_count = 1 + rand() % 6;
+		for (u32 i = 0; i < rect_count; ++i) {
+			draw_random_rect();
+			// Vblanks and pointer motion arrive while the update is being drawn
+			switch (rand() % 4) {
+			case 0:
+				vnc_fb_mngr_handle_flip_events(&test.mngr);
+				check_on_screen("flip event during a frame");
+				break;
+			case 1: {
+				// A little past the edges too
+				i32 x = (i32)(rand() % (width + 20)) - 10;
+				i32 y = (i32)(rand() % (height + 20)) - 10;
+				vnc_fb_mngr_move_cursor(&test.mngr, x, y);
+				check_on_screen("cursor move during a frame");
+			} break;
+			}
+		}
+		test.mid_frame = false;
+		vnc_fb_mngr_flip_buffers(&test.mngr);
+		check_on_screen("end of frame");
+		if (rand() % 2 == 0) {
+			vnc_fb_mngr_handle_flip_events(&test.mngr);
+			check_on_screen("flip event between frames");
+		}
+		if (rand() % 50 == 0) {
+			set_random_cursor();
+			check_on_screen("new cursor");
+		}
+	}
+	printf("%u frames, %u flips, %u errors\n", FRAMES, test.flips, test.errors);
+	// What copying the whole output on every flip would have cost instead
+	u64 presented = 0;
+	u64 full_copy_bytes = 0;
+	for (u32 i = 0; i < OUTPUT_COUNT; ++i) {
+		u64 output_presented, skipped;
+		vnc_fb_mngr_get_frame_counts(&test.mngr, i, &output_presented, &skipped);
+		presented += output_presented;
+		full_copy_bytes += output_presented * widths[i] * heights[i] * sizeof(u32);
+	}
+	if (presented > 0) {
+		printf("%llu bytes copied per presented frame, %llu with full copies\n",
+		       (unsigned long long)(test.mngr.bytes_copied / presented),
+		       (unsigned long long)(full_copy_bytes / presented));
+	}
+	vnc_fb_mngr_deinit(&test.mngr);
+	return test.errors == 0 ? 0 : 1;
+}
+
+// Only a whole frame may be flipped to, with the cursor where it is now
+static bool flip_buffer(struct Vnc_display *display, u32 output, u32 fb_index,
+			struct Vnc_rfb_rect *damage, u32 damage_count)
+{
+	if (display->outputs[output].flip_pending) {
+		return false;
+	}
+	if (test.mid_frame) {
+		printf("output %u: flipped to a frame that is still being drawn\n", output);
+		++test.errors;
+	}
+	struct Vnc_framebuffer *frame = &test.presented[output];
+	copy_from_shadow(output, frame);
+	if (!matches_frame(output, frame, &display->outputs[output].fbs[fb_index])) {
+		printf("output %u: flipped to a buffer that differs from the shadow\n", output);
+		++test.errors;
+	}
+	display->outputs[output].flip_pending = true;
+	++test.flips;
+	return true;
+}
+
+static bool handle_events(struct Vnc_display *display)
+{
+	for (u32 i = 0; i < display->output_count; ++i) {
+		display->outputs[i].flip_pending = false;
+	}
+	return true;
+}
+
+static void mark_dirty(struct Vnc_display *display, u32 output, u32 fb_index,
+		       struct Vnc_rfb_rect *rects, u32 rect_count)
+{
+}
+
+static void check_on_screen(const char *when)
+{
+	for (u32 i = 0; i < OUTPUT_COUNT; ++i) {
+		struct Vnc_display_output *output = &test.display.outputs[i];
+		struct Vnc_framebuffer *on_screen = &output->fbs[test.mngr.outputs[i].current_fb];
+		if (!matches_frame(i, &test.presented[i], on_screen)) {
+			printf("output %u: buffer on screen changed after %s\n", i, when);
+			++test.errors;
+		}
+	}
+}
+
+// `frame` with the cursor on top of it
+static bool matches_frame(u32 output, struct Vnc_framebuffer *frame,
+			  struct Vnc_framebuffer *framebuffer)
+{
+	struct Vnc_framebuffer *expected = &test.expected;
+	expected->width = frame->width;
+	expected->height = frame->height;
+	expected->pitch = frame->pitch;
+	memcpy(expected->buffer, frame->buffer, frame->size);
+	struct Vnc_fb_mngr *mngr = &test.mngr;
+	i32 x = mngr->cursor_x - test.display.outputs[output].x;
+	i32 y = mngr->cursor_y - test.display.outputs[output].y;
+	struct Vnc_rfb_rect rect;
+	if (mngr->cursor_visible && vnc_cursor_get_rect(&mngr->cursor, x, y, expected, &rect)) {
+		vnc_cursor_draw(&mngr->cursor, x, y, &rect, expected);
+	}
+	for (u32 row = 0; row < frame->height; ++row) {
+		if (memcmp(expected->buffer + row * expected->pitch,
+			   framebuffer->buffer + row * framebuffer->pitch,
+			   frame->width * sizeof(u32)) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void copy_from_shadow(u32 output, struct Vnc_framebuffer *dest)
+{
+	struct Vnc_framebuffer *shadow = vnc_fb_mngr_get_framebuffer(&test.mngr);
+	u32 x = test.display.outputs[output].x;
+	u32 y = test.display.outputs[output].y;
+	for (u32 row = 0; row < dest->height; ++row) {
+		memcpy(dest->buffer + row * dest->pitch,
+		       shadow->buffer + (y + row) * shadow->pitch + x * sizeof(u32),
+		       dest->width * sizeof(u32));
+	}
+}
+
+// Mostly small rects, now and then one across both outputs
+static void draw_random_rect(void)
+{
+	struct Vnc_framebuffer *shadow = vnc_fb_mngr_get_framebuffer(&test.mngr);
+	u32 max_size = rand() % 8 == 0 ? shadow->width : 40;
+	u32 width = 1 + rand() % MIN(max_size, shadow->width);
+	u32 height = 1 + rand() % MIN(max_size, shadow->height);
+	struct Vnc_rfb_rect rect = {
+		.x = rand() % (shadow->width - width + 1),
+		.y = rand() % (shadow->height - height + 1),
+		.width = width,
+		.height = height,
+	};
+	for (u32 y = rect.y; y < (u32)rect.y + rect.height; ++y) {
+		u32 *row = (u32 *)(shadow->buffer + y * shadow->pitch);
+		for (u32 x = rect.x; x < (u32)rect.x + rect.width; ++x) {
+			row[x] = rand();
+		}
+	}
+	vnc_fb_mngr_register_drawn_rect(&test.mngr, &rect);
+}
+
+// Opaque with a transparent checkerboard, so what is underneath shows through
+static void set_random_cursor(void)
+{
+	u32 image[CURSOR_SIZE * CURSOR_SIZE];
+	for (u32 i = 0; i < ARRAY_COUNT(image); ++i) {
+		bool transparent = ((i / CURSOR_SIZE + i) / 2) % 2 == 0;
+		image[i] = transparent ? 0 : 0xff000000 | (rand() & 0xffffff);
+	}
+	struct Vnc_cursor cursor = {
+		.image = image,
+		.width = CURSOR_SIZE,
+		.height = CURSOR_SIZE,
+		.hot_x = rand() % CURSOR_SIZE,
+		.hot_y = rand() % CURSOR_SIZE,
+	};
+	vnc_fb_mngr_set_cursor(&test.mngr, &cursor);
+}
+
+static void init_framebuffer(struct Vnc_framebuffer *framebuffer, u32 width, u32 height,
+			     u32 padding)
+{
+	framebuffer->width = width;
+	framebuffer->height = height;
+	framebuffer->bpp = 32;
+	framebuffer->pitch = (width + padding) * sizeof(u32);
+	framebuffer->size = framebuffer->pitch * height;
+	framebuffer->buffer = malloc(framebuffer->size);
+	memset(framebuffer->buffer, 0xff, framebuffer->size);
+}
@@ -0,0 +1,534 @@
+// Compares Hextile and RRE with Raw on synthetic desktops of windows, text and flat colour: bytes
+// on the wire, the time to decode a buffered frame, and that time with the transfer over a link.
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hextile.h"
+#include "log.h"
+#include "macros.h"
+#include "rre.h"
+
+#define WIDTH 1280
+#define HEIGHT 800
+#define FRAMES 10
+#define WINDOW_COUNT 3
+#define LINK_MBITS 100
+// Distinct colours counted when picking a background, UI content has few
+#define MAX_COLORS 64
+
+struct Wire {
+	u8 *buffer;
+	size_t len;
+	size_t capacity;
+	int fd;
+};
+
+struct Subrect {
+	u32 color;
+	u16 x;
+	u16 y;
+	u16 width;
+	u16 height;
+};
+
+struct Subrects {
+	struct Subrect *items;
+	size_t count;
+	size_t capacity;
+	u32 *open; // Subrects reaching down to the previous row, left to right
+	u32 *next_open;
+};
+
+static void draw_desktop(u32 *frame);
+static void draw_window(u32 *frame, u16 x, u16 y, u16 width, u16 height);
+static void draw_text(u32 *frame, u16 x, u16 y, u16 width);
+static void fill(u32 *frame, int x, int y, int width, int height, u32 color);
+static void encode_raw(struct Wire *wire, const u32 *frame);
+static void encode_rre(struct Wire *wire, const u32 *frame, struct Subrects *subrects);
+static void encode_hextile(struct Wire *wire, const u32 *frame, struct Subrects *subrects);
+static void find_subrects(const u32 *pixels, u32 stride, u16 width, u16 height, u32 background,
+			  struct Subrects *subrects);
+static u32 most_common_color(const u32 *pixels, u32 stride, u16 width, u16 height);
+static bool decode_frames(struct Wire *wire, i32 encoding, const u32 *expected, u64 *best_ns);
+static enum Vnc_rfb_result measure(struct Vnc_rfb_stream *stream, struct Vnc_rfb_rect *rect,
+				   struct Vnc_pixel_converter *converter,
+				   struct Vnc_rfb_rect_progress *progress);
+static void put_pixel(struct Wire *wire, u32 color);
+static void put_u16(struct Wire *wire, u16 value);
+static void put_u8(struct Wire *wire, u8 value);
+static void put(struct Wire *wire, const void *data, size_t size);
+static void *write_wire(void *args);
+static u32 random_u32(void);
+static u64 now_ns(void);
+
+int main(void)
+{
+	vnc_log_init("hextile_rre_bench.log");
+	u32 *frames = malloc((size_t)FRAMES * WIDTH * HEIGHT * sizeof(u32));
+	for (int i = 0; i < FRAMES; ++i) {
+		draw_desktop(frames + (size_t)i * WIDTH * HEIGHT);
+	}
+	struct {
+		const char *name;
+		i32 encoding;
+	} encodings[] = {
+		{ "raw", VNC_RFB_ENCODING_RAW },
+		{ "RRE", VNC_RFB_ENCODING_RRE },
+		{ "hextile", VNC_RFB_ENCODING_HEXTILE },
+	};
+	printf("%ux%u desktops with %d windows, best of %d frames, transfer at %d Mbit/s\n",
+	       WIDTH, HEIGHT, WINDOW_COUNT, FRAMES, LINK_MBITS);
+	struct Subrects subrects = {
+		.open = malloc(WIDTH * sizeof(u32)),
+		.next_open = malloc(WIDTH * sizeof(u32)),
+	};
+	bool ok = true;
+	for (size_t i = 0; i < ARRAY_COUNT(encodings) && ok; ++i) {
+		struct Wire wire = { 0 };
+		for (int frame = 0; frame < FRAMES; ++frame) {
+			const u32 *pixels = frames + (size_t)frame * WIDTH * HEIGHT;
+			if (encodings[i].encoding == VNC_RFB_ENCODING_RAW) {
+				encode_raw(&wire, pixels);
+			} else if (encodings[i].encoding == VNC_RFB_ENCODING_RRE) {
+				encode_rre(&wire, pixels, &subrects);
+			} else {
+				encode_hextile(&wire, pixels, &subrects);
+			}
+		}
+		u64 best_ns;
+		ok = decode_frames(&wire, encodings[i].encoding, frames, &best_ns);
+		if (ok) {
+			double frame_bytes = (double)wire.len / FRAMES;
+			double transfer_ms = frame_bytes * 8 / (LINK_MBITS * 1e3);
+			printf("%-8s: %8.0f bytes per frame, decode %6.2f ms, ", encodings[i].name,
+			       frame_bytes, best_ns / 1e6);
+			printf("with transfer %7.2f ms\n", best_ns / 1e6 + transfer_ms);
+		}
+		free(wire.buffer);
+	}
+	free(subrects.items);
+	free(subrects.open);
+	free(subrects.next_open);
+	free(frames);
+	return ok ? 0 : 1;
+}
+
+// A flat backdrop, a taskbar of icons and overlapping windows
+static void draw_desktop(u32 *frame)
+{
+	fill(frame, 0, 0, WIDTH, HEIGHT, 0x3a6ea5);
+	fill(frame, 0, HEIGHT - 32, WIDTH, 32, 0x202020);
+	for (int x = 8; x < 8 + 10 * 40; x += 40) {
+		fill(frame, x, HEIGHT - 24, 16, 16, random_u32() & 0xffffff);
+	}
+	for (int i = 0; i < WINDOW_COUNT; ++i) {
+		u16 width = 320 + random_u32() % 480;
+		u16 height = 200 + random_u32() % 360;
+		u16 x = random_u32() % (WIDTH - width);
+		u16 y = random_u32() % (HEIGHT - 32 - height);
+		draw_window(frame, x, y, width, height);
+	}
+}
+
+static void draw_window(u32 *frame, u16 x, u16 y, u16 width, u16 height)
+{
+	fill(frame, x, y, width, height, 0x808080);
+	fill(frame, x + 1, y + 1, width - 2, 24, 0x2b579a);
+	draw_text(frame, x + 8, y + 8, 120);
+	fill(frame, x + 1, y + 25, width - 2, height - 26, 0xffffff);
+	for (u16 line_y = y + 34; line_y + 16 < y + height - 40; line_y += 16) {
+		draw_text(frame, x + 10, line_y, random_u32() % (width - 20));
+	}
+	// An OK button in the bottom right corner
+	fill(frame, x + width - 90, y + height - 34, 80, 26, 0xadadad);
+	fill(frame, x + width - 89, y + height - 33, 78, 24, 0xe1e1e1);
+	draw_text(frame, x + width - 60, y + height - 26, 20);
+}
+
+// Glyphs of 5x9 dark and antialiased grey pixels, a space now and then
+static void draw_text(u32 *frame, u16 x, u16 y, u16 width)
+{
+	static const u32 shades[] = { 0x000000, 0x555555, 0xaaaaaa };
+	for (u16 glyph_x = x; glyph_x + 5 <= x + width; glyph_x += 7) {
+		if (random_u32() % 6 == 0) {
+			continue;
+		}
+		for (u16 gy = 0; gy < 9; ++gy) {
+			for (u16 gx = 0; gx < 5; ++gx) {
+				u32 bits = random_u32();
+				u32 shade = shades[bits / 5 % 3];
+				if (bits % 5 < 2) {
+					fill(frame, glyph_x + gx, y + gy, 1, 1, shade);
+				}
+			}
+		}
+	}
+}
+
+static void fill(u32 *frame, int x, int y, int width, int height, u32 color)
+{
+	for (int row = MAX(y, 0); row < MIN(y + height, HEIGHT); ++row) {
+		for (int column = MAX(x, 0); column < MIN(x + width, WIDTH); ++column) {
+			frame[row * WIDTH + column] = color;
+		}
+	}
+}
+
+static void encode_raw(struct Wire *wire, const u32 *frame)
+{
+	for (size_t i = 0; i < (size_t)WIDTH * HEIGHT; ++i) {
+		put_pixel(wire, frame[i]);
+	}
+}
+
+// The whole frame as one rect, a subrect per run of equal pixels merged with the runs below it
+static void encode_rre(struct Wire *wire, const u32 *frame, struct Subrects *subrects)
+{
+	u32 background = most_common_color(frame, WIDTH, WIDTH, HEIGHT);
+	find_subrects(frame, WIDTH, WIDTH, HEIGHT, background, subrects);
+	u32 count = htonl(subrects->count);
+	put(wire, &count, sizeof(count));
+	put_pixel(wire, background);
+	for (size_t i = 0; i < subrects->count; ++i) {
+		struct Subrect *subrect = &subrects->items[i];
+		put_pixel(wire, subrect->color);
+		put_u16(wire, subrect->x);
+		put_u16(wire, subrect->y);
+		put_u16(wire, subrect->width);
+		put_u16(wire, subrect->height);
+	}
+}
+
+// Tiles are solid, subrects in the foreground or subrects of their own colour, or raw when smaller
+static void encode_hextile(struct Wire *wire, const u32 *frame, struct Subrects *subrects)
+{
+	enum { RAW = 1, BACKGROUND = 2, FOREGROUND = 4, ANY_SUBRECTS = 8, COLOURED = 16 };
+	bool have_background = false;
+	bool have_foreground = false;
+	u32 background = 0;
+	u32 foreground = 0;
+	for (u16 ty = 0; ty < HEIGHT; ty += VNC_HEXTILE_TILE_SIZE) {
+		for (u16 tx = 0; tx < WIDTH; tx += VNC_HEXTILE_TILE_SIZE) {
+			const u32 *tile = frame + ty * WIDTH + tx;
+			u16 width = MIN(VNC_HEXTILE_TILE_SIZE, WIDTH - tx);
+			u16 height = MIN(VNC_HEXTILE_TILE_SIZE, HEIGHT - ty);
+			u32 tile_background = most_common_color(tile, WIDTH, width, height);
+			find_subrects(tile, WIDTH, width, height, tile_background, subrects);
+
+			u8 flags = 0;
+			if (!have_background || tile_background != background) {
+				flags |= BACKGROUND;
+			}
+			bool one_color = true;
+			for (size_t i = 1; i < subrects->count; ++i) {
+				one_color &= subrects->items[i].color == subrects->items[0].color;
+			}
+			if (subrects->count > 0) {
+				flags |= ANY_SUBRECTS;
+				if (!one_color) {
+					flags |= COLOURED;
+				} else if (!have_foreground ||
+					   subrects->items[0].color != foreground) {
+					flags |= FOREGROUND;
+				}
+			}
+			size_t size = 1 + (flags & BACKGROUND ? 4 : 0) +
+				      (flags & FOREGROUND ? 4 : 0) + (subrects->count > 0 ? 1 : 0) +
+				      subrects->count * (flags & COLOURED ? 6 : 2);
+			if (subrects->count > 255 || size > 1 + (size_t)width * height * 4) {
+				// The colours aren't carried past a raw tile
+				put_u8(wire, RAW);
+				for (u16 y = 0; y < height; ++y) {
+					for (u16 x = 0; x < width; ++x) {
+						put_pixel(wire, tile[y * WIDTH + x]);
+					}
+				}
+				have_background = false;
+				have_foreground = false;
+				continue;
+			}
+
+			put_u8(wire, flags);
+			background = tile_background;
+			have_background = true;
+			if (flags & BACKGROUND) {
+				put_pixel(wire, background);
+			}
+			if (flags & FOREGROUND) {
+				foreground = subrects->items[0].color;
+				have_foreground = true;
+				put_pixel(wire, foreground);
+			}
+			if (subrects->count == 0) {
+				continue;
+			}
+			put_u8(wire, subrects->count);
+			for (size_t i = 0; i < subrects->count; ++i) {
+				struct Subrect *subrect = &subrects->items[i];
+				if (flags & COLOURED) {
+					put_pixel(wire, subrect->color);
+				}
+				put_u8(wire, subrect->x << 4 | subrect->y);
+				put_u8(wire, (subrect->width - 1) << 4 | (subrect->height - 1));
+			}
+			// The foreground is undefined after coloured subrects
+			have_foreground &= (flags & COLOURED) == 0;
+		}
+	}
+}
+
+// Runs of one colour other than the background, each grown downwards while the row below has the
+// same run
+static void find_subrects(const u32 *pixels, u32 stride, u16 width, u16 height, u32 background,
+			  struct Subrects *subrects)
+{
+	subrects->count = 0;
+	u32 open_count = 0;
+	for (u16 y = 0; y < height; ++y) {
+		const u32 *row = pixels + y * stride;
+		u32 next_open_count = 0;
+		u32 open_index = 0;
+		for (u16 x = 0; x < width;) {
+			u16 start = x;
+			u32 color = row[x];
+			while (x < width && row[x] == color) {
+				++x;
+			}
+			if (color == background) {
+				continue;
+			}
+			while (open_index < open_count &&
+			       subrects->items[subrects->open[open_index]].x < start) {
+				++open_index;
+			}
+			struct Subrect *above = NULL;
+			u32 index = 0;
+			if (open_index < open_count) {
+				index = subrects->open[open_index];
+				above = &subrects->items[index];
+			}
+			if (above != NULL && above->x == start && above->width == x - start &&
+			    above->color == color) {
+				above->height += 1;
+			} else {
+				if (subrects->count == subrects->capacity) {
+					subrects->capacity = MAX(subrects->capacity * 2, 256);
+					size_t size = subrects->capacity * sizeof(*subrects->items);
+					subrects->items = realloc(subrects->items, size);
+				}
+				index = subrects->count++;
+				subrects->items[index] = (struct Subrect){
+					.color = color,
+					.x = start,
+					.y = y,
+					.width = x - start,
+					.height = 1,
+				};
+			}
+			subrects->next_open[next_open_count++] = index;
+		}
+		u32 *open = subrects->open;
+		subrects->open = subrects->next_open;
+		subrects->next_open = open;
+		open_count = next_open_count;
+	}
+}
+
+static u32 most_common_color(const u32 *pixels, u32 stride, u16 width, u16 height)
+{
+	u32 colors[MAX_COLORS];
+	u32 counts[MAX_COLORS];
+	u32 color_count = 0;
+	for (u16 y = 0; y < height; ++y) {
+		for (u16 x = 0; x < width; ++x) {
+			u32 color = pixels[y * stride + x];
+			u32 i = 0;
+			while (i < color_count && colors[i] != color) {
+				++i;
+			}
+			if (i == color_count) {
+				if (color_count == MAX_COLORS) {
+					continue;
+				}
+				colors[color_count] = color;
+				counts[color_count++] = 0;
+			}
+			++counts[i];
+		}
+	}
+	u32 best = 0;
+	for (u32 i = 1; i < color_count; ++i) {
+		best = counts[i] > counts[best] ? i : best;
+	}
+	return colors[best];
+}
+
+// Times each frame from the moment all of it is buffered, so the socket doesn't count
+static bool decode_frames(struct Wire *wire, i32 encoding, const u32 *expected, u64 *best_ns)
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		perror("socketpair");
+		return false;
+	}
+	struct Vnc_rfb_pixel_format format = {
+		.bpp = 32,
+		.depth = 24,
+		.true_color = 1,
+		.red_max = 255,
+		.green_max = 255,
+		.blue_max = 255,
+		.red_shift = 16,
+		.green_shift = 8,
+		.blue_shift = 0,
+	};
+	struct Vnc_framebuffer framebuffer = {
+		.width = WIDTH,
+		.height = HEIGHT,
+		.pitch = WIDTH * sizeof(u32),
+		.size = WIDTH * HEIGHT * sizeof(u32),
+		.bpp = 32,
+		.buffer = calloc(WIDTH * HEIGHT, sizeof(u32)),
+	};
+	struct Vnc_pixel_converter converter;
+	struct Vnc_rfb_stream stream;
+	if (!vnc_pixel_converter_init(&converter, &format) ||
+	    !vnc_rfb_stream_init(&stream, fds[0])) {
+		return false;
+	}
+
+	wire->fd = fds[1];
+	pthread_t writer;
+	pthread_create(&writer, NULL, write_wire, wire);
+	*best_ns = UINT64_MAX;
+	bool ok = true;
+	for (int frame = 0; frame < FRAMES && ok; ++frame) {
+		struct Vnc_rfb_rect rect = {
+			.width = WIDTH,
+			.height = HEIGHT,
+			.encoding = encoding,
+		};
+		struct Vnc_rfb_rect_progress progress = { 0 };
+		enum Vnc_rfb_result result;
+		while ((result = measure(&stream, &rect, &converter, &progress)) ==
+		       VNC_RFB_RESULT_WOULD_BLOCK) {
+			vnc_rfb_stream_receive(&stream);
+		}
+
+		u64 start_ns = now_ns();
+		if (result == VNC_RFB_RESULT_SUCCESS) {
+			if (encoding == VNC_RFB_ENCODING_RAW) {
+				size_t done = 0;
+				result = vnc_rfb_recv_rect_raw(&stream, &rect, &converter,
+							       &framebuffer, &done);
+			} else if (encoding == VNC_RFB_ENCODING_RRE) {
+				result = vnc_rre_recv_rect(&stream, &rect, &converter,
+							   &framebuffer);
+			} else {
+				result = vnc_hextile_recv_rect(&stream, &rect, &converter,
+							       &framebuffer);
+			}
+		}
+		u64 elapsed_ns = now_ns() - start_ns;
+		*best_ns = MIN(*best_ns, elapsed_ns);
+		if (result != VNC_RFB_RESULT_SUCCESS) {
+			fprintf(stderr, "frame %d: %s\n", frame, vnc_rfb_result_to_str(result));
+			ok = false;
+		} else if (memcmp(framebuffer.buffer, expected + (size_t)frame * WIDTH * HEIGHT,
+				  framebuffer.size) != 0) {
+			printf("frame %d: decoded pixels differ from the encoded ones\n", frame);
+			ok = false;
+		}
+	}
+
+	close(fds[0]);
+	pthread_join(writer, NULL);
+	close(fds[1]);
+	vnc_rfb_stream_deinit(&stream);
+	vnc_pixel_converter_deinit(&converter);
+	free(framebuffer.buffer);
+	return ok;
+}
+
+// Raw rects are buffered whole too, the session would read them as they arrive
+static enum Vnc_rfb_result measure(struct Vnc_rfb_stream *stream, struct Vnc_rfb_rect *rect,
+				   struct Vnc_pixel_converter *converter,
+				   struct Vnc_rfb_rect_progress *progress)
+{
+	switch (rect->encoding) {
+	case VNC_RFB_ENCODING_RAW:
+		return vnc_rfb_stream_ensure(stream, (size_t)rect->width * rect->height *
+							     converter->bytes_per_pixel);
+	case VNC_RFB_ENCODING_RRE:
+		return vnc_rre_measure_rect(stream, converter);
+	default:
+		return vnc_hextile_measure_rect(stream, rect, converter, progress);
+	}
+}
+
+// Little endian, as the pixel format asks for
+static void put_pixel(struct Wire *wire, u32 color)
+{
+	u8 bytes[] = { color, color >> 8, color >> 16, 0 };
+	put(wire, bytes, sizeof(bytes));
+}
+
+static void put_u16(struct Wire *wire, u16 value)
+{
+	u16 value_be = htons(value);
+	put(wire, &value_be, sizeof(value_be));
+}
+
+static void put_u8(struct Wire *wire, u8 value)
+{
+	put(wire, &value, 1);
+}
+
+static void put(struct Wire *wire, const void *data, size_t size)
+{
+	if (wire->len + size > wire->capacity) {
+		wire->capacity = MAX(wire->capacity * 2, wire->len + size);
+		wire->buffer = realloc(wire->buffer, wire->capacity);
+	}
+	memcpy(wire->buffer + wire->len, data, size);
+	wire->len += size;
+}
+
+// Stops without a SIGPIPE when the decoder gave up and closed its end
+static void *write_wire(void *args)
+{
+	struct Wire *wire = args;
+	size_t written = 0;
+	while (written < wire->len) {
+		ssize_t count = send(wire->fd, wire->buffer + written, wire->len - written,
+				     MSG_NOSIGNAL);
+		if (count <= 0) {
+			break;
+		}
+		written += count;
+	}
+	return NULL;
+}
+
+// xorshift32
+static u32 random_u32(void)
+{
+	static u32 state = 1;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
@@ -0,0 +1,276 @@
+// Checks that every vector kernel this build and CPU have converts exactly like the scalar code,
+// for every value the components of each wire format can take, then times the kernels.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "macros.h"
+#include "pixel.h"
+
+// Pixels converted at a time, every 8 and 16 bpp value and a 256th of the 32 bpp ones
+#define BLOCK_SIZE 65536
+// Row lengths cycle up to this, to hit every tail the kernels leave to the scalar code
+#define MAX_ROW_LENGTH 67
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 1080
+#define BENCH_FRAMES 20
+
+struct Layout {
+	const char *name;
+	bool bench;
+	struct Vnc_rfb_pixel_format format;
+};
+
+struct Buffers {
+	u8 *wire; // One byte in, so the kernels load from unaligned addresses
+	u32 *values;
+	u32 *expected;
+	u32 *dest;
+};
+
+static const struct Layout layouts[] = {
+	{ "rgb332", true,
+	  { .bpp = 8, .depth = 8, .true_color = 1, .red_max = 7, .green_max = 7, .blue_max = 3,
+	    .red_shift = 5, .green_shift = 2, .blue_shift = 0 } },
+	{ "bgr233", false,
+	  { .bpp = 8, .depth = 8, .true_color = 1, .red_max = 7, .green_max = 7, .blue_max = 3,
+	    .red_shift = 0, .green_shift = 3, .blue_shift = 6 } },
+	{ "rgb222", false,
+	  { .bpp = 8, .depth = 6, .true_color = 1, .red_max = 3, .green_max = 3, .blue_max = 3,
+	    .red_shift = 4, .green_shift = 2, .blue_shift = 0 } },
+	{ "rgb565", true,
+	  { .bpp = 16, .depth = 16, .true_color = 1, .red_max = 31, .green_max = 63,
+	    .blue_max = 31, .red_shift = 11, .green_shift = 5, .blue_shift = 0 } },
+	{ "rgb565 be", false,
+	  { .bpp = 16, .depth = 16, .big_endian = 1, .true_color = 1, .red_max = 31,
+	    .green_max = 63, .blue_max = 31, .red_shift = 11, .green_shift = 5, .blue_shift = 0 } },
+	{ "bgr565", false,
+	  { .bpp = 16, .depth = 16, .true_color = 1, .red_max = 31, .green_max = 63,
+	    .blue_max = 31, .red_shift = 0, .green_shift = 5, .blue_shift = 11 } },
+	{ "rgb555", false,
+	  { .bpp = 16, .depth = 15, .true_color = 1, .red_max = 31, .green_max = 31,
+	    .blue_max = 31, .red_shift = 10, .green_shift = 5, .blue_shift = 0 } },
+	{ "rgb555 be", false,
+	  { .bpp = 16, .depth = 15, .big_endian = 1, .true_color = 1, .red_max = 31,
+	    .green_max = 31, .blue_max = 31, .red_shift = 10, .green_shift = 5, .blue_shift = 0 } },
+	{ "rgb444", false,
+	  { .bpp = 16, .depth = 12, .true_color = 1, .red_max = 15, .green_max = 15,
+	    .blue_max = 15, .red_shift = 8, .green_shift = 4, .blue_shift = 0 } },
+	{ "xrgb8888 be", true,
+	  { .bpp = 32, .depth = 24, .big_endian = 1, .true_color = 1, .red_max = 255,
+	    .green_max = 255, .blue_max = 255, .red_shift = 16, .green_shift = 8,
+	    .blue_shift = 0 } },
+	{ "xbgr8888", true,
+	  { .bpp = 32, .depth = 24, .true_color = 1, .red_max = 255, .green_max = 255,
+	    .blue_max = 255, .red_shift = 0, .green_shift = 8, .blue_shift = 16 } },
+	{ "rgbx8888", false,
+	  { .bpp = 32, .depth = 24, .true_color = 1, .red_max = 255, .green_max = 255,
+	    .blue_max = 255, .red_shift = 24, .green_shift = 16, .blue_shift = 8 } },
+	{ "rgbx8888 be", false,
+	  { .bpp = 32, .depth = 24, .big_endian = 1, .true_color = 1, .red_max = 255,
+	    .green_max = 255, .blue_max = 255, .red_shift = 24, .green_shift = 16,
+	    .blue_shift = 8 } },
+	{ "bgrx8888 be", false,
+	  { .bpp = 32, .depth = 24, .big_endian = 1, .true_color = 1, .red_max = 255,
+	    .green_max = 255, .blue_max = 255, .red_shift = 8, .green_shift = 16,
+	    .blue_shift = 24 } },
+	// Not byte aligned, so not a byte shuffle
+	{ "rgb888 unaligned", false,
+	  { .bpp = 32, .depth = 24, .true_color = 1, .red_max = 255, .green_max = 255,
+	    .blue_max = 255, .red_shift = 21, .green_shift = 13, .blue_shift = 2 } },
+	{ "rgb888 unaligned be", false,
+	  { .bpp = 32, .depth = 24, .big_endian = 1, .true_color = 1, .red_max = 255,
+	    .green_max = 255, .blue_max = 255, .red_shift = 3, .green_shift = 11,
+	    .blue_shift = 19 } },
+};
+
+static const char *kernel_names[] = { "sse2", "avx2", "neon" };
+
+static bool check(const struct Layout *layout, struct Buffers *buffers);
+static u32 check_kernel(struct Vnc_pixel_converter *converter, struct Buffers *buffers,
+			u32 count);
+static u32 fill_block(const struct Vnc_pixel_converter *converter, u32 block,
+		      struct Buffers *buffers);
+static void bench(const struct Layout *layout, struct Buffers *buffers);
+static double bench_kernel(struct Vnc_pixel_converter *converter, const u8 *wire, u32 *dest);
+static void put_value(u8 *dest, u32 value, u8 bytes, bool big_endian);
+static u32 random_u32(void);
+static u64 now_ns(void);
+
+int main(void)
+{
+	vnc_log_init("pixel_test.log");
+	struct Buffers buffers = {
+		.wire = malloc(BENCH_WIDTH * BENCH_HEIGHT * sizeof(u32) + 1),
+		.values = malloc(BLOCK_SIZE * sizeof(u32)),
+		.expected = malloc(BLOCK_SIZE * sizeof(u32)),
+		.dest = malloc(BENCH_WIDTH * BENCH_HEIGHT * sizeof(u32)),
+	};
+	if (buffers.wire == NULL || buffers.values == NULL || buffers.expected == NULL ||
+	    buffers.dest == NULL) {
+		return 1;
+	}
+	bool ok = true;
+	for (size_t i = 0; i < ARRAY_COUNT(layouts); ++i) {
+		ok &= check(&layouts[i], &buffers);
+	}
+	for (size_t i = 0; i < ARRAY_COUNT(layouts); ++i) {
+		if (layouts[i].bench) {
+			bench(&layouts[i], &buffers);
+		}
+	}
+	free(buffers.wire);
+	free(buffers.values);
+	free(buffers.expected);
+	free(buffers.dest);
+	return ok ? 0 : 1;
+}
+
+// Every kernel against vnc_pixel_read, which goes through the table or the scalar formula
+static bool check(const struct Layout *layout, struct Buffers *buffers)
+{
+	struct Vnc_rfb_pixel_format format = layout->format;
+	struct Vnc_pixel_converter converter;
+	if (!vnc_pixel_converter_init(&converter, &format)) {
+		return false;
+	}
+	u32 total = format.bpp == 32 ? 1u << 24 : 1u << format.bpp;
+	u32 mismatches[ARRAY_COUNT(kernel_names)] = { 0 };
+	for (u32 block = 0; block * BLOCK_SIZE < total; ++block) {
+		u32 count = fill_block(&converter, block, buffers);
+		for (size_t i = 0; i < ARRAY_COUNT(kernel_names); ++i) {
+			if (vnc_pixel_converter_use_kernels(&converter, kernel_names[i])) {
+				mismatches[i] += check_kernel(&converter, buffers, count);
+			}
+		}
+	}
+	bool ok = true;
+	for (size_t i = 0; i < ARRAY_COUNT(kernel_names); ++i) {
+		if (vnc_pixel_converter_use_kernels(&converter, kernel_names[i])) {
+			printf("%-20s %-5s %8u values, %u mismatches\n", layout->name,
+			       kernel_names[i], total, mismatches[i]);
+			ok &= mismatches[i] == 0;
+		}
+	}
+	vnc_pixel_converter_deinit(&converter);
+	return ok;
+}
+
+static u32 check_kernel(struct Vnc_pixel_converter *converter, struct Buffers *buffers,
+			u32 count)
+{
+	u32 mismatches = 0;
+	u32 length = 1;
+	for (u32 i = 0; i < count; i += length, length = length % MAX_ROW_LENGTH + 1) {
+		length = MIN(length, count - i);
+		vnc_pixel_convert_row(converter, buffers->wire + 1 + i * converter->bytes_per_pixel,
+				      buffers->dest + i, length);
+	}
+	for (u32 i = 0; i < count; ++i) {
+		mismatches += buffers->dest[i] != buffers->expected[i];
+	}
+	if (converter->convert_values == NULL) {
+		return mismatches;
+	}
+
+	// Values already in host byte order, as the decoders that read them first pass them
+	memcpy(buffers->dest, buffers->values, count * sizeof(u32));
+	length = 1;
+	for (u32 i = 0; i < count; i += length, length = length % MAX_ROW_LENGTH + 1) {
+		length = MIN(length, count - i);
+		vnc_pixel_convert_values(converter, buffers->dest + i, length);
+	}
+	for (u32 i = 0; i < count; ++i) {
+		mismatches += buffers->dest[i] != buffers->expected[i];
+	}
+	return mismatches;
+}
+
+// Every combination of component values, the bits outside of the components random
+static u32 fill_block(const struct Vnc_pixel_converter *converter, u32 block,
+		      struct Buffers *buffers)
+{
+	const struct Vnc_rfb_pixel_format *format = &converter->format;
+	u32 mask = (u32)format->red_max << format->red_shift |
+		   (u32)format->green_max << format->green_shift |
+		   (u32)format->blue_max << format->blue_shift;
+	u8 bytes = format->bpp / 8;
+	u32 count = format->bpp == 32 ? BLOCK_SIZE : MIN(1u << format->bpp, BLOCK_SIZE);
+	for (u32 i = 0; i < count; ++i) {
+		u32 value = block * BLOCK_SIZE + i;
+		if (format->bpp == 32) {
+			value = (value >> 16 & 0xff) << format->red_shift |
+				(value >> 8 & 0xff) << format->green_shift |
+				(value & 0xff) << format->blue_shift | (random_u32() & ~mask);
+		}
+		u8 *wire = buffers->wire + 1 + i * bytes;
+		put_value(wire, value, bytes, format->big_endian);
+		buffers->values[i] = value;
+		buffers->expected[i] = vnc_pixel_read(converter, wire);
+	}
+	return count;
+}
+
+static void bench(const struct Layout *layout, struct Buffers *buffers)
+{
+	struct Vnc_rfb_pixel_format format = layout->format;
+	struct Vnc_pixel_converter converter;
+	if (!vnc_pixel_converter_init(&converter, &format)) {
+		return;
+	}
+	u8 *wire = buffers->wire + 1;
+	for (size_t i = 0; i < BENCH_WIDTH * BENCH_HEIGHT * converter.bytes_per_pixel; ++i) {
+		wire[i] = random_u32();
+	}
+	vnc_pixel_converter_use_kernels(&converter, "scalar");
+	double scalar = bench_kernel(&converter, wire, buffers->dest);
+	printf("%-20s scalar %6.0f Mpx/s", layout->name, scalar);
+	for (size_t i = 0; i < ARRAY_COUNT(kernel_names); ++i) {
+		if (vnc_pixel_converter_use_kernels(&converter, kernel_names[i])) {
+			printf(", %s %6.0f Mpx/s", kernel_names[i],
+			       bench_kernel(&converter, wire, buffers->dest));
+		}
+	}
+	printf("\n");
+	vnc_pixel_converter_deinit(&converter);
+}
+
+static double bench_kernel(struct Vnc_pixel_converter *converter, const u8 *wire, u32 *dest)
+{
+	u32 src_pitch = BENCH_WIDTH * converter->bytes_per_pixel;
+	u64 start_ns = now_ns();
+	for (u32 frame = 0; frame < BENCH_FRAMES; ++frame) {
+		for (u32 y = 0; y < BENCH_HEIGHT; ++y) {
+			vnc_pixel_convert_row(converter, wire + y * src_pitch,
+					      dest + y * BENCH_WIDTH, BENCH_WIDTH);
+		}
+	}
+	u64 elapsed_ns = now_ns() - start_ns;
+	return (double)BENCH_WIDTH * BENCH_HEIGHT * BENCH_FRAMES / elapsed_ns * 1e3;
+}
+
+static void put_value(u8 *dest, u32 value, u8 bytes, bool big_endian)
+{
+	for (u8 i = 0; i < bytes; ++i) {
+		dest[i] = value >> (big_endian ? (bytes - 1 - i) * 8 : i * 8);
+	}
+}
+
+// xorshift32, rand() takes longer than the kernels
+static u32 random_u32(void)
+{
+	static u32 state = 1;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
@@ -0,0 +1,225 @@
+// Checks that every scaler kernel this build and CPU have draws exactly like the scalar code, for
+// each filter when shrinking, enlarging and letterboxing, then times the kernels.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "macros.h"
+#include "scale.h"
+
+// Random rects redrawn per size, at the edges of the area too
+#define RECT_COUNT 64
+#define BENCH_SRC_WIDTH 2560
+#define BENCH_SRC_HEIGHT 1440
+#define BENCH_DEST_WIDTH 1920
+#define BENCH_DEST_HEIGHT 1080
+#define BENCH_FRAMES 10
+
+struct Size {
+	u32 src_width;
+	u32 src_height;
+	u32 dest_width;
+	u32 dest_height;
+};
+
+// Odd sizes leave every tail the kernels hand to the scalar code
+static const struct Size sizes[] = {
+	{ 67, 45, 31, 21 },
+	{ 31, 21, 67, 45 },
+	{ 640, 480, 1920, 1080 },
+	{ 1920, 1080, 1280, 1024 },
+	{ 1920, 1080, 97, 53 },
+	{ 3, 2, 250, 170 },
+};
+
+static const enum Vnc_scale_filter filters[] = {
+	VNC_SCALE_FILTER_NEAREST,
+	VNC_SCALE_FILTER_BILINEAR,
+	VNC_SCALE_FILTER_AREA,
+};
+
+static const char *filter_names[] = { "nearest", "bilinear", "area" };
+static const char *kernel_names[] = { "sse2", "avx2", "neon" };
+
+static bool check(enum Vnc_scale_filter filter, const struct Size *size);
+static u32 check_kernel(struct Vnc_scaler *scaler, struct Vnc_framebuffer *src,
+			struct Vnc_framebuffer *expected, struct Vnc_framebuffer *dest,
+			const struct Vnc_rfb_rect *rects);
+static void bench(enum Vnc_scale_filter filter);
+static double bench_kernel(struct Vnc_scaler *scaler, struct Vnc_framebuffer *src,
+			   struct Vnc_framebuffer *dest);
+static bool alloc_framebuffer(struct Vnc_framebuffer *framebuffer, u32 width, u32 height);
+static void fill_random(struct Vnc_framebuffer *framebuffer);
+static u32 random_u32(void);
+static u64 now_ns(void);
+
+int main(void)
+{
+	vnc_log_init("scale_test.log");
+	bool ok = true;
+	for (size_t i = 0; i < ARRAY_COUNT(filters); ++i) {
+		for (size_t j = 0; j < ARRAY_COUNT(sizes); ++j) {
+			ok &= check(filters[i], &sizes[j]);
+		}
+	}
+	for (size_t i = 0; i < ARRAY_COUNT(filters); ++i) {
+		bench(filters[i]);
+	}
+	return ok ? 0 : 1;
+}
+
+// The whole destination, then rects of it drawn into a framebuffer that starts at their corner
+static bool check(enum Vnc_scale_filter filter, const struct Size *size)
+{
+	struct Vnc_scaler scaler;
+	struct Vnc_framebuffer src;
+	struct Vnc_framebuffer expected;
+	struct Vnc_framebuffer dest;
+	if (!vnc_scaler_init(&scaler, filter, size->src_width, size->src_height, size->dest_width,
+			     size->dest_height) ||
+	    !alloc_framebuffer(&src, size->src_width, size->src_height) ||
+	    !alloc_framebuffer(&expected, size->dest_width, size->dest_height) ||
+	    !alloc_framebuffer(&dest, size->dest_width, size->dest_height)) {
+		return false;
+	}
+	fill_random(&src);
+	struct Vnc_rfb_rect rects[RECT_COUNT];
+	for (u32 i = 0; i < RECT_COUNT; ++i) {
+		rects[i].x = random_u32() % size->dest_width;
+		rects[i].y = random_u32() % size->dest_height;
+		rects[i].width = 1 + random_u32() % (size->dest_width - rects[i].x);
+		rects[i].height = 1 + random_u32() % (size->dest_height - rects[i].y);
+	}
+	vnc_scaler_use_kernels(&scaler, "scalar");
+	struct Vnc_rfb_rect whole = { .width = size->dest_width, .height = size->dest_height };
+	vnc_scaler_scale(&scaler, &src, &expected, 0, 0, &whole);
+
+	bool ok = true;
+	for (size_t i = 0; i < ARRAY_COUNT(kernel_names); ++i) {
+		if (vnc_scaler_use_kernels(&scaler, kernel_names[i])) {
+			u32 mismatches = check_kernel(&scaler, &src, &expected, &dest, rects);
+			printf("%-8s %4ux%-4u onto %4ux%-4u %-5s %u mismatches\n",
+			       filter_names[filter], size->src_width, size->src_height,
+			       size->dest_width, size->dest_height, kernel_names[i], mismatches);
+			ok &= mismatches == 0;
+		}
+	}
+	vnc_scaler_deinit(&scaler);
+	free(src.buffer);
+	free(expected.buffer);
+	free(dest.buffer);
+	return ok;
+}
+
+static u32 check_kernel(struct Vnc_scaler *scaler, struct Vnc_framebuffer *src,
+			struct Vnc_framebuffer *expected, struct Vnc_framebuffer *dest,
+			const struct Vnc_rfb_rect *rects)
+{
+	u32 mismatches = 0;
+	u32 stride = dest->pitch / sizeof(u32);
+	struct Vnc_rfb_rect whole = { .width = dest->width, .height = dest->height };
+	memset(dest->buffer, 0xff, dest->size);
+	vnc_scaler_scale(scaler, src, dest, 0, 0, &whole);
+	for (u32 i = 0; i < dest->width * dest->height; ++i) {
+		mismatches += ((u32 *)dest->buffer)[i] != ((u32 *)expected->buffer)[i];
+	}
+
+	for (u32 i = 0; i < RECT_COUNT; ++i) {
+		const struct Vnc_rfb_rect *rect = &rects[i];
+		struct Vnc_rfb_rect local = { .width = rect->width, .height = rect->height };
+		memset(dest->buffer, 0xff, dest->size);
+		vnc_scaler_scale(scaler, src, dest, rect->x, rect->y, &local);
+		for (u32 y = 0; y < rect->height; ++y) {
+			const u32 *row = (u32 *)dest->buffer + y * stride;
+			const u32 *expected_row =
+				(u32 *)expected->buffer + (rect->y + y) * stride + rect->x;
+			for (u32 x = 0; x < rect->width; ++x) {
+				mismatches += row[x] != expected_row[x];
+			}
+		}
+	}
+	return mismatches;
+}
+
+static void bench(enum Vnc_scale_filter filter)
+{
+	struct Vnc_scaler scaler;
+	struct Vnc_framebuffer src;
+	struct Vnc_framebuffer dest;
+	if (!vnc_scaler_init(&scaler, filter, BENCH_SRC_WIDTH, BENCH_SRC_HEIGHT, BENCH_DEST_WIDTH,
+			     BENCH_DEST_HEIGHT) ||
+	    !alloc_framebuffer(&src, BENCH_SRC_WIDTH, BENCH_SRC_HEIGHT) ||
+	    !alloc_framebuffer(&dest, BENCH_DEST_WIDTH, BENCH_DEST_HEIGHT)) {
+		return;
+	}
+	fill_random(&src);
+	vnc_scaler_use_kernels(&scaler, "scalar");
+	printf("%-8s %ux%u onto %ux%u: scalar %5.0f Mpx/s", filter_names[filter],
+	       BENCH_SRC_WIDTH, BENCH_SRC_HEIGHT, BENCH_DEST_WIDTH, BENCH_DEST_HEIGHT,
+	       bench_kernel(&scaler, &src, &dest));
+	for (size_t i = 0; i < ARRAY_COUNT(kernel_names); ++i) {
+		if (vnc_scaler_use_kernels(&scaler, kernel_names[i])) {
+			printf(", %s %5.0f Mpx/s", kernel_names[i],
+			       bench_kernel(&scaler, &src, &dest));
+		}
+	}
+	printf("\n");
+	vnc_scaler_deinit(&scaler);
+	free(src.buffer);
+	free(dest.buffer);
+}
+
+// Destination pixels per second of the best frame
+static double bench_kernel(struct Vnc_scaler *scaler, struct Vnc_framebuffer *src,
+			   struct Vnc_framebuffer *dest)
+{
+	struct Vnc_rfb_rect whole = { .width = dest->width, .height = dest->height };
+	u64 best_ns = UINT64_MAX;
+	for (u32 frame = 0; frame < BENCH_FRAMES; ++frame) {
+		u64 start_ns = now_ns();
+		vnc_scaler_scale(scaler, src, dest, 0, 0, &whole);
+		u64 elapsed_ns = now_ns() - start_ns;
+		best_ns = MIN(best_ns, elapsed_ns);
+	}
+	return (double)dest->width * dest->height / best_ns * 1e3;
+}
+
+static bool alloc_framebuffer(struct Vnc_framebuffer *framebuffer, u32 width, u32 height)
+{
+	*framebuffer = (struct Vnc_framebuffer){
+		.width = width,
+		.height = height,
+		.pitch = width * sizeof(u32),
+		.size = width * height * sizeof(u32),
+		.bpp = 32,
+		.buffer = malloc(width * height * sizeof(u32)),
+	};
+	return framebuffer->buffer != NULL;
+}
+
+static void fill_random(struct Vnc_framebuffer *framebuffer)
+{
+	u32 *pixels = (u32 *)framebuffer->buffer;
+	for (u32 i = 0; i < framebuffer->width * framebuffer->height; ++i) {
+		pixels[i] = random_u32() & 0xffffff;
+	}
+}
+
+// xorshift32, rand() takes longer than the kernels
+static u32 random_u32(void)
+{
+	static u32 state = 1;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
@@ -0,0 +1,281 @@
+// Checks the Tight palette expansion and gradient filter against straightforward scalar
+// versions of them for random data and every row length up to 67, then times both on the best
+// of ten 1920x1080 frames.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "macros.h"
+#include "tight.h"
+
+#define MAX_CHECK_WIDTH 67
+#define CHECK_HEIGHT 5
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 1080
+#define BENCH_FRAMES 10
+
+struct Buffers {
+	u8 *src;
+	u16 *rows;
+	u32 *expected;
+	u32 *dest;
+};
+
+static const struct Vnc_rfb_pixel_format formats[] = {
+	// Sent as TPIXELs
+	{ .bpp = 32, .depth = 24, .true_color = 1, .red_max = 255, .green_max = 255,
+	  .blue_max = 255, .red_shift = 16, .green_shift = 8, .blue_shift = 0 },
+	{ .bpp = 16, .depth = 16, .true_color = 1, .red_max = 31, .green_max = 63, .blue_max = 31,
+	  .red_shift = 11, .green_shift = 5, .blue_shift = 0 },
+	{ .bpp = 8, .depth = 8, .true_color = 1, .red_max = 7, .green_max = 7, .blue_max = 3,
+	  .red_shift = 0, .green_shift = 3, .blue_shift = 6 },
+};
+
+static const u16 palette_sizes[] = { 2, 3, 16, 17, 256 };
+
+static bool check_palette(u16 palette_size, struct Buffers *buffers);
+static bool check_gradient(const struct Vnc_rfb_pixel_format *format, struct Buffers *buffers);
+static void bench_palette(u16 palette_size, struct Buffers *buffers);
+static void bench_gradient(const struct Vnc_rfb_pixel_format *format, struct Buffers *buffers);
+static void expand_palette_scalar(const u8 *src, const u32 *palette, u16 palette_size,
+				  u16 width, u16 height, u32 *dest);
+static void gradient_filter_scalar(const u8 *src, u16 *rows, u16 width, u16 height,
+				   const struct Vnc_pixel_converter *converter, u32 *dest);
+static void random_palette(u32 *palette, u16 palette_size);
+static u8 tpixel_size(const struct Vnc_rfb_pixel_format *format);
+static size_t palette_data_size(u16 palette_size, u16 width, u16 height);
+static u32 random_u32(void);
+static u64 now_ns(void);
+
+int main(void)
+{
+	vnc_log_init("tight_bench.log");
+	size_t pixels = BENCH_WIDTH * BENCH_HEIGHT;
+	struct Buffers buffers = {
+		.src = malloc(pixels * 4),
+		.rows = malloc(VNC_TIGHT_GRADIENT_ROWS_LEN(BENCH_WIDTH) * sizeof(u16)),
+		.expected = malloc(pixels * sizeof(u32)),
+		.dest = malloc(pixels * sizeof(u32)),
+	};
+	if (buffers.src == NULL || buffers.rows == NULL || buffers.expected == NULL ||
+	    buffers.dest == NULL) {
+		return 1;
+	}
+	bool ok = true;
+	for (size_t i = 0; i < ARRAY_COUNT(palette_sizes); ++i) {
+		ok &= check_palette(palette_sizes[i], &buffers);
+	}
+	for (size_t i = 0; i < ARRAY_COUNT(formats); ++i) {
+		ok &= check_gradient(&formats[i], &buffers);
+	}
+	for (size_t i = 0; i < ARRAY_COUNT(palette_sizes); ++i) {
+		bench_palette(palette_sizes[i], &buffers);
+	}
+	for (size_t i = 0; i < ARRAY_COUNT(formats); ++i) {
+		bench_gradient(&formats[i], &buffers);
+	}
+	free(buffers.src);
+	free(buffers.rows);
+	free(buffers.expected);
+	free(buffers.dest);
+	return ok ? 0 : 1;
+}
+
+// Indices go past the palette too, which the decoder keeps zeroed up to 256 entries
+static bool check_palette(u16 palette_size, struct Buffers *buffers)
+{
+	u32 palette[256] = { 0 };
+	random_palette(palette, palette_size);
+	u32 mismatches = 0;
+	for (u16 width = 1; width <= MAX_CHECK_WIDTH; ++width) {
+		size_t size = palette_data_size(palette_size, width, CHECK_HEIGHT);
+		for (size_t i = 0; i < size; ++i) {
+			buffers->src[i] = random_u32();
+		}
+		expand_palette_scalar(buffers->src, palette, palette_size, width, CHECK_HEIGHT,
+				      buffers->expected);
+		vnc_tight_expand_palette(buffers->src, palette, palette_size, width, CHECK_HEIGHT,
+					 buffers->dest, width);
+		for (u32 i = 0; i < (u32)width * CHECK_HEIGHT; ++i) {
+			mismatches += buffers->dest[i] != buffers->expected[i];
+		}
+	}
+	printf("palette of %3u: %u mismatches\n", palette_size, mismatches);
+	return mismatches == 0;
+}
+
+static bool check_gradient(const struct Vnc_rfb_pixel_format *format, struct Buffers *buffers)
+{
+	struct Vnc_rfb_pixel_format copy = *format;
+	struct Vnc_pixel_converter converter;
+	if (!vnc_pixel_converter_init(&converter, &copy)) {
+		return false;
+	}
+	u32 mismatches = 0;
+	for (u16 width = 1; width <= MAX_CHECK_WIDTH; ++width) {
+		for (size_t i = 0; i < (size_t)width * CHECK_HEIGHT * tpixel_size(format); ++i) {
+			buffers->src[i] = random_u32();
+		}
+		gradient_filter_scalar(buffers->src, buffers->rows, width, CHECK_HEIGHT, &converter,
+				       buffers->expected);
+		vnc_tight_gradient_filter(buffers->src, buffers->rows, width, CHECK_HEIGHT,
+					  &converter, buffers->dest, width);
+		for (u32 i = 0; i < (u32)width * CHECK_HEIGHT; ++i) {
+			mismatches += buffers->dest[i] != buffers->expected[i];
+		}
+	}
+	printf("gradient at %2u bpp: %u mismatches\n", format->bpp, mismatches);
+	vnc_pixel_converter_deinit(&converter);
+	return mismatches == 0;
+}
+
+static void bench_palette(u16 palette_size, struct Buffers *buffers)
+{
+	u32 palette[256] = { 0 };
+	random_palette(palette, palette_size);
+	size_t size = palette_data_size(palette_size, BENCH_WIDTH, BENCH_HEIGHT);
+	for (size_t i = 0; i < size; ++i) {
+		buffers->src[i] = random_u32() % MIN(palette_size, 256);
+	}
+	u64 scalar_ns = UINT64_MAX;
+	u64 decoder_ns = UINT64_MAX;
+	for (u32 frame = 0; frame < BENCH_FRAMES; ++frame) {
+		u64 start_ns = now_ns();
+		expand_palette_scalar(buffers->src, palette, palette_size, BENCH_WIDTH,
+				      BENCH_HEIGHT, buffers->expected);
+		u64 scalar_end_ns = now_ns();
+		vnc_tight_expand_palette(buffers->src, palette, palette_size, BENCH_WIDTH,
+					 BENCH_HEIGHT, buffers->dest, BENCH_WIDTH);
+		u64 decoder_end_ns = now_ns();
+		scalar_ns = MIN(scalar_ns, scalar_end_ns - start_ns);
+		decoder_ns = MIN(decoder_ns, decoder_end_ns - scalar_end_ns);
+	}
+	double pixels = (double)BENCH_WIDTH * BENCH_HEIGHT;
+	printf("palette of %3u: scalar %6.0f Mpx/s, decoder %6.0f Mpx/s\n", palette_size,
+	       pixels / scalar_ns * 1e3, pixels / decoder_ns * 1e3);
+}
+
+static void bench_gradient(const struct Vnc_rfb_pixel_format *format, struct Buffers *buffers)
+{
+	struct Vnc_rfb_pixel_format copy = *format;
+	struct Vnc_pixel_converter converter;
+	if (!vnc_pixel_converter_init(&converter, &copy)) {
+		return;
+	}
+	// Small differences, like the filter leaves of smooth images
+	for (size_t i = 0; i < (size_t)BENCH_WIDTH * BENCH_HEIGHT * tpixel_size(format); ++i) {
+		buffers->src[i] = random_u32() % 5 - 2;
+	}
+	u64 scalar_ns = UINT64_MAX;
+	u64 decoder_ns = UINT64_MAX;
+	for (u32 frame = 0; frame < BENCH_FRAMES; ++frame) {
+		u64 start_ns = now_ns();
+		gradient_filter_scalar(buffers->src, buffers->rows, BENCH_WIDTH, BENCH_HEIGHT,
+				       &converter, buffers->expected);
+		u64 scalar_end_ns = now_ns();
+		vnc_tight_gradient_filter(buffers->src, buffers->rows, BENCH_WIDTH, BENCH_HEIGHT,
+					  &converter, buffers->dest, BENCH_WIDTH);
+		u64 decoder_end_ns = now_ns();
+		scalar_ns = MIN(scalar_ns, scalar_end_ns - start_ns);
+		decoder_ns = MIN(decoder_ns, decoder_end_ns - scalar_end_ns);
+	}
+	double pixels = (double)BENCH_WIDTH * BENCH_HEIGHT;
+	printf("gradient at %2u bpp: scalar %6.0f Mpx/s, decoder %6.0f Mpx/s\n", format->bpp,
+	       pixels / scalar_ns * 1e3, pixels / decoder_ns * 1e3);
+	vnc_pixel_converter_deinit(&converter);
+}
+
+static void expand_palette_scalar(const u8 *src, const u32 *palette, u16 palette_size,
+				  u16 width, u16 height, u32 *dest)
+{
+	for (u16 y = 0; y < height; ++y) {
+		u32 *row = dest + y * width;
+		if (palette_size != 2) {
+			for (u16 x = 0; x < width; ++x) {
+				row[x] = palette[*src++];
+			}
+			continue;
+		}
+		for (u16 x = 0; x < width; ++x) {
+			row[x] = palette[(src[x / 8] >> (7 - x % 8)) & 1];
+		}
+		src += (width + 7) / 8;
+	}
+}
+
+// Three components per pixel, one pixel at a time
+static void gradient_filter_scalar(const u8 *src, u16 *rows, u16 width, u16 height,
+				   const struct Vnc_pixel_converter *converter, u32 *dest)
+{
+	const struct Vnc_rfb_pixel_format *format = &converter->format;
+	bool tpixel = tpixel_size(format) == 3;
+	u8 shifts[3] = { format->red_shift, format->green_shift, format->blue_shift };
+	u16 max[3] = { format->red_max, format->green_max, format->blue_max };
+	if (tpixel) {
+		shifts[0] = 16;
+		shifts[1] = 8;
+		shifts[2] = 0;
+	}
+	u16 *prev_row = rows;
+	u16 *cur_row = rows + width * 3;
+	memset(prev_row, 0, width * 3 * sizeof(*prev_row));
+	for (u16 y = 0; y < height; ++y) {
+		i32 left[3] = { 0 };
+		i32 up_left[3] = { 0 };
+		for (u16 x = 0; x < width; ++x) {
+			u32 pixel = 0;
+			u32 value = tpixel ? 0 : vnc_pixel_read_value(converter, src);
+			for (u8 c = 0; c < 3; ++c) {
+				u32 diff = tpixel ? src[c] : value >> shifts[c];
+				i32 up = prev_row[x * 3 + c];
+				i32 predicted = MIN(MAX(left[c] + up - up_left[c], 0), max[c]);
+				u16 component = (predicted + diff) & max[c];
+				cur_row[x * 3 + c] = component;
+				pixel |= (u32)component << shifts[c];
+				left[c] = component;
+				up_left[c] = up;
+			}
+			src += tpixel ? 3 : format->bpp / 8;
+			dest[y * width + x] = tpixel ? pixel : vnc_pixel_convert(converter, pixel);
+		}
+		u16 *tmp = prev_row;
+		prev_row = cur_row;
+		cur_row = tmp;
+	}
+}
+
+static void random_palette(u32 *palette, u16 palette_size)
+{
+	for (u16 i = 0; i < palette_size; ++i) {
+		palette[i] = random_u32() & 0xffffff;
+	}
+}
+
+static u8 tpixel_size(const struct Vnc_rfb_pixel_format *format)
+{
+	return format->bpp == 32 && format->depth == 24 ? 3 : format->bpp / 8;
+}
+
+static size_t palette_data_size(u16 palette_size, u16 width, u16 height)
+{
+	return palette_size == 2 ? (size_t)(width + 7) / 8 * height : (size_t)width * height;
+}
+
+// xorshift32
+static u32 random_u32(void)
+{
+	static u32 state = 1;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
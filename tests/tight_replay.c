@@ -0,0 +1,244 @@
+// Replays Tight basic rects spread over the four zlib streams through the decoder, serially on
+// this thread and on the stream workers, and times both. The speedup needs a core per stream.
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "log.h"
+#include "macros.h"
+#include "tight.h"
+
+#define WIDTH 1024
+#define HEIGHT 1024
+#define RECT_WIDTH 256
+#define RECT_HEIGHT 64
+#define RECT_COUNT 480
+#define RUNS 5
+
+struct Wire {
+	u8 *buffer;
+	size_t len;
+	size_t capacity;
+	z_stream zstreams[VNC_TIGHT_STREAM_COUNT];
+	int fd;
+};
+
+static bool replay(struct Wire *wire, struct Vnc_rfb_rect *rects, bool parallel,
+		   struct Vnc_framebuffer *framebuffer, u64 *elapsed_ns);
+static void encode_basic(struct Wire *wire, u8 stream, struct Vnc_rfb_rect *rect);
+static void put_compact_length(struct Wire *wire, u32 length);
+static void put(struct Wire *wire, const void *data, size_t size);
+static void *write_wire(void *args);
+static u32 random_u32(void);
+static u64 now_ns(void);
+
+int main(void)
+{
+	vnc_log_init("tight_replay.log");
+	// Rects tile the desktop, each stream takes every fourth one
+	static struct Vnc_rfb_rect rects[RECT_COUNT];
+	struct Wire wire = { 0 };
+	for (size_t i = 0; i < ARRAY_COUNT(wire.zstreams); ++i) {
+		deflateInit(&wire.zstreams[i], Z_DEFAULT_COMPRESSION);
+	}
+	u32 columns = WIDTH / RECT_WIDTH;
+	u32 rows = HEIGHT / RECT_HEIGHT;
+	for (u32 i = 0; i < RECT_COUNT; ++i) {
+		u32 tile = i % (columns * rows);
+		rects[i] = (struct Vnc_rfb_rect){
+			.x = tile % columns * RECT_WIDTH,
+			.y = tile / columns * RECT_HEIGHT,
+			.width = RECT_WIDTH,
+			.height = RECT_HEIGHT,
+			.encoding = 7,
+		};
+		encode_basic(&wire, i % VNC_TIGHT_STREAM_COUNT, &rects[i]);
+	}
+	for (size_t i = 0; i < ARRAY_COUNT(wire.zstreams); ++i) {
+		deflateEnd(&wire.zstreams[i]);
+	}
+	printf("%u rects of %ux%u over %u streams, %.1f MB on the wire\n", RECT_COUNT,
+	       RECT_WIDTH, RECT_HEIGHT, VNC_TIGHT_STREAM_COUNT, wire.len / 1e6);
+
+	struct Vnc_framebuffer framebuffers[2];
+	u64 best_ns[2] = { UINT64_MAX, UINT64_MAX };
+	bool ok = true;
+	for (int mode = 0; mode < 2 && ok; ++mode) {
+		framebuffers[mode] = (struct Vnc_framebuffer){
+			.width = WIDTH,
+			.height = HEIGHT,
+			.pitch = WIDTH * 4,
+			.size = WIDTH * HEIGHT * 4,
+			.bpp = 32,
+			.buffer = calloc(WIDTH * HEIGHT, 4),
+		};
+		for (int run = 0; run < RUNS && ok; ++run) {
+			u64 elapsed_ns;
+			ok = replay(&wire, rects, mode == 1, &framebuffers[mode], &elapsed_ns);
+			best_ns[mode] = MIN(best_ns[mode], elapsed_ns);
+		}
+	}
+	if (ok) {
+		printf("serial %.1f ms, parallel %.1f ms, best of %d runs on %ld CPUs\n",
+		       best_ns[0] / 1e6, best_ns[1] / 1e6, RUNS, sysconf(_SC_NPROCESSORS_ONLN));
+		size_t size = framebuffers[0].size;
+		ok = memcmp(framebuffers[0].buffer, framebuffers[1].buffer, size) == 0;
+		if (!ok) {
+			printf("serial and parallel decode drew different pixels\n");
+		}
+	}
+	free(framebuffers[0].buffer);
+	free(framebuffers[1].buffer);
+	free(wire.buffer);
+	return ok ? 0 : 1;
+}
+
+// From the first byte on the socket until every worker is done
+static bool replay(struct Wire *wire, struct Vnc_rfb_rect *rects, bool parallel,
+		   struct Vnc_framebuffer *framebuffer, u64 *elapsed_ns)
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		perror("socketpair");
+		return false;
+	}
+	struct Vnc_rfb_pixel_format format = {
+		.bpp = 32,
+		.depth = 24,
+		.true_color = 1,
+		.red_max = 255,
+		.green_max = 255,
+		.blue_max = 255,
+		.red_shift = 16,
+		.green_shift = 8,
+		.blue_shift = 0,
+	};
+	struct Vnc_pixel_converter converter;
+	struct Vnc_rfb_stream stream;
+	struct Vnc_tight tight;
+	if (!vnc_pixel_converter_init(&converter, &format) ||
+	    !vnc_rfb_stream_init(&stream, fds[0]) || !vnc_tight_init(&tight, parallel)) {
+		return false;
+	}
+
+	wire->fd = fds[1];
+	pthread_t writer;
+	u64 start_ns = now_ns();
+	pthread_create(&writer, NULL, write_wire, wire);
+	bool ok = true;
+	for (u32 i = 0; i < RECT_COUNT && ok; ++i) {
+		enum Vnc_rfb_result result;
+		while ((result = vnc_tight_measure_rect(&stream, &rects[i], &converter)) ==
+		       VNC_RFB_RESULT_WOULD_BLOCK) {
+			vnc_rfb_stream_receive(&stream);
+		}
+		if (result == VNC_RFB_RESULT_SUCCESS) {
+			result = vnc_tight_recv_rect(&tight, &stream, &rects[i], &converter,
+						     framebuffer);
+		}
+		if (result != VNC_RFB_RESULT_SUCCESS) {
+			fprintf(stderr, "rect %u: %s\n", i, vnc_rfb_result_to_str(result));
+			ok = false;
+		}
+	}
+	ok &= vnc_tight_sync(&tight) == VNC_RFB_RESULT_SUCCESS;
+	*elapsed_ns = now_ns() - start_ns;
+
+	close(fds[0]);
+	pthread_join(writer, NULL);
+	close(fds[1]);
+	vnc_tight_deinit(&tight);
+	vnc_rfb_stream_deinit(&stream);
+	vnc_pixel_converter_deinit(&converter);
+	return ok;
+}
+
+// A basic rect with the copy filter, a gradient noisy enough that zlib barely shrinks it
+static void encode_basic(struct Wire *wire, u8 stream, struct Vnc_rfb_rect *rect)
+{
+	u8 header[] = { 0x40 | stream << 4, 0 };
+	put(wire, header, sizeof(header));
+
+	size_t size = (size_t)rect->width * rect->height * 3;
+	u8 *pixels = malloc(size);
+	for (size_t i = 0; i < size; i += 3) {
+		u32 x = rect->x + i / 3 % rect->width;
+		u32 y = rect->y + i / 3 / rect->width;
+		u32 noise = random_u32();
+		pixels[i] = x + (noise & 0xf);
+		pixels[i + 1] = y + (noise >> 4 & 0xf);
+		pixels[i + 2] = x + y + (noise >> 8 & 0xf);
+	}
+	z_stream *zstream = &wire->zstreams[stream];
+	uLong capacity = deflateBound(zstream, size) + 16;
+	u8 *compressed = malloc(capacity);
+	zstream->next_in = pixels;
+	zstream->avail_in = size;
+	zstream->next_out = compressed;
+	zstream->avail_out = capacity;
+	deflate(zstream, Z_SYNC_FLUSH);
+	u32 length = capacity - zstream->avail_out;
+	put_compact_length(wire, length);
+	put(wire, compressed, length);
+	free(compressed);
+	free(pixels);
+}
+
+static void put_compact_length(struct Wire *wire, u32 length)
+{
+	for (u8 i = 0; i < 3; ++i) {
+		u8 byte = i == 2 ? length >> 14 : (length >> (7 * i)) & 0x7f;
+		bool more = i < 2 && length >> (7 * (i + 1)) > 0;
+		byte |= more ? 0x80 : 0;
+		put(wire, &byte, 1);
+		if (!more) {
+			break;
+		}
+	}
+}
+
+static void put(struct Wire *wire, const void *data, size_t size)
+{
+	if (wire->len + size > wire->capacity) {
+		wire->capacity = MAX(wire->capacity * 2, wire->len + size);
+		wire->buffer = realloc(wire->buffer, wire->capacity);
+	}
+	memcpy(wire->buffer + wire->len, data, size);
+	wire->len += size;
+}
+
+static void *write_wire(void *args)
+{
+	struct Wire *wire = args;
+	size_t written = 0;
+	while (written < wire->len) {
+		ssize_t count = write(wire->fd, wire->buffer + written, wire->len - written);
+		if (count <= 0) {
+			break;
+		}
+		written += count;
+	}
+	return NULL;
+}
+
+// xorshift32
+static u32 random_u32(void)
+{
+	static u32 state = 1;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
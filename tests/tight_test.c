@@ -0,0 +1,247 @@
+// Checks that rects drawn while Tight basic rects are still decoding on the stream workers land
+// on top of them: fill rects, and basic rects of another stream.
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "log.h"
+#include "macros.h"
+#include "tight.h"
+
+#define WIDTH 512
+#define HEIGHT 512
+#define ROUNDS 200
+
+enum Op_kind {
+	OP_BASIC,
+	OP_FILL,
+};
+
+struct Op {
+	enum Op_kind kind;
+	struct Vnc_rfb_rect rect;
+	u8 stream;
+	u32 color;
+};
+
+struct Wire {
+	u8 *buffer;
+	size_t len;
+	size_t capacity;
+	z_stream zstreams[VNC_TIGHT_STREAM_COUNT];
+	int fd;
+};
+
+static bool run(bool parallel, u32 *errors);
+static void encode_basic(struct Wire *wire, struct Op *op);
+static void encode_fill(struct Wire *wire, struct Op *op);
+static void put_compact_length(struct Wire *wire, u32 length);
+static void put(struct Wire *wire, const void *data, size_t size);
+static void *write_wire(void *args);
+static u32 pixel_at(struct Vnc_framebuffer *framebuffer, u32 x, u32 y);
+
+int main(void)
+{
+	vnc_log_init("tight_test.log");
+	bool ok = true;
+	for (int i = 0; i < 2; ++i) {
+		bool parallel = i == 1;
+		u32 errors;
+		if (!run(parallel, &errors)) {
+			return 1;
+		}
+		printf("%s: %u misordered rects\n", parallel ? "parallel" : "serial", errors);
+		ok &= errors == 0;
+	}
+	return ok ? 0 : 1;
+}
+
+// Each round is a desktop-sized basic rect, a fill on top of it and a basic rect of another
+// stream on top of it
+static bool run(bool parallel, u32 *errors)
+{
+	static struct Op ops[ROUNDS * 3];
+	size_t op_count = 0;
+	srand(1);
+	for (u32 i = 0; i < ROUNDS; ++i) {
+		u8 stream = rand() % VNC_TIGHT_STREAM_COUNT;
+		u8 other_stream = (stream + 1 + rand() % (VNC_TIGHT_STREAM_COUNT - 1)) %
+				  VNC_TIGHT_STREAM_COUNT;
+		ops[op_count++] = (struct Op){ OP_BASIC, { 0, 0, WIDTH, HEIGHT, 7 }, stream,
+					       rand() & 0xffffff };
+		ops[op_count++] =
+			(struct Op){ OP_FILL, { 10, 10, 32, 32, 7 }, 0, rand() & 0xffffff };
+		ops[op_count++] = (struct Op){ OP_BASIC, { 100, 100, 64, 64, 7 }, other_stream,
+					       rand() & 0xffffff };
+	}
+
+	struct Wire wire = { 0 };
+	for (size_t i = 0; i < ARRAY_COUNT(wire.zstreams); ++i) {
+		deflateInit(&wire.zstreams[i], Z_DEFAULT_COMPRESSION);
+	}
+	for (size_t i = 0; i < op_count; ++i) {
+		if (ops[i].kind == OP_BASIC) {
+			encode_basic(&wire, &ops[i]);
+		} else {
+			encode_fill(&wire, &ops[i]);
+		}
+	}
+	for (size_t i = 0; i < ARRAY_COUNT(wire.zstreams); ++i) {
+		deflateEnd(&wire.zstreams[i]);
+	}
+
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		perror("socketpair");
+		return false;
+	}
+	wire.fd = fds[1];
+	pthread_t writer;
+	pthread_create(&writer, NULL, write_wire, &wire);
+
+	struct Vnc_rfb_pixel_format format = {
+		.bpp = 32,
+		.depth = 24,
+		.true_color = 1,
+		.red_max = 255,
+		.green_max = 255,
+		.blue_max = 255,
+		.red_shift = 16,
+		.green_shift = 8,
+		.blue_shift = 0,
+	};
+	struct Vnc_pixel_converter converter;
+	struct Vnc_rfb_stream stream;
+	struct Vnc_tight tight;
+	struct Vnc_framebuffer framebuffer = {
+		.width = WIDTH,
+		.height = HEIGHT,
+		.pitch = WIDTH * 4,
+		.size = WIDTH * HEIGHT * 4,
+		.bpp = 32,
+		.buffer = calloc(WIDTH * HEIGHT, 4),
+	};
+	if (!vnc_pixel_converter_init(&converter, &format) ||
+	    !vnc_rfb_stream_init(&stream, fds[0]) || !vnc_tight_init(&tight, parallel)) {
+		return false;
+	}
+
+	*errors = 0;
+	bool ok = true;
+	for (size_t i = 0; i < op_count && ok; ++i) {
+		enum Vnc_rfb_result result;
+		while ((result = vnc_tight_measure_rect(&stream, &ops[i].rect, &converter)) ==
+		       VNC_RFB_RESULT_WOULD_BLOCK) {
+			vnc_rfb_stream_receive(&stream);
+		}
+		if (result == VNC_RFB_RESULT_SUCCESS) {
+			result = vnc_tight_recv_rect(&tight, &stream, &ops[i].rect, &converter,
+						     &framebuffer);
+		}
+		if (result != VNC_RFB_RESULT_SUCCESS) {
+			fprintf(stderr, "rect %zu: %s\n", i, vnc_rfb_result_to_str(result));
+			ok = false;
+			break;
+		}
+		if (i % 3 != 2) {
+			continue;
+		}
+		if (vnc_tight_sync(&tight) != VNC_RFB_RESULT_SUCCESS) {
+			ok = false;
+		}
+		*errors += pixel_at(&framebuffer, 300, 300) != ops[i - 2].color;
+		*errors += pixel_at(&framebuffer, 20, 20) != ops[i - 1].color;
+		*errors += pixel_at(&framebuffer, 120, 120) != ops[i].color;
+	}
+
+	pthread_join(writer, NULL);
+	vnc_tight_deinit(&tight);
+	vnc_rfb_stream_deinit(&stream);
+	vnc_pixel_converter_deinit(&converter);
+	close(fds[0]);
+	close(fds[1]);
+	free(framebuffer.buffer);
+	free(wire.buffer);
+	return ok;
+}
+
+// A basic rect with the copy filter, its data deflated on the op's stream
+static void encode_basic(struct Wire *wire, struct Op *op)
+{
+	u8 header[] = { 0x40 | op->stream << 4, 0 };
+	put(wire, header, sizeof(header));
+
+	size_t size = (size_t)op->rect.width * op->rect.height * 3;
+	u8 *pixels = malloc(size);
+	for (size_t i = 0; i < size; i += 3) {
+		pixels[i] = op->color >> 16;
+		pixels[i + 1] = op->color >> 8;
+		pixels[i + 2] = op->color;
+	}
+	z_stream *zstream = &wire->zstreams[op->stream];
+	uLong capacity = deflateBound(zstream, size) + 16;
+	u8 *compressed = malloc(capacity);
+	zstream->next_in = pixels;
+	zstream->avail_in = size;
+	zstream->next_out = compressed;
+	zstream->avail_out = capacity;
+	deflate(zstream, Z_SYNC_FLUSH);
+	u32 length = capacity - zstream->avail_out;
+	put_compact_length(wire, length);
+	put(wire, compressed, length);
+	free(compressed);
+	free(pixels);
+}
+
+static void encode_fill(struct Wire *wire, struct Op *op)
+{
+	u8 data[] = { 0x80, op->color >> 16, op->color >> 8, op->color };
+	put(wire, data, sizeof(data));
+}
+
+static void put_compact_length(struct Wire *wire, u32 length)
+{
+	for (u8 i = 0; i < 3; ++i) {
+		u8 byte = i == 2 ? length >> 14 : (length >> (7 * i)) & 0x7f;
+		bool more = i < 2 && length >> (7 * (i + 1)) > 0;
+		byte |= more ? 0x80 : 0;
+		put(wire, &byte, 1);
+		if (!more) {
+			break;
+		}
+	}
+}
+
+static void put(struct Wire *wire, const void *data, size_t size)
+{
+	if (wire->len + size > wire->capacity) {
+		wire->capacity = MAX(wire->capacity * 2, wire->len + size);
+		wire->buffer = realloc(wire->buffer, wire->capacity);
+	}
+	memcpy(wire->buffer + wire->len, data, size);
+	wire->len += size;
+}
+
+static void *write_wire(void *args)
+{
+	struct Wire *wire = args;
+	size_t written = 0;
+	while (written < wire->len) {
+		ssize_t count = write(wire->fd, wire->buffer + written, wire->len - written);
+		if (count <= 0) {
+			break;
+		}
+		written += count;
+	}
+	return NULL;
+}
+
+static u32 pixel_at(struct Vnc_framebuffer *framebuffer, u32 x, u32 y)
+{
+	u32 *row = (u32 *)(framebuffer->buffer + y * framebuffer->pitch);
+	return row[x] & 0xffffff;
+}
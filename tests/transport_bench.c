@@ -0,0 +1,272 @@
+// Streams full screen raw updates from a server thread to the client over TCP on the loopback
+// interface and over a Unix socket, read the way the session reads raw rects, and times both.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "macros.h"
+#include "pixel.h"
+#include "rfb.h"
+#include "transport.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define UPDATES 50
+#define RUNS 3
+// Socket buffer size of the tuned runs, both ends
+#define BUFFER_SIZE (4 * 1024 * 1024)
+
+struct Server {
+	int listener;
+	int send_buffer_size;
+	const u8 *pixels;
+	size_t size;
+};
+
+static int listen_tcp(const char *host, int family, char *address, size_t address_size);
+static int listen_unix(const char *path, char *address, size_t address_size);
+static bool run(int listener, const char *address, int buffer_size, const u8 *pixels,
+		u64 *elapsed_ns);
+static void *serve(void *args);
+static u64 now_ns(void);
+
+int main(void)
+{
+	vnc_log_init("transport_bench.log");
+	size_t size = (size_t)WIDTH * HEIGHT * sizeof(u32);
+	u8 *pixels = malloc(size);
+	for (size_t i = 0; i < size; ++i) {
+		pixels[i] = i * 7 + i / 4096;
+	}
+	char dir[] = "/tmp/vnc-transport-XXXXXX";
+	if (pixels == NULL || mkdtemp(dir) == NULL) {
+		perror("setup");
+		return 1;
+	}
+	char path[sizeof(dir) + 8];
+	snprintf(path, sizeof(path), "%s/socket", dir);
+
+	printf("%d raw %ux%u updates, %.0f MB, best of %d runs\n", UPDATES, WIDTH, HEIGHT,
+	       (double)size * UPDATES / 1e6, RUNS);
+	struct {
+		const char *name;
+		int buffer_size;
+	} configs[] = {
+		{ "tcp 127.0.0.1", 0 },
+		{ "tcp [::1]", 0 },
+		{ "unix", 0 },
+		{ "tcp 127.0.0.1", BUFFER_SIZE },
+		{ "tcp [::1]", BUFFER_SIZE },
+		{ "unix", BUFFER_SIZE },
+	};
+	bool ok = true;
+	for (size_t i = 0; i < ARRAY_COUNT(configs) && ok; ++i) {
+		char address[128];
+		int listener;
+		if (strcmp(configs[i].name, "unix") == 0) {
+			listener = listen_unix(path, address, sizeof(address));
+		} else if (strcmp(configs[i].name, "tcp [::1]") == 0) {
+			listener = listen_tcp("::1", AF_INET6, address, sizeof(address));
+		} else {
+			listener = listen_tcp("127.0.0.1", AF_INET, address, sizeof(address));
+		}
+		if (listener == -1) {
+			printf("%-14s unavailable\n", configs[i].name);
+			continue;
+		}
+		u64 best_ns = UINT64_MAX;
+		for (int j = 0; j < RUNS && ok; ++j) {
+			u64 elapsed_ns;
+			ok = run(listener, address, configs[i].buffer_size, pixels, &elapsed_ns);
+			best_ns = MIN(best_ns, elapsed_ns);
+		}
+		if (ok) {
+			char buffers[32] = "default buffers";
+			if (configs[i].buffer_size > 0) {
+				snprintf(buffers, sizeof(buffers), "%d KiB buffers",
+					 configs[i].buffer_size / 1024);
+			}
+			printf("%-14s %-16s %5.0f MB/s\n", configs[i].name, buffers,
+			       (double)size * UPDATES / best_ns * 1e3);
+		}
+		close(listener);
+		unlink(path);
+	}
+	rmdir(dir);
+	free(pixels);
+	return ok ? 0 : 1;
+}
+
+// On a port the kernel picks, written into `address` the way vnc_transport_connect takes it
+static int listen_tcp(const char *host, int family, char *address, size_t address_size)
+{
+	struct sockaddr_storage addr = { 0 };
+	socklen_t addr_len;
+	if (family == AF_INET6) {
+		struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+		addr6->sin6_family = AF_INET6;
+		inet_pton(AF_INET6, host, &addr6->sin6_addr);
+		addr_len = sizeof(*addr6);
+	} else {
+		struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
+		addr4->sin_family = AF_INET;
+		inet_pton(AF_INET, host, &addr4->sin_addr);
+		addr_len = sizeof(*addr4);
+	}
+	int listener = socket(family, SOCK_STREAM, 0);
+	if (listener == -1 || bind(listener, (struct sockaddr *)&addr, addr_len) != 0 ||
+	    listen(listener, 1) != 0 || getsockname(listener, (struct sockaddr *)&addr,
+						    &addr_len) != 0) {
+		if (listener != -1) {
+			close(listener);
+		}
+		return -1;
+	}
+	if (family == AF_INET6) {
+		snprintf(address, address_size, "[%s]:%u", host,
+			 ntohs(((struct sockaddr_in6 *)&addr)->sin6_port));
+	} else {
+		snprintf(address, address_size, "%s:%u", host,
+			 ntohs(((struct sockaddr_in *)&addr)->sin_port));
+	}
+	return listener;
+}
+
+static int listen_unix(const char *path, char *address, size_t address_size)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener == -1 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(listener, 1) != 0) {
+		if (listener != -1) {
+			close(listener);
+		}
+		return -1;
+	}
+	snprintf(address, address_size, "unix:%s", path);
+	return listener;
+}
+
+// From the connect until the last update is in the framebuffer
+static bool run(int listener, const char *address, int buffer_size, const u8 *pixels,
+		u64 *elapsed_ns)
+{
+	struct Vnc_framebuffer framebuffer = {
+		.width = WIDTH,
+		.height = HEIGHT,
+		.pitch = WIDTH * sizeof(u32),
+		.size = WIDTH * HEIGHT * sizeof(u32),
+		.bpp = 32,
+		.buffer = malloc(WIDTH * HEIGHT * sizeof(u32)),
+	};
+	struct Vnc_rfb_pixel_format format = {
+		.bpp = 32,
+		.depth = 24,
+		.true_color = 1,
+		.red_max = 255,
+		.green_max = 255,
+		.blue_max = 255,
+		.red_shift = 16,
+		.green_shift = 8,
+		.blue_shift = 0,
+	};
+	struct Vnc_pixel_converter converter;
+	if (framebuffer.buffer == NULL || !vnc_pixel_converter_init(&converter, &format)) {
+		free(framebuffer.buffer);
+		return false;
+	}
+	struct Server server = {
+		.listener = listener,
+		.send_buffer_size = buffer_size,
+		.pixels = pixels,
+		.size = framebuffer.size,
+	};
+	struct Vnc_transport_options options = {
+		.recv_buffer_size = buffer_size,
+		.send_buffer_size = buffer_size,
+	};
+
+	u64 start_ns = now_ns();
+	pthread_t thread;
+	pthread_create(&thread, NULL, serve, &server);
+	int fd = vnc_transport_connect(address, &options);
+	struct Vnc_rfb_stream stream;
+	bool ok = fd != -1 && vnc_rfb_stream_init(&stream, fd);
+	for (u32 i = 0; i < UPDATES && ok; ++i) {
+		struct Vnc_rfb_rect rect = { .width = WIDTH, .height = HEIGHT };
+		size_t done = 0;
+		enum Vnc_rfb_result result;
+		while ((result = vnc_rfb_recv_rect_raw(&stream, &rect, &converter, &framebuffer,
+						       &done)) == VNC_RFB_RESULT_WOULD_BLOCK) {
+			result = vnc_rfb_stream_wait(&stream, 1000);
+			if (result != VNC_RFB_RESULT_SUCCESS) {
+				break;
+			}
+		}
+		if (result != VNC_RFB_RESULT_SUCCESS) {
+			fprintf(stderr, "%s: %s\n", address, vnc_rfb_result_to_str(result));
+			ok = false;
+		}
+	}
+	*elapsed_ns = now_ns() - start_ns;
+	if (ok && memcmp(framebuffer.buffer, pixels, framebuffer.size) != 0) {
+		printf("%s: received pixels differ from the sent ones\n", address);
+		ok = false;
+	}
+
+	if (fd != -1) {
+		vnc_rfb_stream_deinit(&stream);
+		close(fd);
+	} else {
+		// Wakes the server thread still waiting in accept
+		shutdown(listener, SHUT_RDWR);
+	}
+	pthread_join(thread, NULL);
+	vnc_pixel_converter_deinit(&converter);
+	free(framebuffer.buffer);
+	return ok;
+}
+
+// Accepts one client and sends it the updates
+static void *serve(void *args)
+{
+	struct Server *server = args;
+	int fd = accept(server->listener, NULL, NULL);
+	if (fd == -1) {
+		return NULL;
+	}
+	if (server->send_buffer_size > 0) {
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &server->send_buffer_size,
+			   sizeof(server->send_buffer_size));
+	}
+	for (u32 i = 0; i < UPDATES; ++i) {
+		size_t sent = 0;
+		while (sent < server->size) {
+			ssize_t count = send(fd, server->pixels + sent, server->size - sent,
+					     MSG_NOSIGNAL);
+			if (count <= 0) {
+				close(fd);
+				return NULL;
+			}
+			sent += count;
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
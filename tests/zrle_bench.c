@@ -0,0 +1,334 @@
+// Times the ZRLE decoder on frames made of a single subencoding and checks what it draws. MB/s
+// counts the framebuffer bytes written, so the subencodings compare on the same scale.
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "log.h"
+#include "macros.h"
+#include "zrle.h"
+
+#define WIDTH 1024
+#define HEIGHT 1024
+#define FRAMES 10
+#define PALETTE_SIZE 16
+#define MAX_RUN_LENGTH 64
+
+enum Subencoding {
+	RAW,
+	SOLID,
+	PACKED_PALETTE,
+	PLAIN_RLE,
+	PALETTE_RLE,
+	SUBENCODING_COUNT,
+};
+
+struct Wire {
+	u8 *buffer;
+	size_t len;
+	size_t capacity;
+	int fd;
+};
+
+static size_t encode_frames(struct Wire *wire, enum Subencoding subencoding, u32 *expected);
+static void encode_tile(struct Wire *tiles, enum Subencoding subencoding, u32 *dest, u32 stride,
+			u16 width, u16 height);
+static bool decode_frames(struct Wire *wire, const u32 *expected, u64 *best_ns);
+static void put_cpixel(struct Wire *wire, u32 color);
+static void put_run_length(struct Wire *wire, u32 run_length);
+static void put_u8(struct Wire *wire, u8 value);
+static void put(struct Wire *wire, const void *data, size_t size);
+static void *write_wire(void *args);
+static u32 random_u32(void);
+static u64 now_ns(void);
+
+int main(void)
+{
+	vnc_log_init("zrle_bench.log");
+	static const char *names[SUBENCODING_COUNT] = {
+		[RAW] = "raw",
+		[SOLID] = "solid",
+		[PACKED_PALETTE] = "packed palette",
+		[PLAIN_RLE] = "plain RLE",
+		[PALETTE_RLE] = "palette RLE",
+	};
+	printf("%ux%u frames of 64x64 tiles, best of %d\n", WIDTH, HEIGHT, FRAMES);
+	u32 *expected = malloc((size_t)FRAMES * WIDTH * HEIGHT * sizeof(u32));
+	bool ok = true;
+	for (int i = 0; i < SUBENCODING_COUNT && ok; ++i) {
+		struct Wire wire = { 0 };
+		size_t tile_bytes = encode_frames(&wire, i, expected);
+		u64 best_ns;
+		ok = decode_frames(&wire, expected, &best_ns);
+		if (ok) {
+			printf("%-14s: %5.2f MB of tiles, %5.2f MB on the wire, %6.0f MB/s\n",
+			       names[i], tile_bytes / 1e6, wire.len / 1e6 / FRAMES,
+			       WIDTH * HEIGHT * sizeof(u32) * 1e3 / best_ns);
+		}
+		free(wire.buffer);
+	}
+	free(expected);
+	return ok ? 0 : 1;
+}
+
+// Appends FRAMES rects to the wire, deflated on one stream like a server would, and draws each
+// into `expected`. Returns the inflated size of a frame.
+static size_t encode_frames(struct Wire *wire, enum Subencoding subencoding, u32 *expected)
+{
+	z_stream zstream = { 0 };
+	deflateInit(&zstream, Z_DEFAULT_COMPRESSION);
+	struct Wire tiles = { 0 };
+	for (int frame = 0; frame < FRAMES; ++frame) {
+		u32 *dest = expected + (size_t)frame * WIDTH * HEIGHT;
+		tiles.len = 0;
+		for (u16 ty = 0; ty < HEIGHT; ty += VNC_ZRLE_TILE_SIZE) {
+			for (u16 tx = 0; tx < WIDTH; tx += VNC_ZRLE_TILE_SIZE) {
+				encode_tile(&tiles, subencoding, dest + ty * WIDTH + tx, WIDTH,
+					    MIN(VNC_ZRLE_TILE_SIZE, WIDTH - tx),
+					    MIN(VNC_ZRLE_TILE_SIZE, HEIGHT - ty));
+			}
+		}
+		uLong capacity = deflateBound(&zstream, tiles.len) + 16;
+		u8 *compressed = malloc(capacity);
+		zstream.next_in = tiles.buffer;
+		zstream.avail_in = tiles.len;
+		zstream.next_out = compressed;
+		zstream.avail_out = capacity;
+		deflate(&zstream, Z_SYNC_FLUSH);
+		u32 length = capacity - zstream.avail_out;
+		u32 length_be = htonl(length);
+		put(wire, &length_be, sizeof(length_be));
+		put(wire, compressed, length);
+		free(compressed);
+	}
+	deflateEnd(&zstream);
+	free(tiles.buffer);
+	return tiles.len;
+}
+
+static void encode_tile(struct Wire *tiles, enum Subencoding subencoding, u32 *dest, u32 stride,
+			u16 width, u16 height)
+{
+	u32 palette[PALETTE_SIZE];
+	for (u8 i = 0; i < PALETTE_SIZE; ++i) {
+		palette[i] = random_u32() & 0xffffff;
+	}
+	switch (subencoding) {
+	case RAW:
+		put_u8(tiles, 0);
+		for (u16 y = 0; y < height; ++y) {
+			for (u16 x = 0; x < width; ++x) {
+				dest[y * stride + x] = random_u32() & 0xffffff;
+				put_cpixel(tiles, dest[y * stride + x]);
+			}
+		}
+		break;
+	case SOLID:
+		put_u8(tiles, 1);
+		put_cpixel(tiles, palette[0]);
+		for (u16 y = 0; y < height; ++y) {
+			for (u16 x = 0; x < width; ++x) {
+				dest[y * stride + x] = palette[0];
+			}
+		}
+		break;
+	case PACKED_PALETTE:
+		// Four bits per index, the first pixel of a byte in its high nibble
+		put_u8(tiles, PALETTE_SIZE);
+		for (u8 i = 0; i < PALETTE_SIZE; ++i) {
+			put_cpixel(tiles, palette[i]);
+		}
+		for (u16 y = 0; y < height; ++y) {
+			u8 byte = 0;
+			for (u16 x = 0; x < width; ++x) {
+				u8 index = random_u32() % PALETTE_SIZE;
+				dest[y * stride + x] = palette[index];
+				byte |= index << (x % 2 == 0 ? 4 : 0);
+				if (x % 2 == 1 || x == width - 1) {
+					put_u8(tiles, byte);
+					byte = 0;
+				}
+			}
+		}
+		break;
+	case PLAIN_RLE:
+	case PALETTE_RLE:
+		put_u8(tiles, subencoding == PLAIN_RLE ? 128 : 128 + PALETTE_SIZE);
+		for (u8 i = 0; i < PALETTE_SIZE && subencoding == PALETTE_RLE; ++i) {
+			put_cpixel(tiles, palette[i]);
+		}
+		u32 pixel_count = (u32)width * height;
+		for (u32 pos = 0; pos < pixel_count;) {
+			u32 run_length = 1 + random_u32() % MAX_RUN_LENGTH;
+			run_length = MIN(run_length, pixel_count - pos);
+			u32 color;
+			if (subencoding == PLAIN_RLE) {
+				color = random_u32() & 0xffffff;
+				put_cpixel(tiles, color);
+				put_run_length(tiles, run_length);
+			} else {
+				// A run of one is the index alone
+				u8 index = random_u32() % PALETTE_SIZE;
+				color = palette[index];
+				put_u8(tiles, index | (run_length > 1 ? 0x80 : 0));
+				if (run_length > 1) {
+					put_run_length(tiles, run_length);
+				}
+			}
+			for (u32 end = pos + run_length; pos < end; ++pos) {
+				dest[pos / width * stride + pos % width] = color;
+			}
+		}
+		break;
+	case SUBENCODING_COUNT:
+		break;
+	}
+}
+
+// Times each rect from the moment its data is buffered, so the socket doesn't count
+static bool decode_frames(struct Wire *wire, const u32 *expected, u64 *best_ns)
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		perror("socketpair");
+		return false;
+	}
+	struct Vnc_rfb_pixel_format format = {
+		.bpp = 32,
+		.depth = 24,
+		.true_color = 1,
+		.red_max = 255,
+		.green_max = 255,
+		.blue_max = 255,
+		.red_shift = 16,
+		.green_shift = 8,
+		.blue_shift = 0,
+	};
+	struct Vnc_framebuffer framebuffer = {
+		.width = WIDTH,
+		.height = HEIGHT,
+		.pitch = WIDTH * sizeof(u32),
+		.size = WIDTH * HEIGHT * sizeof(u32),
+		.bpp = 32,
+		.buffer = calloc(WIDTH * HEIGHT, sizeof(u32)),
+	};
+	struct Vnc_pixel_converter converter;
+	struct Vnc_rfb_stream stream;
+	struct Vnc_zrle zrle;
+	if (!vnc_pixel_converter_init(&converter, &format) ||
+	    !vnc_rfb_stream_init(&stream, fds[0]) || !vnc_zrle_init(&zrle)) {
+		return false;
+	}
+
+	wire->fd = fds[1];
+	pthread_t writer;
+	pthread_create(&writer, NULL, write_wire, wire);
+	*best_ns = UINT64_MAX;
+	bool ok = true;
+	for (int frame = 0; frame < FRAMES && ok; ++frame) {
+		struct Vnc_rfb_rect rect = {
+			.width = WIDTH,
+			.height = HEIGHT,
+			.encoding = 16,
+		};
+		enum Vnc_rfb_result result;
+		while ((result = vnc_zrle_measure_rect(&stream, &rect, &converter)) ==
+		       VNC_RFB_RESULT_WOULD_BLOCK) {
+			vnc_rfb_stream_receive(&stream);
+		}
+		u64 start_ns = now_ns();
+		if (result == VNC_RFB_RESULT_SUCCESS) {
+			result = vnc_zrle_recv_rect(&zrle, &stream, &rect, &converter,
+						    &framebuffer);
+		}
+		u64 elapsed_ns = now_ns() - start_ns;
+		*best_ns = MIN(*best_ns, elapsed_ns);
+		if (result != VNC_RFB_RESULT_SUCCESS) {
+			fprintf(stderr, "frame %d: %s\n", frame, vnc_rfb_result_to_str(result));
+			ok = false;
+		} else if (memcmp(framebuffer.buffer, expected + (size_t)frame * WIDTH * HEIGHT,
+				  framebuffer.size) != 0) {
+			printf("frame %d: decoded pixels differ from the encoded ones\n", frame);
+			ok = false;
+		}
+	}
+
+	close(fds[0]);
+	pthread_join(writer, NULL);
+	close(fds[1]);
+	vnc_zrle_deinit(&zrle);
+	vnc_rfb_stream_deinit(&stream);
+	vnc_pixel_converter_deinit(&converter);
+	free(framebuffer.buffer);
+	return ok;
+}
+
+// Little endian, the three bytes a CPIXEL keeps of a 24 bit depth pixel
+static void put_cpixel(struct Wire *wire, u32 color)
+{
+	u8 bytes[] = { color, color >> 8, color >> 16 };
+	put(wire, bytes, sizeof(bytes));
+}
+
+static void put_run_length(struct Wire *wire, u32 run_length)
+{
+	u32 remaining = run_length - 1;
+	for (; remaining >= 255; remaining -= 255) {
+		put_u8(wire, 255);
+	}
+	put_u8(wire, remaining);
+}
+
+static void put_u8(struct Wire *wire, u8 value)
+{
+	put(wire, &value, 1);
+}
+
+static void put(struct Wire *wire, const void *data, size_t size)
+{
+	if (wire->len + size > wire->capacity) {
+		wire->capacity = MAX(wire->capacity * 2, wire->len + size);
+		wire->buffer = realloc(wire->buffer, wire->capacity);
+	}
+	memcpy(wire->buffer + wire->len, data, size);
+	wire->len += size;
+}
+
+// Stops without a SIGPIPE when the decoder gave up and closed its end
+static void *write_wire(void *args)
+{
+	struct Wire *wire = args;
+	size_t written = 0;
+	while (written < wire->len) {
+		ssize_t count = send(wire->fd, wire->buffer + written, wire->len - written,
+				     MSG_NOSIGNAL);
+		if (count <= 0) {
+			break;
+		}
+		written += count;
+	}
+	return NULL;
+}
+
+// xorshift32
+static u32 random_u32(void)
+{
+	static u32 state = 1;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}